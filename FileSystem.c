@@ -1,209 +1,803 @@
+#define _GNU_SOURCE  // SEEK_DATA
 #include "FileSystem.h"
+#include "snapshot.h"
+#include "scrub.h"
+#include "defrag.h"
+#include "reclaim.h"
+#include "namecache.h"
+#include "walk.h"
+#include "writeback.h"
+#include "quota.h"
+#include "xattr.h"
+#include "crc32c.h"
+#include "memzero.h"
+#include "trace.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+
+static FsLogHandler log_handler;
+
+void set_log_handler(FsLogHandler handler) {
+    log_handler = handler;
+}
+
+void log_to_stdout(const char *fmt, va_list args) {
+    vprintf(fmt, args);
+}
+
+void fs_log(const char *fmt, ...) {
+    if (!log_handler)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    log_handler(fmt, args);
+    va_end(args);
+}
+
+
+static size_t meta_bytes(size_t size) {
+    return (size ? size + ARENA_ALIGN - 1 : ARENA_ALIGN) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+// Carve the per-block and per-inode arrays out of a single zeroed arena chunk,
+// so there is one allocation to fail and cleanup_file_system frees them together.
+// lazy adds the block_loaded array of an image-backed file system.
+static int alloc_metadata(FileSystem *fs, bool lazy) {
+    size_t blocks = fs->total_blocks;
+    size_t inodes = fs->total_inodes;
+    size_t size = meta_bytes(blocks * sizeof(bool)) + meta_bytes(inodes * sizeof(bool)) +
+                  meta_bytes(blocks * sizeof(uint16_t)) + meta_bytes(blocks * sizeof(uint32_t)) +
+                  meta_bytes(inodes * sizeof(Inode)) + meta_bytes(inodes * sizeof(uint32_t)) +
+                  meta_bytes(inodes * sizeof(TreeUsage)) + meta_bytes(blocks * sizeof(bool)) +
+                  meta_bytes(inodes * sizeof(uint32_t)) + (lazy ? meta_bytes(blocks * sizeof(bool)) : 0);
+
+    arena_init(&fs->meta, size);
+    fs->block_bitmap = (bool *)arena_zalloc(&fs->meta, blocks * sizeof(bool));
+    fs->inode_bitmap = (bool *)arena_zalloc(&fs->meta, inodes * sizeof(bool));
+    fs->block_refcount = (uint16_t *)arena_zalloc(&fs->meta, blocks * sizeof(uint16_t));
+    fs->block_crc = (uint32_t *)arena_zalloc(&fs->meta, blocks * sizeof(uint32_t));
+    fs->inodes = (Inode *)arena_zalloc(&fs->meta, inodes * sizeof(Inode));
+    fs->parents = (uint32_t *)arena_zalloc(&fs->meta, inodes * sizeof(uint32_t));
+    fs->usage = (TreeUsage *)arena_zalloc(&fs->meta, inodes * sizeof(TreeUsage));
+    fs->block_dirty = (bool *)arena_zalloc(&fs->meta, blocks * sizeof(bool));
+    fs->reserved = (uint32_t *)arena_zalloc(&fs->meta, inodes * sizeof(uint32_t));
+    if (lazy)
+        fs->block_loaded = (bool *)arena_zalloc(&fs->meta, blocks * sizeof(bool));
+    if (!fs->block_bitmap || !fs->inode_bitmap || !fs->block_refcount || !fs->block_crc ||
+        !fs->inodes || !fs->parents || !fs->usage || !fs->block_dirty || !fs->reserved || (lazy && !fs->block_loaded)) {
+        return -1;
+    }
+    return 0;
+}
 
+// Move the metadata arrays into a new arena sized for blocks and inodes. Per-block
+// arrays keep their first min(old, new) entries, per-inode arrays their first
+// inodes_kept; the rest starts out zero, new blocks count as resident. On failure
+// nothing changes. The block array itself is the caller's to resize.
+int resize_metadata(FileSystem *fs, uint32_t blocks, uint32_t inodes, uint32_t inodes_kept) {
+    FileSystem old = *fs;
+    bool lazy = fs->block_loaded != NULL;
+    fs->total_blocks = blocks;
+    fs->total_inodes = inodes;
+    fs->block_loaded = NULL;
+    if (alloc_metadata(fs, lazy) != 0) {
+        arena_free(&fs->meta);
+        *fs = old;
+        return -1;
+    }
 
-void initialize_file_system(FileSystem *fs, uint32_t num_blocks) {
+    size_t kept_blocks = blocks < old.total_blocks ? blocks : old.total_blocks;
+    memcpy(fs->block_bitmap, old.block_bitmap, kept_blocks * sizeof(bool));
+    memcpy(fs->block_refcount, old.block_refcount, kept_blocks * sizeof(uint16_t));
+    memcpy(fs->block_crc, old.block_crc, kept_blocks * sizeof(uint32_t));
+    memcpy(fs->block_dirty, old.block_dirty, kept_blocks * sizeof(bool));
+    if (lazy) {
+        memcpy(fs->block_loaded, old.block_loaded, kept_blocks * sizeof(bool));
+        // Nothing past the old end is on the image
+        memset(fs->block_loaded + kept_blocks, true, (blocks - kept_blocks) * sizeof(bool));
+    }
+    memcpy(fs->inode_bitmap, old.inode_bitmap, inodes_kept * sizeof(bool));
+    memcpy(fs->inodes, old.inodes, (size_t)inodes_kept * sizeof(Inode));
+    memcpy(fs->parents, old.parents, inodes_kept * sizeof(uint32_t));
+    memcpy(fs->usage, old.usage, inodes_kept * sizeof(TreeUsage));
+    memcpy(fs->reserved, old.reserved, inodes_kept * sizeof(uint32_t));
+    arena_free(&old.meta);
+    return 0;
+}
+
+int initialize_file_system(FileSystem *fs, uint32_t num_blocks) {
+    memset(fs, 0, sizeof(FileSystem));
     fs->total_blocks = num_blocks;
     int num_inode = num_blocks / INODE_BLOCK_RATIO;
     fs->total_inodes = num_inode;
 
-    printf("Total blocks: %d\n", num_blocks);
-    // Allocate memory for the block bitmap and blocks
-    fs->block_bitmap = (bool *)malloc(num_blocks * sizeof(bool));
-    if (fs->block_bitmap == NULL) {
-        printf("Memory allocation for block bitmap failed!\n");
-        exit(1);
+    fs_log("Total blocks: %d\n", num_blocks);
+    if (block_memory_alloc(&fs->block_memory, (size_t)num_blocks * sizeof(Block)) != 0) {
+        fs_log("Memory allocation for blocks failed!\n");
+        goto fail;
     }
+    fs->blocks = (Block *)fs->block_memory.base;
+    #ifdef DEBUG
+    fs_log("Block array: %zu bytes in %s pages\n", fs->block_memory.size, fs->block_memory.kind);
+    #endif
 
-    fs->blocks = (Block *)malloc(num_blocks * sizeof(Block));
-    if (fs->blocks == NULL) {
-        printf("Memory allocation for blocks failed!\n");
-        exit(1);
+    // Bitmaps, refcounts, checksums and inodes, all zeroed
+    if (alloc_metadata(fs, false) != 0) {
+        fs_log("Memory allocation for file system metadata failed!\n");
+        goto fail;
     }
 
-    // Allocate memory for the inode bitmap and inodes
-    fs->inode_bitmap = (bool *)malloc(num_blocks * sizeof(bool));
-    if (fs->block_bitmap == NULL) {
-        printf("Memory allocation for inode bitmap failed!\n");
-        exit(1);
+    fs->lock = (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t));
+    if (fs->lock == NULL) {
+        fs_log("Memory allocation for file system lock failed!\n");
+        goto fail;
     }
+    pthread_rwlock_init(fs->lock, NULL);
 
-    fs->inodes = (Inode *)malloc(num_blocks * sizeof(Inode));
-    if (fs->block_bitmap == NULL) {
-        printf("Memory allocation for inodes failed!\n");
-        exit(1);
-    }
 
+    // Every block lives in memory, nothing to fault in
+    fs->block_loaded = NULL;
+    fs->image = NULL;
+    fs->data_offset = 0;
+    fs->fetch_block = NULL;
 
+    fs->snapshots = NULL;
+    fs->snapshot_count = 0;
+    fs->read_only = false;
 
-    if (fs->block_bitmap == NULL || fs->blocks == NULL) {
-        printf("Memory allocation failed!\n");
-        exit(1);
-    }
+    // Checksums are kept current from the first write on
+    fs->checksums_valid = true;
+    // So are the directory totals, starting from an empty tree
+    fs->usage_valid = true;
 
+    fs_log("File System Memory allocated\n");
+    return 0;
 
-    // Initialize block bitmap
-    #ifdef DEBUG
-    printf("Initialize block bitmap !\n");
-    #endif
+fail:
+    cleanup_file_system(fs);
+    return -1;
+}
 
-    for (uint32_t i = 0; i < num_blocks; i++) {
-        fs->block_bitmap[i] = false;
+void cleanup_file_system(FileSystem *fs) {
+    // A running scrub, defrag, writeback or reclaim still uses the arrays below.
+    // Writeback goes after defrag, it drains the reclaim queue before its last flush.
+    scrub_wait(fs);
+    defrag_stop(fs);
+    writeback_stop(fs);
+    reclaim_stop(fs);
+    if (fs->image) {
+        fclose(fs->image);
+        fs->image = NULL;
+    }
+    free_snapshots(fs);
+    block_memory_free(&fs->block_memory);
+    fs->blocks = NULL;
+    arena_free(&fs->meta);
+    name_cache_free(fs);
+    xattr_cache_free(fs);
+    free(fs->scrub);
+    if (fs->lock) {
+        pthread_rwlock_destroy(fs->lock);
+        free(fs->lock);
     }
+}
 
-    // Initialize inode bitmap
-    #ifdef DEBUG
-    printf("Initialize inode bitmap !\n");
-    #endif
-    for (int i = 0; i < num_inode; i++) {
-        fs->inode_bitmap[i] = false;
+
+// Default block fetch hook: read one block from the backing image.
+// pread keeps it usable from several threads at once (scrub).
+int fetch_block_from_image(FileSystem *fs, uint32_t block_index, Block *block) {
+    TRACE_SPAN("image_read_block");
+    off_t offset = fs->data_offset + (off_t)block_index * sizeof(Block);
+    ssize_t got = pread(fileno(fs->image), block->data, sizeof(Block), offset);
+    if (got < 0) {
+        return -1;
+    }
+    if ((size_t)got < sizeof(Block)) {
+        // Short image, the missing tail reads back as zeros
+        memset(block->data + got, 0, sizeof(Block) - got);
     }
+    return 0;
+}
 
+// Recompute the stored checksum after a block's contents changed
+void update_block_checksum(FileSystem *fs, uint32_t block_index) {
+    fs->block_crc[block_index] = crc32c(0, fs->blocks[block_index].data, BLOCK_SIZE);
+    mark_block_dirty(fs, block_index);
+}
 
-    printf("File System Memory allocated\n");
+// Something the image holds changed. The first change starts the clock the
+// writeback thread flushes by; later ones ride along until it has run.
+void mark_dirty(FileSystem *fs) {
+    if (fs->dirty_since == 0) {
+        fs->dirty_since = fs_time();
+        writeback_kick(fs, false);
+    }
+}
 
+// A block's contents changed, it goes out with the next flush
+void mark_block_dirty(FileSystem *fs, uint32_t block_index) {
+    mark_dirty(fs);
+    if (!fs->block_dirty || fs->block_dirty[block_index])
+        return;
+    fs->block_dirty[block_index] = true;
+    if (++fs->dirty_blocks == fs->dirty_limit)
+        writeback_kick(fs, true);
 }
 
-void cleanup_file_system(FileSystem *fs) {
-    free(fs->block_bitmap);
-    free(fs->blocks);
-    free(fs->inodes);
-    free(fs->inode_bitmap);
+// Check a copy of a block against its stored checksum
+bool verify_block_checksum(FileSystem *fs, uint32_t block_index, const Block *block) {
+    return crc32c(0, block->data, BLOCK_SIZE) == fs->block_crc[block_index];
 }
 
+// Return the in-memory block, faulting it in from the image on first access
+Block *get_block(FileSystem *fs, uint32_t block_index) {
+    Block *block = &fs->blocks[block_index];
+    if (fs->block_loaded && !fs->block_loaded[block_index]) {
+        __atomic_fetch_add(&fs->stats.cache_misses, 1, __ATOMIC_RELAXED);
+        if (fs->fetch_block(fs, block_index, block) != 0) {
+            fs_log("Failed to fetch block %u from image.\n", block_index);
+            memset(block->data, 0, sizeof(Block));
+        } else if (!fs->checksums_valid) {
+            // Image predates checksums, take what we read as the reference.
+            // The data itself is what the image has, nothing to write back.
+            fs->block_crc[block_index] = crc32c(0, block->data, BLOCK_SIZE);
+        } else if (fs->block_bitmap[block_index] && !verify_block_checksum(fs, block_index, block)) {
+            fs_log("Checksum mismatch on block %u, data may be corrupted.\n", block_index);
+            fs->checksum_errors++;
+        }
+        fs->block_loaded[block_index] = true;
+    } else {
+        __atomic_fetch_add(&fs->stats.cache_hits, 1, __ATOMIC_RELAXED);
+    }
+    return block;
+}
 
-int allocate_block(FileSystem *fs) {
+// A file's block for reading, holes come back as a shared block of zeros
+const Block *data_block(FileSystem *fs, uint32_t block_index) {
+    static const Block zero_block;
+    return block_index == BLOCK_HOLE ? &zero_block : get_block(fs, block_index);
+}
+
+// Hint the kernel that a block still on the image is about to be faulted in
+void prefetch_block(FileSystem *fs, uint32_t block_index) {
+    if (block_index == BLOCK_HOLE || !fs->block_loaded || fs->block_loaded[block_index] || !fs->image ||
+        fs->fetch_block != fetch_block_from_image) {
+        return;
+    }
+    posix_fadvise(fileno(fs->image), fs->data_offset + (off_t)block_index * sizeof(Block),
+                  sizeof(Block), POSIX_FADV_WILLNEED);
+}
+
+// Fault in every block that is still only on the image, then drop the image
+void load_all_blocks(FileSystem *fs) {
+    if (!fs->block_loaded) {
+        return;
+    }
+    TRACE_SPAN("load_all_blocks");
     for (uint32_t i = 0; i < fs->total_blocks; i++) {
+        if (fs->block_bitmap[i]) {
+            get_block(fs, i);
+        }
+    }
+
+    if (fs->image) {
+        fclose(fs->image);
+        fs->image = NULL;
+    }
+    // The array itself lives in fs->meta until cleanup
+    fs->block_loaded = NULL;
+    // Every used block has been through update_block_checksum by now
+    fs->checksums_valid = true;
+}
+
+// Last used block + 1, 0 when none is
+uint32_t used_block_end(FileSystem *fs) {
+    uint32_t end = fs->total_blocks;
+    while (end % sizeof(uint64_t) != 0 && !fs->block_bitmap[end - 1]) {
+        end--;
+    }
+    // Free tails are long, skip them eight entries at a time
+    uint64_t word;
+    while (end >= sizeof(uint64_t)) {
+        memcpy(&word, fs->block_bitmap + end - sizeof(uint64_t), sizeof(word));
+        if (word)
+            break;
+        end -= sizeof(uint64_t);
+    }
+    while (end > 0 && !fs->block_bitmap[end - 1]) {
+        end--;
+    }
+    return end;
+}
+
+int allocate_block(FileSystem *fs) {
+    TRACE_SPAN("allocate_block");
+    // What is left belongs to reservations, their writers give theirs back first.
+    // Blocks of unlinked files still queued for the reclaim thread are freed here.
+    if (fs->used_blocks + fs->reserved_blocks >= fs->total_blocks && reclaim_pending(fs))
+        reclaim_drain(fs);
+    if (fs->used_blocks + fs->reserved_blocks >= fs->total_blocks)
+        return -1;
+    for (uint32_t i = fs->block_hint; i < fs->total_blocks; i++) {
         if (!fs->block_bitmap[i]) {
+            fs->block_hint = i + 1;
             fs->block_bitmap[i] = true; // Mark block as used
+            fs->block_refcount[i] = 1;
+            fs->used_blocks++;
+            fs->stats.block_allocs++;
+            fs->map_generation++;
+            mark_dirty(fs);
+            if (fs->block_loaded) {
+                // Old contents of a free block are garbage, no need to fetch them
+                fs->block_loaded[i] = true;
+            }
             return i;                   // Return block index
         }
     }
+    fs->block_hint = fs->total_blocks;
     return -1; // No free blocks
 }
 
+// Drop one reference, the block only becomes free when nobody shares it anymore
 void free_block(FileSystem *fs, int block_index) {
     if (block_index >= 0 && block_index < fs->total_blocks) {
+        // Some inode just lost this pointer
+        fs->map_generation++;
+        mark_dirty(fs);
+        if (fs->block_refcount[block_index] > 1) {
+            fs->block_refcount[block_index]--;
+            return;
+        }
+        fs->block_refcount[block_index] = 0;
+        if (fs->block_bitmap[block_index]) {
+            fs->used_blocks--;
+            fs->stats.block_frees++;
+            if ((uint32_t)block_index < fs->block_hint)
+                fs->block_hint = block_index;
+        }
         fs->block_bitmap[block_index] = false; // Mark block as free
     }
 }
 
+// Add a reference to a used block (snapshots and clones share blocks this way)
+int ref_block(FileSystem *fs, uint32_t block_index) {
+    if (block_index == BLOCK_HOLE) {
+        return 0;
+    }
+    if (block_index >= fs->total_blocks || !fs->block_bitmap[block_index]) {
+        return -1;
+    }
+    if (fs->block_refcount[block_index] == UINT16_MAX) {
+        return -1;
+    }
+    fs->block_refcount[block_index]++;
+    mark_dirty(fs);
+    return 0;
+}
+
+// Copy-on-write: give the caller a private copy of a shared block before it writes to it.
+// A hole gets a block of zeros.
+int cow_block(FileSystem *fs, uint32_t *block_index) {
+    if (*block_index == BLOCK_HOLE) {
+        int block = allocate_block(fs);
+        if (block == -1) {
+            return -1;
+        }
+        memset(get_block(fs, block)->data, 0, BLOCK_SIZE);
+        update_block_checksum(fs, block);
+        *block_index = block;
+        return 0;
+    }
+    if (fs->block_refcount[*block_index] <= 1) {
+        return 0;
+    }
+
+    TRACE_SPAN("cow_block");
+    int copy = allocate_block(fs);
+    if (copy == -1) {
+        return -1;
+    }
+    memcpy(get_block(fs, copy)->data, get_block(fs, *block_index)->data, BLOCK_SIZE);
+    fs->block_crc[copy] = fs->block_crc[*block_index];
+    mark_block_dirty(fs, copy);
+    free_block(fs, *block_index);
+    *block_index = copy;
+    return 0;
+}
+
+// Change a live file's size, keeping the files' blocks total in step
+void set_file_size(FileSystem *fs, Inode *inode, uint32_t size) {
+    uint32_t old_blocks = inode_block_count(inode);
+    TreeUsage delta = { (int64_t)size - inode->size, 0, 0, 0 };
+    inode->size = size;
+    delta.blocks = (int64_t)inode_block_count(inode) - old_blocks;
+    fs->file_blocks += delta.blocks;
+    charge_usage(fs, inode - fs->inodes, &delta, 1);
+    touch_modified(fs, inode);
+}
+
+// Seconds since the epoch. The coarse clock is enough for second resolution and
+// costs no more than a memory read, so every write can afford it.
+uint32_t fs_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return (uint32_t)now.tv_sec;
+}
+
+void touch_modified(FileSystem *fs, Inode *inode) {
+    inode->modification_time = fs_time();
+    mark_dirty(fs);
+}
+
+// Record a read, relatime style: only when the access time is not newer than the
+// last write or is a day old, so reading the same file over and over stores nothing.
+// Readers may hold fs->lock only for reading, hence the atomic store. The inode is not
+// marked dirty, the new time goes out with whatever the writeback thread writes next.
+void touch_accessed(FileSystem *fs, Inode *inode) {
+    if (fs->read_only)
+        return;
+    uint32_t now = fs_time();
+    uint32_t atime = __atomic_load_n(&inode->access_time, __ATOMIC_RELAXED);
+    if (atime <= inode->modification_time || now - atime >= RELATIME_INTERVAL)
+        __atomic_store_n(&inode->access_time, now, __ATOMIC_RELAXED);
+}
+
+// Recompute the usage totals from the bitmaps, after loading or repairing
+void recount_usage(FileSystem *fs) {
+    // Repairs may have rewritten block pointers, cleared bitmap bits and dropped entries
+    fs->map_generation++;
+    fs->name_generation++;
+    rebuild_parents(fs);
+    // Directory totals are recomputed by the next du that needs them
+    fs->usage_valid = false;
+    fs->block_hint = 0;
+    fs->inode_hint = 0;
+    fs->used_blocks = 0;
+    fs->used_inodes = 0;
+    fs->file_blocks = 0;
+    for (uint32_t i = 0; i < fs->total_blocks; i++) {
+        if (fs->block_bitmap[i])
+            fs->used_blocks++;
+    }
+    for (uint32_t i = 0; i < fs->total_inodes; i++) {
+        if (fs->inode_bitmap[i]) {
+            fs->used_inodes++;
+            fs->file_blocks += inode_block_count(&fs->inodes[i]);
+        }
+    }
+}
+
+// Point every inode at the first directory naming it, so find_parent never has to scan
+void rebuild_parents(FileSystem *fs) {
+    memset(fs->parents, 0, fs->total_inodes * sizeof(uint32_t));
+    for (uint32_t i = 0; i < fs->total_inodes; i++) {
+        Inode *dir = &fs->inodes[i];
+        if (!fs->inode_bitmap[i] || !dir->is_directory)
+            continue;
+        for (uint32_t j = 0; j < dir->dir_entry_count && j < MAX_DIR_ENTRIES; j++) {
+            uint32_t child = dir->entries[j].inode_index;
+            if (child < fs->total_inodes && !fs->parents[child])
+                fs->parents[child] = i + 1;
+        }
+    }
+}
+
+// Threads to use for parallel scans: one per online CPU, capped at max_threads
+int worker_thread_count(int max_threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    return cpus > max_threads ? max_threads : (int)cpus;
+}
+
+// Number of block pointers in use by a file
+uint32_t inode_block_count(const Inode *inode) {
+    if (inode->is_directory) {
+        return 0;
+    }
+    // Short symlink targets sit in the block pointers themselves
+    if (inode->is_symlink && inode->size < SYMLINK_INLINE_MAX) {
+        return 0;
+    }
+    uint32_t count = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return count > DIRECT_POINTERS ? DIRECT_POINTERS : count;
+}
+
+// First offset from offset on in a hole (or in data), inode->size if there is none
+uint32_t find_data_or_hole(const Inode *inode, uint32_t offset, bool hole) {
+    uint32_t count = inode_block_count(inode);
+    for (uint32_t b = offset / BLOCK_SIZE; b < count; b++) {
+        if ((inode->blocks[b] == BLOCK_HOLE) == hole)
+            return b * BLOCK_SIZE > offset ? b * BLOCK_SIZE : offset;
+    }
+    return inode->size;
+}
+
+// Blocks the file's data takes up, holes left out
+uint32_t inode_data_blocks(const Inode *inode) {
+    uint32_t count = inode_block_count(inode);
+    uint32_t blocks = 0;
+    for (uint32_t b = 0; b < count; b++) {
+        blocks += inode->blocks[b] != BLOCK_HOLE;
+    }
+    return blocks;
+}
+
+// Hand out a free inode, zeroed but for its times and default permissions
 int allocate_inode(FileSystem *fs) {
-    for (int i = 0; i < fs->total_inodes; i++) {
+    TRACE_SPAN("allocate_inode");
+    for (uint32_t i = fs->inode_hint; i < fs->total_inodes; i++) {
         if (!fs->inode_bitmap[i]) {
             fs->inode_bitmap[i] = true; // Mark inode as used
+            fs->inode_hint = i + 1;
+            fs->used_inodes++;
+            fs->stats.inode_allocs++;
+            mark_dirty(fs);
+            // Past the watermark the inode has never been used and is still zero
+            if (i < fs->inode_watermark) {
+                memset(&fs->inodes[i], 0, sizeof(Inode));
+            } else {
+                fs->inode_watermark = i + 1;
+            }
+            Inode *inode = &fs->inodes[i];
+            inode->creation_time = fs_time();
+            inode->modification_time = inode->creation_time;
+            inode->access_time = inode->creation_time;
+            inode->permissions = DEFAULT_FILE_PERMISSIONS;
             return i;                   // Return inode index
         }
     }
+    fs->inode_hint = fs->total_inodes;
     return -1; // No free inodes
 }
 
 void free_inode(FileSystem *fs, int inode_index) {
     if (inode_index >= 0 && inode_index < fs->total_inodes) {
-        printf("test_free    ");
+        if (fs->inode_bitmap[inode_index]) {
+            // The attributes in the inode go with it, its block loses a reference
+            if (fs->inodes[inode_index].xattr_block) {
+                free_block(fs, fs->inodes[inode_index].xattr_block - 1);
+                fs->inodes[inode_index].xattr_block = 0;
+            }
+            fs->used_inodes--;
+            fs->stats.inode_frees++;
+            mark_dirty(fs);
+            if ((uint32_t)inode_index < fs->inode_hint)
+                fs->inode_hint = inode_index;
+        }
         fs->inode_bitmap[inode_index] = false;// Mark inode as free
+        fs->parents[inode_index] = 0;
 
     }
 }
 
 
-void remove_from_directory(FileSystem *fs, int dir_inode_index, int child_inode_index, const char *name)
+// Drop the entry called name that points to child_inode_index, keeping the others in order
+int remove_from_directory(FileSystem *fs, int dir_inode_index, int child_inode_index, const char *name)
 {
+    TRACE_SPAN("remove_from_directory");
     Inode *dir_inode = &fs->inodes[dir_inode_index];
     if (!dir_inode->is_directory) {
-        printf("Inode is not a directory!\n");
-        return;
+        fs_log("Inode is not a directory!\n");
+        return -1;
     }
 
-    if (dir_inode->dir_entry_count >= MAX_DIR_ENTRIES) {
-        printf("Directory is full!\n");
-        return;
+    for (uint32_t i = 0; i < dir_inode->dir_entry_count; i++) {
+        DirectoryEntry *entry = &dir_inode->entries[i];
+        if (entry->inode_index == (uint32_t)child_inode_index && strcmp(entry->name, name) == 0) {
+            memmove(entry, entry + 1, (dir_inode->dir_entry_count - i - 1) * sizeof(DirectoryEntry));
+            dir_inode->dir_entry_count--;
+            touch_modified(fs, dir_inode);
+            // The caller frees the child once this was its last name
+            if (fs->inodes[child_inode_index].nlink > 0)
+                fs->inodes[child_inode_index].nlink--;
+            // Another name may be in some other directory, find_parent looks for it
+            if (fs->parents[child_inode_index] == (uint32_t)dir_inode_index + 1) {
+                TreeUsage usage;
+                inode_usage(fs, child_inode_index, &usage);
+                charge_usage(fs, child_inode_index, &usage, -1);
+                fs->parents[child_inode_index] = 0;
+                // A file with another name is counted nowhere now, and a directory may hold
+                // files linked from elsewhere too; the next du rebuilds the totals then
+                if (fs->inodes[child_inode_index].nlink > 0 || usage.files > 0)
+                    fs->usage_valid = false;
+            }
+            return 0;
+        }
     }
 
-    // Add a new entry
-    DirectoryEntry *entry = &dir_inode->entries[dir_inode->dir_entry_count];
-    entry->inode_index = child_inode_index;
-    //strncpy(entry->name, name, MAX_FILENAME);
-    printf("Before delete dir_entry_count:  %d\n", dir_inode->dir_entry_count);
-
-    dir_inode->dir_entry_count--;
-
-    printf("After delete dir_entry_count:  %d\n", dir_inode->dir_entry_count);
-    return;
+    fs_log("Entry '%s' not found in directory!\n", name);
+    return -1;
 }
 
 void write_to_file(FileSystem *fs, int inode_index, const uint8_t *data, uint32_t size) {
+    TRACE_SPAN("write_to_file");
     Inode *inode = &fs->inodes[inode_index];
     uint32_t remaining = size;
     uint32_t block_index;
+    uint32_t allocated = inode_block_count(inode);
 
     for (int i = 0; i < DIRECT_POINTERS && remaining > 0; i++) {
-        if (inode->blocks[i] == 0) {
+        if (i >= allocated) {
             block_index = allocate_block(fs);
             if (block_index == -1) {
-                printf("No free blocks available!\n");
+                fs_log("No free blocks available!\n");
                 return;
             }
             inode->blocks[i] = block_index;
+        } else if (cow_block(fs, &inode->blocks[i]) != 0) {
+            fs_log("No free blocks available!\n");
+            return;
         }
 
         // Write data to block
         uint32_t to_write = (remaining > BLOCK_SIZE) ? BLOCK_SIZE : remaining;
-        memcpy(fs->blocks[inode->blocks[i]].data, data, to_write);
-         if (remaining <= BLOCK_SIZE) {
-           fs->blocks[inode->blocks[i]].data[to_write] = '\0'; // Null-terminate
+        Block *block = get_block(fs, inode->blocks[i]);
+        memcpy(block->data, data, to_write);
+         if (remaining < BLOCK_SIZE) {
+           block->data[to_write] = '\0'; // Null-terminate
          }
+        update_block_checksum(fs, inode->blocks[i]);
         data += to_write;
         remaining -= to_write;
     }
 
-    inode->size = size; // Update file size
+    set_file_size(fs, inode, size); // Update file size
+    fs->stats.bytes_written += size;
 }
 
 
 void read_from_file(FileSystem *fs, int inode_index, uint8_t *buffer, uint32_t size) {
+    TRACE_SPAN("read_from_file");
     Inode *inode = &fs->inodes[inode_index];
     uint32_t remaining = size;
     uint32_t block_index;
 
     for (int i = 0; i < DIRECT_POINTERS && remaining > 0; i++) {
         if (inode->blocks[i] == 0) {
-           // printf("Block not allocated! i=%d\n",i);
+           // fs_log("Block not allocated! i=%d\n",i);
             //return;
         }
 
         // Read data from block
         uint32_t to_read = (remaining > BLOCK_SIZE) ? BLOCK_SIZE : remaining;
-        memcpy(buffer, fs->blocks[inode->blocks[i]].data, to_read);
+        memcpy(buffer, data_block(fs, inode->blocks[i])->data, to_read);
         buffer += to_read;
         remaining -= to_read;
     }
+    __atomic_fetch_add(&fs->stats.bytes_read, size - remaining, __ATOMIC_RELAXED);
+    touch_accessed(fs, inode);
     *buffer = '\0'; // Null-terminate the read data
 }
 
+// Grow a file with holes or shrink it, freeing what falls off the end.
+// Returns -1 when no block is left to copy a shared last block, -2 past DIRECT_POINTERS,
+// -3 when the growth would take a directory above over its quota.
+int truncate_file(FileSystem *fs, Inode *inode, uint32_t size) {
+    uint32_t count = inode_block_count(inode);
+    uint32_t wanted = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (size > DIRECT_POINTERS * BLOCK_SIZE)
+        return -2;
+    if (wanted > count && !quota_allows(fs, inode - fs->inodes, wanted - count))
+        return -3;
+
+    while (count > wanted) {
+        count--;
+        free_block(fs, inode->blocks[count]);
+    }
+
+    // Bytes past the old end of the last block are stale, zero them before they become file data
+    if (size > inode->size && inode->size % BLOCK_SIZE != 0 &&
+        inode->blocks[inode->size / BLOCK_SIZE] != BLOCK_HOLE) {
+        uint32_t *last = &inode->blocks[inode->size / BLOCK_SIZE];
+        if (cow_block(fs, last) != 0)
+            return -1;
+        Block *block = get_block(fs, *last);
+        memset(block->data + inode->size % BLOCK_SIZE, 0, BLOCK_SIZE - inode->size % BLOCK_SIZE);
+        update_block_checksum(fs, *last);
+    }
+
+    // Blocks are only allocated once something is written there
+    while (count < wanted) {
+        inode->blocks[count++] = BLOCK_HOLE;
+    }
+
+    set_file_size(fs, inode, size);
+    return 0;
+}
+
+// Copy up to size bytes from offset, returns how many there were
+uint32_t read_file_range(FileSystem *fs, Inode *inode, uint32_t offset, uint8_t *buffer, uint32_t size) {
+    if (offset >= inode->size)
+        return 0;
+    if (size > inode->size - offset)
+        size = inode->size - offset;
+
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t pos = offset + done;
+        uint32_t in_block = pos % BLOCK_SIZE;
+        uint32_t len = BLOCK_SIZE - in_block < size - done ? BLOCK_SIZE - in_block : size - done;
+        memcpy(buffer + done, data_block(fs, inode->blocks[pos / BLOCK_SIZE])->data + in_block, len);
+        done += len;
+    }
+    __atomic_fetch_add(&fs->stats.bytes_read, done, __ATOMIC_RELAXED);
+    touch_accessed(fs, inode);
+    return done;
+}
+
+// Write size bytes at offset, growing the file as needed. The caller keeps offset + size
+// within DIRECT_POINTERS blocks. Returns the bytes written, -1 if nothing fit, or -3
+// (nothing written) if growing the file would go over a quota.
+int write_file_range(FileSystem *fs, Inode *inode, uint32_t offset, const uint8_t *data, uint32_t size) {
+    uint32_t old_size = inode->size;
+    uint32_t end = offset + size;
+    int ret;
+    if (end > inode->size && (ret = truncate_file(fs, inode, end)) != 0)
+        return ret == -3 ? -3 : -1;
+
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t pos = offset + done;
+        uint32_t in_block = pos % BLOCK_SIZE;
+        uint32_t len = BLOCK_SIZE - in_block < size - done ? BLOCK_SIZE - in_block : size - done;
+        uint32_t *block_index = &inode->blocks[pos / BLOCK_SIZE];
+        // Zeros over a whole block, or all of it up to the end of the file, leave a hole
+        if (in_block == 0 && (len == BLOCK_SIZE || pos + len >= inode->size) && mem_is_zero(data + done, len)) {
+            if (*block_index != BLOCK_HOLE) {
+                free_block(fs, *block_index);
+                *block_index = BLOCK_HOLE;
+            }
+            done += len;
+            continue;
+        }
+        if (cow_block(fs, block_index) != 0)
+            break;
+        memcpy(get_block(fs, *block_index)->data + in_block, data + done, len);
+        update_block_checksum(fs, *block_index);
+        done += len;
+    }
+
+    // Out of blocks for copies, the file ends where the data does
+    if (done < size && end > old_size)
+        truncate_file(fs, inode, offset + done > old_size ? offset + done : old_size);
+    if (done > 0)
+        touch_modified(fs, inode);
+    fs->stats.bytes_written += done;
+    return done == 0 && size > 0 ? -1 : (int)done;
+}
+
 int create_directory(FileSystem *fs, const char *name) {
     int inode_index = allocate_inode(fs);
     if (inode_index == -1) {
-        printf("No free inodes available!\n");
+        fs_log("No free inodes available!\n");
         return -1;
     }
 
     Inode *inode = &fs->inodes[inode_index];
     inode->is_directory = true;
+    inode->permissions = DEFAULT_DIR_PERMISSIONS;
     inode->dir_entry_count = 0;
     strncpy(inode->filename, name, MAX_FILENAME);
     inode->size = 0; // Directory size is 0 (data stored in entries)
+    memset(&fs->usage[inode_index], 0, sizeof(TreeUsage));
     return inode_index;
 }
 
 int add_to_directory(FileSystem *fs, int dir_inode_index, int child_inode_index, const char *name) {
+    TRACE_SPAN("add_to_directory");
     Inode *dir_inode = &fs->inodes[dir_inode_index];
     if (!dir_inode->is_directory) {
-        printf("Inode is not a directory!\n");
+        fs_log("Inode is not a directory!\n");
         return -1;
     }
 
     if (dir_inode->dir_entry_count >= MAX_DIR_ENTRIES) {
-        printf("Directory is full!\n");
+        fs_log("Directory is full!\n");
         return -1;
     }
 
@@ -213,36 +807,206 @@ int add_to_directory(FileSystem *fs, int dir_inode_index, int child_inode_index,
     strncpy(entry->name, name, MAX_FILENAME);
 
     dir_inode->dir_entry_count++;
+    touch_modified(fs, dir_inode);
+    fs->inodes[child_inode_index].nlink++;
+    if (!fs->parents[child_inode_index]) {
+        fs->parents[child_inode_index] = dir_inode_index + 1;
+        TreeUsage usage;
+        inode_usage(fs, child_inode_index, &usage);
+        charge_usage(fs, child_inode_index, &usage, 1);
+    }
+    fs->name_generation++;
     return 0;
 }
 
-void list_directory(FileSystem *fs, int dir_inode_index) {
+// Look a name up in one directory, returns the child's inode index or -1
+int find_in_directory(FileSystem *fs, int dir_inode_index, const char *name) {
     Inode *dir_inode = &fs->inodes[dir_inode_index];
+    // fusefs looks names up under the shared lock
+    __atomic_fetch_add(&fs->stats.dir_lookups, 1, __ATOMIC_RELAXED);
     if (!dir_inode->is_directory) {
-         printf("Inode is not a directory!\n");
-         return;
+        return -1;
     }
-    printf("Contents of directory '%s':\n", dir_inode->filename);
-    printf("!!dir_entry_count:  %d\n", dir_inode->dir_entry_count);
     for (uint32_t i = 0; i < dir_inode->dir_entry_count; i++) {
-        printf("dir_entry_count:  %d\n", dir_inode->dir_entry_count);
-         DirectoryEntry *entry = &dir_inode->entries[i];
-         Inode *child = &fs->inodes[entry->inode_index];
-         printf("  %s (inode %d, %s)\n", entry->name, entry->inode_index,
-                child->is_directory ? "directory" : "file");
+        if (strcmp(dir_inode->entries[i].name, name) == 0) {
+            return dir_inode->entries[i].inode_index;
+        }
+    }
+    return -1;
+}
+
+// Directory that has inode_index as an entry, the root is its own parent
+int find_parent(FileSystem *fs, int inode_index) {
+    if (inode_index == 0)
+        return 0;
+    if (fs->parents[inode_index])
+        return fs->parents[inode_index] - 1;
+    // A file that lost the name it was first linked under
+    for (uint32_t i = 0; i < fs->total_inodes; i++) {
+        if (!fs->inode_bitmap[i] || !fs->inodes[i].is_directory)
+            continue;
+        for (uint32_t j = 0; j < fs->inodes[i].dir_entry_count; j++) {
+            if (fs->inodes[i].entries[j].inode_index == (uint32_t)inode_index)
+                return i;
+        }
+    }
+    return -1;
+}
+
+static int walk_path(FileSystem *fs, int cwd, const char *path, int *dir_inode_index, char *leaf, int depth);
+
+// Where the symlink inode_index, found in dir_inode_index, ends up once every link in a row
+// is followed. depth counts the links already followed on the way here.
+static int follow_links(FileSystem *fs, int dir_inode_index, int inode_index, int depth) {
+    if (!fs->inodes[inode_index].is_symlink)
+        return inode_index;
+
+    Arena *scratch = scratch_arena();
+    ArenaMark mark = arena_mark(scratch);
+    char *target = (char *)arena_alloc(scratch, SYMLINK_MAX);
+    char *leaf = (char *)arena_alloc(scratch, MAX_FILENAME);
+    if (!target || !leaf) {
+        arena_rewind(scratch, mark);
+        return PATH_NOT_FOUND;
+    }
+
+    // Relative targets start from the directory holding the link
+    int dir = dir_inode_index;
+    while (fs->inodes[inode_index].is_symlink) {
+        if (++depth > SYMLINK_MAX_DEPTH) {
+            inode_index = PATH_LOOP;
+            break;
+        }
+        read_symlink(fs, &fs->inodes[inode_index], target, SYMLINK_MAX);
+        int ret = walk_path(fs, dir, target, &dir, leaf, depth);
+        if (ret != 0) {
+            inode_index = ret;
+            break;
+        }
+        inode_index = leaf[0] ? name_cache_lookup(fs, dir, leaf) : dir;
+        if (inode_index == -1) {
+            inode_index = PATH_NOT_FOUND;
+            break;
+        }
+    }
+    arena_rewind(scratch, mark);
+    return inode_index;
+}
+
+static int walk_path(FileSystem *fs, int cwd, const char *path, int *dir_inode_index, char *leaf, int depth) {
+    int dir = path[0] == '/' ? 0 : cwd;
+    const char *p = path;
+
+    leaf[0] = '\0';
+    while (true) {
+        while (*p == '/')
+            p++;
+        if (*p == '\0')
+            break;
+
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len >= MAX_FILENAME)
+            return PATH_TOO_LONG;
+
+        // A name we have not stepped into yet has to be a directory (or a link to one) to go on
+        if (leaf[0]) {
+            int next = name_cache_lookup(fs, dir, leaf);
+            if (next == -1)
+                return PATH_NOT_FOUND;
+            next = follow_links(fs, dir, next, depth);
+            if (next < 0)
+                return next;
+            if (!fs->inodes[next].is_directory)
+                return PATH_NOT_DIR;
+            dir = next;
+            leaf[0] = '\0';
+        }
+
+        if (len == 1 && p[0] == '.') {
+            // Stay where we are
+        } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+            dir = find_parent(fs, dir);
+            if (dir == -1)
+                return PATH_NOT_FOUND;
+        } else {
+            memcpy(leaf, p, len);
+            leaf[len] = '\0';
+        }
+        p += len;
     }
+
+    *dir_inode_index = dir;
+    return 0;
+}
+
+// Walk path from cwd (or the root if it starts with '/') up to its last component.
+// On success *dir_inode_index is the directory holding the last component and leaf
+// its name; leaf is empty when the path names a directory itself ("/", "a/..").
+// Symlinks along the way are followed, the last component is left as it is.
+// Returns 0, or PATH_NOT_FOUND, PATH_NOT_DIR, PATH_TOO_LONG or PATH_LOOP.
+int resolve_path(FileSystem *fs, int cwd, const char *path, int *dir_inode_index, char *leaf) {
+    return walk_path(fs, cwd, path, dir_inode_index, leaf, 0);
+}
+
+// What inode_index (an entry of dir_inode_index) refers to: itself, or for a symlink
+// the inode at the end of its target. Returns a PATH_* code if that does not exist.
+int follow_symlink(FileSystem *fs, int dir_inode_index, int inode_index) {
+    return follow_links(fs, dir_inode_index, inode_index, 0);
+}
+
+// New symlink inode pointing at target, not linked into any directory yet. Returns it or -1.
+int create_symlink(FileSystem *fs, const char *target) {
+    size_t len = strlen(target);
+    if (len == 0 || len >= SYMLINK_MAX) {
+        fs_log("Symlink target must be 1 to %d bytes long.\n", SYMLINK_MAX - 1);
+        return -1;
+    }
+
+    int inode_index = allocate_inode(fs);
+    if (inode_index == -1) {
+        fs_log("No free inodes available!\n");
+        return -1;
+    }
+    Inode *inode = &fs->inodes[inode_index];
+    inode->is_symlink = true;
+    inode->permissions = DEFAULT_SYMLINK_PERMISSIONS;
+    if (len < SYMLINK_INLINE_MAX) {
+        memcpy(inode->blocks, target, len + 1);
+        inode->size = (uint32_t)len;
+    } else if (write_file_range(fs, inode, 0, (const uint8_t *)target, (uint32_t)len) != (int)len) {
+        fs_log("No free blocks available!\n");
+        truncate_file(fs, inode, 0);
+        free_inode(fs, inode_index);
+        return -1;
+    }
+    return inode_index;
+}
+
+// Copy a symlink's target into buffer, NUL-terminated and cut to size - 1 bytes. Returns its length.
+uint32_t read_symlink(FileSystem *fs, Inode *inode, char *buffer, uint32_t size) {
+    if (size == 0)
+        return 0;
+    uint32_t len = inode->size < size - 1 ? inode->size : size - 1;
+    if (inode->size < SYMLINK_INLINE_MAX)
+        memcpy(buffer, inode->blocks, len);
+    else
+        len = read_file_range(fs, inode, 0, (uint8_t *)buffer, len);
+    buffer[len] = '\0';
+    return len;
 }
 
 int read_file_to_fs(FileSystem *fs, const char *external_filename, const char *internal_filename) {
+    TRACE_SPAN("read_file_to_fs");
     FILE *file = fopen(external_filename, "rb");
     if (!file) {
-        printf("Failed to open external file '%s'.\n", external_filename);
+        fs_log("Failed to open external file '%s'.\n", external_filename);
         return -1;
     }
 
     int inode_index = allocate_inode(fs);
     if (inode_index == -1) {
-        printf("No free inodes available!\n");
+        fs_log("No free inodes available!\n");
         fclose(file);
         return -1;
     }
@@ -258,20 +1022,37 @@ int read_file_to_fs(FileSystem *fs, const char *external_filename, const char *i
     int block_index;
 
     while ((bytes_read = fread(buffer, 1, BLOCK_SIZE, file)) > 0) {
+        if (inode->size / BLOCK_SIZE >= DIRECT_POINTERS) {
+            fs_log("File is larger than %d blocks! File partially written.\n", DIRECT_POINTERS);
+            break;
+        }
+        // Zero blocks take no space, they stay holes
+        if (mem_is_zero(buffer, bytes_read)) {
+            inode->blocks[inode->size / BLOCK_SIZE] = BLOCK_HOLE;
+            set_file_size(fs, inode, inode->size + bytes_read);
+            fs->stats.bytes_written += bytes_read;
+            total_written += bytes_read;
+            continue;
+        }
         block_index = allocate_block(fs);
         if (block_index == -1) {
-            printf("No free blocks available! File partially written.\n");
+            fs_log("No free blocks available! File partially written.\n");
             break;
         }
 
-        memcpy(fs->blocks[block_index].data, buffer, bytes_read);
+        {
+            TRACE_SPAN("copy_block");
+            memcpy(get_block(fs, block_index)->data, buffer, bytes_read);
+            update_block_checksum(fs, block_index);
+        }
         inode->blocks[inode->size / BLOCK_SIZE] = block_index;
-        inode->size += bytes_read;
+        set_file_size(fs, inode, inode->size + bytes_read);
+        fs->stats.bytes_written += bytes_read;
         total_written += bytes_read;
     }
 
     fclose(file);
-    printf("File '%s' written to internal file system as '%s'. Total bytes: %u\n",
+    fs_log("File '%s' written to internal file system as '%s'. Total bytes: %u\n",
            external_filename, internal_filename, total_written);
 
     return inode_index;
@@ -279,17 +1060,18 @@ int read_file_to_fs(FileSystem *fs, const char *external_filename, const char *i
 
 int write_file_to_host(FileSystem *fs, int inode_index, const char *external_filename)
 {
+    TRACE_SPAN("write_file_to_host");
     // 取得模擬檔案系統裡的 inode
     Inode *inode = &fs->inodes[inode_index];
     if (inode->is_directory) {
-        printf("'%s' is a directory, not a file.\n", inode->filename);
+        fs_log("'%s' is a directory, not a file.\n", inode->filename);
         return -1;
     }
 
     // 以 "wb" 模式開啟(或建立)外部檔案
     FILE *file = fopen(external_filename, "wb");
     if (!file) {
-        printf("Failed to create external file '%s'.\n", external_filename);
+        fs_log("Failed to create external file '%s'.\n", external_filename);
         return -1;
     }
 
@@ -298,42 +1080,74 @@ int write_file_to_host(FileSystem *fs, int inode_index, const char *external_fil
     size_t bytes_to_write = inode->size;
     uint8_t buffer[BLOCK_SIZE];
 
-    for (uint32_t i = 0; i < (bytes_to_write + BLOCK_SIZE - 1) / BLOCK_SIZE; i++) {
+    off_t hole = 0;
+    uint32_t count = inode_block_count(inode);
+    for (uint32_t i = 0; i < count; i++) {
         uint32_t block_index = inode->blocks[i];
+        // 計算本次要寫入的區塊大小
+        size_t chunk_size = (bytes_to_write > BLOCK_SIZE) ? BLOCK_SIZE : bytes_to_write;
+        // 洞不寫出去，跳過讓 host 的檔案也留成 sparse
+        if (block_index == BLOCK_HOLE) {
+            hole += chunk_size;
+            total_written += chunk_size;
+            bytes_to_write -= chunk_size;
+            continue;
+        }
         if (block_index >= fs->total_blocks) {
-            printf("Invalid block index encountered during write.\n");
+            fs_log("Invalid block index encountered during write.\n");
             fclose(file);
             return -1;
         }
 
-        // 計算本次要寫入的區塊大小
-        size_t chunk_size = (bytes_to_write > BLOCK_SIZE) ? BLOCK_SIZE : bytes_to_write;
-        memcpy(buffer, fs->blocks[block_index].data, chunk_size);
-        fwrite(buffer, 1, chunk_size, file);
+        if (hole) {
+            if (fseeko(file, hole, SEEK_CUR) != 0) {
+                fs_log("Failed to write host file '%s'.\n", external_filename);
+                fclose(file);
+                return -1;
+            }
+            hole = 0;
+        }
+        memcpy(buffer, get_block(fs, block_index)->data, chunk_size);
+        if (fwrite(buffer, 1, chunk_size, file) != chunk_size) {
+            fs_log("Failed to write host file '%s'.\n", external_filename);
+            fclose(file);
+            return -1;
+        }
 
         total_written += chunk_size;
         bytes_to_write -= chunk_size;
     }
+    __atomic_fetch_add(&fs->stats.bytes_read, total_written, __ATOMIC_RELAXED);
 
-    fclose(file);
-    printf("File '%s' written to host file '%s'. Total bytes: %zu\n",
+    // 結尾的洞要靠 ftruncate 補上檔案長度
+    if (hole && (fflush(file) != 0 || ftruncate(fileno(file), (off_t)total_written) != 0)) {
+        fs_log("Failed to write host file '%s'.\n", external_filename);
+        fclose(file);
+        return -1;
+    }
+    // Buffered data only reaches the host file here
+    if (fclose(file) != 0) {
+        fs_log("Failed to write host file '%s'.\n", external_filename);
+        return -1;
+    }
+    fs_log("File '%s' written to host file '%s'. Total bytes: %zu\n",
            inode->filename, external_filename, total_written);
 
     return total_written;
 }
 
-void save_file_system(FileSystem *fs, const char *image_filename) {
-    FILE *file = fopen(image_filename, "wb");
-    if (!file) {
-        printf("Failed to create disk image file '%s'.\n", image_filename);
-        return;
-    }
-
-    // Write the total number of blocks to the disk image
-    fwrite(&fs->total_blocks, sizeof(uint32_t), 1, file);
-
-    // Write the total number of inodes
-    fwrite(&fs->total_inodes, sizeof(uint32_t), 1, file);
+// Write the superblock, metadata and snapshots at file's position. The never used end
+// of the inode table is seeked over, so a new file gets a hole there.
+void write_image_metadata(FileSystem *fs, FILE *file) {
+    TRACE_SPAN("image_write_metadata");
+    // Write the superblock
+    SuperBlock sb;
+    sb.magic = FS_MAGIC;
+    sb.version = FS_VERSION;
+    sb.total_blocks = fs->total_blocks;
+    sb.total_inodes = fs->total_inodes;
+    sb.snapshot_count = fs->snapshot_count;
+    fwrite(&sb, sizeof(SuperBlock), 1, file);
 
     // Write the block bitmap
     fwrite(fs->block_bitmap, sizeof(bool), fs->total_blocks, file);
@@ -341,122 +1155,325 @@ void save_file_system(FileSystem *fs, const char *image_filename) {
     // Write the inode bitmap
     fwrite(fs->inode_bitmap, sizeof(bool), fs->total_inodes, file);
 
-    // Write inodes
-    fwrite(fs->inodes, sizeof(Inode), fs->total_inodes, file);
+    // Write the block refcounts and checksums
+    fwrite(fs->block_refcount, sizeof(uint16_t), fs->total_blocks, file);
+    fwrite(fs->block_crc, sizeof(uint32_t), fs->total_blocks, file);
 
-    // Write blocks
-    for (uint32_t i = 0; i < fs->total_blocks; i++) {
-        fwrite(&fs->blocks[i], sizeof(Block), 1, file);
-    }
+    // Write inodes, past the watermark they are all zero
+    fwrite(fs->inodes, sizeof(Inode), fs->inode_watermark, file);
+    fseeko(file, (off_t)(fs->total_inodes - fs->inode_watermark) * sizeof(Inode), SEEK_CUR);
 
-    fclose(file);
-    printf("File system saved to disk image '%s'.\n", image_filename);
+    // Write snapshots
+    save_snapshots(fs, file);
 }
 
+// Write the whole image to file: superblock, metadata, snapshots, then every block.
+// Blocks still on the backing image are faulted in on the way. Free blocks and the
+// never used end of the inode table are skipped over, so file has to start out empty
+// and gets holes there. data_offset (if not NULL) gets where the blocks start.
+// Returns -1 if a write failed, file stays open.
+int write_image(FileSystem *fs, FILE *file, off_t *data_offset) {
+    write_image_metadata(fs, file);
+    if (data_offset)
+        *data_offset = ftello(file);
+
+    {
+        TRACE_SPAN("image_write_blocks");
+        // Write used blocks, a partition grown far past what it holds costs nothing extra.
+        // The image ends with the last used block, a compacted partition saves shorter.
+        off_t skipped = 0;
+        for (uint32_t i = 0; i < fs->total_blocks; i++) {
+            if (!fs->block_bitmap[i]) {
+                skipped += sizeof(Block);
+                continue;
+            }
+            if (skipped) {
+                fseeko(file, skipped, SEEK_CUR);
+                skipped = 0;
+            }
+            fwrite(get_block(fs, i), sizeof(Block), 1, file);
+        }
+        // Reads past the end come back as free zero blocks; the size still has to
+        // reach past a skipped inode table end with nothing written after it
+        if (fflush(file) != 0 || ftruncate(fileno(file), ftello(file)) != 0)
+            return -1;
+    }
+    return ferror(file) != 0 ? -1 : 0;
+}
 
-void load_file_system(FileSystem *fs, const char *image_filename) {
-    FILE *file = fopen(image_filename, "rb");
+int save_file_system(FileSystem *fs, const char *image_filename) {
+    TRACE_SPAN("save_file_system");
+    // Pending frees would otherwise be saved as leaked blocks
+    {
+        TRACE_SPAN("reclaim_drain");
+        reclaim_drain(fs);
+    }
+
+    // The image may be the one we are lazily reading from, pull everything in first
+    load_all_blocks(fs);
+
+    FILE *file = fopen(image_filename, "wb");
     if (!file) {
-        printf("Failed to open disk image file '%s'.\n", image_filename);
-        return;
+        fs_log("Failed to create disk image file '%s'.\n", image_filename);
+        return -1;
     }
 
-    // Read the total number of blocks from the disk image
-    fread(&fs->total_blocks, sizeof(uint32_t), 1, file);
+    bool failed = write_image(fs, file, NULL) != 0;
+    {
+        TRACE_SPAN("image_close");
+        failed |= fclose(file) != 0;
+    }
+    if (failed) {
+        fs_log("Failed to write disk image file '%s'.\n", image_filename);
+        return -1;
+    }
+    fs_log("File system saved to disk image '%s'.\n", image_filename);
+    return 0;
+}
 
-    // Read the total number of inodes
-    fread(&fs->total_inodes, sizeof(uint32_t), 1, file);
 
-    #ifdef DEBUG
-    printf("Total blocks: %d\n", fs->total_blocks);
-    printf("Total inodes: %d\n", fs->total_inodes);
-    #endif
+// fread that reports whether the whole request came back
+static bool read_exact(void *dst, size_t size, size_t count, FILE *file) {
+    return fread(dst, size, count, file) == count;
+}
 
-    // Allocate memory for block bitmap
-    fs->block_bitmap = (bool *)malloc(fs->total_blocks * sizeof(bool));
-    if (!fs->block_bitmap) {
-        printf("Memory allocation for block bitmap failed!\n");
-        fclose(file);
-        return;
+// Size of an inode record in an image of this version
+static size_t inode_record_size(uint32_t version) {
+    return version < 4 ? INODE_V3_SIZE : version < 5 ? INODE_V4_SIZE : version < 6 ? INODE_V5_SIZE : sizeof(Inode);
+}
+
+// Inode records as the image's version wrote them. Before version 4 a record ends
+// where access_time starts, before version 5 where quota_blocks does, before version 6
+// where xattr_block does; the missing fields are left zero for upgrade_inode to fill.
+bool read_inode_records(FILE *file, Inode *inodes, uint32_t count, uint32_t version) {
+    size_t record = inode_record_size(version);
+    if (record == sizeof(Inode))
+        return read_exact(inodes, sizeof(Inode), count, file);
+    for (uint32_t i = 0; i < count; i++) {
+        memset(&inodes[i], 0, sizeof(Inode));
+        if (!read_exact(&inodes[i], record, 1, file))
+            return false;
     }
+    return true;
+}
 
-    #ifdef DEBUG
-    printf("Memory allocated for block bitmap\n");
-    #endif
+// The live inode table. write_image leaves a hole where the never used end of the
+// table is, and a resized partition can have a table mostly made of that; holes are
+// seeked over instead of read, so their inodes stay untouched zero pages, and the
+// watermark ends after the last inode that was actually read.
+static bool read_inode_table(FileSystem *fs, FILE *file, uint32_t version) {
+    if (version < 4) {
+        fs->inode_watermark = fs->total_inodes;
+        return read_inode_records(file, fs->inodes, fs->total_inodes, version);
+    }
 
-    // Allocate memory for inode bitmap
-    fs->inode_bitmap = (bool *)malloc(fs->total_inodes * sizeof(bool));
-    if (!fs->inode_bitmap) {
-        printf("Memory allocation for inode bitmap failed!\n");
-        free(fs->block_bitmap);
-        fclose(file);
-        return;
+    int fd = fileno(file);
+    off_t record = (off_t)inode_record_size(version);
+    off_t start = ftello(file);
+    off_t table_end = start + (off_t)fs->total_inodes * record;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < table_end)
+        return false;
+    uint32_t i = 0;
+    fs->inode_watermark = 0;
+    while (i < fs->total_inodes) {
+        off_t pos = start + (off_t)i * record;
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        // Hole up to the end of the file (ENXIO), or no SEEK_DATA support (read it all)
+        if (data < 0)
+            data = errno == ENXIO ? table_end : pos;
+        uint32_t skip = data - pos >= record ? (uint32_t)((data - pos) / record) : 0;
+        if (skip > fs->total_inodes - i)
+            skip = fs->total_inodes - i;
+        i += skip;
+        if (i == fs->total_inodes)
+            break;
+        uint32_t n = fs->total_inodes - i < INODE_READ_CHUNK ? fs->total_inodes - i : INODE_READ_CHUNK;
+        // lseek moved the descriptor under stdio, put both at the same place
+        if (fseeko(file, start + (off_t)i * record, SEEK_SET) != 0 ||
+            !read_inode_records(file, &fs->inodes[i], n, version))
+            return false;
+        i += n;
+        fs->inode_watermark = i;
     }
+    return fseeko(file, table_end, SEEK_SET) == 0;
+}
 
-    #ifdef DEBUG
-    printf("Memory allocated for inode bitmap\n");
-    #endif
+// Fill in what older versions did not keep. nlink and is_symlink sit in what used to
+// be padding: images before version 3 had neither symlinks nor a way to link a file
+// twice, so every inode but the root had one name. Nothing wrote permissions or
+// access times before version 4; quotas, new in version 5, start out unlimited (zero).
+// Before version 6 nothing promised that a file's unused entries were zero, and they
+// now hold its extended attributes.
+static void upgrade_inode(Inode *inode, uint32_t inode_index, uint32_t version) {
+    if (version < 3) {
+        inode->nlink = inode_index == 0 ? 0 : 1;
+        inode->is_symlink = false;
+    }
+    if (version < 6 && !inode->is_directory)
+        memset(inode->xattrs, 0, sizeof(inode->xattrs));
+    if (version < 4) {
+        inode->access_time = inode->modification_time;
+        if (inode->permissions == 0) {
+            inode->permissions = inode->is_directory ? DEFAULT_DIR_PERMISSIONS :
+                                 inode->is_symlink ? DEFAULT_SYMLINK_PERMISSIONS : DEFAULT_FILE_PERMISSIONS;
+        }
+    }
+}
+
+int load_file_system(FileSystem *fs, const char *image_filename) {
+    TRACE_SPAN("load_file_system");
+    // Everything starts out NULL so a failed load can go through cleanup_file_system
+    memset(fs, 0, sizeof(FileSystem));
 
-    // Allocate memory for blocks
-    fs->blocks = (Block *)malloc(fs->total_blocks * sizeof(Block));
-    if (!fs->blocks) {
-        printf("Memory allocation for blocks failed!\n");
-        free(fs->block_bitmap);
+    FILE *file = fopen(image_filename, "rb");
+    if (!file) {
+        fs_log("Failed to open disk image file '%s'.\n", image_filename);
+        return -1;
+    }
+
+    // Read the superblock, images without a magic number are the old headerless layout
+    SuperBlock sb;
+    uint32_t first;
+    if (!read_exact(&first, sizeof(uint32_t), 1, file)) {
+        fs_log("Disk image '%s' is empty.\n", image_filename);
         fclose(file);
-        return;
+        return -1;
     }
+    if (first == FS_MAGIC) {
+        sb.magic = first;
+        if (!read_exact(&sb.version, sizeof(SuperBlock) - sizeof(uint32_t), 1, file)) {
+            fs_log("Disk image '%s' has a truncated superblock.\n", image_filename);
+            fclose(file);
+            return -1;
+        }
+        if (sb.version < 1 || sb.version > FS_VERSION) {
+            fs_log("Unsupported disk image version %u.\n", sb.version);
+            fclose(file);
+            return -1;
+        }
+    } else {
+        sb.magic = 0;
+        sb.version = 0;
+        sb.total_blocks = first;
+        sb.snapshot_count = 0;
+        if (!read_exact(&sb.total_inodes, sizeof(uint32_t), 1, file)) {
+            fs_log("Disk image '%s' has a truncated header.\n", image_filename);
+            fclose(file);
+            return -1;
+        }
+    }
+    fs->total_blocks = sb.total_blocks;
+    fs->total_inodes = sb.total_inodes;
+    fs->image = file;
 
     #ifdef DEBUG
-    printf("Memory allocated for blocks\n");
+    fs_log("Total blocks: %d\n", fs->total_blocks);
+    fs_log("Total inodes: %d\n", fs->total_inodes);
     #endif
 
-    // Allocate memory for inodes
-    fs->inodes = (Inode *)malloc(fs->total_inodes * sizeof(Inode));
-    if (!fs->inodes) {
-        printf("Memory allocation for inodes failed!\n");
-        free(fs->block_bitmap);
-        free(fs->blocks);
-        fclose(file);
-        return;
+    fs->lock = (pthread_rwlock_t *)malloc(sizeof(pthread_rwlock_t));
+    if (!fs->lock) {
+        fs_log("Memory allocation for file system lock failed!\n");
+        goto fail;
+    }
+    pthread_rwlock_init(fs->lock, NULL);
+
+    // Bitmaps, refcounts, checksums and inodes in one arena chunk.
+    // Blocks are not read here, get_block() faults them in on first access.
+    // Zero pages of the block array stay untouched until then.
+    if (block_memory_alloc(&fs->block_memory, (size_t)fs->total_blocks * sizeof(Block)) != 0 ||
+        alloc_metadata(fs, true) != 0) {
+        fs_log("Memory allocation for file system failed!\n");
+        goto fail;
     }
+    fs->blocks = (Block *)fs->block_memory.base;
 
     #ifdef DEBUG
-    printf("Memory allocated for inodes\n");
+    fs_log("Memory allocated for file system\n");
     #endif
 
     // Read the block bitmap
-    fread(fs->block_bitmap, sizeof(bool), fs->total_blocks, file);
-
-    #ifdef DEBUG
-    printf("Block bitmap read\n");
-    #endif
+    if (!read_exact(fs->block_bitmap, sizeof(bool), fs->total_blocks, file)) {
+        fs_log("Disk image '%s' has a truncated block bitmap.\n", image_filename);
+        goto fail;
+    }
 
     // Read the inode bitmap
-    fread(fs->inode_bitmap, sizeof(bool), fs->total_inodes, file);
+    if (!read_exact(fs->inode_bitmap, sizeof(bool), fs->total_inodes, file)) {
+        fs_log("Disk image '%s' has a truncated inode bitmap.\n", image_filename);
+        goto fail;
+    }
 
-    #ifdef DEBUG
-    printf("inode bitmap read\n");
-    #endif
+    // Read the block refcounts, old images have no sharing so every used block has one owner
+    if (sb.version >= 1) {
+        if (!read_exact(fs->block_refcount, sizeof(uint16_t), fs->total_blocks, file)) {
+            fs_log("Disk image '%s' has truncated block refcounts.\n", image_filename);
+            goto fail;
+        }
+    } else {
+        for (uint32_t i = 0; i < fs->total_blocks; i++) {
+            fs->block_refcount[i] = fs->block_bitmap[i] ? 1 : 0;
+        }
+    }
 
+    // Read the block checksums, older images get theirs computed as blocks are faulted in
+    if (sb.version >= 2) {
+        if (!read_exact(fs->block_crc, sizeof(uint32_t), fs->total_blocks, file)) {
+            fs_log("Disk image '%s' has truncated block checksums.\n", image_filename);
+            goto fail;
+        }
+        fs->checksums_valid = true;
+    }
 
     // Read inodes
-    fread(fs->inodes, sizeof(Inode), fs->total_inodes, file);
+    if (!read_inode_table(fs, file, sb.version)) {
+        fs_log("Disk image '%s' has a truncated inode table.\n", image_filename);
+        goto fail;
+    }
 
     #ifdef DEBUG
-    printf("inode read\n");
+    fs_log("inode read\n");
     #endif
 
-    // Read blocks
-    for (uint32_t i = 0; i < fs->total_blocks; i++) {
-        fread(&fs->blocks[i], sizeof(Block), 1, file);
+    // Read snapshots
+    if (load_snapshots(fs, file, sb.snapshot_count, sb.version) != 0) {
+        fs_log("Failed to read snapshots from disk image '%s'.\n", image_filename);
+        goto fail;
+    }
+
+    if (sb.version < FS_VERSION) {
+        for (uint32_t i = 0; i < fs->total_inodes; i++) {
+            upgrade_inode(&fs->inodes[i], i, sb.version);
+        }
+        for (uint32_t s = 0; s < fs->snapshot_count; s++) {
+            Snapshot *snap = &fs->snapshots[s];
+            for (uint32_t i = 0; i < snap->inode_count; i++) {
+                upgrade_inode(&snap->inodes[i], snap->inode_indexes[i], sb.version);
+            }
+        }
     }
 
+    fs->data_offset = ftello(file);
+    fs->fetch_block = fetch_block_from_image;
+    fs->image_current = sb.version == FS_VERSION;
+    struct stat image_stat;
+    if (fstat(fileno(file), &image_stat) == 0) {
+        fs->image_dev = image_stat.st_dev;
+        fs->image_ino = image_stat.st_ino;
+    }
+    recount_usage(fs);
+
     #ifdef DEBUG
-    printf("blocks read\n");
+    fs_log("metadata read, data starts at %lld\n", (long long)fs->data_offset);
     #endif
 
-    fclose(file);
-    printf("File system loaded from disk image '%s'. Total blocks: %u\n", image_filename, fs->total_blocks);
+    fs_log("File system loaded from disk image '%s'. Total blocks: %u\n", image_filename, fs->total_blocks);
+    return 0;
+
+fail:
+    cleanup_file_system(fs);
+    return -1;
 }
 
 void get_inode_path(FileSystem *fs, int inode_index, char *path, int max_path_len) {
@@ -466,68 +1483,46 @@ void get_inode_path(FileSystem *fs, int inode_index, char *path, int max_path_le
         return;
     }
 
-    char temp_path[max_path_len];
-    temp_path[0] = '\0';
+    // The path is assembled right to left at the end of a scratch buffer
+    Arena *scratch = scratch_arena();
+    ArenaMark mark = arena_mark(scratch);
+    char *temp_path = (char *)arena_alloc(scratch, max_path_len);
+    if (!temp_path) {
+        return;
+    }
+    int start = max_path_len - 1;
+    temp_path[start] = '\0';
     int current_inode_index = inode_index;
 
     while(current_inode_index != 0) {
-       char dir_name[MAX_FILENAME];
-       int parent_inode_index = -1;
-
-         for (uint32_t parent_inode_idx = 0; parent_inode_idx < fs->total_inodes; parent_inode_idx++){
-            if (fs->inodes[parent_inode_idx].is_directory) {
-                 for (int j = 0; j < fs->inodes[parent_inode_idx].dir_entry_count; j++) {
-                      if(fs->inodes[parent_inode_idx].entries[j].inode_index == current_inode_index){
-                        strcpy(dir_name, fs->inodes[parent_inode_idx].entries[j].name);
-                        parent_inode_index = parent_inode_idx;
-                        break;
-                      }
-                 }
-                 if(parent_inode_index != -1)
-                    break;
-             }
-        }
-        char tmp[max_path_len];
-         snprintf(tmp, max_path_len, "/%s%s", dir_name, temp_path);
-        strcpy(temp_path, tmp);
-        current_inode_index = parent_inode_index;
-
-        if(current_inode_index == -1){
-            printf("Invalid Path\n");
+        int parent_inode_index = find_parent(fs, current_inode_index);
+        if(parent_inode_index == -1){
+            fs_log("Invalid Path\n");
             path[0] = '\0';
+            arena_rewind(scratch, mark);
             return;
         }
-    }
 
-    strcpy(path, temp_path);
-}
-
-void status(FileSystem *fs){
-  int used_blocks = 0;
-  int used_inodes = 0;
-  int used_files_blocks = 0;
-
-   for(int i =0; i < fs->total_blocks; i++){
-     if(fs->block_bitmap[i])
-        used_blocks++;
-   }
-
-    for (int i = 0; i < fs->total_inodes; i++) {
-      if(fs->inode_bitmap[i]){
-          used_inodes++;
-           if(!fs->inodes[i].is_directory){
-                used_files_blocks+= (fs->inodes[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-          }
-      }
+        // The entry in the parent carries the name
+        const char *dir_name = "";
+        Inode *parent = &fs->inodes[parent_inode_index];
+        for (uint32_t j = 0; j < parent->dir_entry_count; j++) {
+            if (parent->entries[j].inode_index == (uint32_t)current_inode_index) {
+                dir_name = parent->entries[j].name;
+                break;
+            }
+        }
+        // Components that no longer fit are dropped from the front
+        int len = (int)strlen(dir_name) + 1;
+        if (len > start) {
+            break;
+        }
+        start -= len;
+        temp_path[start] = '/';
+        memcpy(temp_path + start + 1, dir_name, len - 1);
+        current_inode_index = parent_inode_index;
     }
 
-
-    printf("partition size: %ld\n", (long)(fs->total_blocks * BLOCK_SIZE));
-    printf("total inodes: %d\n", fs->total_inodes);
-    printf("used inodes: %d\n", used_inodes);
-     printf("total blocks: %d\n", fs->total_blocks);
-    printf("used blocks: %d\n", used_blocks);
-     printf("files' blocks: %d\n", used_files_blocks);
-    printf("block size: %d\n", BLOCK_SIZE);
-   printf("free space: %ld\n", (long)((fs->total_blocks - used_blocks) * BLOCK_SIZE));
-}
\ No newline at end of file
+    memcpy(path, temp_path + start, max_path_len - start);
+    arena_rewind(scratch, mark);
+}
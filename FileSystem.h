@@ -1,9 +1,18 @@
+#ifndef FILESYSTEM_H
+#define FILESYSTEM_H
+
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "alloc.h"
+#include "blockmem.h"
 
 
 #define BLOCK_SIZE 4096   // Size of each block
@@ -11,6 +20,15 @@
 #define DIRECT_POINTERS 12 // Number of direct pointers in an inode
 #define MAX_DIR_ENTRIES 16 // Maximum entries in a single directory
 #define INODE_BLOCK_RATIO 4
+#define BLOCK_HOLE UINT32_MAX // Block pointer of a hole: never written or written as zeros, reads as zeros
+#define FS_MAGIC 0x46534d49 // "IMSF", marks images that start with a SuperBlock
+#define FS_VERSION 6       // 1: block refcounts and snapshots, 2: block checksums, 3: link counts and symlinks, 4: access times, 5: directory quotas, 6: extended attributes
+
+// resolve_path results
+#define PATH_NOT_FOUND -1  // A directory along the way does not exist
+#define PATH_NOT_DIR -2    // A component along the way is a file
+#define PATH_TOO_LONG -3   // A component does not fit in MAX_FILENAME
+#define PATH_LOOP -4       // More than SYMLINK_MAX_DEPTH symlinks in a row
 //#define DEBUG
 // #define LOAD_IMG
 
@@ -25,53 +43,200 @@ typedef struct {
     char name[MAX_FILENAME];  // Name of the file or subdirectory
 } DirectoryEntry;
 
+// On-disk header (images written before version 1 start directly with total_blocks)
+typedef struct {
+    uint32_t magic;           // FS_MAGIC
+    uint32_t version;         // FS_VERSION
+    uint32_t total_blocks;    // Total number of blocks
+    uint32_t total_inodes;    // Total number of inodes
+    uint32_t snapshot_count;  // Number of snapshot records after the inode table
+} SuperBlock;
+
 // Inode structure
 typedef struct {
     uint32_t size;                   // File size in bytes (not applicable for directories)
     uint32_t blocks[DIRECT_POINTERS]; // Direct block pointers
     uint32_t indirect_block;         // Pointer to indirect block (if implemented)
     uint16_t permissions;            // File permissions
+    uint16_t nlink;                  // Directory entries naming this inode (none for the root)
     uint32_t creation_time;          // File creation timestamp
     uint32_t modification_time;      // Last modification timestamp
     bool is_directory;               // True if this is a directory
+    bool is_symlink;                 // The file data is the link target (inline in blocks if short)
     uint32_t dir_entry_count;        // Number of entries (only for directories)
-    DirectoryEntry entries[MAX_DIR_ENTRIES]; // Entries in the directory
+    union {
+        DirectoryEntry entries[MAX_DIR_ENTRIES]; // Entries in the directory
+        uint8_t xattrs[MAX_DIR_ENTRIES * sizeof(DirectoryEntry)]; // Files and symlinks: short extended attributes (see xattr.h)
+    };
     char filename[MAX_FILENAME];     // Filename or directory name
+    uint32_t access_time;            // Last read, relatime style (see touch_accessed)
+    uint32_t quota_blocks;           // Directories: blocks the tree below may hold, reserved ones included; 0 for no limit
+    uint32_t xattr_block;            // Extended attribute block + 1, possibly shared with other inodes; 0 for none
 } Inode;
 
+// Inode records before version 4 end where access_time starts, before version 5 where
+// quota_blocks does, before version 6 where xattr_block does
+#define INODE_V3_SIZE offsetof(Inode, access_time)
+#define INODE_V4_SIZE offsetof(Inode, quota_blocks)
+#define INODE_V5_SIZE offsetof(Inode, xattr_block)
+#define INODE_READ_CHUNK 256 // Inodes read at a time between checks for holes in an image's table
+
+#define DEFAULT_FILE_PERMISSIONS 0644
+#define DEFAULT_DIR_PERMISSIONS 0755
+#define DEFAULT_SYMLINK_PERMISSIONS 0777
+#define RELATIME_INTERVAL (24 * 60 * 60) // Reads refresh an access time at most this often unless it predates the last write
+
+// Symlink targets shorter than this live in the inode's block pointers, longer ones in a data block
+#define SYMLINK_INLINE_MAX (DIRECT_POINTERS * sizeof(uint32_t))
+#define SYMLINK_MAX BLOCK_SIZE   // Targets must be shorter than this
+#define SYMLINK_MAX_DEPTH 8      // Symlinks followed in a row before giving up with PATH_LOOP
+
+
+// What a directory holds, everything below it included. A hard-linked file is
+// counted once, under the directory parents[] records for it.
+typedef struct {
+    int64_t bytes;            // File sizes
+    int64_t blocks;           // Data blocks of those files
+    int64_t files;            // Files and symlinks
+    int64_t directories;
+    int64_t reserved;         // Blocks reserved for those files and not written yet (see quota.h)
+} TreeUsage;
+
+// Operation counters. Most are bumped under fs->lock held for writing (or by the
+// only thread using fs) with plain increments. The ones the read paths reach under
+// the shared lock (bytes_read, dir_lookups, cache_hits, cache_misses, map_hits) are
+// bumped with __atomic_fetch_add there.
+typedef struct {
+    uint64_t block_allocs;    // Blocks handed out by allocate_block
+    uint64_t block_frees;     // Blocks returned to the bitmap
+    uint64_t inode_allocs;
+    uint64_t inode_frees;
+    uint64_t bytes_read;      // File data read out of the file system
+    uint64_t bytes_written;   // File data written into the file system
+    uint64_t dir_lookups;     // Name lookups in a directory
+    uint64_t name_cache_hits; // Path components resolve_path found in the name cache
+    uint64_t cache_hits;      // get_block found the block in memory
+    uint64_t cache_misses;    // get_block had to fault the block in from the image
+    uint64_t map_hits;        // Reads served from an open file's cached block map
+} FsStats;
 
 // File system metadata
 typedef struct file_manager{
     bool *block_bitmap;   // Dynamic array to track free/used blocks
     bool *inode_bitmap;   // Tracks free/used inodes
-    Block *blocks;        // Dynamically allocated array of blocks
+    Block *blocks;        // Array of blocks, inside block_memory
+    BlockMemory block_memory; // Huge-page / NUMA aware mapping behind blocks (see blockmem.h)
     Inode *inodes; // Array of inodes (still fixed for simplicity)
     uint32_t total_blocks;    // Total number of blocks
     uint32_t total_inodes;    // Total number of inodes
+    bool *block_loaded;   // Blocks already faulted in from the image (NULL = all resident)
+    FILE *image;          // Backing image for lazily loaded blocks (NULL if none)
+    off_t data_offset;    // Byte offset of block 0 inside the backing image
+    int (*fetch_block)(struct file_manager *fs, uint32_t block_index, Block *block); // Block fetch hook
+    uint16_t *block_refcount; // References to each block from live inodes and snapshots
+    struct Snapshot *snapshots; // Named read-only snapshots (see snapshot.h)
+    uint32_t snapshot_count;  // Number of snapshots
+    bool read_only;           // Set on snapshot views, mutating commands refuse to run
+    uint32_t *block_crc;      // CRC32C of every used block
+    bool checksums_valid;     // block_crc can be trusted (false while loading a pre-checksum image)
+    uint32_t checksum_errors; // Mismatches seen while faulting blocks in
+    pthread_rwlock_t *lock;   // Shell commands hold it for writing, background readers (scrub) for reading
+    struct ScrubState *scrub; // Background scrub, NULL if none ran (see scrub.h)
+    struct ReclaimQueue *reclaim; // Deferred frees of unlinked inodes (see reclaim.h)
+    uint32_t used_blocks;     // Set bits in block_bitmap, kept in step so status is O(1)
+    uint32_t used_inodes;     // Set bits in inode_bitmap
+    uint32_t file_blocks;     // Block pointers in use by live files, holes included
+    uint32_t reserved_blocks; // Free blocks promised to reservations, allocate_block leaves them alone
+    uint32_t block_hint;      // No free block below this index, allocation scans from here
+    uint32_t inode_hint;      // No free inode below this index
+    uint32_t inode_watermark; // Inodes from here on were never handed out and are still zero pages
+    FsStats stats;            // Operation counters
+    uint32_t map_generation;  // Bumped on every block allocate/free, open files drop their cached maps
+    Arena meta;               // Backs the bitmaps, refcounts, checksums, block_loaded, inodes, parents, usage and reserved
+    uint32_t *parents;        // Directory holding each inode + 1, 0 if unknown (find_parent scans then)
+    struct NameCache *names;  // resolve_path's lookup cache, NULL until first used (see namecache.h)
+    struct XattrCache *xattrs; // Attribute blocks to share, NULL until first used (see xattr.h)
+    uint32_t name_generation; // Bumped whenever a directory gains an entry, cached misses go stale
+    TreeUsage *usage;         // Totals below each directory, NULL on snapshot views (see walk.h)
+    bool usage_valid;         // usage is kept up to date; cleared when an update cannot be done in place
+    uint32_t *reserved;       // Blocks reserved for each inode, NULL on snapshot views
+    bool *block_dirty;        // Blocks written since the writeback thread last copied them out, NULL on views
+    uint32_t dirty_blocks;    // Set entries in block_dirty
+    uint32_t dirty_since;     // fs_time() of the oldest change the image does not have yet, 0 if none
+    uint32_t dirty_limit;     // dirty_blocks that wake the writeback thread early, 0 without one
+    uint32_t snapshot_generation; // Bumped when a snapshot is taken or deleted, the image's records go stale
+    bool image_current;       // Loaded in this version's layout, nothing had to be upgraded
+    dev_t image_dev;          // File the image was loaded from, to tell whether a path is the same one
+    ino_t image_ino;
+    struct Writeback *writeback; // Background flusher, NULL if none runs (see writeback.h)
+    struct DefragState *defrag; // Background defragmenter, NULL if none ran (see defrag.h)
 } FileSystem;
 
 
-void initialize_file_system(FileSystem *fs, uint32_t num_blocks);
-void cleanup_file_system(FileSystem *fs);
+// Diagnostics from the core go through fs_log. Nothing is printed until a
+// handler is installed, programs that want the messages on stdout install log_to_stdout.
+typedef void (*FsLogHandler)(const char *fmt, va_list args);
+void set_log_handler(FsLogHandler handler);
+void log_to_stdout(const char *fmt, va_list args);
+void fs_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
+int initialize_file_system(FileSystem *fs, uint32_t num_blocks);
+void cleanup_file_system(FileSystem *fs);
+int resize_metadata(FileSystem *fs, uint32_t blocks, uint32_t inodes, uint32_t inodes_kept);
+
+Block *get_block(FileSystem *fs, uint32_t block_index);
+const Block *data_block(FileSystem *fs, uint32_t block_index);
+void prefetch_block(FileSystem *fs, uint32_t block_index);
+void load_all_blocks(FileSystem *fs);
+int fetch_block_from_image(FileSystem *fs, uint32_t block_index, Block *block);
+void update_block_checksum(FileSystem *fs, uint32_t block_index);
+void mark_dirty(FileSystem *fs);
+void mark_block_dirty(FileSystem *fs, uint32_t block_index);
+bool verify_block_checksum(FileSystem *fs, uint32_t block_index, const Block *block);
+
+uint32_t used_block_end(FileSystem *fs);
 int allocate_block(FileSystem *fs) ;
 void free_block(FileSystem *fs, int block_index);
+int ref_block(FileSystem *fs, uint32_t block_index);
+int cow_block(FileSystem *fs, uint32_t *block_index);
+uint32_t inode_block_count(const Inode *inode);
+uint32_t inode_data_blocks(const Inode *inode);
+uint32_t find_data_or_hole(const Inode *inode, uint32_t offset, bool hole);
+void set_file_size(FileSystem *fs, Inode *inode, uint32_t size);
+uint32_t fs_time(void);
+void touch_modified(FileSystem *fs, Inode *inode);
+void touch_accessed(FileSystem *fs, Inode *inode);
+void recount_usage(FileSystem *fs);
+void rebuild_parents(FileSystem *fs);
+int worker_thread_count(int max_threads);
 int allocate_inode(FileSystem *fs);
 void free_inode(FileSystem *fs, int inode_index);
 
 void write_to_file(FileSystem *fs, int inode_index, const uint8_t *data, uint32_t size);
 void read_from_file(FileSystem *fs, int inode_index, uint8_t *buffer, uint32_t size);
+int truncate_file(FileSystem *fs, Inode *inode, uint32_t size);
+uint32_t read_file_range(FileSystem *fs, Inode *inode, uint32_t offset, uint8_t *buffer, uint32_t size);
+int write_file_range(FileSystem *fs, Inode *inode, uint32_t offset, const uint8_t *data, uint32_t size);
 
 int create_directory(FileSystem *fs, const char *name);
 int add_to_directory(FileSystem *fs, int dir_inode_index, int child_inode_index, const char *name);
-void list_directory(FileSystem *fs, int dir_inode_index);
+int find_in_directory(FileSystem *fs, int dir_inode_index, const char *name);
+int find_parent(FileSystem *fs, int inode_index);
+int resolve_path(FileSystem *fs, int cwd, const char *path, int *dir_inode_index, char *leaf);
+int follow_symlink(FileSystem *fs, int dir_inode_index, int inode_index);
+int create_symlink(FileSystem *fs, const char *target);
+uint32_t read_symlink(FileSystem *fs, Inode *inode, char *buffer, uint32_t size);
 
 int read_file_to_fs(FileSystem *fs, const char *external_filename, const char *internal_filename);
 int write_file_to_host(FileSystem *fs, int inode_index, const char *external_filename);
 
-void save_file_system(FileSystem *fs, const char *image_filename);
-void load_file_system(FileSystem *fs, const char *image_filename);
+void write_image_metadata(FileSystem *fs, FILE *file);
+int write_image(FileSystem *fs, FILE *file, off_t *data_offset);
+int save_file_system(FileSystem *fs, const char *image_filename);
+int load_file_system(FileSystem *fs, const char *image_filename);
+bool read_inode_records(FILE *file, Inode *inodes, uint32_t count, uint32_t version);
 
 void get_inode_path(FileSystem *fs, int inode_index, char *path, int max_path_len);
-void status(FileSystem *fs);
-void remove_from_directory(FileSystem *fs, int dir_inode_index, int child_inode_index, const char *name);
\ No newline at end of file
+int remove_from_directory(FileSystem *fs, int dir_inode_index, int child_inode_index, const char *name);
+
+#endif
@@ -0,0 +1,201 @@
+#include "alloc.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE (2u << 20)
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;          // Usable bytes after the header
+    size_t used;
+    size_t clean_from;    // Bytes from here on are still zero
+    bool mapped;          // Came from mmap rather than malloc
+};
+
+// Data starts a cache line after the chunk header
+#define CHUNK_HEADER ((sizeof(ArenaChunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct SlabChunk {
+    SlabChunk *next;
+};
+
+#define SLAB_HEADER ((sizeof(SlabChunk) + 15) & ~(size_t)15)
+
+
+static size_t align_up(size_t size, size_t align) {
+    return (size + align - 1) & ~(align - 1);
+}
+
+static ArenaChunk *chunk_new(size_t size) {
+    size_t total = CHUNK_HEADER + size;
+    ArenaChunk *chunk;
+    bool mapped = total >= ARENA_MMAP_THRESHOLD;
+    if (mapped) {
+        // Fresh anonymous pages read as zero and cost nothing until touched
+        total = align_up(total, HUGE_PAGE_SIZE);
+        void *mem = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise(mem, total, MADV_HUGEPAGE);
+#endif
+        chunk = (ArenaChunk *)mem;
+    } else {
+        chunk = (ArenaChunk *)calloc(1, total);
+        if (!chunk)
+            return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = total - CHUNK_HEADER;
+    chunk->used = 0;
+    chunk->clean_from = 0;
+    chunk->mapped = mapped;
+    return chunk;
+}
+
+static void chunk_free(ArenaChunk *chunk) {
+    if (chunk->mapped)
+        munmap(chunk, CHUNK_HEADER + chunk->size);
+    else
+        free(chunk);
+}
+
+void arena_init(Arena *arena, size_t chunk_size) {
+    arena->head = NULL;
+    arena->chunk_size = chunk_size;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = align_up(size ? size : 1, ARENA_ALIGN);
+    ArenaChunk *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        chunk = chunk_new(size > arena->chunk_size ? size : arena->chunk_size);
+        if (!chunk)
+            return NULL;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    void *ptr = (uint8_t *)chunk + CHUNK_HEADER + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+// arena_alloc, zeroed. Memory no one has handed out yet is known to be zero and left alone.
+void *arena_zalloc(Arena *arena, size_t size) {
+    uint8_t *ptr = (uint8_t *)arena_alloc(arena, size);
+    if (!ptr)
+        return NULL;
+    ArenaChunk *chunk = arena->head;
+    size_t start = ptr - ((uint8_t *)chunk + CHUNK_HEADER);
+    if (start < chunk->clean_from)
+        memset(ptr, 0, chunk->clean_from - start < size ? chunk->clean_from - start : size);
+    if (chunk->used > chunk->clean_from)
+        chunk->clean_from = chunk->used;
+    return ptr;
+}
+
+ArenaMark arena_mark(Arena *arena) {
+    ArenaMark mark = { arena->head, arena->head ? arena->head->used : 0 };
+    return mark;
+}
+
+// Give back everything allocated since mark
+void arena_rewind(Arena *arena, ArenaMark mark) {
+    while (arena->head && arena->head != mark.chunk) {
+        ArenaChunk *next = arena->head->next;
+        chunk_free(arena->head);
+        arena->head = next;
+    }
+    if (arena->head) {
+        if (arena->head->used > arena->head->clean_from)
+            arena->head->clean_from = arena->head->used;
+        arena->head->used = mark.used;
+    }
+}
+
+void arena_free(Arena *arena) {
+    while (arena->head) {
+        ArenaChunk *next = arena->head->next;
+        chunk_free(arena->head);
+        arena->head = next;
+    }
+}
+
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_destroy(void *ptr) {
+    arena_free((Arena *)ptr);
+    free(ptr);
+}
+
+static void scratch_key_init(void) {
+    pthread_key_create(&scratch_key, scratch_destroy);
+}
+
+Arena *scratch_arena(void) {
+    pthread_once(&scratch_once, scratch_key_init);
+    Arena *arena = (Arena *)pthread_getspecific(scratch_key);
+    if (!arena) {
+        arena = (Arena *)malloc(sizeof(Arena));
+        if (!arena)
+            return NULL;
+        arena_init(arena, SCRATCH_CHUNK_SIZE);
+        pthread_setspecific(scratch_key, arena);
+    }
+    return arena;
+}
+
+
+void slab_init(Slab *slab, size_t object_size, uint32_t per_chunk) {
+    slab->object_size = align_up(object_size < sizeof(void *) ? sizeof(void *) : object_size, 16);
+    slab->per_chunk = per_chunk ? per_chunk : 1;
+    slab->free_list = NULL;
+    slab->chunks = NULL;
+    slab->in_use = 0;
+}
+
+// A zeroed object
+void *slab_alloc(Slab *slab) {
+    if (!slab->free_list) {
+        SlabChunk *chunk = (SlabChunk *)malloc(SLAB_HEADER + (size_t)slab->per_chunk * slab->object_size);
+        if (!chunk)
+            return NULL;
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+        // Thread the new objects onto the free list, first object on top
+        uint8_t *objects = (uint8_t *)chunk + SLAB_HEADER;
+        for (uint32_t i = slab->per_chunk; i-- > 0; ) {
+            void *object = objects + (size_t)i * slab->object_size;
+            *(void **)object = slab->free_list;
+            slab->free_list = object;
+        }
+    }
+
+    void *object = slab->free_list;
+    slab->free_list = *(void **)object;
+    memset(object, 0, slab->object_size);
+    slab->in_use++;
+    return object;
+}
+
+void slab_free(Slab *slab, void *object) {
+    if (!object)
+        return;
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+}
+
+void slab_destroy(Slab *slab) {
+    while (slab->chunks) {
+        SlabChunk *next = slab->chunks->next;
+        free(slab->chunks);
+        slab->chunks = next;
+    }
+    slab->free_list = NULL;
+    slab->in_use = 0;
+}
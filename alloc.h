@@ -0,0 +1,61 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN 64                   // Every arena allocation starts on a cache line
+#define ARENA_MMAP_THRESHOLD (1u << 20)  // Chunks this big come straight from mmap as zero pages
+#define SCRATCH_CHUNK_SIZE (64u << 10)   // First chunk of each thread's scratch arena
+
+
+// Arena: bump allocation out of a list of chunks, everything is released at once.
+// Used for the file system's metadata arrays (one allocation, one free, no partial
+// failure to unwind) and for per-call scratch memory.
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;     // Chunk being carved, older chunks follow
+    size_t chunk_size;    // Size of new chunks, bigger requests get a chunk of their own
+} Arena;
+
+// Position to rewind a scratch arena to
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+void arena_init(Arena *arena, size_t chunk_size);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_zalloc(Arena *arena, size_t size);
+ArenaMark arena_mark(Arena *arena);
+void arena_rewind(Arena *arena, ArenaMark mark);
+void arena_free(Arena *arena);
+
+// This thread's scratch arena, callers take a mark and rewind to it before returning
+Arena *scratch_arena(void);
+
+
+// Slab: fixed-size objects carved from chunks, freed objects go on a free list
+// and are handed out again without touching malloc. Not thread safe, callers
+// protect it with whatever lock guards the objects.
+// Only OpenFile is allocated one at a time. Inodes are indexed by number in the
+// arena-backed table, directory entries live inside their inode, name cache
+// slots in one fixed table and block frames in the block array.
+typedef struct SlabChunk SlabChunk;
+
+typedef struct {
+    size_t object_size;
+    uint32_t per_chunk;   // Objects per chunk
+    void *free_list;      // Freed objects, linked through their first word
+    SlabChunk *chunks;
+    uint32_t in_use;      // Objects handed out and not freed
+} Slab;
+
+void slab_init(Slab *slab, size_t object_size, uint32_t per_chunk);
+void *slab_alloc(Slab *slab);
+void slab_free(Slab *slab, void *object);
+void slab_destroy(Slab *slab);
+
+#endif
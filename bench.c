@@ -0,0 +1,625 @@
+#include "FileSystem.h"
+#include "openfile.h"
+#include "walk.h"
+#include <unistd.h>
+#include <fcntl.h>
+
+
+// Benchmarks for the FileSystem.c core: ./fsbench [--quick] [--baseline file.json] [--threshold pct]
+// Results go to stdout as JSON, one result per line so runs can be diffed and compared.
+// Everything is deterministic (fixed sizes, fill levels and iteration counts), the core's
+// own messages are sent to /dev/null while measuring.
+
+#define BENCH_MAX_RESULTS 128
+#define BENCH_DEFAULT_THRESHOLD 10.0 // Percent drop in ops/s that counts as a regression
+
+typedef struct {
+    char id[128];          // Unique name including parameters, used to match baselines
+    uint64_t iterations;
+    double ops_per_sec;
+    double p50_ns;
+    double p99_ns;
+    double bytes_per_sec;  // 0 when the operation moves no data
+} BenchResult;
+
+static FILE *out;          // Real stdout, the process stdout is /dev/null while benchmarking
+static BenchResult results[BENCH_MAX_RESULTS];
+static int result_count;
+static int scale = 1;      // --quick divides iteration counts by 10
+static char tmp_dir[] = "/tmp/fsbench.XXXXXX";
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Turn per-operation samples into a result line
+static void record(const char *id, uint64_t *samples, uint64_t n, uint64_t total_ns, uint64_t bytes) {
+    if (result_count >= BENCH_MAX_RESULTS || n == 0)
+        return;
+    BenchResult *r = &results[result_count++];
+    snprintf(r->id, sizeof(r->id), "%s", id);
+    qsort(samples, n, sizeof(uint64_t), cmp_u64);
+    r->iterations = n;
+    r->ops_per_sec = total_ns ? n * 1e9 / total_ns : 0;
+    r->p50_ns = samples[n / 2];
+    r->p99_ns = samples[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1];
+    r->bytes_per_sec = total_ns ? bytes * 1e9 / total_ns : 0;
+    fprintf(stderr, "  %-48s %12.0f ops/s  p50 %9.0f ns  p99 %9.0f ns\n", r->id, r->ops_per_sec, r->p50_ns, r->p99_ns);
+}
+
+static uint64_t iters(uint64_t n) {
+    n /= scale;
+    return n ? n : 1;
+}
+
+// Fresh partition with a root directory and the first fill_pct percent of blocks and inodes in use
+static void setup(FileSystem *fs, uint32_t num_blocks, int fill_pct) {
+    initialize_file_system(fs, num_blocks);
+    memset(fs->inodes, 0, fs->total_inodes * sizeof(Inode));
+    create_directory(fs, "root");
+
+    uint32_t used_blocks = (uint32_t)((uint64_t)num_blocks * fill_pct / 100);
+    for (uint32_t i = 0; i < used_blocks; i++) {
+        fs->block_bitmap[i] = true;
+        fs->block_refcount[i] = 1;
+    }
+    uint32_t used_inodes = (uint32_t)((uint64_t)fs->total_inodes * fill_pct / 100);
+    for (uint32_t i = 1; i < used_inodes; i++) {
+        fs->inode_bitmap[i] = true;
+    }
+    recount_usage(fs);
+}
+
+// Free an inode and its blocks right away, without going through the background reclaimer
+static void drop_inode(FileSystem *fs, int inode_index) {
+    Inode *inode = &fs->inodes[inode_index];
+    uint32_t count = inode_block_count(inode);
+    for (uint32_t b = 0; b < count; b++) {
+        free_block(fs, inode->blocks[b]);
+    }
+    set_file_size(fs, inode, 0);
+    free_inode(fs, inode_index);
+}
+
+static void make_host_file(const char *path, size_t size) {
+    FILE *f = fopen(path, "wb");
+    uint32_t x = 2463534242u;
+    for (size_t i = 0; i < size; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        fputc((int)(x & 0xff), f);
+    }
+    fclose(f);
+}
+
+static void bench_allocate_block(uint32_t num_blocks, int fill_pct) {
+    FileSystem fs;
+    setup(&fs, num_blocks, fill_pct);
+    uint64_t n = iters(20000);
+    uint64_t *samples = (uint64_t *)malloc(n * sizeof(uint64_t));
+
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        int b = allocate_block(&fs);
+        free_block(&fs, b);
+        samples[i] = now_ns() - t;
+    }
+    uint64_t total = now_ns() - begin;
+
+    char id[128];
+    snprintf(id, sizeof(id), "allocate_block/blocks=%u/fill=%d", num_blocks, fill_pct);
+    record(id, samples, n, total, 0);
+    free(samples);
+    cleanup_file_system(&fs);
+}
+
+static void bench_read_file_to_fs(uint32_t num_blocks, int fill_pct, size_t file_size) {
+    FileSystem fs;
+    setup(&fs, num_blocks, fill_pct);
+    char path[256];
+    snprintf(path, sizeof(path), "%s/put_%zu", tmp_dir, file_size);
+    make_host_file(path, file_size);
+
+    uint64_t n = iters(2000);
+    uint64_t *samples = (uint64_t *)malloc(n * sizeof(uint64_t));
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        int inode_index = read_file_to_fs(&fs, path, "bench");
+        samples[i] = now_ns() - t;
+        drop_inode(&fs, inode_index);
+    }
+    uint64_t total = now_ns() - begin;
+
+    char id[128];
+    snprintf(id, sizeof(id), "read_file_to_fs/blocks=%u/fill=%d/size=%zu", num_blocks, fill_pct, file_size);
+    record(id, samples, n, total, n * file_size);
+    free(samples);
+    unlink(path);
+    cleanup_file_system(&fs);
+}
+
+// Chain of nested directories, returns the innermost one. Each level gets
+// siblings empty directories listed ahead of the next one.
+static int make_chain(FileSystem *fs, int parent, int depth, int siblings) {
+    for (int d = 0; d < depth; d++) {
+        char name[32];
+        for (int s = 0; s < siblings; s++) {
+            snprintf(name, sizeof(name), "s%d", s);
+            // Small partitions run out of inodes, the chain itself comes first
+            if (fs->total_inodes - fs->used_inodes <= (uint32_t)(depth - d))
+                break;
+            add_to_directory(fs, parent, create_directory(fs, name), name);
+        }
+        snprintf(name, sizeof(name), "d%d", d);
+        int dir = create_directory(fs, name);
+        add_to_directory(fs, parent, dir, name);
+        parent = dir;
+    }
+    return parent;
+}
+
+static void bench_get_inode_path(uint32_t num_blocks, int fill_pct, int depth) {
+    FileSystem fs;
+    setup(&fs, num_blocks, fill_pct);
+    int leaf = make_chain(&fs, 0, depth, 0);
+
+    uint64_t n = iters(500);
+    uint64_t *samples = (uint64_t *)malloc(n * sizeof(uint64_t));
+    char path[4096];
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        get_inode_path(&fs, leaf, path, sizeof(path));
+        samples[i] = now_ns() - t;
+    }
+    uint64_t total = now_ns() - begin;
+
+    char id[128];
+    snprintf(id, sizeof(id), "get_inode_path/blocks=%u/fill=%d/depth=%d", num_blocks, fill_pct, depth);
+    record(id, samples, n, total, 0);
+    free(samples);
+    cleanup_file_system(&fs);
+}
+
+// Resolve a deep path in one call: down from the root by name through full directories,
+// or up from the bottom through ".."
+static void bench_resolve_path(uint32_t num_blocks, int fill_pct, int depth, bool up) {
+    FileSystem fs;
+    setup(&fs, num_blocks, fill_pct);
+    int leaf = make_chain(&fs, 0, depth, up ? 0 : MAX_DIR_ENTRIES - 1);
+
+    char path[4096];
+    size_t len = 0;
+    for (int d = 0; d < depth; d++) {
+        if (up)
+            len += snprintf(path + len, sizeof(path) - len, "../");
+        else
+            len += snprintf(path + len, sizeof(path) - len, "/d%d", d);
+    }
+
+    uint64_t n = iters(2000);
+    uint64_t *samples = (uint64_t *)malloc(n * sizeof(uint64_t));
+    char name[MAX_FILENAME];
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        int dir;
+        int ret = resolve_path(&fs, leaf, path, &dir, name);
+        samples[i] = now_ns() - t;
+        if (ret != 0 || (up && dir != 0) || (!up && find_in_directory(&fs, dir, name) != leaf))
+            fprintf(stderr, "resolve_path ended at the wrong inode\n");
+    }
+    uint64_t total = now_ns() - begin;
+
+    char id[128];
+    snprintf(id, sizeof(id), "resolve_path/blocks=%u/fill=%d/depth=%d/%s", num_blocks, fill_pct, depth, up ? "up" : "down");
+    record(id, samples, n, total, 0);
+    free(samples);
+    cleanup_file_system(&fs);
+}
+
+// Re-read one full-size file in small chunks, straight from the inode or through an open file's block map
+static void bench_read_hot_file(uint32_t num_blocks, bool mapped) {
+    FileSystem fs;
+    setup(&fs, num_blocks, 0);
+    int inode_index = allocate_inode(&fs);
+    Inode *inode = &fs.inodes[inode_index];
+    truncate_file(&fs, inode, DIRECT_POINTERS * BLOCK_SIZE);
+    OpenFileTable table = {0};
+    OpenFile *file = open_file_get(&table, open_file_install(&table, inode_index, false, 0));
+
+    uint64_t n = iters(200);
+    uint64_t *samples = (uint64_t *)malloc(n * sizeof(uint64_t));
+    uint8_t chunk[512];
+    uint64_t bytes = 0;
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        for (uint32_t off = 0; off < inode->size; off += sizeof(chunk)) {
+            bytes += mapped ? open_file_read(&fs, file, off, chunk, sizeof(chunk))
+                            : read_file_range(&fs, inode, off, chunk, sizeof(chunk));
+        }
+        samples[i] = now_ns() - t;
+    }
+    uint64_t total = now_ns() - begin;
+
+    char id[128];
+    snprintf(id, sizeof(id), "read_hot_file/blocks=%u/%s", num_blocks, mapped ? "mapped" : "inode");
+    record(id, samples, n, total, bytes);
+    free(samples);
+    open_file_table_free(&table);
+    cleanup_file_system(&fs);
+}
+
+// Create (and tear down) an empty partition with its root directory
+static void bench_initialize(uint32_t num_blocks) {
+    uint64_t n = iters(50);
+    uint64_t *samples = (uint64_t *)malloc(n * sizeof(uint64_t));
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        FileSystem fs;
+        uint64_t t = now_ns();
+        initialize_file_system(&fs, num_blocks);
+        create_directory(&fs, "root");
+        samples[i] = now_ns() - t;
+        cleanup_file_system(&fs);
+    }
+    uint64_t total = now_ns() - begin;
+
+    char id[128];
+    snprintf(id, sizeof(id), "initialize/blocks=%u", num_blocks);
+    record(id, samples, n, total, 0);
+    free(samples);
+}
+
+static void bench_save_load(uint32_t num_blocks, int fill_pct) {
+    FileSystem fs;
+    setup(&fs, num_blocks, fill_pct);
+    char image[256];
+    snprintf(image, sizeof(image), "%s/image.bin", tmp_dir);
+
+    uint64_t n = iters(20);
+    uint64_t *save = (uint64_t *)malloc(n * sizeof(uint64_t));
+    uint64_t *load = (uint64_t *)malloc(n * sizeof(uint64_t));
+    uint64_t *full = (uint64_t *)malloc(n * sizeof(uint64_t));
+    uint64_t save_total = 0, load_total = 0, full_total = 0;
+
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        save_file_system(&fs, image);
+        save[i] = now_ns() - t;
+        save_total += save[i];
+
+        // Metadata only (lazy), then with every used block faulted in
+        FileSystem loaded;
+        t = now_ns();
+        load_file_system(&loaded, image);
+        load[i] = now_ns() - t;
+        load_total += load[i];
+        load_all_blocks(&loaded);
+        full[i] = now_ns() - t;
+        full_total += full[i];
+        cleanup_file_system(&loaded);
+    }
+    uint64_t bytes = (uint64_t)num_blocks * BLOCK_SIZE;
+
+    char id[128];
+    snprintf(id, sizeof(id), "save_file_system/blocks=%u/fill=%d", num_blocks, fill_pct);
+    record(id, save, n, save_total, n * bytes);
+    snprintf(id, sizeof(id), "load_file_system/blocks=%u/fill=%d", num_blocks, fill_pct);
+    record(id, load, n, load_total, 0);
+    snprintf(id, sizeof(id), "load_file_system+fault_all/blocks=%u/fill=%d", num_blocks, fill_pct);
+    record(id, full, n, full_total, n * bytes * fill_pct / 100);
+    free(save);
+    free(load);
+    free(full);
+    unlink(image);
+    cleanup_file_system(&fs);
+}
+
+// Macro: N small files spread over directories of MAX_DIR_ENTRIES - 1 files each
+static void macro_small_files(uint32_t num_blocks, uint32_t files) {
+    FileSystem fs;
+    setup(&fs, num_blocks, 0);
+    char path[256];
+    snprintf(path, sizeof(path), "%s/small", tmp_dir);
+    make_host_file(path, 1024);
+
+    uint64_t *samples = (uint64_t *)malloc(files * sizeof(uint64_t));
+    int dir = -1;
+    uint32_t in_dir = MAX_DIR_ENTRIES;
+    uint32_t done = 0;
+    uint64_t begin = now_ns();
+    for (uint32_t i = 0; i < files; i++) {
+        uint64_t t = now_ns();
+        if (in_dir >= MAX_DIR_ENTRIES - 1) {
+            char name[32];
+            snprintf(name, sizeof(name), "dir%u", i);
+            dir = create_directory(&fs, name);
+            if (dir == -1 || add_to_directory(&fs, 0, dir, name) != 0)
+                break;
+            in_dir = 0;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "f%u", i);
+        int inode_index = read_file_to_fs(&fs, path, name);
+        if (inode_index == -1)
+            break;
+        add_to_directory(&fs, dir, inode_index, name);
+        in_dir++;
+        samples[done++] = now_ns() - t;
+    }
+    uint64_t total = now_ns() - begin;
+
+    char id[128];
+    snprintf(id, sizeof(id), "macro/create_small_files/files=%u", files);
+    record(id, samples, done, total, (uint64_t)done * 1024);
+    free(samples);
+    unlink(path);
+    cleanup_file_system(&fs);
+}
+
+// Macro: put and get one file of the largest size an inode can hold.
+// A sparse file is all zeros and should go through as holes.
+static void macro_stream_large_file(uint32_t num_blocks, bool sparse) {
+    FileSystem fs;
+    setup(&fs, num_blocks, 0);
+    size_t size = DIRECT_POINTERS * BLOCK_SIZE;
+    char src[256], dst[256];
+    snprintf(src, sizeof(src), "%s/large", tmp_dir);
+    snprintf(dst, sizeof(dst), "%s/large.out", tmp_dir);
+    if (sparse) {
+        FILE *f = fopen(src, "wb");
+        if (!f || ftruncate(fileno(f), (off_t)size) != 0) {
+            perror(src);
+            exit(2);
+        }
+        fclose(f);
+    } else {
+        make_host_file(src, size);
+    }
+
+    uint64_t n = iters(500);
+    uint64_t *samples = (uint64_t *)malloc(n * sizeof(uint64_t));
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        int inode_index = read_file_to_fs(&fs, src, "large");
+        write_file_to_host(&fs, inode_index, dst);
+        samples[i] = now_ns() - t;
+        drop_inode(&fs, inode_index);
+    }
+    uint64_t total = now_ns() - begin;
+
+    char id[128];
+    snprintf(id, sizeof(id), sparse ? "macro/stream_sparse_file/size=%zu" : "macro/stream_large_file/size=%zu", size);
+    record(id, samples, n, total, n * size * 2);
+    free(samples);
+    unlink(src);
+    unlink(dst);
+    cleanup_file_system(&fs);
+}
+
+// Macro: resolve a deep path from the root in one resolve_path call, then print its path
+static void macro_deep_tree(uint32_t num_blocks, int depth) {
+    FileSystem fs;
+    setup(&fs, num_blocks, 0);
+    int leaf = make_chain(&fs, 0, depth, 0);
+
+    char deep[8192];
+    size_t len = 0;
+    for (int d = 0; d < depth; d++) {
+        len += snprintf(deep + len, sizeof(deep) - len, "/d%d", d);
+    }
+
+    uint64_t n = iters(200);
+    uint64_t *samples = (uint64_t *)malloc(n * sizeof(uint64_t));
+    char path[8192];
+    char name[MAX_FILENAME];
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        int dir;
+        int cur = resolve_path(&fs, 0, deep, &dir, name) == 0 ? find_in_directory(&fs, dir, name) : -1;
+        get_inode_path(&fs, cur, path, sizeof(path));
+        samples[i] = now_ns() - t;
+        if (cur != leaf)
+            fprintf(stderr, "deep tree walk ended at the wrong inode\n");
+    }
+    uint64_t total = now_ns() - begin;
+
+    char id[128];
+    snprintf(id, sizeof(id), "macro/deep_tree/depth=%d", depth);
+    record(id, samples, n, total, 0);
+    free(samples);
+    cleanup_file_system(&fs);
+}
+
+static void count_entry(FileSystem *fs, uint32_t dir_inode_index, const DirectoryEntry *entry, int worker, void *arg) {
+    __atomic_fetch_add((uint64_t *)arg, 1, __ATOMIC_RELAXED);
+}
+
+// Add fanout directories of fanout files each under dir, levels deep
+static void make_wide_tree(FileSystem *fs, int dir, int levels, int fanout) {
+    for (int i = 0; i < fanout; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%s%d", levels ? "d" : "f", i);
+        if (levels == 0) {
+            int file = allocate_inode(fs);
+            if (file == -1)
+                return;
+            add_to_directory(fs, dir, file, name);
+            set_file_size(fs, &fs->inodes[file], 1000 + i);
+            continue;
+        }
+        int sub = create_directory(fs, name);
+        if (sub == -1)
+            return;
+        add_to_directory(fs, dir, sub, name);
+        make_wide_tree(fs, sub, levels - 1, fanout);
+    }
+}
+
+// Macro: du over a tree of about fanout^(levels+1) files, answered from the kept totals,
+// rebuilt by a parallel walk, and a bare walk visiting every entry
+static void macro_tree_walk(uint32_t num_blocks, int levels, int fanout) {
+    FileSystem fs;
+    setup(&fs, num_blocks, 0);
+    make_wide_tree(&fs, 0, levels, fanout);
+
+    const char *modes[] = {"du_cached", "du_rebuild", "visit"};
+    for (int m = 0; m < 3; m++) {
+        uint64_t n = iters(m == 0 ? 100000 : 50);
+        uint64_t *samples = (uint64_t *)malloc(n * sizeof(uint64_t));
+        uint64_t visited = 0;
+        TreeUsage usage;
+        uint64_t begin = now_ns();
+        for (uint64_t i = 0; i < n; i++) {
+            uint64_t t = now_ns();
+            if (m == 1)
+                fs.usage_valid = false;
+            if (m < 2)
+                tree_usage(&fs, 0, &usage);
+            else
+                walk_tree(&fs, 0, count_entry, &visited);
+            samples[i] = now_ns() - t;
+        }
+        uint64_t total = now_ns() - begin;
+        if (m < 2 && usage.files != fs.used_inodes - 1 - usage.directories)
+            fprintf(stderr, "du counted %lld files, %u inodes are in use\n", (long long)usage.files, fs.used_inodes);
+
+        char id[128];
+        snprintf(id, sizeof(id), "macro/tree_walk/%s/inodes=%u", modes[m], fs.used_inodes);
+        record(id, samples, n, total, 0);
+        free(samples);
+    }
+    cleanup_file_system(&fs);
+}
+
+// Read "id" and "ops_per_sec" back from a previous run's output
+static int load_baseline(const char *filename, BenchResult *base, int max) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Failed to open baseline '%s'.\n", filename);
+        return -1;
+    }
+    char line[1024];
+    int n = 0;
+    while (n < max && fgets(line, sizeof(line), f)) {
+        char *id = strstr(line, "\"id\":\"");
+        char *ops = strstr(line, "\"ops_per_sec\":");
+        if (!id || !ops)
+            continue;
+        id += 6;
+        char *end = strchr(id, '"');
+        if (!end || end - id >= (long)sizeof(base[n].id))
+            continue;
+        memcpy(base[n].id, id, end - id);
+        base[n].id[end - id] = '\0';
+        base[n].ops_per_sec = strtod(ops + 14, NULL);
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    const char *baseline = NULL;
+    double threshold = BENCH_DEFAULT_THRESHOLD;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            scale = 10;
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--quick] [--baseline file.json] [--threshold pct]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (!mkdtemp(tmp_dir)) {
+        perror("mkdtemp");
+        return 2;
+    }
+
+    // Keep the JSON on the real stdout and silence the core's printf()s
+    fflush(stdout);
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || !freopen("/dev/null", "w", stdout)) {
+        perror("stdout");
+        return 2;
+    }
+
+    const uint32_t sizes[] = {1024, 16384, 65536};
+    const int fills[] = {0, 50, 90};
+
+    fprintf(stderr, "micro benchmarks\n");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+            bench_allocate_block(sizes[s], fills[f]);
+            bench_read_file_to_fs(sizes[s], fills[f], BLOCK_SIZE);
+            bench_read_file_to_fs(sizes[s], fills[f], DIRECT_POINTERS * BLOCK_SIZE);
+            bench_get_inode_path(sizes[s], fills[f], 8);
+            bench_resolve_path(sizes[s], fills[f], 16, false);
+            bench_resolve_path(sizes[s], fills[f], 16, true);
+        }
+        bench_read_hot_file(sizes[s], false);
+        bench_read_hot_file(sizes[s], true);
+        bench_save_load(sizes[s], 50);
+    }
+
+    // 4 GiB and 100 GiB partitions, neither should touch more than a few pages
+    bench_initialize(1u << 20);
+    bench_initialize(25u << 20);
+
+    fprintf(stderr, "macro benchmarks\n");
+    macro_small_files(65536, 2000);
+    macro_stream_large_file(16384, false);
+    macro_stream_large_file(16384, true);
+    macro_deep_tree(16384, 256);
+    macro_tree_walk(262144, 3, 15);
+
+    BenchResult base[BENCH_MAX_RESULTS];
+    int base_count = baseline ? load_baseline(baseline, base, BENCH_MAX_RESULTS) : 0;
+    int regressions = 0;
+
+    fprintf(out, "{\"block_size\":%d,\"results\":[\n", BLOCK_SIZE);
+    for (int i = 0; i < result_count; i++) {
+        BenchResult *r = &results[i];
+        fprintf(out, "{\"id\":\"%s\",\"iterations\":%llu,\"ops_per_sec\":%.1f,\"p50_ns\":%.0f,\"p99_ns\":%.0f,\"bytes_per_sec\":%.1f",
+                r->id, (unsigned long long)r->iterations, r->ops_per_sec, r->p50_ns, r->p99_ns, r->bytes_per_sec);
+        for (int b = 0; b < base_count; b++) {
+            if (strcmp(base[b].id, r->id) == 0 && base[b].ops_per_sec > 0) {
+                double change = (r->ops_per_sec / base[b].ops_per_sec - 1.0) * 100.0;
+                bool regressed = change < -threshold;
+                fprintf(out, ",\"baseline_ops_per_sec\":%.1f,\"change_pct\":%.1f,\"regression\":%s",
+                        base[b].ops_per_sec, change, regressed ? "true" : "false");
+                if (regressed) {
+                    fprintf(stderr, "REGRESSION %s: %.1f%%\n", r->id, change);
+                    regressions++;
+                }
+                break;
+            }
+        }
+        fprintf(out, "}%s\n", i + 1 < result_count ? "," : "");
+    }
+    fprintf(out, "]}\n");
+    fclose(out);
+
+    rmdir(tmp_dir);
+    if (baseline)
+        fprintf(stderr, "%d regressions against %s (threshold %.1f%%)\n", regressions, baseline, threshold);
+    return regressions ? 1 : 0;
+}
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE  // mremap
+#include "blockmem.h"
+#include "FileSystem.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#define HUGE_2M (2ul << 20)
+#define HUGE_1G (1ul << 30)
+
+// set_mempolicy/mbind modes, numaif.h is not always installed
+#define NUMA_MPOL_INTERLEAVE 3
+#define NUMA_MPOL_LOCAL 4
+#define NUMA_MAX_NODES 1024
+
+typedef struct {
+    uint8_t *start;
+    size_t size;
+    size_t step;
+} PrefaultSlice;
+
+
+static size_t round_up(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+// Small pages are mapped without reserving swap, so a partition far bigger than what is
+// in use costs nothing up front; only the pages touched are ever backed.
+static void *map_pages(size_t size, int extra_flags) {
+    if (!(extra_flags & MAP_HUGETLB))
+        extra_flags |= MAP_NORESERVE;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+// Online NUMA nodes as a bitmask, returns the highest node + 1 (0 if unknown)
+static int online_nodes(unsigned long *mask, int words) {
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (!f)
+        return 0;
+    char line[256];
+    int max_node = 0;
+    if (fgets(line, sizeof(line), f)) {
+        // "0-3,6" style ranges
+        char *p = line;
+        while (*p >= '0' && *p <= '9') {
+            int lo = (int)strtol(p, &p, 10), hi = lo;
+            if (*p == '-')
+                hi = (int)strtol(p + 1, &p, 10);
+            for (int n = lo; n <= hi && n < words * 64; n++) {
+                mask[n / 64] |= 1ul << (n % 64);
+                if (n + 1 > max_node)
+                    max_node = n + 1;
+            }
+            if (*p == ',')
+                p++;
+        }
+    }
+    fclose(f);
+    return max_node;
+}
+
+// Apply FS_NUMA to the mapping before anything touches it
+static void place_pages(void *base, size_t size) {
+    const char *policy = getenv("FS_NUMA");
+    if (!policy || !*policy)
+        return;
+
+    unsigned long mask[NUMA_MAX_NODES / 64] = {0};
+    int nodes = online_nodes(mask, NUMA_MAX_NODES / 64);
+    int mode;
+    if (strcmp(policy, "interleave") == 0) {
+        if (nodes < 2)
+            return;
+        mode = NUMA_MPOL_INTERLEAVE;
+    } else if (strcmp(policy, "local") == 0) {
+        mode = NUMA_MPOL_LOCAL;
+    } else {
+        fs_log("Unknown FS_NUMA policy '%s', use interleave or local.\n", policy);
+        return;
+    }
+    if (syscall(SYS_mbind, base, size, mode, mode == NUMA_MPOL_LOCAL ? NULL : mask,
+                mode == NUMA_MPOL_LOCAL ? 0 : (unsigned long)nodes + 1, 0) != 0) {
+        fs_log("NUMA policy '%s' for the block array failed, using the default.\n", policy);
+    }
+}
+
+static void *prefault_slice(void *arg) {
+    PrefaultSlice *slice = (PrefaultSlice *)arg;
+    for (size_t off = 0; off < slice->size; off += slice->step) {
+        ((volatile uint8_t *)slice->start)[off] = 0;
+    }
+    return NULL;
+}
+
+// Touch every page from up to MAX_PREFAULT_THREADS threads, one write per page
+static void prefault_pages(BlockMemory *mem) {
+    const char *setting = getenv("FS_PREFAULT");
+    if (!setting || !*setting || strcmp(setting, "0") == 0)
+        return;
+
+    int threads = atoi(setting) > 1 ? atoi(setting) : worker_thread_count(MAX_PREFAULT_THREADS);
+    if (threads > MAX_PREFAULT_THREADS)
+        threads = MAX_PREFAULT_THREADS;
+    size_t pages = mem->size / mem->page_size;
+    if ((size_t)threads > pages)
+        threads = pages ? (int)pages : 1;
+
+    pthread_t tids[MAX_PREFAULT_THREADS];
+    PrefaultSlice slices[MAX_PREFAULT_THREADS];
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        size_t first = pages * i / threads, last = pages * (i + 1) / threads;
+        slices[i].start = (uint8_t *)mem->base + first * mem->page_size;
+        slices[i].size = (last - first) * mem->page_size;
+        // THP is only a hint, a range the kernel did not back with a huge page needs every small page touched
+        slices[i].step = strcmp(mem->kind, "thp") == 0 ? 4096 : mem->page_size;
+        if (i == 0 || pthread_create(&tids[i], NULL, prefault_slice, &slices[i]) != 0) {
+            continue;
+        }
+        started |= 1 << i;
+    }
+    // This thread takes the first slice, and any a thread could not be started for
+    for (int i = 0; i < threads; i++) {
+        if (!(started & (1 << i)))
+            prefault_slice(&slices[i]);
+    }
+    for (int i = 1; i < threads; i++) {
+        if (started & (1 << i))
+            pthread_join(tids[i], NULL);
+    }
+}
+
+// Map size bytes of zeroed memory for the block array
+int block_memory_alloc(BlockMemory *mem, size_t size) {
+    const char *pages = getenv("FS_HUGEPAGES");
+    memset(mem, 0, sizeof(BlockMemory));
+    if (size == 0)
+        size = 1;
+
+    if (pages && (strcmp(pages, "1g") == 0 || strcmp(pages, "2m") == 0)) {
+        bool gig = strcmp(pages, "1g") == 0;
+        size_t page = gig ? HUGE_1G : HUGE_2M;
+        int shift = gig ? 30 : 21;
+        mem->base = map_pages(round_up(size, page), MAP_HUGETLB | (shift << MAP_HUGE_SHIFT));
+        if (mem->base) {
+            mem->size = round_up(size, page);
+            mem->page_size = page;
+            mem->kind = gig ? "1g huge" : "2m huge";
+        } else {
+            fs_log("No free %s huge pages for the block array, using transparent huge pages.\n", pages);
+        }
+    }
+
+    if (!mem->base) {
+        bool thp = !pages || strcmp(pages, "off") != 0;
+        // Whole huge pages so THP can back every part of the array
+        mem->size = thp ? round_up(size, HUGE_2M) : round_up(size, (size_t)sysconf(_SC_PAGESIZE));
+        mem->base = map_pages(mem->size, 0);
+        if (!mem->base)
+            return -1;
+        mem->page_size = thp ? HUGE_2M : (size_t)sysconf(_SC_PAGESIZE);
+        mem->kind = thp ? "thp" : "4k";
+#ifdef MADV_HUGEPAGE
+        if (thp)
+            madvise(mem->base, mem->size, MADV_HUGEPAGE);
+#endif
+    }
+
+    place_pages(mem->base, mem->size);
+    prefault_pages(mem);
+    return 0;
+}
+
+// Grow or shrink the mapping to hold size bytes, keeping what it holds up to the
+// smaller of the two sizes. The mapping may move; pages past the old end start out
+// zero, and page size and NUMA policy carry over to them.
+int block_memory_resize(BlockMemory *mem, size_t size) {
+    if (size == 0)
+        size = 1;
+    size_t new_size = round_up(size, mem->page_size);
+    if (new_size == mem->size)
+        return 0;
+
+    void *base = mremap(mem->base, mem->size, new_size, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
+        // Older kernels cannot remap hugetlb pages, copy into a fresh mapping instead
+        BlockMemory fresh;
+        if (block_memory_alloc(&fresh, size) != 0)
+            return -1;
+        memcpy(fresh.base, mem->base, new_size < mem->size ? new_size : mem->size);
+        block_memory_free(mem);
+        *mem = fresh;
+        return 0;
+    }
+    mem->base = base;
+    mem->size = new_size;
+    return 0;
+}
+
+void block_memory_free(BlockMemory *mem) {
+    if (mem->base)
+        munmap(mem->base, mem->size);
+    memset(mem, 0, sizeof(BlockMemory));
+}
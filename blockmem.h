@@ -0,0 +1,34 @@
+#ifndef BLOCKMEM_H
+#define BLOCKMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_PREFAULT_THREADS 16  // Upper bound on threads touching the block array at startup
+
+
+// Backing memory for the block array, an anonymous mapping whose page size and
+// NUMA placement come from the environment:
+//   FS_HUGEPAGES = thp (default) | 2m | 1g | off
+//       thp asks for transparent huge pages with madvise; 2m and 1g map hugetlbfs
+//       pages (they must be reserved, e.g. /proc/sys/vm/nr_hugepages) and fall
+//       back to thp when none are free.
+//   FS_NUMA = interleave | local
+//       interleave spreads the pages over every online node, local keeps each
+//       page on the node of the thread that first touches it. Unset leaves the
+//       process policy alone.
+//   FS_PREFAULT = 1 | <threads>
+//       touch every page at startup from several threads, so the faults happen
+//       in parallel there instead of one by one on first access.
+typedef struct {
+    void *base;            // Mapping, NULL if none
+    size_t size;           // Bytes mapped, a multiple of page_size
+    size_t page_size;      // Page size actually obtained
+    const char *kind;      // "4k", "thp", "2m huge", "1g huge"
+} BlockMemory;
+
+int block_memory_alloc(BlockMemory *mem, size_t size);
+int block_memory_resize(BlockMemory *mem, size_t size);
+void block_memory_free(BlockMemory *mem);
+
+#endif
@@ -0,0 +1,150 @@
+#include "crc32c.h"
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_X86
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
+#define CRC32C_POLY 0x82F63B78 // Reflected Castagnoli polynomial
+#define CRC32C_STRIDE 1360     // Bytes per lane of the 3-way hardware loop (3 lanes ~ one block)
+
+
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *p, size_t len);
+static const char *crc32c_name = "table";
+
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len--) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+// x^n mod P in the reflected representation (bit 31 is x^0)
+static uint32_t xpow_mod(uint32_t n) {
+    uint32_t p = 0x80000000;
+    while (n--) {
+        p = (p & 1) ? (p >> 1) ^ CRC32C_POLY : p >> 1;
+    }
+    return p;
+}
+
+static uint32_t shift_k1; // x^(8 * 2 * STRIDE - 33) mod P
+static uint32_t shift_k2; // x^(8 * STRIDE - 33) mod P
+
+// crc * x^(8 * len) mod P, with k = x^(8 * len - 33) mod P.
+// The 64-bit carry-less product is reduced by the crc32 instruction itself.
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_shift(uint32_t crc, uint32_t k) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc), _mm_cvtsi32_si128((int)k), 0);
+    return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(product));
+}
+
+// Three independent crc32 chains hide the instruction latency, PCLMUL stitches them back together
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c0 = crc;
+
+    while (len >= 3 * CRC32C_STRIDE) {
+        uint64_t c1 = 0, c2 = 0;
+        for (size_t i = 0; i < CRC32C_STRIDE; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + CRC32C_STRIDE + i, 8);
+            memcpy(&w2, p + 2 * CRC32C_STRIDE + i, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c0 = crc32c_shift((uint32_t)c0, shift_k1) ^ crc32c_shift((uint32_t)c1, shift_k2) ^ (uint32_t)c2;
+        p += 3 * CRC32C_STRIDE;
+        len -= 3 * CRC32C_STRIDE;
+    }
+
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c0 = _mm_crc32_u64(c0, w);
+        p += 8;
+        len -= 8;
+    }
+    uint32_t c = (uint32_t)c0;
+    while (len--) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+    return c;
+}
+#endif
+
+#ifdef CRC32C_ARM
+static uint32_t crc32c_arm(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        crc = __crc32cd(crc, w);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[i] = c;
+    }
+    crc32c_fn = crc32c_sw;
+    crc32c_name = "table";
+
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        shift_k1 = xpow_mod(8 * 2 * CRC32C_STRIDE - 33);
+        shift_k2 = xpow_mod(8 * CRC32C_STRIDE - 33);
+
+        // Only trust the fast path once it agrees with the table on a full block
+        uint8_t probe[4096];
+        for (size_t i = 0; i < sizeof(probe); i++) {
+            probe[i] = (uint8_t)(i * 131 + 7);
+        }
+        if (crc32c_hw(0xFFFFFFFF, probe, sizeof(probe)) == crc32c_sw(0xFFFFFFFF, probe, sizeof(probe))) {
+            crc32c_fn = crc32c_hw;
+            crc32c_name = "sse4.2+pclmul";
+        }
+    }
+#endif
+#ifdef CRC32C_ARM
+    crc32c_fn = crc32c_arm;
+    crc32c_name = "armv8";
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    if (!crc32c_fn) {
+        crc32c_init();
+    }
+    return ~crc32c_fn(~crc, (const uint8_t *)data, len);
+}
+
+const char *crc32c_impl(void) {
+    if (!crc32c_fn) {
+        crc32c_init();
+    }
+    return crc32c_name;
+}
@@ -0,0 +1,16 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// CRC32C (Castagnoli), the checksum used for blocks in the image.
+// Picks the SSE4.2/PCLMUL (x86) or CRC32 extension (ARMv8) path at runtime
+// and falls back to a table driven version everywhere else.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+// Name of the implementation crc32c() dispatches to ("sse4.2+pclmul", "armv8", "table")
+const char *crc32c_impl(void);
+
+#endif
@@ -0,0 +1,352 @@
+#include "defrag.h"
+#include "reclaim.h"
+#include <sched.h>
+
+
+// Files in the order they are visited: lowest first block first
+typedef struct {
+    uint32_t first;
+    uint32_t inode;
+} DefragCandidate;
+
+static int by_first_block(const void *a, const void *b) {
+    uint32_t x = ((const DefragCandidate *)a)->first;
+    uint32_t y = ((const DefragCandidate *)b)->first;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Runs of consecutive blocks the file's data lies in, holes do not break a run
+static uint32_t file_extents(const Inode *inode) {
+    uint32_t count = inode_block_count(inode);
+    uint32_t extents = 0;
+    uint32_t prev = BLOCK_HOLE;
+    for (uint32_t b = 0; b < count; b++) {
+        if (inode->blocks[b] == BLOCK_HOLE)
+            continue;
+        if (prev == BLOCK_HOLE || inode->blocks[b] != prev + 1)
+            extents++;
+        prev = inode->blocks[b];
+    }
+    return extents;
+}
+
+// Measure the live file system. Caller holds fs->lock.
+void fragmentation_report(FileSystem *fs, FragReport *out) {
+    memset(out, 0, sizeof(*out));
+    uint32_t scan_end = fs->inode_watermark < fs->total_inodes ? fs->inode_watermark : fs->total_inodes;
+    for (uint32_t i = 0; i < scan_end; i++) {
+        // Unlinked files still waiting for the reclaimer are not counted
+        if (!fs->inode_bitmap[i] || fs->inodes[i].is_directory || fs->inodes[i].nlink == 0)
+            continue;
+        uint32_t extents = file_extents(&fs->inodes[i]);
+        if (extents == 0)
+            continue;
+        out->files++;
+        out->extents += extents;
+        if (extents == 1)
+            continue;
+        out->fragmented++;
+
+        // Keep the worst few, most extents first
+        uint32_t pos = out->worst_count < DEFRAG_MAX_REPORTED ? out->worst_count++ : DEFRAG_MAX_REPORTED;
+        while (pos > 0 && out->worst_extents[pos - 1] < extents) {
+            if (pos < DEFRAG_MAX_REPORTED) {
+                out->worst[pos] = out->worst[pos - 1];
+                out->worst_extents[pos] = out->worst_extents[pos - 1];
+            }
+            pos--;
+        }
+        if (pos < DEFRAG_MAX_REPORTED) {
+            out->worst[pos] = i;
+            out->worst_extents[pos] = extents;
+        }
+    }
+    out->end = used_block_end(fs);
+    out->holes = out->end - fs->used_blocks;
+}
+
+// Lowest run of n free blocks between *from and limit. *from moves up as far as it
+// can: no run of n starts below it (until a block below is freed).
+static uint32_t find_free_run(FileSystem *fs, uint32_t n, uint32_t *from, uint32_t limit) {
+    uint32_t run = 0;
+    uint32_t i = *from;
+    for (; i < limit; i++) {
+        if (fs->block_bitmap[i]) {
+            run = 0;
+            continue;
+        }
+        if (++run == n) {
+            *from = i + 1 - n;
+            return *from;
+        }
+    }
+    if (i > *from)
+        *from = i - run;
+    return UINT32_MAX;
+}
+
+// Blocks start .. start + n - 1 are free or the file's own
+static bool fits_over_own(FileSystem *fs, const Inode *inode, uint32_t n, uint32_t start) {
+    if (start + n > fs->total_blocks)
+        return false;
+    uint32_t count = inode_block_count(inode);
+    for (uint32_t p = start; p < start + n; p++) {
+        if (!fs->block_bitmap[p])
+            continue;
+        uint32_t b = 0;
+        while (b < count && inode->blocks[b] != p) {
+            b++;
+        }
+        if (b == count)
+            return false;
+    }
+    return true;
+}
+
+// Move a file down into the lowest run of blocks that holds all of it, or at least
+// into one piece. The run is either free, or starts at the free blocks just below the
+// file and covers its own blocks (it slides down). search_from[n - 1] is where
+// find_free_run starts for n blocks. staging holds DIRECT_POINTERS blocks.
+// Returns the blocks moved. Caller holds fs->lock for writing.
+static uint32_t defrag_file(FileSystem *fs, uint32_t inode_index, uint32_t *search_from, Block *staging) {
+    if (inode_index >= fs->total_inodes || !fs->inode_bitmap[inode_index])
+        return 0;
+    Inode *inode = &fs->inodes[inode_index];
+    // Unlinked files are on their way out with the reclaimer
+    uint32_t count = inode->is_directory || inode->nlink == 0 ? 0 : inode_block_count(inode);
+
+    // Pointers that hold data, holes stay holes
+    uint32_t slots[DIRECT_POINTERS];
+    uint32_t n = 0;
+    uint32_t first = UINT32_MAX;
+    for (uint32_t b = 0; b < count; b++) {
+        uint32_t block = inode->blocks[b];
+        if (block == BLOCK_HOLE)
+            continue;
+        // Other owners would have to be repointed too
+        if (block >= fs->total_blocks || fs->block_refcount[block] != 1)
+            return 0;
+        if (block < first)
+            first = block;
+        slots[n++] = b;
+    }
+    if (n == 0)
+        return 0;
+    bool fragmented = file_extents(inode) > 1;
+    uint32_t start = first;
+    while (start > 0 && !fs->block_bitmap[start - 1]) {
+        start--;
+    }
+    // A free run below can only end before start, block start - 1 is in use
+    uint32_t target = find_free_run(fs, n, &search_from[n - 1], start);
+    if (target == UINT32_MAX && (start < first || fragmented) && fits_over_own(fs, inode, n, start))
+        target = start;
+    // In one piece is still worth a run further up
+    if (target == UINT32_MAX && fragmented)
+        target = find_free_run(fs, n, &search_from[n - 1], fs->total_blocks);
+    if (target == UINT32_MAX)
+        return 0;
+
+    // Copied out first, the run may overlap where the file is now
+    uint32_t crcs[DIRECT_POINTERS];
+    for (uint32_t b = 0; b < n; b++) {
+        uint32_t old = inode->blocks[slots[b]];
+        memcpy(staging[b].data, get_block(fs, old)->data, BLOCK_SIZE);
+        crcs[b] = fs->block_crc[old];
+        fs->block_bitmap[old] = false;
+        fs->block_refcount[old] = 0;
+    }
+    for (uint32_t b = 0; b < n; b++) {
+        uint32_t dest = target + b;
+        memcpy(fs->blocks[dest].data, staging[b].data, BLOCK_SIZE);
+        if (fs->block_loaded)
+            fs->block_loaded[dest] = true;
+        fs->block_bitmap[dest] = true;
+        fs->block_refcount[dest] = 1;
+        fs->block_crc[dest] = crcs[b];
+        mark_block_dirty(fs, dest);
+    }
+    uint32_t lowest_freed = UINT32_MAX;
+    for (uint32_t b = 0; b < n; b++) {
+        uint32_t old = inode->blocks[slots[b]];
+        if (!fs->block_bitmap[old] && old < lowest_freed)
+            lowest_freed = old;
+        inode->blocks[slots[b]] = target + b;
+    }
+    // Nothing is freed when the file only moved within its own blocks
+    if (lowest_freed != UINT32_MAX) {
+        if (lowest_freed < fs->block_hint)
+            fs->block_hint = lowest_freed;
+        // A free run may now start in the stretch the freed blocks joined
+        while (lowest_freed > 0 && !fs->block_bitmap[lowest_freed - 1]) {
+            lowest_freed--;
+        }
+        for (uint32_t k = 0; k < DIRECT_POINTERS; k++) {
+            if (lowest_freed < search_from[k])
+                search_from[k] = lowest_freed;
+        }
+    }
+    fs->map_generation++;
+    mark_dirty(fs);
+    return n;
+}
+
+// Files with data blocks, lowest first block first, only the fragmented ones if asked.
+// Files changed in between slices are taken as they are by then. NULL if out of memory.
+static DefragCandidate *plan_pass(FileSystem *fs, bool fragmented_only, uint32_t *count) {
+    pthread_rwlock_rdlock(fs->lock);
+    uint32_t scan_end = fs->inode_watermark < fs->total_inodes ? fs->inode_watermark : fs->total_inodes;
+    DefragCandidate *files = (DefragCandidate *)malloc((scan_end ? scan_end : 1) * sizeof(DefragCandidate));
+    for (uint32_t i = 0; files && i < scan_end; i++) {
+        Inode *inode = &fs->inodes[i];
+        uint32_t extents = fs->inode_bitmap[i] && !inode->is_directory ? file_extents(inode) : 0;
+        if (extents == 0 || (fragmented_only && extents == 1))
+            continue;
+        uint32_t blocks = inode_block_count(inode);
+        uint32_t first = UINT32_MAX;
+        for (uint32_t b = 0; b < blocks; b++) {
+            if (inode->blocks[b] < first)
+                first = inode->blocks[b];
+        }
+        files[(*count)++] = (DefragCandidate){ first, i };
+    }
+    pthread_rwlock_unlock(fs->lock);
+    // Low files go first so each one has the space the ones before it left behind
+    if (files)
+        qsort(files, *count, sizeof(DefragCandidate), by_first_block);
+    return files;
+}
+
+static void *defrag_main(void *arg) {
+    FileSystem *fs = (FileSystem *)arg;
+    DefragState *st = fs->defrag;
+    struct timespec begin, finish;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    Block *staging = (Block *)malloc(DIRECT_POINTERS * sizeof(Block));
+    // Fragmented files are put in one piece first, wherever a run is free; then every
+    // file slides down over the holes, the ones that went up included
+    for (int pass = 0; staging && pass < 2 && !__atomic_load_n(&st->stop, __ATOMIC_RELAXED); pass++) {
+        uint32_t count = 0;
+        DefragCandidate *files = plan_pass(fs, pass == 0, &count);
+        if (!files) {
+            fs_log("Memory allocation for defrag failed!\n");
+            break;
+        }
+
+        uint32_t next = 0;
+        while (next < count && !__atomic_load_n(&st->stop, __ATOMIC_RELAXED)) {
+            pthread_rwlock_wrlock(fs->lock);
+            // Commands in between may have freed anything, searches start over each slice
+            uint32_t search_from[DIRECT_POINTERS];
+            for (uint32_t k = 0; k < DIRECT_POINTERS; k++) {
+                search_from[k] = fs->block_hint;
+            }
+            uint32_t work = 0;
+            uint32_t moved = 0;
+            while (next < count && work < DEFRAG_SLICE_BLOCKS) {
+                uint32_t blocks = defrag_file(fs, files[next++].inode, search_from, staging);
+                if (blocks)
+                    __atomic_fetch_add(&st->files_moved, 1, __ATOMIC_RELAXED);
+                moved += blocks;
+                work += blocks ? blocks : 1;
+            }
+            __atomic_fetch_add(&st->blocks_moved, moved, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&st->slices, 1, __ATOMIC_RELAXED);
+            pthread_rwlock_unlock(fs->lock);
+            sched_yield();
+        }
+        free(files);
+    }
+    if (!staging)
+        fs_log("Memory allocation for defrag failed!\n");
+    free(staging);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    // running drops under the lock, so defrag_start (write lock held) never joins a thread still waiting for it
+    pthread_rwlock_rdlock(fs->lock);
+    st->seconds = (finish.tv_sec - begin.tv_sec) + (finish.tv_nsec - begin.tv_nsec) / 1e9;
+    __atomic_store_n(&st->running, false, __ATOMIC_RELEASE);
+    defrag_report(fs);
+    pthread_rwlock_unlock(fs->lock);
+    return NULL;
+}
+
+// Start defragmenting in the background. Caller holds fs->lock for writing.
+int defrag_start(FileSystem *fs) {
+    if (fs->defrag && __atomic_load_n(&fs->defrag->running, __ATOMIC_ACQUIRE)) {
+        defrag_report(fs);
+        return 0;
+    }
+    if (!fs->defrag) {
+        fs->defrag = (DefragState *)calloc(1, sizeof(DefragState));
+        if (!fs->defrag) {
+            fs_log("Memory allocation for defrag failed!\n");
+            return -1;
+        }
+    }
+    defrag_wait(fs);
+
+    // Space still waiting to be reclaimed is space files can move into
+    reclaim_drain(fs);
+    DefragState *st = fs->defrag;
+    st->files_moved = 0;
+    st->blocks_moved = 0;
+    st->slices = 0;
+    st->seconds = 0;
+    __atomic_store_n(&st->stop, false, __ATOMIC_RELAXED);
+    fragmentation_report(fs, &st->before);
+    __atomic_store_n(&st->running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&st->thread, NULL, defrag_main, fs) != 0) {
+        fs_log("Failed to start defrag thread.\n");
+        __atomic_store_n(&st->running, false, __ATOMIC_RELEASE);
+        return -1;
+    }
+    st->started = true;
+    fs_log("Defrag started: %u of %u files fragmented, used blocks end at %u with %u free below.\n",
+           st->before.fragmented, st->before.files, st->before.end, st->before.holes);
+    return 0;
+}
+
+// Block until a running defrag is done. Called without fs->lock, or with it held
+// for writing once running is false.
+void defrag_wait(FileSystem *fs) {
+    if (fs->defrag && fs->defrag->started) {
+        pthread_join(fs->defrag->thread, NULL);
+        fs->defrag->started = false;
+    }
+}
+
+// Stop after the current slice and drop the state. Called without fs->lock.
+void defrag_stop(FileSystem *fs) {
+    if (!fs->defrag)
+        return;
+    __atomic_store_n(&fs->defrag->stop, true, __ATOMIC_RELAXED);
+    defrag_wait(fs);
+    free(fs->defrag);
+    fs->defrag = NULL;
+}
+
+// Caller holds fs->lock
+void defrag_report(FileSystem *fs) {
+    DefragState *st = fs->defrag;
+    if (!st) {
+        fs_log("No defrag has run.\n");
+        return;
+    }
+
+    uint32_t files = __atomic_load_n(&st->files_moved, __ATOMIC_RELAXED);
+    uint32_t blocks = __atomic_load_n(&st->blocks_moved, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&st->running, __ATOMIC_ACQUIRE)) {
+        fs_log("Defrag running: %u files moved (%u blocks) so far.\n", files, blocks);
+        return;
+    }
+
+    FragReport now;
+    fragmentation_report(fs, &now);
+    fs_log("Defrag %s: %u files moved (%u blocks) in %u slices, %.3f s.\n", __atomic_load_n(&st->stop, __ATOMIC_RELAXED) ? "stopped" : "finished",
+           files, blocks, st->slices, st->seconds);
+    fs_log("  fragmented files %u -> %u, extents %u -> %u, used blocks end at %u -> %u (%u free below)\n",
+           st->before.fragmented, now.fragmented, st->before.extents, now.extents, st->before.end, now.end,
+           now.holes);
+}
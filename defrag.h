@@ -0,0 +1,46 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include "FileSystem.h"
+
+#define DEFRAG_SLICE_BLOCKS 256  // Blocks moved per write-lock hold, about a millisecond of copying
+#define DEFRAG_MAX_REPORTED 8    // Most fragmented files named in a report
+
+
+// How the files lie on the partition
+typedef struct {
+    uint32_t files;            // Files and symlinks with data blocks
+    uint32_t fragmented;       // Of those, files not in one run of consecutive blocks
+    uint32_t extents;          // Runs of consecutive blocks over all files
+    uint32_t end;              // Last used block + 1, where a saved image ends
+    uint32_t holes;            // Free blocks below end
+    uint32_t worst[DEFRAG_MAX_REPORTED];         // Most fragmented files, most extents first
+    uint32_t worst_extents[DEFRAG_MAX_REPORTED];
+    uint32_t worst_count;
+} FragReport;
+
+// Background defragmenter, one per live file system. Files are taken from the start
+// of the partition up and each is moved to the lowest run of blocks that holds all of
+// it, free or its own, so files become contiguous and slide down over the holes.
+// Work is done a slice at a time under the write lock, commands run in between.
+// Blocks shared with a snapshot or a clone stay where they are.
+typedef struct DefragState {
+    pthread_t thread;
+    bool started;              // thread has to be joined
+    bool running;              // Atomic, the results are final once it drops
+    bool stop;                 // Atomic, leave after the current slice
+    uint32_t files_moved;      // Counters, read without the lock (atomic); a file may move twice
+    uint32_t blocks_moved;
+    uint32_t slices;
+    double seconds;            // Wall time of the last finished run
+    FragReport before;         // Layout when the run started
+} DefragState;
+
+
+void fragmentation_report(FileSystem *fs, FragReport *out);
+int defrag_start(FileSystem *fs);
+void defrag_wait(FileSystem *fs);
+void defrag_stop(FileSystem *fs);
+void defrag_report(FileSystem *fs);
+
+#endif
@@ -0,0 +1,294 @@
+#include "fsck.h"
+#include "snapshot.h"
+#include "reclaim.h"
+#include <stdarg.h>
+
+
+typedef struct {
+    FileSystem *fs;
+    bool repair;
+    bool *reachable;          // Inodes reachable from the root directory
+    uint32_t *links;          // Directory entries found naming each inode
+    uint32_t *expected_refs;  // References to each block found in inodes and snapshots
+    uint32_t next;            // Next chunk of the current parallel pass (atomic)
+    uint32_t problems;        // Problems found (atomic)
+    uint32_t orphans;         // Used inodes nothing points to (atomic)
+    uint32_t leaked;          // Used blocks nothing points to (atomic)
+} FsckContext;
+
+
+static void fsck_problem(FsckContext *ctx, const char *fmt, ...) {
+    uint32_t n = __atomic_fetch_add(&ctx->problems, 1, __ATOMIC_RELAXED);
+    if (n >= FSCK_MAX_REPORTED) {
+        if (n == FSCK_MAX_REPORTED)
+            fs_log("  ... more problems, only counting from here\n");
+        return;
+    }
+
+    char line[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    fs_log("  %s%s\n", line, ctx->repair ? " (fixed)" : "");
+}
+
+// Run worker on every thread and wait for all of them
+static void fsck_parallel(FsckContext *ctx, void *(*worker)(void *)) {
+    pthread_t threads[MAX_FSCK_THREADS];
+    int count = worker_thread_count(MAX_FSCK_THREADS);
+    int started = 0;
+
+    ctx->next = 0;
+    for (int t = 0; t < count; t++) {
+        if (pthread_create(&threads[t], NULL, worker, ctx) == 0)
+            started++;
+    }
+    if (started == 0)
+        worker(ctx);
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+// Walk the directory tree from the root, dropping entries that point nowhere
+static int fsck_walk_directories(FsckContext *ctx) {
+    FileSystem *fs = ctx->fs;
+    uint32_t *queue = (uint32_t *)malloc(fs->total_inodes * sizeof(uint32_t));
+    if (!queue) {
+        fs_log("Memory allocation for fsck failed!\n");
+        return -1;
+    }
+    uint32_t head = 0, tail = 0;
+
+    ctx->reachable[0] = true;
+    queue[tail++] = 0;
+
+    while (head < tail) {
+        uint32_t dir_index = queue[head++];
+        Inode *dir = &fs->inodes[dir_index];
+
+        if (dir->dir_entry_count > MAX_DIR_ENTRIES) {
+            fsck_problem(ctx, "directory inode %u claims %u entries (max %d)",
+                         dir_index, dir->dir_entry_count, MAX_DIR_ENTRIES);
+            dir->dir_entry_count = MAX_DIR_ENTRIES;
+        }
+
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < dir->dir_entry_count; i++) {
+            DirectoryEntry *entry = &dir->entries[i];
+            uint32_t child = entry->inode_index;
+            bool keep = true;
+
+            if (child >= fs->total_inodes) {
+                fsck_problem(ctx, "entry '%.64s' in directory inode %u points past the inode table (%u)",
+                             entry->name, dir_index, child);
+                keep = false;
+            } else if (!fs->inode_bitmap[child]) {
+                fsck_problem(ctx, "entry '%.64s' in directory inode %u points to free inode %u",
+                             entry->name, dir_index, child);
+                keep = false;
+            } else if (fs->inodes[child].is_directory && ctx->reachable[child]) {
+                // A directory may only have one parent, anything else makes a cycle
+                fsck_problem(ctx, "directory inode %u is linked a second time as '%.64s'",
+                             child, entry->name);
+                keep = false;
+            }
+
+            if (!keep && ctx->repair)
+                continue;
+            if (keep && !ctx->reachable[child]) {
+                ctx->reachable[child] = true;
+                if (fs->inodes[child].is_directory)
+                    queue[tail++] = child;
+            }
+            if (keep)
+                ctx->links[child]++;
+            if (ctx->repair && kept != i)
+                dir->entries[kept] = *entry;
+            kept++;
+        }
+        if (ctx->repair)
+            dir->dir_entry_count = kept;
+    }
+    free(queue);
+    return 0;
+}
+
+// Check block pointers and sizes of live inodes and count their block references
+static void *fsck_inode_worker(void *arg) {
+    FsckContext *ctx = (FsckContext *)arg;
+    FileSystem *fs = ctx->fs;
+
+    while (true) {
+        uint32_t start = __atomic_fetch_add(&ctx->next, FSCK_CHUNK, __ATOMIC_RELAXED);
+        if (start >= fs->total_inodes)
+            break;
+        uint32_t end = start + FSCK_CHUNK < fs->total_inodes ? start + FSCK_CHUNK : fs->total_inodes;
+
+        for (uint32_t i = start; i < end; i++) {
+            if (!fs->inode_bitmap[i])
+                continue;
+            Inode *inode = &fs->inodes[i];
+
+            if (!ctx->reachable[i]) {
+                fsck_problem(ctx, "inode %u ('%.64s') is used but not in any directory", i, inode->filename);
+                __atomic_fetch_add(&ctx->orphans, 1, __ATOMIC_RELAXED);
+                if (ctx->repair) {
+                    // Its blocks are not counted, so the block pass frees them too
+                    fs->inode_bitmap[i] = false;
+                    continue;
+                }
+            } else if (inode->nlink != ctx->links[i]) {
+                fsck_problem(ctx, "inode %u has link count %u, %u entries name it", i, inode->nlink, ctx->links[i]);
+                if (ctx->repair)
+                    inode->nlink = (uint16_t)ctx->links[i];
+            }
+            if (inode->xattr_block > fs->total_blocks) {
+                fsck_problem(ctx, "inode %u attribute block %u is out of range (%u)", i,
+                             inode->xattr_block - 1, fs->total_blocks);
+                if (ctx->repair)
+                    inode->xattr_block = 0;
+            } else if (inode->xattr_block) {
+                __atomic_fetch_add(&ctx->expected_refs[inode->xattr_block - 1], 1, __ATOMIC_RELAXED);
+            }
+            if (inode->is_directory)
+                continue;
+
+            if (inode->size > DIRECT_POINTERS * BLOCK_SIZE) {
+                fsck_problem(ctx, "inode %u is %u bytes, more than its %d block pointers hold",
+                             i, inode->size, DIRECT_POINTERS);
+                if (ctx->repair)
+                    inode->size = DIRECT_POINTERS * BLOCK_SIZE;
+            }
+
+            uint32_t count = inode_block_count(inode);
+            for (uint32_t b = 0; b < count; b++) {
+                if (inode->blocks[b] == BLOCK_HOLE)
+                    continue;
+                if (inode->blocks[b] >= fs->total_blocks) {
+                    fsck_problem(ctx, "inode %u block pointer %u is out of range (%u)", i, b, inode->blocks[b]);
+                    if (ctx->repair)
+                        inode->size = b * BLOCK_SIZE;
+                    break;
+                }
+                __atomic_fetch_add(&ctx->expected_refs[inode->blocks[b]], 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Compare the bitmap and refcounts with what the inodes reference
+static void *fsck_block_worker(void *arg) {
+    FsckContext *ctx = (FsckContext *)arg;
+    FileSystem *fs = ctx->fs;
+
+    while (true) {
+        uint32_t start = __atomic_fetch_add(&ctx->next, FSCK_CHUNK, __ATOMIC_RELAXED);
+        if (start >= fs->total_blocks)
+            break;
+        uint32_t end = start + FSCK_CHUNK < fs->total_blocks ? start + FSCK_CHUNK : fs->total_blocks;
+
+        for (uint32_t i = start; i < end; i++) {
+            uint32_t expected = ctx->expected_refs[i];
+            if (expected > UINT16_MAX)
+                expected = UINT16_MAX;
+
+            if (fs->block_bitmap[i] && expected == 0) {
+                fsck_problem(ctx, "block %u is marked used but nothing references it", i);
+                __atomic_fetch_add(&ctx->leaked, 1, __ATOMIC_RELAXED);
+            } else if (!fs->block_bitmap[i] && expected > 0) {
+                fsck_problem(ctx, "block %u is referenced %u times but marked free", i, expected);
+            } else if (fs->block_bitmap[i] && fs->block_refcount[i] != expected) {
+                fsck_problem(ctx, "block %u has refcount %u, expected %u", i, fs->block_refcount[i], expected);
+            } else {
+                continue;
+            }
+
+            if (ctx->repair) {
+                fs->block_bitmap[i] = expected > 0;
+                fs->block_refcount[i] = (uint16_t)expected;
+            }
+        }
+    }
+    return NULL;
+}
+
+int fsck_file_system(FileSystem *fs, bool repair) {
+    struct timespec begin, finish;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    // Queued inodes are unlinked on purpose, finish them so they do not show up as orphans
+    reclaim_drain(fs);
+
+    if (fs->total_inodes == 0 || !fs->inode_bitmap[0] || !fs->inodes[0].is_directory) {
+        fs_log("fsck: root directory (inode 0) is missing, cannot check this image.\n");
+        return -1;
+    }
+
+    FsckContext ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fs = fs;
+    ctx.repair = repair;
+    ctx.reachable = (bool *)calloc(fs->total_inodes, sizeof(bool));
+    ctx.links = (uint32_t *)calloc(fs->total_inodes, sizeof(uint32_t));
+    ctx.expected_refs = (uint32_t *)calloc(fs->total_blocks, sizeof(uint32_t));
+    if (!ctx.reachable || !ctx.links || !ctx.expected_refs) {
+        fs_log("Memory allocation for fsck failed!\n");
+        free(ctx.reachable);
+        free(ctx.links);
+        free(ctx.expected_refs);
+        return -1;
+    }
+
+    fs_log("fsck: checking %u inodes and %u blocks%s\n", fs->total_inodes, fs->total_blocks,
+           repair ? ", repairing" : "");
+
+    // Pass 1: directory tree. Without it every inode would look orphaned, so stop here
+    if (fsck_walk_directories(&ctx) != 0) {
+        free(ctx.reachable);
+        free(ctx.links);
+        free(ctx.expected_refs);
+        return -1;
+    }
+
+    // Pass 2: inode table, in parallel
+    fsck_parallel(&ctx, fsck_inode_worker);
+
+    // Snapshot inodes own block references as well
+    for (uint32_t s = 0; s < fs->snapshot_count; s++) {
+        Snapshot *snap = &fs->snapshots[s];
+        for (uint32_t i = 0; i < snap->inode_count; i++) {
+            uint32_t count = inode_block_count(&snap->inodes[i]);
+            for (uint32_t b = 0; b < count; b++) {
+                if (snap->inodes[i].blocks[b] < fs->total_blocks)
+                    ctx.expected_refs[snap->inodes[i].blocks[b]]++;
+            }
+            uint32_t xattr_block = snap->inodes[i].xattr_block;
+            if (xattr_block && xattr_block <= fs->total_blocks)
+                ctx.expected_refs[xattr_block - 1]++;
+        }
+    }
+
+    // Pass 3: block bitmap and refcounts, in parallel
+    fsck_parallel(&ctx, fsck_block_worker);
+    if (repair) {
+        recount_usage(fs);
+        // The workers fixed things behind the dirty tracking's back
+        if (ctx.problems)
+            mark_dirty(fs);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double seconds = (finish.tv_sec - begin.tv_sec) + (finish.tv_nsec - begin.tv_nsec) / 1e9;
+
+    fs_log("fsck: %u problems (%u orphan inodes, %u leaked blocks)%s, %.3f s\n",
+           ctx.problems, ctx.orphans, ctx.leaked,
+           ctx.problems == 0 ? "" : (repair ? ", repaired" : ", run 'fsck -r' to repair"), seconds);
+
+    free(ctx.reachable);
+    free(ctx.links);
+    free(ctx.expected_refs);
+    return (int)ctx.problems;
+}
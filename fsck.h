@@ -0,0 +1,17 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include "FileSystem.h"
+
+#define MAX_FSCK_THREADS 16   // Upper bound on checker threads
+#define FSCK_CHUNK 1024       // Inodes or blocks a thread takes at a time
+#define FSCK_MAX_REPORTED 32  // Problems printed before the rest are only counted
+
+
+// Rebuild the expected bitmaps and refcounts from the directory tree, the inode
+// table and the snapshots, and compare them with what the image says.
+// With repair set, mismatches are fixed in memory.
+// Returns the number of problems found, or -1 if the root directory is unusable.
+int fsck_file_system(FileSystem *fs, bool repair);
+
+#endif
@@ -0,0 +1,41 @@
+#include "FileSystem.h"
+#include "fsck.h"
+
+
+// Standalone checker: fsck [-r] [image]
+// Exit codes follow fsck(8): 0 clean, 1 errors fixed, 4 errors left, 8 could not check
+int main(int argc, char *argv[]) {
+    const char *image_filename = "disk_image.bin";
+    bool repair = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            repair = true;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            repair = false;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-r|-n] [image]\n", argv[0]);
+            return 8;
+        } else {
+            image_filename = argv[i];
+        }
+    }
+
+    FileSystem fs;
+    set_log_handler(log_to_stdout);
+    if (load_file_system(&fs, image_filename) != 0) {
+        return 8;
+    }
+
+    int problems = fsck_file_system(&fs, repair);
+    if (problems > 0 && repair) {
+        save_file_system(&fs, image_filename);
+    }
+    cleanup_file_system(&fs);
+
+    if (problems < 0)
+        return 8;
+    if (problems == 0)
+        return 0;
+    return repair ? 1 : 4;
+}
@@ -0,0 +1,821 @@
+#define FUSE_USE_VERSION 34
+
+#include "FileSystem.h"
+#include "reclaim.h"
+#include "writeback.h"
+#include "quota.h"
+#include "xattr.h"
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+#define FUSEFS_CACHE_TIMEOUT 60.0 // Seconds the kernel may cache entries and attributes
+#define FUSEFS_MAX_IDLE_THREADS 16
+
+
+// Mount an image: fusefs <image> <mountpoint> [FUSE options]
+//
+// FUSE inode numbers are our inode indexes plus one, so the root directory
+// (inode 0) is FUSE_ROOT_ID. This process is the only writer while the image
+// is mounted, which is what makes the long cache timeouts safe.
+//
+// Readers share fs->lock, writers take it exclusively. Every block is loaded
+// at mount time so readers never have to fault blocks in under the shared lock.
+
+typedef struct {
+    FileSystem fs;
+    const char *image_filename;
+    uint32_t *open_count;  // Open handles per inode
+    bool *unlinked;        // Removed from its directory while still open
+} FuseFs;
+
+static FuseFs fuse_fs;
+
+
+static int ino_to_index(fuse_ino_t ino) {
+    if (ino < FUSE_ROOT_ID || ino - FUSE_ROOT_ID >= fuse_fs.fs.total_inodes)
+        return -1;
+    if (!fuse_fs.fs.inode_bitmap[ino - FUSE_ROOT_ID])
+        return -1;
+    return (int)(ino - FUSE_ROOT_ID);
+}
+
+static void fill_stat(uint32_t inode_index, struct stat *st) {
+    Inode *inode = &fuse_fs.fs.inodes[inode_index];
+    memset(st, 0, sizeof(*st));
+    st->st_ino = inode_index + FUSE_ROOT_ID;
+    if (inode->is_directory) {
+        st->st_mode = S_IFDIR | inode->permissions;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = (inode->is_symlink ? S_IFLNK : S_IFREG) | inode->permissions;
+        st->st_nlink = inode->nlink;
+        st->st_size = inode->size;
+        st->st_blocks = (blkcnt_t)inode_data_blocks(inode) * (BLOCK_SIZE / 512);
+    }
+    st->st_blksize = BLOCK_SIZE;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    // There is no change time, the last write stands in for it
+    st->st_atime = __atomic_load_n(&inode->access_time, __ATOMIC_RELAXED);
+    st->st_mtime = inode->modification_time;
+    st->st_ctime = inode->modification_time;
+}
+
+static void fill_entry(uint32_t inode_index, struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(*e));
+    e->ino = inode_index + FUSE_ROOT_ID;
+    e->attr_timeout = FUSEFS_CACHE_TIMEOUT;
+    e->entry_timeout = FUSEFS_CACHE_TIMEOUT;
+    fill_stat(inode_index, &e->attr);
+}
+
+// truncate_file with its result as an errno
+static int resize_file(FileSystem *fs, Inode *inode, uint32_t new_size) {
+    int ret = truncate_file(fs, inode, new_size);
+    return ret == 0 ? 0 : ret == -2 ? -EFBIG : ret == -3 ? -EDQUOT : -ENOSPC;
+}
+
+// Unlinked files stay around until their last handle is closed. Caller holds the write lock.
+static void drop_inode(uint32_t inode_index) {
+    // Still reachable under another name
+    if (fuse_fs.fs.inodes[inode_index].nlink > 0)
+        return;
+    if (fuse_fs.open_count[inode_index] > 0) {
+        fuse_fs.unlinked[inode_index] = true;
+        return;
+    }
+    reclaim_inode(&fuse_fs.fs, inode_index);
+}
+
+
+static void fusefs_init(void *userdata, struct fuse_conn_info *conn) {
+    // Requests and replies go through pipes instead of being copied through our buffers
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+        conn->want |= FUSE_CAP_SPLICE_MOVE;
+    if (conn->capable & FUSE_CAP_SPLICE_READ)
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    // No file is larger than its direct blocks, one write request is enough for any of them
+    conn->max_write = DIRECT_POINTERS * BLOCK_SIZE;
+}
+
+static void fusefs_destroy(void *userdata) {
+    FileSystem *fs = &fuse_fs.fs;
+    pthread_rwlock_wrlock(fs->lock);
+    // Files still open at unmount were unlinked, they go now
+    for (uint32_t i = 0; i < fs->total_inodes; i++) {
+        if (fuse_fs.unlinked[i])
+            reclaim_inode(fs, i);
+    }
+    if (!fs->writeback)
+        save_file_system(fs, fuse_fs.image_filename);
+    pthread_rwlock_unlock(fs->lock);
+    // Most of it is on the image already, this writes the rest
+    writeback_flush(fs);
+}
+
+static void fusefs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    FileSystem *fs = &fuse_fs.fs;
+    struct fuse_entry_param e;
+
+    pthread_rwlock_rdlock(fs->lock);
+    int dir_index = ino_to_index(parent);
+    if (dir_index == -1) {
+        pthread_rwlock_unlock(fs->lock);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    int child = find_in_directory(fs, dir_index, name);
+    if (child == -1) {
+        pthread_rwlock_unlock(fs->lock);
+        // Negative entry, the kernel caches the miss as well
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = FUSEFS_CACHE_TIMEOUT;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    fill_entry(child, &e);
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_entry(req, &e);
+}
+
+static void fusefs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    FileSystem *fs = &fuse_fs.fs;
+    struct stat st;
+
+    pthread_rwlock_rdlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    if (inode_index == -1) {
+        pthread_rwlock_unlock(fs->lock);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fill_stat(inode_index, &st);
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_attr(req, &st, FUSEFS_CACHE_TIMEOUT);
+}
+
+static void fusefs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                           struct fuse_file_info *fi) {
+    FileSystem *fs = &fuse_fs.fs;
+    struct stat st;
+
+    pthread_rwlock_wrlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    if (inode_index == -1) {
+        pthread_rwlock_unlock(fs->lock);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    // Owners are not stored, a chown is accepted and ignored
+    Inode *inode = &fs->inodes[inode_index];
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        int err = inode->is_directory ? -EISDIR
+                : inode->is_symlink || attr->st_size < 0 ? -EINVAL
+                : resize_file(fs, inode, attr->st_size > UINT32_MAX ? UINT32_MAX : (uint32_t)attr->st_size);
+        if (err != 0) {
+            pthread_rwlock_unlock(fs->lock);
+            fuse_reply_err(req, -err);
+            return;
+        }
+    }
+    if (to_set & FUSE_SET_ATTR_MODE)
+        inode->permissions = attr->st_mode & 07777;
+    if (to_set & FUSE_SET_ATTR_ATIME)
+        inode->access_time = to_set & FUSE_SET_ATTR_ATIME_NOW ? fs_time() : (uint32_t)attr->st_atime;
+    if (to_set & FUSE_SET_ATTR_MTIME)
+        inode->modification_time = to_set & FUSE_SET_ATTR_MTIME_NOW ? fs_time() : (uint32_t)attr->st_mtime;
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
+        mark_dirty(fs);
+    fill_stat(inode_index, &st);
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_attr(req, &st, FUSEFS_CACHE_TIMEOUT);
+}
+
+static void fusefs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info *fi) {
+    FileSystem *fs = &fuse_fs.fs;
+    Arena *scratch = scratch_arena();
+    ArenaMark mark = arena_mark(scratch);
+    char *buf = (char *)arena_alloc(scratch, size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_rwlock_rdlock(fs->lock);
+    int dir_index = ino_to_index(ino);
+    if (dir_index == -1 || !fs->inodes[dir_index].is_directory) {
+        pthread_rwlock_unlock(fs->lock);
+        arena_rewind(scratch, mark);
+        fuse_reply_err(req, dir_index == -1 ? ENOENT : ENOTDIR);
+        return;
+    }
+
+    // Offsets 0 and 1 are "." and "..", entry i is at offset i + 2
+    Inode *dir = &fs->inodes[dir_index];
+    size_t used = 0;
+    for (off_t pos = off; pos < (off_t)dir->dir_entry_count + 2; pos++) {
+        struct stat st;
+        const char *name;
+        memset(&st, 0, sizeof(st));
+        if (pos < 2) {
+            name = pos == 0 ? "." : "..";
+            st.st_ino = ino;
+            st.st_mode = S_IFDIR;
+        } else {
+            DirectoryEntry *entry = &dir->entries[pos - 2];
+            name = entry->name;
+            st.st_ino = entry->inode_index + FUSE_ROOT_ID;
+            Inode *child = &fs->inodes[entry->inode_index];
+            st.st_mode = child->is_directory ? S_IFDIR : child->is_symlink ? S_IFLNK : S_IFREG;
+        }
+        size_t len = fuse_add_direntry(req, buf + used, size - used, name, &st, pos + 1);
+        if (len > size - used)
+            break;
+        used += len;
+    }
+    pthread_rwlock_unlock(fs->lock);
+
+    fuse_reply_buf(req, buf, used);
+    arena_rewind(scratch, mark);
+}
+
+static void fusefs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    FileSystem *fs = &fuse_fs.fs;
+
+    pthread_rwlock_wrlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    if (inode_index == -1 || fs->inodes[inode_index].is_directory) {
+        pthread_rwlock_unlock(fs->lock);
+        fuse_reply_err(req, inode_index == -1 ? ENOENT : EISDIR);
+        return;
+    }
+    if (fi->flags & O_TRUNC) {
+        int err = resize_file(fs, &fs->inodes[inode_index], 0);
+        if (err != 0) {
+            pthread_rwlock_unlock(fs->lock);
+            fuse_reply_err(req, -err);
+            return;
+        }
+    }
+    fuse_fs.open_count[inode_index]++;
+    pthread_rwlock_unlock(fs->lock);
+
+    // Contents only change through this mount, the page cache may be kept across opens
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void fusefs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    FileSystem *fs = &fuse_fs.fs;
+    uint32_t inode_index = ino - FUSE_ROOT_ID;
+
+    pthread_rwlock_wrlock(fs->lock);
+    if (inode_index < fs->total_inodes && fuse_fs.open_count[inode_index] > 0) {
+        fuse_fs.open_count[inode_index]--;
+        if (fuse_fs.open_count[inode_index] == 0 && fuse_fs.unlinked[inode_index]) {
+            fuse_fs.unlinked[inode_index] = false;
+            reclaim_inode(fs, inode_index);
+        }
+    }
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_err(req, 0);
+}
+
+// Reply straight from the block array: one buffer per block, spliced to the kernel when it can
+static void fusefs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                        struct fuse_file_info *fi) {
+    FileSystem *fs = &fuse_fs.fs;
+    Arena *scratch = scratch_arena();
+    ArenaMark mark = arena_mark(scratch);
+    struct fuse_bufvec *bufv = (struct fuse_bufvec *)arena_alloc(scratch,
+        sizeof(struct fuse_bufvec) + DIRECT_POINTERS * sizeof(struct fuse_buf));
+    if (!bufv) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_rwlock_rdlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    if (inode_index == -1) {
+        pthread_rwlock_unlock(fs->lock);
+        arena_rewind(scratch, mark);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    Inode *inode = &fs->inodes[inode_index];
+    uint64_t end = (uint64_t)off + size < inode->size ? (uint64_t)off + size : inode->size;
+    memset(bufv, 0, sizeof(struct fuse_bufvec));
+    for (uint64_t pos = off; pos < end; ) {
+        uint32_t in_block = pos % BLOCK_SIZE;
+        uint32_t len = BLOCK_SIZE - in_block < end - pos ? BLOCK_SIZE - in_block : (uint32_t)(end - pos);
+        struct fuse_buf *buf = &bufv->buf[bufv->count++];
+        memset(buf, 0, sizeof(*buf));
+        buf->mem = (void *)(data_block(fs, inode->blocks[pos / BLOCK_SIZE])->data + in_block);
+        buf->size = len;
+        pos += len;
+    }
+    if (end > (uint64_t)off)
+        __atomic_fetch_add(&fs->stats.bytes_read, end - off, __ATOMIC_RELAXED);
+    touch_accessed(fs, inode);
+
+    // The buffers point into the blocks, so the reply has to go out before the lock is dropped
+    if (bufv->count == 0)
+        fuse_reply_buf(req, NULL, 0);
+    else
+        fuse_reply_data(req, bufv, 0);
+    pthread_rwlock_unlock(fs->lock);
+    arena_rewind(scratch, mark);
+}
+
+// Copy the request into the blocks, spliced from the kernel when it can
+static void fusefs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf, off_t off,
+                             struct fuse_file_info *fi) {
+    FileSystem *fs = &fuse_fs.fs;
+    size_t size = fuse_buf_size(in_buf);
+
+    pthread_rwlock_wrlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    if (inode_index == -1) {
+        pthread_rwlock_unlock(fs->lock);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    Inode *inode = &fs->inodes[inode_index];
+    if (fi->flags & O_APPEND)
+        off = inode->size;
+    if ((uint64_t)off + size > DIRECT_POINTERS * BLOCK_SIZE) {
+        pthread_rwlock_unlock(fs->lock);
+        fuse_reply_err(req, EFBIG);
+        return;
+    }
+
+    uint32_t old_size = inode->size;
+    uint32_t end = (uint32_t)(off + size);
+    if (end > inode->size) {
+        int err = resize_file(fs, inode, end);
+        if (err != 0) {
+            pthread_rwlock_unlock(fs->lock);
+            fuse_reply_err(req, -err);
+            return;
+        }
+    }
+
+    size_t written = 0;
+    for (uint32_t pos = (uint32_t)off; pos < end; ) {
+        uint32_t in_block = pos % BLOCK_SIZE;
+        uint32_t len = BLOCK_SIZE - in_block < end - pos ? BLOCK_SIZE - in_block : end - pos;
+        uint32_t *block_index = &inode->blocks[pos / BLOCK_SIZE];
+        if (cow_block(fs, block_index) != 0)
+            break;
+
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+        dst.buf[0].mem = get_block(fs, *block_index)->data + in_block;
+        ssize_t copied = fuse_buf_copy(&dst, in_buf, 0);
+        if (copied > 0) {
+            update_block_checksum(fs, *block_index);
+            written += copied;
+        }
+        if (copied != (ssize_t)len)
+            break;
+        pos += len;
+    }
+
+    // A short write leaves the file no longer than what was actually written
+    if ((uint64_t)off + written < end)
+        resize_file(fs, inode, (uint64_t)off + written > old_size ? (uint32_t)(off + written) : old_size);
+    fs->stats.bytes_written += written;
+    pthread_rwlock_unlock(fs->lock);
+
+    if (written == 0 && size > 0)
+        fuse_reply_err(req, ENOSPC);
+    else
+        fuse_reply_write(req, written);
+}
+
+// New file, directory or (with link_target) symlink called name under parent. Caller holds the write lock.
+static int make_node(fuse_ino_t parent, const char *name, bool is_directory, const char *link_target) {
+    FileSystem *fs = &fuse_fs.fs;
+    int dir_index = ino_to_index(parent);
+    if (dir_index == -1)
+        return -ENOENT;
+    if (!fs->inodes[dir_index].is_directory)
+        return -ENOTDIR;
+    if (strlen(name) >= MAX_FILENAME)
+        return -ENAMETOOLONG;
+    if (find_in_directory(fs, dir_index, name) != -1)
+        return -EEXIST;
+    if (fs->inodes[dir_index].dir_entry_count >= MAX_DIR_ENTRIES)
+        return -ENOSPC;
+
+    int inode_index;
+    if (is_directory) {
+        inode_index = create_directory(fs, name);
+    } else if (link_target) {
+        inode_index = create_symlink(fs, link_target);
+        if (inode_index != -1) {
+            strncpy(fs->inodes[inode_index].filename, name, MAX_FILENAME - 1);
+        }
+    } else {
+        inode_index = allocate_inode(fs);
+        if (inode_index != -1) {
+            strncpy(fs->inodes[inode_index].filename, name, MAX_FILENAME - 1);
+        }
+    }
+    if (inode_index == -1)
+        return -ENOSPC;
+    if (add_to_directory(fs, dir_index, inode_index, name) != 0) {
+        truncate_file(fs, &fs->inodes[inode_index], 0);
+        free_inode(fs, inode_index);
+        return -ENOSPC;
+    }
+    return inode_index;
+}
+
+static void fusefs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                          struct fuse_file_info *fi) {
+    FileSystem *fs = &fuse_fs.fs;
+    struct fuse_entry_param e;
+
+    pthread_rwlock_wrlock(fs->lock);
+    int inode_index = make_node(parent, name, false, NULL);
+    if (inode_index < 0) {
+        pthread_rwlock_unlock(fs->lock);
+        fuse_reply_err(req, -inode_index);
+        return;
+    }
+    fs->inodes[inode_index].permissions = mode & 07777;
+    fuse_fs.open_count[inode_index]++;
+    fill_entry(inode_index, &e);
+    pthread_rwlock_unlock(fs->lock);
+
+    fi->keep_cache = 1;
+    fuse_reply_create(req, &e, fi);
+}
+
+static void fusefs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    FileSystem *fs = &fuse_fs.fs;
+    struct fuse_entry_param e;
+
+    pthread_rwlock_wrlock(fs->lock);
+    int inode_index = make_node(parent, name, true, NULL);
+    if (inode_index < 0) {
+        pthread_rwlock_unlock(fs->lock);
+        fuse_reply_err(req, -inode_index);
+        return;
+    }
+    fs->inodes[inode_index].permissions = mode & 07777;
+    fill_entry(inode_index, &e);
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_entry(req, &e);
+}
+
+static void fusefs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
+    FileSystem *fs = &fuse_fs.fs;
+    struct fuse_entry_param e;
+
+    if (strlen(link) >= SYMLINK_MAX) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+    pthread_rwlock_wrlock(fs->lock);
+    int inode_index = make_node(parent, name, false, link);
+    if (inode_index < 0) {
+        pthread_rwlock_unlock(fs->lock);
+        fuse_reply_err(req, -inode_index);
+        return;
+    }
+    fill_entry(inode_index, &e);
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_entry(req, &e);
+}
+
+static void fusefs_readlink(fuse_req_t req, fuse_ino_t ino) {
+    FileSystem *fs = &fuse_fs.fs;
+    char target[SYMLINK_MAX];
+
+    pthread_rwlock_rdlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    if (inode_index == -1 || !fs->inodes[inode_index].is_symlink) {
+        pthread_rwlock_unlock(fs->lock);
+        fuse_reply_err(req, inode_index == -1 ? ENOENT : EINVAL);
+        return;
+    }
+    // Straight from the inode or the resident block, like fusefs_read, so the shared lock is enough
+    Inode *inode = &fs->inodes[inode_index];
+    uint32_t len = inode->size < SYMLINK_MAX ? inode->size : SYMLINK_MAX - 1;
+    memcpy(target, inode->size < SYMLINK_INLINE_MAX ? (const void *)inode->blocks
+                                                    : (const void *)fs->blocks[inode->blocks[0]].data, len);
+    target[len] = '\0';
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_readlink(req, target);
+}
+
+static void fusefs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+    FileSystem *fs = &fuse_fs.fs;
+    struct fuse_entry_param e;
+    int err = 0;
+
+    pthread_rwlock_wrlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    int dir_index = ino_to_index(newparent);
+    if (inode_index == -1 || dir_index == -1) {
+        err = ENOENT;
+    } else if (fs->inodes[inode_index].is_directory) {
+        err = EPERM;
+    } else if (!fs->inodes[dir_index].is_directory) {
+        err = ENOTDIR;
+    } else if (strlen(newname) >= MAX_FILENAME) {
+        err = ENAMETOOLONG;
+    } else if (find_in_directory(fs, dir_index, newname) != -1) {
+        err = EEXIST;
+    } else if (fs->inodes[inode_index].nlink >= UINT16_MAX) {
+        err = EMLINK;
+    } else if (add_to_directory(fs, dir_index, inode_index, newname) != 0) {
+        err = ENOSPC;
+    } else {
+        fill_entry(inode_index, &e);
+    }
+    pthread_rwlock_unlock(fs->lock);
+    if (err)
+        fuse_reply_err(req, err);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+// Unlink name from parent, want_directory selects rmdir or unlink semantics
+static void remove_node(fuse_req_t req, fuse_ino_t parent, const char *name, bool want_directory) {
+    FileSystem *fs = &fuse_fs.fs;
+    int err = 0;
+
+    pthread_rwlock_wrlock(fs->lock);
+    int dir_index = ino_to_index(parent);
+    int child = dir_index == -1 ? -1 : find_in_directory(fs, dir_index, name);
+    if (child == -1) {
+        err = ENOENT;
+    } else if (fs->inodes[child].is_directory != want_directory) {
+        err = want_directory ? ENOTDIR : EISDIR;
+    } else if (want_directory && fs->inodes[child].dir_entry_count > 0) {
+        err = ENOTEMPTY;
+    } else if (remove_from_directory(fs, dir_index, child, name) != 0) {
+        err = EIO;
+    } else {
+        drop_inode(child);
+    }
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_err(req, err);
+}
+
+static void fusefs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    remove_node(req, parent, name, false);
+}
+
+static void fusefs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    remove_node(req, parent, name, true);
+}
+
+static void fusefs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+                          const char *newname, unsigned int flags) {
+    FileSystem *fs = &fuse_fs.fs;
+    int err = 0;
+
+    if (flags & ~RENAME_NOREPLACE) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    pthread_rwlock_wrlock(fs->lock);
+    int from_dir = ino_to_index(parent);
+    int to_dir = ino_to_index(newparent);
+    int child = from_dir == -1 ? -1 : find_in_directory(fs, from_dir, name);
+    int target = to_dir == -1 ? -1 : find_in_directory(fs, to_dir, newname);
+
+    if (child == -1 || to_dir == -1) {
+        err = ENOENT;
+    } else if (!fs->inodes[to_dir].is_directory) {
+        err = ENOTDIR;
+    } else if (strlen(newname) >= MAX_FILENAME) {
+        err = ENAMETOOLONG;
+    } else if (target == child) {
+        err = 0;
+    } else if (target != -1 && (flags & RENAME_NOREPLACE)) {
+        err = EEXIST;
+    } else if (target != -1 && fs->inodes[target].is_directory != fs->inodes[child].is_directory) {
+        err = fs->inodes[target].is_directory ? EISDIR : ENOTDIR;
+    } else if (target != -1 && fs->inodes[target].dir_entry_count > 0) {
+        err = ENOTEMPTY;
+    } else if (target == -1 && to_dir != from_dir && fs->inodes[to_dir].dir_entry_count >= MAX_DIR_ENTRIES) {
+        err = ENOSPC;
+    } else {
+        // The kernel already refuses to move a directory below itself
+        if (target != -1) {
+            remove_from_directory(fs, to_dir, target, newname);
+            drop_inode(target);
+        }
+        remove_from_directory(fs, from_dir, child, name);
+        add_to_directory(fs, to_dir, child, newname);
+        strncpy(fs->inodes[child].filename, newname, MAX_FILENAME - 1);
+    }
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_err(req, err);
+}
+
+// xattr_* results as errno values
+static int xattr_errno(int ret) {
+    return ret == XATTR_NOT_FOUND ? ENODATA : ret == XATTR_EXISTS ? EEXIST : ret == XATTR_NO_SPACE ? ENOSPC
+         : ret == XATTR_RANGE ? ERANGE : EINVAL;
+}
+
+static void fusefs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value,
+                            size_t size, int flags) {
+    FileSystem *fs = &fuse_fs.fs;
+    int only = (flags & XATTR_CREATE ? XATTR_ONLY_CREATE : 0) | (flags & XATTR_REPLACE ? XATTR_ONLY_REPLACE : 0);
+
+    pthread_rwlock_wrlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    int ret = inode_index == -1 ? -1 : xattr_set(fs, inode_index, name, value, size, only);
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_err(req, inode_index == -1 ? ENOENT : ret < 0 ? xattr_errno(ret) : 0);
+}
+
+// Lookups only read the inode and its resident attribute block, like fusefs_read,
+// so the shared lock is enough
+static void fusefs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    FileSystem *fs = &fuse_fs.fs;
+    char value[XATTR_VALUE_MAX];
+
+    pthread_rwlock_rdlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    int ret = inode_index == -1 ? -1 : xattr_get(fs, inode_index, name, value, size < sizeof(value) ? size : sizeof(value));
+    pthread_rwlock_unlock(fs->lock);
+    if (inode_index == -1 || ret < 0)
+        fuse_reply_err(req, inode_index == -1 ? ENOENT : xattr_errno(ret));
+    else if (size == 0)
+        fuse_reply_xattr(req, (size_t)ret);
+    else
+        fuse_reply_buf(req, value, (size_t)ret);
+}
+
+static void fusefs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+    FileSystem *fs = &fuse_fs.fs;
+    char list[BLOCK_SIZE + sizeof(((Inode *)0)->xattrs)];
+
+    pthread_rwlock_rdlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    int ret = inode_index == -1 ? -1 : xattr_list(fs, inode_index, list, size < sizeof(list) ? size : sizeof(list));
+    pthread_rwlock_unlock(fs->lock);
+    if (inode_index == -1 || ret < 0)
+        fuse_reply_err(req, inode_index == -1 ? ENOENT : xattr_errno(ret));
+    else if (size == 0)
+        fuse_reply_xattr(req, (size_t)ret);
+    else
+        fuse_reply_buf(req, list, (size_t)ret);
+}
+
+static void fusefs_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name) {
+    FileSystem *fs = &fuse_fs.fs;
+
+    pthread_rwlock_wrlock(fs->lock);
+    int inode_index = ino_to_index(ino);
+    int ret = inode_index == -1 ? -1 : xattr_remove(fs, inode_index, name);
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_err(req, inode_index == -1 ? ENOENT : ret < 0 ? xattr_errno(ret) : 0);
+}
+
+static void fusefs_statfs(fuse_req_t req, fuse_ino_t ino) {
+    FileSystem *fs = &fuse_fs.fs;
+    struct statvfs st;
+
+    memset(&st, 0, sizeof(st));
+    pthread_rwlock_rdlock(fs->lock);
+    st.f_bsize = BLOCK_SIZE;
+    st.f_frsize = BLOCK_SIZE;
+    st.f_blocks = fs->total_blocks;
+    st.f_bfree = fs->total_blocks - fs->used_blocks;
+    st.f_bavail = available_blocks(fs);
+    st.f_files = fs->total_inodes;
+    st.f_ffree = fs->total_inodes - fs->used_inodes;
+    st.f_favail = st.f_ffree;
+    st.f_namemax = MAX_FILENAME - 1;
+    pthread_rwlock_unlock(fs->lock);
+    fuse_reply_statfs(req, &st);
+}
+
+static const struct fuse_lowlevel_ops fusefs_ops = {
+    .init = fusefs_init,
+    .destroy = fusefs_destroy,
+    .lookup = fusefs_lookup,
+    .getattr = fusefs_getattr,
+    .setattr = fusefs_setattr,
+    .readdir = fusefs_readdir,
+    .open = fusefs_open,
+    .release = fusefs_release,
+    .read = fusefs_read,
+    .write_buf = fusefs_write_buf,
+    .create = fusefs_create,
+    .mkdir = fusefs_mkdir,
+    .unlink = fusefs_unlink,
+    .rmdir = fusefs_rmdir,
+    .rename = fusefs_rename,
+    .link = fusefs_link,
+    .symlink = fusefs_symlink,
+    .readlink = fusefs_readlink,
+    .statfs = fusefs_statfs,
+    .setxattr = fusefs_setxattr,
+    .getxattr = fusefs_getxattr,
+    .listxattr = fusefs_listxattr,
+    .removexattr = fusefs_removexattr,
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argv[1][0] == '-') {
+        fprintf(stderr, "usage: %s <image> <mountpoint> [FUSE options]\n", argv[0]);
+        return 1;
+    }
+    fuse_fs.image_filename = argv[1];
+
+    // The rest of the command line is the usual FUSE one
+    struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv + 1);
+    args.argv[0] = argv[0];
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return 1;
+    if (opts.show_help || !opts.mountpoint) {
+        fprintf(stderr, "usage: %s <image> <mountpoint> [FUSE options]\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return opts.show_help ? 0 : 1;
+    }
+
+    FileSystem *fs = &fuse_fs.fs;
+    set_log_handler(log_to_stdout);
+    if (load_file_system(fs, fuse_fs.image_filename) != 0) {
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    load_all_blocks(fs);
+    fuse_fs.open_count = (uint32_t *)calloc(fs->total_inodes, sizeof(uint32_t));
+    fuse_fs.unlinked = (bool *)calloc(fs->total_inodes, sizeof(bool));
+
+    int ret = 1;
+    struct fuse_session *se = NULL;
+    if (!fuse_fs.open_count || !fuse_fs.unlinked) {
+        printf("Memory allocation for open file counts failed!\n");
+        goto out;
+    }
+
+    se = fuse_session_new(&args, &fusefs_ops, sizeof(fusefs_ops), NULL);
+    if (!se)
+        goto out;
+    if (fuse_set_signal_handlers(se) != 0)
+        goto out;
+    if (fuse_session_mount(se, opts.mountpoint) != 0) {
+        fuse_remove_signal_handlers(se);
+        goto out;
+    }
+    fuse_daemonize(opts.foreground);
+
+    // After the fork, threads do not survive it. Changes reach the image in place from here on.
+    pthread_rwlock_wrlock(fs->lock);
+    writeback_start(fs, fuse_fs.image_filename);
+    pthread_rwlock_unlock(fs->lock);
+
+    if (opts.singlethread) {
+        ret = fuse_session_loop(se);
+    } else {
+        struct fuse_loop_config config;
+        memset(&config, 0, sizeof(config));
+        config.clone_fd = opts.clone_fd;
+        config.max_idle_threads = FUSEFS_MAX_IDLE_THREADS;
+        ret = fuse_session_loop_mt(se, &config);
+    }
+
+    fuse_session_unmount(se);
+    fuse_remove_signal_handlers(se);
+
+out:
+    if (se)
+        fuse_session_destroy(se);
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    free(fuse_fs.open_count);
+    free(fuse_fs.unlinked);
+    cleanup_file_system(fs);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+#include "histogram.h"
+
+
+static uint32_t hist_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS)
+        return (uint32_t)value;
+    uint32_t exponent = 63 - __builtin_clzll(value);
+    uint32_t sub = (uint32_t)(value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// Highest value that lands in the bucket
+static uint64_t hist_value(uint32_t index) {
+    if (index < HIST_SUB_BUCKETS)
+        return index;
+    uint32_t exponent = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub = index % HIST_SUB_BUCKETS;
+    uint32_t shift = exponent - HIST_SUB_BITS;
+    return (((HIST_SUB_BUCKETS + sub + 1) << shift) - 1);
+}
+
+void hist_record(Histogram *h, uint64_t value) {
+    h->counts[hist_index(value)]++;
+    if (h->total == 0 || value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+    h->total++;
+    h->sum += value;
+}
+
+uint64_t hist_percentile(const Histogram *h, double percentile) {
+    if (h->total == 0)
+        return 0;
+    uint64_t wanted = (uint64_t)(h->total * percentile / 100.0 + 0.5);
+    if (wanted < 1)
+        wanted = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= wanted) {
+            uint64_t value = hist_value(i);
+            return value > h->max ? h->max : value;
+        }
+    }
+    return h->max;
+}
+
+void hist_print_json(const Histogram *h, FILE *out) {
+    fprintf(out, "{\"count\":%llu,\"min_ns\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,"
+                 "\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+            (unsigned long long)h->total, (unsigned long long)h->min,
+            (unsigned long long)(h->total ? h->sum / h->total : 0),
+            (unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+            (unsigned long long)hist_percentile(h, 99), (unsigned long long)hist_percentile(h, 99.9),
+            (unsigned long long)h->max);
+}
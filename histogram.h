@@ -0,0 +1,27 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HIST_SUB_BITS 4                        // 16 sub-buckets per power of two, ~6% resolution
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)  // Covers the whole uint64_t range
+
+
+// Log-linear latency histogram in the spirit of HdrHistogram: fixed memory,
+// O(1) record, bounded relative error. Values are nanoseconds.
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;   // Number of recorded values
+    uint64_t sum;     // Sum of recorded values
+    uint64_t min;
+    uint64_t max;
+} Histogram;
+
+
+void hist_record(Histogram *h, uint64_t value);
+uint64_t hist_percentile(const Histogram *h, double percentile);
+void hist_print_json(const Histogram *h, FILE *out);
+
+#endif
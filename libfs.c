@@ -0,0 +1,1366 @@
+#include "libfs.h"
+#include "FileSystem.h"
+#include "snapshot.h"
+#include "scrub.h"
+#include "defrag.h"
+#include "fsck.h"
+#include "reclaim.h"
+#include "openfile.h"
+#include "namecache.h"
+#include "walk.h"
+#include "writeback.h"
+#include "resize.h"
+#include "quota.h"
+#include "xattr.h"
+#include <fnmatch.h>
+
+
+_Static_assert(FS_NAME_MAX == MAX_FILENAME, "FS_NAME_MAX must match MAX_FILENAME");
+_Static_assert(FS_SCRUB_MAX_REPORTED == SCRUB_MAX_REPORTED, "FS_SCRUB_MAX_REPORTED must match SCRUB_MAX_REPORTED");
+_Static_assert(FS_XATTR_NAME_MAX == XATTR_NAME_MAX, "FS_XATTR_NAME_MAX must match XATTR_NAME_MAX");
+_Static_assert(FS_XATTR_SIZE_MAX == XATTR_VALUE_MAX, "FS_XATTR_SIZE_MAX must match XATTR_VALUE_MAX");
+
+struct FsHandle {
+    FileSystem live;
+    FileSystem *fs;                // live, or the snapshot view being browsed
+    char view_name[MAX_FILENAME];  // Empty on the live file system
+    int cwd;                       // Current directory, an inode of fs
+    OpenFileTable files;           // Descriptors; the view cannot change while any are open
+};
+
+
+static void lock(FsHandle *h) {
+    pthread_rwlock_wrlock(h->live.lock);
+}
+
+// Shared with other readers, for calls that change nothing but counters and access times
+static void lock_shared(FsHandle *h) {
+    pthread_rwlock_rdlock(h->live.lock);
+}
+
+static void unlock(FsHandle *h) {
+    pthread_rwlock_unlock(h->live.lock);
+}
+
+static int path_error(int ret) {
+    return ret == PATH_NOT_DIR ? -FS_ERR_NOTDIR : ret == PATH_TOO_LONG ? -FS_ERR_NAMETOOLONG
+         : ret == PATH_LOOP ? -FS_ERR_LOOP : -FS_ERR_NOENT;
+}
+
+// Resolve path to an inode. When only the last component is missing, dir and leaf
+// still say where it would go; otherwise dir is -1. Caller holds the lock.
+static int lookup(FsHandle *h, const char *path, int *dir, char *leaf) {
+    *dir = -1;
+    leaf[0] = '\0';
+    if (!path || !*path)
+        return -FS_ERR_NOENT;
+    int ret = resolve_path(h->fs, h->cwd, path, dir, leaf);
+    if (ret != 0) {
+        *dir = -1;
+        return path_error(ret);
+    }
+    if (!leaf[0])
+        return *dir;
+    int inode_index = name_cache_lookup(h->fs, *dir, leaf);
+    return inode_index == -1 ? -FS_ERR_NOENT : inode_index;
+}
+
+// lookup, following a symlink in the last component too. A dangling link is
+// -FS_ERR_NOENT with dir -1, nothing gets created in its place.
+static int lookup_follow(FsHandle *h, const char *path, int *dir, char *leaf) {
+    int inode_index = lookup(h, path, dir, leaf);
+    if (inode_index < 0 || !h->fs->inodes[inode_index].is_symlink)
+        return inode_index;
+    inode_index = follow_symlink(h->fs, *dir, inode_index);
+    if (inode_index < 0) {
+        *dir = -1;
+        return path_error(inode_index);
+    }
+    return inode_index;
+}
+
+static int install_fd(FsHandle *h, uint32_t inode_index, bool is_directory, int flags) {
+    int fd = open_file_install(&h->files, inode_index, is_directory, flags);
+    return fd < 0 ? -FS_ERR_MFILE : fd;
+}
+
+static void fill_stat(FileSystem *fs, uint32_t inode_index, FsStat *st) {
+    Inode *inode = &fs->inodes[inode_index];
+    st->ino = inode_index;
+    st->is_directory = inode->is_directory;
+    st->is_symlink = inode->is_symlink;
+    st->nlink = inode->nlink;
+    st->size = inode->is_directory ? 0 : inode->size;
+    st->blocks = inode->is_directory ? 0 : inode_data_blocks(inode);
+    st->entries = inode->is_directory ? inode->dir_entry_count : 0;
+    st->permissions = inode->permissions;
+    st->created = inode->creation_time;
+    st->modified = inode->modification_time;
+    st->accessed = inode->access_time;
+}
+
+static void close_view(FsHandle *h) {
+    if (h->fs != &h->live) {
+        close_snapshot_view(h->fs);
+        h->fs = &h->live;
+        h->view_name[0] = '\0';
+        h->cwd = 0;
+    }
+}
+
+
+int fs_format(FsHandle **out, uint32_t num_blocks) {
+    if (num_blocks < INODE_BLOCK_RATIO)
+        return -FS_ERR_INVAL;
+    FsHandle *h = (FsHandle *)calloc(1, sizeof(FsHandle));
+    if (!h)
+        return -FS_ERR_NOMEM;
+    if (initialize_file_system(&h->live, num_blocks) != 0) {
+        free(h);
+        return -FS_ERR_NOMEM;
+    }
+    h->fs = &h->live;
+    h->cwd = create_directory(&h->live, "root");
+    *out = h;
+    return 0;
+}
+
+int fs_mount(FsHandle **out, const char *image) {
+    FsHandle *h = (FsHandle *)calloc(1, sizeof(FsHandle));
+    if (!h)
+        return -FS_ERR_NOMEM;
+    if (load_file_system(&h->live, image) != 0) {
+        free(h);
+        return -FS_ERR_IO;
+    }
+    h->fs = &h->live;
+    h->cwd = 0;
+    *out = h;
+    return 0;
+}
+
+int fs_sync(FsHandle *h, const char *image) {
+    // Writeback already has most of it on the image
+    if (writeback_targets(&h->live, image))
+        return writeback_flush(&h->live) == 0 ? 0 : -FS_ERR_IO;
+    // The view shares the lazily loaded blocks that saving pulls in and drops
+    if (h->fs != &h->live)
+        return -FS_ERR_BUSY;
+    fs_scrub_wait(h);
+    lock(h);
+    int ret = save_file_system(&h->live, image);
+    unlock(h);
+    return ret == 0 ? 0 : -FS_ERR_IO;
+}
+
+int fs_writeback_start(FsHandle *h, const char *image) {
+    lock(h);
+    int ret = writeback_start(&h->live, image);
+    unlock(h);
+    return ret == 0 ? 0 : h->live.writeback ? -FS_ERR_BUSY : -FS_ERR_NOMEM;
+}
+
+void fs_unmount(FsHandle *h) {
+    if (!h)
+        return;
+    close_view(h);
+    cleanup_file_system(&h->live);
+    open_file_table_free(&h->files);
+    free(h);
+}
+
+const char *fs_strerror(int err) {
+    static const char *const messages[] = {
+        [FS_OK] = "Success",
+        [FS_ERR_NOENT] = "No such file or directory",
+        [FS_ERR_EXIST] = "File exists",
+        [FS_ERR_NOTDIR] = "Not a directory",
+        [FS_ERR_ISDIR] = "Is a directory",
+        [FS_ERR_NOTEMPTY] = "Directory not empty",
+        [FS_ERR_NOSPC] = "No space left",
+        [FS_ERR_FBIG] = "File too large",
+        [FS_ERR_NAMETOOLONG] = "File name too long",
+        [FS_ERR_BADF] = "Bad file descriptor",
+        [FS_ERR_MFILE] = "Too many open files",
+        [FS_ERR_NOMEM] = "Out of memory",
+        [FS_ERR_IO] = "I/O error",
+        [FS_ERR_ROFS] = "Read-only snapshot",
+        [FS_ERR_INVAL] = "Invalid argument",
+        [FS_ERR_BUSY] = "Busy",
+        [FS_ERR_NOTSUP] = "Not supported on this image",
+        [FS_ERR_LOOP] = "Too many levels of symbolic links",
+        [FS_ERR_MLINK] = "Too many links",
+        [FS_ERR_NXIO] = "No data past the offset",
+        [FS_ERR_DQUOT] = "Disk quota exceeded",
+        [FS_ERR_NODATA] = "No such attribute",
+        [FS_ERR_RANGE] = "Result too large",
+    };
+    if (err < 0)
+        err = -err;
+    if (err >= (int)(sizeof(messages) / sizeof(messages[0])))
+        return "Unknown error";
+    return messages[err];
+}
+
+void fs_set_log_handler(FsLogCallback handler) {
+    set_log_handler(handler);
+}
+
+void fs_log_stdout(const char *fmt, va_list args) {
+    log_to_stdout(fmt, args);
+}
+
+
+int fs_open(FsHandle *h, const char *path, int flags) {
+    int mode = flags & FS_O_ACCMODE;
+    if (mode == FS_O_ACCMODE)
+        return -FS_ERR_INVAL;
+    bool writes = mode != FS_O_RDONLY || (flags & (FS_O_CREAT | FS_O_TRUNC));
+
+    lock(h);
+    FileSystem *fs = h->fs;
+    int ret;
+    if (writes && fs->read_only) {
+        ret = -FS_ERR_ROFS;
+        goto out;
+    }
+
+    int dir;
+    char leaf[MAX_FILENAME];
+    int inode_index = lookup_follow(h, path, &dir, leaf);
+    if (inode_index == -FS_ERR_NOENT && (flags & FS_O_CREAT) && dir >= 0) {
+        if (fs->inodes[dir].dir_entry_count >= MAX_DIR_ENTRIES) {
+            ret = -FS_ERR_NOSPC;
+            goto out;
+        }
+        inode_index = allocate_inode(fs);
+        if (inode_index == -1) {
+            ret = -FS_ERR_NOSPC;
+            goto out;
+        }
+        snprintf(fs->inodes[inode_index].filename, MAX_FILENAME, "%s", leaf);
+        add_to_directory(fs, dir, inode_index, leaf);
+    }
+    if (inode_index < 0) {
+        ret = inode_index;
+        goto out;
+    }
+    if (fs->inodes[inode_index].is_directory) {
+        ret = -FS_ERR_ISDIR;
+        goto out;
+    }
+    if ((flags & FS_O_TRUNC) && mode != FS_O_RDONLY && truncate_file(fs, &fs->inodes[inode_index], 0) != 0) {
+        ret = -FS_ERR_NOSPC;
+        goto out;
+    }
+    ret = install_fd(h, inode_index, false, flags);
+
+out:
+    unlock(h);
+    return ret;
+}
+
+int fs_close(FsHandle *h, int fd) {
+    lock(h);
+    OpenFile *file = open_file_get(&h->files, fd);
+    if (file) {
+        charge_reserved(h->fs, file->inode, -(int64_t)file->reserved);
+        open_file_close(&h->files, fd);
+    }
+    unlock(h);
+    return file ? 0 : -FS_ERR_BADF;
+}
+
+// Read through a descriptor, at offset or (offset -1) at the file position, which then
+// moves. Readers share the lock and take the descriptor's own. A read that would fault
+// blocks in from the image changes fs, it drops the shared lock and goes again exclusively.
+static ssize_t read_fd(FsHandle *h, int fd, void *buf, size_t size, off_t offset) {
+    if (size > UINT32_MAX)
+        size = UINT32_MAX;
+    for (bool exclusive = false; ; exclusive = true) {
+        if (exclusive)
+            lock(h);
+        else
+            lock_shared(h);
+        OpenFile *file = open_file_get(&h->files, fd);
+        if (!file || file->is_directory || (file->flags & FS_O_ACCMODE) == FS_O_WRONLY) {
+            unlock(h);
+            return -FS_ERR_BADF;
+        }
+        pthread_mutex_lock(&file->lock);
+        uint32_t pos = offset < 0 ? file->offset : offset > UINT32_MAX ? UINT32_MAX : (uint32_t)offset;
+        if (!exclusive && !open_file_resident(h->fs, file, pos, (uint32_t)size)) {
+            pthread_mutex_unlock(&file->lock);
+            unlock(h);
+            continue;
+        }
+        uint32_t got = open_file_read(h->fs, file, pos, (uint8_t *)buf, (uint32_t)size);
+        if (offset < 0)
+            file->offset += got;
+        pthread_mutex_unlock(&file->lock);
+        unlock(h);
+        return got;
+    }
+}
+
+ssize_t fs_read(FsHandle *h, int fd, void *buf, size_t size) {
+    return read_fd(h, fd, buf, size, -1);
+}
+
+// Read at offset without moving the file position
+ssize_t fs_pread(FsHandle *h, int fd, void *buf, size_t size, off_t offset) {
+    if (offset < 0)
+        return -FS_ERR_INVAL;
+    return read_fd(h, fd, buf, size, offset);
+}
+
+// Blocks in use and the file's block pointers before a write
+typedef struct {
+    uint32_t used_blocks;
+    uint32_t file_blocks;
+} WriteMark;
+
+// A write through a descriptor with a reservation allocates out of it: the reservation
+// is handed back first and what the write did not take is set aside again after.
+// Nothing can claim the blocks in between, the caller holds the lock throughout.
+static void reservation_suspend(FsHandle *h, OpenFile *file, WriteMark *mark) {
+    FileSystem *fs = h->fs;
+    mark->used_blocks = fs->used_blocks;
+    mark->file_blocks = inode_block_count(&fs->inodes[file->inode]);
+    charge_reserved(fs, file->inode, -(int64_t)file->reserved);
+}
+
+static void reservation_resume(FsHandle *h, OpenFile *file, const WriteMark *mark) {
+    FileSystem *fs = h->fs;
+    uint32_t count = inode_block_count(&fs->inodes[file->inode]);
+    // Taken from the free pool or from the quota, whichever the write used more of
+    uint32_t taken = fs->used_blocks > mark->used_blocks ? fs->used_blocks - mark->used_blocks : 0;
+    if (count > mark->file_blocks && count - mark->file_blocks > taken)
+        taken = count - mark->file_blocks;
+    file->reserved = file->reserved > taken ? file->reserved - taken : 0;
+    charge_reserved(fs, file->inode, file->reserved);
+}
+
+ssize_t fs_write(FsHandle *h, int fd, const void *buf, size_t size) {
+    lock(h);
+    OpenFile *file = open_file_get(&h->files, fd);
+    if (!file || file->is_directory || (file->flags & FS_O_ACCMODE) == FS_O_RDONLY) {
+        unlock(h);
+        return -FS_ERR_BADF;
+    }
+    Inode *inode = &h->fs->inodes[file->inode];
+    if (file->flags & FS_O_APPEND)
+        file->offset = inode->size;
+
+    // Write what fits, the next call reports the file as full
+    uint32_t max_size = DIRECT_POINTERS * BLOCK_SIZE;
+    if (size > 0 && file->offset >= max_size) {
+        unlock(h);
+        return -FS_ERR_FBIG;
+    }
+    if (size > max_size - file->offset)
+        size = max_size - file->offset;
+
+    WriteMark mark;
+    reservation_suspend(h, file, &mark);
+    int written = write_file_range(h->fs, inode, file->offset, (const uint8_t *)buf, (uint32_t)size);
+    reservation_resume(h, file, &mark);
+    if (written < 0) {
+        unlock(h);
+        return written == -3 ? -FS_ERR_DQUOT : -FS_ERR_NOSPC;
+    }
+    file->offset += written;
+    unlock(h);
+    return written;
+}
+
+off_t fs_lseek(FsHandle *h, int fd, off_t offset, int whence) {
+    lock(h);
+    OpenFile *file = open_file_get(&h->files, fd);
+    if (!file || file->is_directory) {
+        unlock(h);
+        return -FS_ERR_BADF;
+    }
+    Inode *inode = &h->fs->inodes[file->inode];
+    if (whence == FS_SEEK_DATA || whence == FS_SEEK_HOLE) {
+        // The end of the file is a hole, past it there is neither
+        off_t pos = offset < 0 || offset >= inode->size ? -1
+                  : (off_t)find_data_or_hole(inode, (uint32_t)offset, whence == FS_SEEK_HOLE);
+        if (pos < 0 || (whence == FS_SEEK_DATA && pos >= inode->size)) {
+            unlock(h);
+            return -FS_ERR_NXIO;
+        }
+        file->offset = (uint32_t)pos;
+        unlock(h);
+        return pos;
+    }
+    off_t base = whence == FS_SEEK_SET ? 0
+               : whence == FS_SEEK_CUR ? (off_t)file->offset
+               : whence == FS_SEEK_END ? (off_t)inode->size
+               : -1;
+    off_t pos = base + offset;
+    if (base < 0 || pos < 0 || pos > UINT32_MAX) {
+        unlock(h);
+        return -FS_ERR_INVAL;
+    }
+    file->offset = (uint32_t)pos;
+    unlock(h);
+    return pos;
+}
+
+int fs_ftruncate(FsHandle *h, int fd, off_t size) {
+    lock(h);
+    OpenFile *file = open_file_get(&h->files, fd);
+    int ret = 0;
+    if (!file || file->is_directory || (file->flags & FS_O_ACCMODE) == FS_O_RDONLY) {
+        ret = -FS_ERR_BADF;
+    } else if (size < 0) {
+        ret = -FS_ERR_INVAL;
+    } else if (size > DIRECT_POINTERS * BLOCK_SIZE) {
+        ret = -FS_ERR_FBIG;
+    } else {
+        WriteMark mark;
+        reservation_suspend(h, file, &mark);
+        int err = truncate_file(h->fs, &h->fs->inodes[file->inode], (uint32_t)size);
+        reservation_resume(h, file, &mark);
+        if (err != 0)
+            ret = err == -3 ? -FS_ERR_DQUOT : -FS_ERR_NOSPC;
+    }
+    unlock(h);
+    return ret;
+}
+
+int fs_reserve(FsHandle *h, int fd, off_t size) {
+    lock(h);
+    OpenFile *file = open_file_get(&h->files, fd);
+    int ret = 0;
+    if (!file || file->is_directory || (file->flags & FS_O_ACCMODE) == FS_O_RDONLY) {
+        ret = -FS_ERR_BADF;
+    } else if (size < 0) {
+        ret = -FS_ERR_INVAL;
+    } else if (size > DIRECT_POINTERS * BLOCK_SIZE) {
+        ret = -FS_ERR_FBIG;
+    } else {
+        FileSystem *fs = h->fs;
+        Inode *inode = &fs->inodes[file->inode];
+        uint32_t count = inode_block_count(inode);
+        uint32_t wanted = ((uint32_t)size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        // Holes and blocks shared with a snapshot take a new block when written
+        uint32_t owned = 0;
+        for (uint32_t b = 0; b < count && b < wanted; b++) {
+            if (inode->blocks[b] != BLOCK_HOLE && fs->block_refcount[inode->blocks[b]] == 1)
+                owned++;
+        }
+        uint32_t blocks = wanted - owned;
+        // The old reservation counts as free while the new one is checked
+        charge_reserved(fs, file->inode, -(int64_t)file->reserved);
+        int err = reserve_blocks(fs, file->inode, blocks);
+        if (err == 0) {
+            file->reserved = blocks;
+        } else {
+            charge_reserved(fs, file->inode, file->reserved);
+            ret = err == RESERVE_OVER_QUOTA ? -FS_ERR_DQUOT : -FS_ERR_NOSPC;
+        }
+    }
+    unlock(h);
+    return ret;
+}
+
+int fs_stat(FsHandle *h, const char *path, FsStat *st) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int inode_index = lookup_follow(h, path, &dir, leaf);
+    if (inode_index >= 0)
+        fill_stat(h->fs, inode_index, st);
+    unlock(h);
+    return inode_index < 0 ? inode_index : 0;
+}
+
+// fs_stat on the link itself
+int fs_lstat(FsHandle *h, const char *path, FsStat *st) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int inode_index = lookup(h, path, &dir, leaf);
+    if (inode_index >= 0)
+        fill_stat(h->fs, inode_index, st);
+    unlock(h);
+    return inode_index < 0 ? inode_index : 0;
+}
+
+int fs_fstat(FsHandle *h, int fd, FsStat *st) {
+    lock(h);
+    OpenFile *file = open_file_get(&h->files, fd);
+    if (file)
+        fill_stat(h->fs, file->inode, st);
+    unlock(h);
+    return file ? 0 : -FS_ERR_BADF;
+}
+
+// Permission bits (the low 12) of what path names, following a final symlink
+int fs_chmod(FsHandle *h, const char *path, uint16_t permissions) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    if (permissions > 07777)
+        return -FS_ERR_INVAL;
+    lock(h);
+    int ret = h->fs->read_only ? -FS_ERR_ROFS : lookup_follow(h, path, &dir, leaf);
+    if (ret >= 0) {
+        h->fs->inodes[ret].permissions = permissions;
+        mark_dirty(h->fs);
+        ret = 0;
+    }
+    unlock(h);
+    return ret;
+}
+
+static int xattr_error(int ret) {
+    return ret >= 0 ? ret : ret == XATTR_NOT_FOUND ? -FS_ERR_NODATA : ret == XATTR_EXISTS ? -FS_ERR_EXIST
+         : ret == XATTR_NO_SPACE ? -FS_ERR_NOSPC : ret == XATTR_RANGE ? -FS_ERR_RANGE : -FS_ERR_INVAL;
+}
+
+int fs_setxattr(FsHandle *h, const char *path, const char *name, const void *value, size_t size, int flags) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    if (flags & ~(FS_XATTR_CREATE | FS_XATTR_REPLACE))
+        return -FS_ERR_INVAL;
+    lock(h);
+    int ret = h->fs->read_only ? -FS_ERR_ROFS : lookup_follow(h, path, &dir, leaf);
+    if (ret >= 0) {
+        int only = (flags & FS_XATTR_CREATE ? XATTR_ONLY_CREATE : 0) | (flags & FS_XATTR_REPLACE ? XATTR_ONLY_REPLACE : 0);
+        ret = xattr_error(xattr_set(h->fs, ret, name, value, size, only));
+    }
+    unlock(h);
+    return ret;
+}
+
+ssize_t fs_getxattr(FsHandle *h, const char *path, const char *name, void *value, size_t size) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = lookup_follow(h, path, &dir, leaf);
+    if (ret >= 0)
+        ret = xattr_error(xattr_get(h->fs, ret, name, value, size));
+    unlock(h);
+    return ret;
+}
+
+ssize_t fs_listxattr(FsHandle *h, const char *path, char *list, size_t size) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = lookup_follow(h, path, &dir, leaf);
+    if (ret >= 0)
+        ret = xattr_error(xattr_list(h->fs, ret, list, size));
+    unlock(h);
+    return ret;
+}
+
+int fs_removexattr(FsHandle *h, const char *path, const char *name) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = h->fs->read_only ? -FS_ERR_ROFS : lookup_follow(h, path, &dir, leaf);
+    if (ret >= 0)
+        ret = xattr_error(xattr_remove(h->fs, ret, name));
+    unlock(h);
+    return ret;
+}
+
+int fs_unlink(FsHandle *h, const char *path) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = h->fs->read_only ? -FS_ERR_ROFS : lookup(h, path, &dir, leaf);
+    if (ret >= 0) {
+        int inode_index = ret;
+        Inode *inode = &h->fs->inodes[inode_index];
+        if (inode->is_directory) {
+            ret = -FS_ERR_ISDIR;
+        } else if (inode->nlink <= 1 && open_file_busy(&h->files, inode_index)) {
+            ret = -FS_ERR_BUSY;
+        } else {
+            // The entry goes now, the blocks are freed in the background with the last name
+            remove_from_directory(h->fs, dir, inode_index, leaf);
+            if (inode->nlink == 0)
+                reclaim_inode(h->fs, inode_index);
+            ret = 0;
+        }
+    }
+    unlock(h);
+    return ret;
+}
+
+// Another name for an existing file, sharing its inode and data
+int fs_link(FsHandle *h, const char *existing, const char *path) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    FileSystem *fs = h->fs;
+    int ret = fs->read_only ? -FS_ERR_ROFS : lookup(h, existing, &dir, leaf);
+    if (ret < 0)
+        goto out;
+
+    // Directories keep a single parent, find_parent and ".." rely on it
+    int inode_index = ret;
+    if (fs->inodes[inode_index].is_directory) {
+        ret = -FS_ERR_ISDIR;
+        goto out;
+    }
+    ret = lookup(h, path, &dir, leaf);
+    if (ret >= 0) {
+        ret = -FS_ERR_EXIST;
+    } else if (ret == -FS_ERR_NOENT && dir >= 0) {
+        if (fs->inodes[dir].dir_entry_count >= MAX_DIR_ENTRIES)
+            ret = -FS_ERR_NOSPC;
+        else if (fs->inodes[inode_index].nlink >= UINT16_MAX)
+            ret = -FS_ERR_MLINK;
+        else
+            ret = add_to_directory(fs, dir, inode_index, leaf) == 0 ? 0 : -FS_ERR_NOSPC;
+    }
+
+out:
+    unlock(h);
+    return ret;
+}
+
+// New symlink at path, target is stored as given and resolved on every use
+int fs_symlink(FsHandle *h, const char *target, const char *path) {
+    if (!target || !*target)
+        return -FS_ERR_INVAL;
+    if (strlen(target) >= SYMLINK_MAX)
+        return -FS_ERR_NAMETOOLONG;
+
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    FileSystem *fs = h->fs;
+    int ret = fs->read_only ? -FS_ERR_ROFS : lookup(h, path, &dir, leaf);
+    if (ret >= 0) {
+        ret = -FS_ERR_EXIST;
+    } else if (ret == -FS_ERR_NOENT && dir >= 0) {
+        if (fs->inodes[dir].dir_entry_count >= MAX_DIR_ENTRIES) {
+            ret = -FS_ERR_NOSPC;
+        } else {
+            int inode_index = create_symlink(fs, target);
+            if (inode_index == -1) {
+                ret = -FS_ERR_NOSPC;
+            } else {
+                snprintf(fs->inodes[inode_index].filename, MAX_FILENAME, "%s", leaf);
+                add_to_directory(fs, dir, inode_index, leaf);
+                ret = 0;
+            }
+        }
+    }
+    unlock(h);
+    return ret;
+}
+
+// Target of the symlink at path into buf, NUL-terminated. Returns its length (cut to size - 1).
+int fs_readlink(FsHandle *h, const char *path, char *buf, size_t size) {
+    if (size == 0)
+        return -FS_ERR_INVAL;
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = lookup(h, path, &dir, leaf);
+    if (ret >= 0) {
+        Inode *inode = &h->fs->inodes[ret];
+        if (!inode->is_symlink)
+            ret = -FS_ERR_INVAL;
+        else
+            ret = (int)read_symlink(h->fs, inode, buf, size > SYMLINK_MAX ? SYMLINK_MAX : (uint32_t)size);
+    }
+    unlock(h);
+    return ret;
+}
+
+
+int fs_mkdir(FsHandle *h, const char *path) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = h->fs->read_only ? -FS_ERR_ROFS : lookup(h, path, &dir, leaf);
+    if (ret >= 0) {
+        ret = -FS_ERR_EXIST;
+    } else if (ret == -FS_ERR_NOENT && dir >= 0) {
+        if (h->fs->inodes[dir].dir_entry_count >= MAX_DIR_ENTRIES) {
+            ret = -FS_ERR_NOSPC;
+        } else {
+            int inode_index = create_directory(h->fs, leaf);
+            if (inode_index == -1) {
+                ret = -FS_ERR_NOSPC;
+            } else {
+                add_to_directory(h->fs, dir, inode_index, leaf);
+                ret = 0;
+            }
+        }
+    }
+    unlock(h);
+    return ret;
+}
+
+int fs_rmdir(FsHandle *h, const char *path, int flags) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    FileSystem *fs = h->fs;
+    int ret = fs->read_only ? -FS_ERR_ROFS : lookup(h, path, &dir, leaf);
+    if (ret < 0)
+        goto out;
+
+    int inode_index = ret;
+    if (!leaf[0]) {
+        // "/", "." and ".." have no entry of their own to remove
+        ret = inode_index == 0 ? -FS_ERR_BUSY : -FS_ERR_INVAL;
+        goto out;
+    }
+    if (!fs->inodes[inode_index].is_directory) {
+        ret = -FS_ERR_NOTDIR;
+        goto out;
+    }
+    if (fs->inodes[inode_index].dir_entry_count > 0) {
+        if (!(flags & FS_RMDIR_RECURSIVE)) {
+            ret = -FS_ERR_NOTEMPTY;
+            goto out;
+        }
+        // Whatever is open might be somewhere in the subtree
+        if (h->files.open_count > 0) {
+            ret = -FS_ERR_BUSY;
+            goto out;
+        }
+    }
+    // Nor may the current directory be
+    for (int d = h->cwd; ; d = find_parent(fs, d)) {
+        if (d == inode_index) {
+            ret = -FS_ERR_BUSY;
+            goto out;
+        }
+        if (d <= 0)
+            break;
+    }
+
+    // The subtree is taken apart in the background
+    remove_from_directory(fs, dir, inode_index, leaf);
+    reclaim_inode(fs, inode_index);
+    ret = 0;
+
+out:
+    unlock(h);
+    return ret;
+}
+
+int fs_opendir(FsHandle *h, const char *path) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = lookup_follow(h, path, &dir, leaf);
+    if (ret >= 0) {
+        if (!h->fs->inodes[ret].is_directory)
+            ret = -FS_ERR_NOTDIR;
+        else
+            ret = install_fd(h, ret, true, FS_O_RDONLY);
+    }
+    unlock(h);
+    return ret;
+}
+
+// Next entry into entry: 1 if there was one, 0 at the end
+int fs_readdir(FsHandle *h, int fd, FsDirent *entry) {
+    lock(h);
+    OpenFile *file = open_file_get(&h->files, fd);
+    if (!file || !file->is_directory) {
+        unlock(h);
+        return -FS_ERR_BADF;
+    }
+    Inode *dir = &h->fs->inodes[file->inode];
+    if (file->offset >= dir->dir_entry_count) {
+        unlock(h);
+        return 0;
+    }
+    DirectoryEntry *de = &dir->entries[file->offset++];
+    memcpy(entry->name, de->name, MAX_FILENAME);
+    entry->name[MAX_FILENAME - 1] = '\0';
+    entry->ino = de->inode_index;
+    entry->is_directory = h->fs->inodes[de->inode_index].is_directory;
+    entry->is_symlink = h->fs->inodes[de->inode_index].is_symlink;
+    unlock(h);
+    return 1;
+}
+
+// Up to max next entries with their metadata in one call, returns how many (0 at the end).
+// The children's inodes are prefetched first, they are scattered over the table.
+int fs_readdir_stat(FsHandle *h, int fd, FsDirentStat *out, int max) {
+    lock(h);
+    FileSystem *fs = h->fs;
+    OpenFile *file = open_file_get(&h->files, fd);
+    if (!file || !file->is_directory) {
+        unlock(h);
+        return -FS_ERR_BADF;
+    }
+    Inode *dir = &fs->inodes[file->inode];
+    uint32_t end = dir->dir_entry_count;
+    uint32_t first = file->offset < end ? file->offset : end;
+    if (max >= 0 && end - first > (uint32_t)max)
+        end = first + max;
+    for (uint32_t i = first; i < end; i++) {
+        // The fields fill_stat reads sit in the first two cache lines of the record
+        const char *inode = (const char *)&fs->inodes[dir->entries[i].inode_index];
+        __builtin_prefetch(inode);
+        __builtin_prefetch(inode + 64);
+    }
+
+    int count = 0;
+    for (uint32_t i = first; i < end; i++, count++) {
+        DirectoryEntry *de = &dir->entries[i];
+        FsDirentStat *o = &out[count];
+        memcpy(o->dirent.name, de->name, MAX_FILENAME);
+        o->dirent.name[MAX_FILENAME - 1] = '\0';
+        o->dirent.ino = de->inode_index;
+        fill_stat(fs, de->inode_index, &o->st);
+        o->dirent.is_directory = o->st.is_directory;
+        o->dirent.is_symlink = o->st.is_symlink;
+    }
+    file->offset = end;
+    unlock(h);
+    return count;
+}
+
+int fs_chdir(FsHandle *h, const char *path) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = lookup_follow(h, path, &dir, leaf);
+    if (ret >= 0) {
+        if (!h->fs->inodes[ret].is_directory) {
+            ret = -FS_ERR_NOTDIR;
+        } else {
+            h->cwd = ret;
+            ret = 0;
+        }
+    }
+    unlock(h);
+    return ret;
+}
+
+int fs_getcwd(FsHandle *h, char *buf, size_t size) {
+    char path[FS_PATH_MAX];
+    lock(h);
+    get_inode_path(h->fs, h->cwd, path, sizeof(path));
+    unlock(h);
+    if (strlen(path) >= size)
+        return -FS_ERR_INVAL;
+    strcpy(buf, path);
+    return 0;
+}
+
+
+int fs_du(FsHandle *h, const char *path, FsUsage *out) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = lookup_follow(h, path, &dir, leaf);
+    if (ret >= 0) {
+        TreeUsage usage;
+        if (h->fs->inodes[ret].is_directory)
+            tree_usage(h->fs, ret, &usage);
+        else
+            inode_usage(h->fs, ret, &usage);
+        out->bytes = usage.bytes;
+        out->blocks = usage.blocks;
+        out->files = usage.files;
+        out->directories = usage.directories;
+        ret = 0;
+    }
+    unlock(h);
+    return ret;
+}
+
+int fs_set_quota(FsHandle *h, const char *path, uint32_t blocks) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = lookup_follow(h, path, &dir, leaf);
+    if (ret >= 0) {
+        Inode *inode = &h->fs->inodes[ret];
+        if (h->fs->read_only) {
+            ret = -FS_ERR_ROFS;
+        } else if (!inode->is_directory) {
+            ret = -FS_ERR_NOTDIR;
+        } else {
+            inode->quota_blocks = blocks;
+            mark_dirty(h->fs);
+            ret = 0;
+        }
+    }
+    unlock(h);
+    return ret;
+}
+
+int fs_get_quota(FsHandle *h, const char *path, FsQuota *out) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    int ret = lookup_follow(h, path, &dir, leaf);
+    if (ret >= 0) {
+        if (!h->fs->inodes[ret].is_directory) {
+            ret = -FS_ERR_NOTDIR;
+        } else {
+            TreeUsage usage;
+            tree_usage(h->fs, ret, &usage);
+            out->limit = h->fs->inodes[ret].quota_blocks;
+            out->blocks = usage.blocks;
+            out->reserved = usage.reserved;
+            ret = 0;
+        }
+    }
+    unlock(h);
+    return ret;
+}
+
+typedef struct {
+    uint32_t dir;
+    const DirectoryEntry *entry;
+} FindMatch;
+
+// One walker thread's matches, a cache line apart from the next thread's
+typedef struct {
+    FindMatch *items;
+    uint32_t count;
+    uint32_t capacity;
+    bool failed;              // Out of memory, some matches are missing
+    uint8_t pad[64 - sizeof(FindMatch *) - 2 * sizeof(uint32_t) - sizeof(bool)];
+} FindResults;
+
+typedef struct {
+    const FsFindFilter *filter;
+    FindResults results[MAX_WALK_THREADS];
+} FindContext;
+
+typedef struct {
+    char *path;
+    uint32_t ino;
+} FindHit;
+
+static bool find_filter_matches(FileSystem *fs, uint32_t inode_index, const char *name, const FsFindFilter *filter) {
+    Inode *inode = &fs->inodes[inode_index];
+    if (filter->type) {
+        char type = inode->is_directory ? 'd' : inode->is_symlink ? 'l' : 'f';
+        if (type != filter->type)
+            return false;
+    }
+    if (filter->size_op) {
+        uint64_t size = inode->is_directory ? 0 : inode->size;
+        if ((filter->size_op == '+' && size <= filter->size) || (filter->size_op == '-' && size >= filter->size) ||
+            (filter->size_op == '=' && size != filter->size))
+            return false;
+    }
+    if (filter->newer && inode->modification_time <= filter->newer)
+        return false;
+    return !filter->name || fnmatch(filter->name, name, 0) == 0;
+}
+
+static void find_visit(FileSystem *fs, uint32_t dir_inode_index, const DirectoryEntry *entry, int worker, void *arg) {
+    FindContext *ctx = (FindContext *)arg;
+    if (!find_filter_matches(fs, entry->inode_index, entry->name, ctx->filter))
+        return;
+
+    FindResults *res = &ctx->results[worker];
+    if (res->count == res->capacity) {
+        uint32_t capacity = res->capacity ? res->capacity * 2 : 64;
+        FindMatch *items = (FindMatch *)realloc(res->items, capacity * sizeof(FindMatch));
+        if (!items) {
+            res->failed = true;
+            return;
+        }
+        res->items = items;
+        res->capacity = capacity;
+    }
+    res->items[res->count].dir = dir_inode_index;
+    res->items[res->count].entry = entry;
+    res->count++;
+}
+
+// prefix + the names from root down to dir + name, built right to left in buf.
+// Components that do not fit are dropped from the front, as get_inode_path does.
+static char *find_path(FileSystem *fs, uint32_t root, const char *prefix, uint32_t dir, const char *name, Arena *arena) {
+    char buf[FS_PATH_MAX];
+    int start = FS_PATH_MAX - 1;
+    buf[start] = '\0';
+    const char *component = name;
+    while (true) {
+        int len = (int)strlen(component);
+        if (len + 1 > start)
+            break;
+        start -= len;
+        memcpy(buf + start, component, len);
+        buf[--start] = '/';
+        if (dir == root)
+            break;
+
+        // The directory's entry in its parent carries its name
+        uint32_t parent = fs->parents[dir] ? fs->parents[dir] - 1 : root;
+        component = "";
+        for (uint32_t i = 0; i < fs->inodes[parent].dir_entry_count; i++) {
+            if (fs->inodes[parent].entries[i].inode_index == dir) {
+                component = fs->inodes[parent].entries[i].name;
+                break;
+            }
+        }
+        dir = parent;
+    }
+
+    // "/" as the prefix already ends in the separator
+    size_t prefix_len = strlen(prefix);
+    if (prefix_len > 0 && prefix[prefix_len - 1] == '/')
+        start++;
+    size_t len = prefix_len + (FS_PATH_MAX - 1 - start);
+    char *path = (char *)arena_alloc(arena, len + 1);
+    if (path) {
+        memcpy(path, prefix, prefix_len);
+        memcpy(path + prefix_len, buf + start, len - prefix_len + 1);
+    }
+    return path;
+}
+
+static int cmp_find_hit(const void *a, const void *b) {
+    return strcmp(((const FindHit *)a)->path, ((const FindHit *)b)->path);
+}
+
+// Everything below path (and path itself) that matches filter, handed to callback in
+// path order. Returns the number of matches.
+int fs_find(FsHandle *h, const char *path, const FsFindFilter *filter, FsFindCallback callback, void *arg) {
+    static const FsFindFilter any;
+    if (!filter)
+        filter = &any;
+
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    FileSystem *fs = h->fs;
+    int root = lookup_follow(h, path, &dir, leaf);
+    if (root < 0) {
+        unlock(h);
+        return root;
+    }
+
+    FindContext *ctx = (FindContext *)calloc(1, sizeof(FindContext));
+    if (!ctx) {
+        unlock(h);
+        return -FS_ERR_NOMEM;
+    }
+    ctx->filter = filter;
+    walk_tree(fs, root, find_visit, ctx);
+
+    // Paths as given: "a" finds "a/b/c", "/" finds "/b/c"
+    Arena *scratch = scratch_arena();
+    ArenaMark mark = arena_mark(scratch);
+    size_t prefix_len = strlen(path);
+    while (prefix_len > 1 && path[prefix_len - 1] == '/')
+        prefix_len--;
+    char *prefix = (char *)arena_alloc(scratch, prefix_len + 1);
+    uint32_t total = 1;
+    bool failed = false;
+    for (int t = 0; t < MAX_WALK_THREADS; t++) {
+        total += ctx->results[t].count;
+        failed |= ctx->results[t].failed;
+    }
+    FindHit *hits = (FindHit *)arena_alloc(scratch, total * sizeof(FindHit));
+    int ret = 0;
+    if (!prefix || !hits || failed) {
+        ret = -FS_ERR_NOMEM;
+        goto out;
+    }
+    memcpy(prefix, path, prefix_len);
+    prefix[prefix_len] = '\0';
+
+    // The starting point is judged by the last component it was named with
+    uint32_t count = 0;
+    const char *base = strrchr(prefix, '/');
+    base = base && base[1] ? base + 1 : prefix;
+    if (find_filter_matches(fs, root, base, filter)) {
+        hits[count].path = prefix;
+        hits[count++].ino = root;
+    }
+    for (int t = 0; t < MAX_WALK_THREADS; t++) {
+        for (uint32_t i = 0; i < ctx->results[t].count; i++) {
+            FindMatch *m = &ctx->results[t].items[i];
+            hits[count].path = find_path(fs, root, prefix, m->dir, m->entry->name, scratch);
+            hits[count].ino = m->entry->inode_index;
+            if (!hits[count].path) {
+                ret = -FS_ERR_NOMEM;
+                goto out;
+            }
+            count++;
+        }
+    }
+    qsort(hits, count, sizeof(FindHit), cmp_find_hit);
+
+    for (uint32_t i = 0; i < count; i++) {
+        FsStat st;
+        fill_stat(fs, hits[i].ino, &st);
+        if (callback && callback(hits[i].path, &st, arg) != 0)
+            break;
+    }
+    ret = (int)count;
+
+out:
+    arena_rewind(scratch, mark);
+    for (int t = 0; t < MAX_WALK_THREADS; t++) {
+        free(ctx->results[t].items);
+    }
+    free(ctx);
+    unlock(h);
+    return ret;
+}
+
+
+int fs_statfs(FsHandle *h, FsStatfs *st) {
+    lock(h);
+    FileSystem *fs = h->fs;
+    st->block_size = BLOCK_SIZE;
+    st->total_blocks = fs->total_blocks;
+    st->used_blocks = fs->used_blocks;
+    st->file_blocks = fs->file_blocks;
+    st->reserved_blocks = fs->reserved_blocks;
+    st->available_blocks = available_blocks(fs);
+    st->total_inodes = fs->total_inodes;
+    st->used_inodes = fs->used_inodes;
+    st->pending_frees = reclaim_pending(&h->live);
+    st->checksum_errors = h->live.checksum_errors;
+    st->dirty_blocks = h->live.dirty_blocks;
+    st->writeback_flushes = h->live.writeback ? __atomic_load_n(&h->live.writeback->flushes, __ATOMIC_RELAXED) : 0;
+    st->writeback_blocks = h->live.writeback ? __atomic_load_n(&h->live.writeback->blocks_written, __ATOMIC_RELAXED) : 0;
+    st->block_allocs = fs->stats.block_allocs;
+    st->block_frees = fs->stats.block_frees;
+    st->inode_allocs = fs->stats.inode_allocs;
+    st->inode_frees = fs->stats.inode_frees;
+    st->bytes_read = fs->stats.bytes_read;
+    st->bytes_written = fs->stats.bytes_written;
+    st->dir_lookups = fs->stats.dir_lookups;
+    st->name_cache_hits = fs->stats.name_cache_hits;
+    st->cache_hits = fs->stats.cache_hits;
+    st->cache_misses = fs->stats.cache_misses;
+    st->map_hits = fs->stats.map_hits;
+    unlock(h);
+    return 0;
+}
+
+int fs_resize(FsHandle *h, uint32_t num_blocks) {
+    if (num_blocks < INODE_BLOCK_RATIO)
+        return -FS_ERR_INVAL;
+    // A scrub reads blocks by index, wait for it before anything moves
+    fs_scrub_wait(h);
+    lock(h);
+    int ret = 0;
+    // The view shares the block array, which may move
+    if (h->fs != &h->live || (h->live.scrub && __atomic_load_n(&h->live.scrub->running, __ATOMIC_ACQUIRE)))
+        ret = -FS_ERR_BUSY;
+    else
+        ret = resize_file_system(&h->live, num_blocks);
+    unlock(h);
+    return ret == RESIZE_NO_SPACE ? -FS_ERR_NOSPC : ret == RESIZE_NO_MEMORY ? -FS_ERR_NOMEM : ret;
+}
+
+int fs_snapshot_create(FsHandle *h, const char *name) {
+    if (!name || !*name)
+        return -FS_ERR_INVAL;
+    if (strlen(name) >= MAX_FILENAME)
+        return -FS_ERR_NAMETOOLONG;
+
+    lock(h);
+    int ret = 0;
+    if (find_snapshot(&h->live, name))
+        ret = -FS_ERR_EXIST;
+    else if (h->live.snapshot_count >= MAX_SNAPSHOTS)
+        ret = -FS_ERR_NOSPC;
+    else if (create_snapshot(&h->live, name) != 0)
+        ret = -FS_ERR_NOMEM;
+    unlock(h);
+    return ret;
+}
+
+int fs_snapshot_delete(FsHandle *h, const char *name) {
+    lock(h);
+    int ret = 0;
+    if (h->fs != &h->live && strcmp(h->view_name, name) == 0)
+        ret = -FS_ERR_BUSY;
+    else if (!find_snapshot(&h->live, name))
+        ret = -FS_ERR_NOENT;
+    else
+        delete_snapshot(&h->live, name);
+    unlock(h);
+    return ret;
+}
+
+// Copy up to max snapshots into out, returns how many there are in total
+int fs_snapshot_list(FsHandle *h, FsSnapshotInfo *out, int max) {
+    lock(h);
+    int count = (int)h->live.snapshot_count;
+    for (int i = 0; i < count && i < max; i++) {
+        Snapshot *snap = &h->live.snapshots[i];
+        memcpy(out[i].name, snap->name, MAX_FILENAME);
+        out[i].name[MAX_FILENAME - 1] = '\0';
+        out[i].created = snap->creation_time;
+        out[i].inode_count = snap->inode_count;
+    }
+    unlock(h);
+    return count;
+}
+
+// Browse a snapshot read-only, or go back to the live file system with a NULL or empty name
+int fs_snapshot_view(FsHandle *h, const char *name) {
+    lock(h);
+    int ret = 0;
+    if (h->files.open_count > 0) {
+        ret = -FS_ERR_BUSY;
+        goto out;
+    }
+    close_view(h);
+    if (!name || !*name)
+        goto out;
+
+    if (!find_snapshot(&h->live, name)) {
+        ret = -FS_ERR_NOENT;
+        goto out;
+    }
+    FileSystem *view = open_snapshot_view(&h->live, name);
+    if (!view) {
+        ret = -FS_ERR_NOMEM;
+        goto out;
+    }
+    h->fs = view;
+    strncpy(h->view_name, name, MAX_FILENAME - 1);
+    h->cwd = 0;
+
+out:
+    unlock(h);
+    return ret;
+}
+
+const char *fs_snapshot_viewed(FsHandle *h) {
+    return h->fs != &h->live ? h->view_name : NULL;
+}
+
+// Writable copy of a snapshot's tree at path
+int fs_snapshot_clone(FsHandle *h, const char *name, const char *path) {
+    int dir;
+    char leaf[MAX_FILENAME];
+    lock(h);
+    FileSystem *fs = h->fs;
+    Snapshot *snap = find_snapshot(&h->live, name);
+    int ret = fs->read_only ? -FS_ERR_ROFS : lookup(h, path, &dir, leaf);
+    if (ret >= 0) {
+        ret = -FS_ERR_EXIST;
+    } else if (ret == -FS_ERR_NOENT && dir >= 0) {
+        if (!snap)
+            ret = -FS_ERR_NOENT;
+        else if (fs->inodes[dir].dir_entry_count >= MAX_DIR_ENTRIES ||
+                 fs->total_inodes - fs->used_inodes < snap->inode_count)
+            ret = -FS_ERR_NOSPC;
+        else
+            ret = clone_snapshot(fs, name, dir, leaf) == -1 ? -FS_ERR_NOSPC : 0;
+    }
+    unlock(h);
+    return ret;
+}
+
+int fs_scrub_start(FsHandle *h) {
+    lock(h);
+    int ret = 0;
+    if (h->live.scrub && __atomic_load_n(&h->live.scrub->running, __ATOMIC_ACQUIRE))
+        ret = -FS_ERR_BUSY;
+    else if (!h->live.checksums_valid)
+        ret = -FS_ERR_NOTSUP;
+    else if (scrub_start(&h->live) != 0)
+        ret = -FS_ERR_NOMEM;
+    unlock(h);
+    return ret;
+}
+
+// Wait for a running scrub; must not be called with the lock held, the verifiers need it
+int fs_scrub_wait(FsHandle *h) {
+    scrub_wait(&h->live);
+    return 0;
+}
+
+int fs_scrub_status(FsHandle *h, FsScrubStatus *st) {
+    ScrubState *scrub = h->live.scrub;
+    memset(st, 0, sizeof(*st));
+    if (!scrub)
+        return 0;
+    st->ran = true;
+    st->running = __atomic_load_n(&scrub->running, __ATOMIC_ACQUIRE);
+    st->checked = __atomic_load_n(&scrub->checked, __ATOMIC_RELAXED);
+    st->errors = __atomic_load_n(&scrub->errors, __ATOMIC_RELAXED);
+    st->unreadable = __atomic_load_n(&scrub->unreadable, __ATOMIC_RELAXED);
+    st->threads = scrub->thread_count;
+    // The verifiers are still filling these in while it runs
+    if (!st->running) {
+        st->seconds = scrub->seconds;
+        memcpy(st->bad_blocks, scrub->bad_blocks, sizeof(st->bad_blocks));
+    }
+    return 0;
+}
+
+int fs_defrag_start(FsHandle *h) {
+    lock(h);
+    int ret = 0;
+    if (h->live.defrag && __atomic_load_n(&h->live.defrag->running, __ATOMIC_ACQUIRE))
+        ret = -FS_ERR_BUSY;
+    else if (defrag_start(&h->live) != 0)
+        ret = -FS_ERR_NOMEM;
+    unlock(h);
+    return ret;
+}
+
+// Wait for a running defrag; must not be called with the lock held, it moves files under it
+int fs_defrag_wait(FsHandle *h) {
+    defrag_wait(&h->live);
+    return 0;
+}
+
+int fs_defrag_status(FsHandle *h, FsDefragStatus *st) {
+    memset(st, 0, sizeof(*st));
+    lock(h);
+    FileSystem *fs = &h->live;
+    DefragState *defrag = fs->defrag;
+    if (defrag) {
+        st->ran = true;
+        st->running = __atomic_load_n(&defrag->running, __ATOMIC_ACQUIRE);
+        st->files_moved = __atomic_load_n(&defrag->files_moved, __ATOMIC_RELAXED);
+        st->blocks_moved = __atomic_load_n(&defrag->blocks_moved, __ATOMIC_RELAXED);
+        st->slices = __atomic_load_n(&defrag->slices, __ATOMIC_RELAXED);
+        st->seconds = defrag->seconds;
+    }
+
+    FragReport report;
+    fragmentation_report(fs, &report);
+    st->files = report.files;
+    st->fragmented_files = report.fragmented;
+    st->extents = report.extents;
+    st->end_block = report.end;
+    st->holes = report.holes;
+    st->worst_count = report.worst_count;
+    for (uint32_t i = 0; i < report.worst_count; i++) {
+        get_inode_path(fs, report.worst[i], st->worst[i].path, sizeof(st->worst[i].path));
+        st->worst[i].extents = report.worst_extents[i];
+        st->worst[i].blocks = inode_block_count(&fs->inodes[report.worst[i]]);
+    }
+    unlock(h);
+    return 0;
+}
+
+// Check the live file system, returns the number of problems found
+int fs_fsck(FsHandle *h, bool repair) {
+    if (repair && h->fs != &h->live)
+        return -FS_ERR_BUSY;
+
+    // A scrub reading blocks would race with the repairs
+    fs_scrub_wait(h);
+    lock(h);
+    int problems = fsck_file_system(&h->live, repair);
+    unlock(h);
+    return problems < 0 ? -FS_ERR_IO : problems;
+}
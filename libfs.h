@@ -0,0 +1,294 @@
+#ifndef LIBFS_H
+#define LIBFS_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Handle-based API to the file system, built as libfs.a and libfs.so.
+//
+// Every call returns 0 (or a count / descriptor) on success and a negative
+// FS_ERR_* code on failure; fs_strerror turns one into text. Nothing is printed
+// unless a log handler is installed with fs_set_log_handler.
+// Calls on one handle may come from several threads, each call locks the handle.
+
+#define FS_API __attribute__((visibility("default")))
+
+#define FS_NAME_MAX 255   // Longest name, terminating NUL included
+#define FS_PATH_MAX 512
+
+// Error codes, returned negated
+enum {
+    FS_OK = 0,
+    FS_ERR_NOENT,        // No such file or directory
+    FS_ERR_EXIST,        // Name already taken
+    FS_ERR_NOTDIR,       // A directory was expected
+    FS_ERR_ISDIR,        // A file was expected
+    FS_ERR_NOTEMPTY,     // Directory still has entries
+    FS_ERR_NOSPC,        // Out of blocks, inodes or directory entries
+    FS_ERR_FBIG,         // File would outgrow its direct blocks
+    FS_ERR_NAMETOOLONG,  // A path component is FS_NAME_MAX or longer
+    FS_ERR_BADF,         // Descriptor is not open, or not open for this
+    FS_ERR_MFILE,        // Descriptor table could not grow
+    FS_ERR_NOMEM,        // Out of memory
+    FS_ERR_IO,           // Image could not be read or written
+    FS_ERR_ROFS,         // Browsing a snapshot, which is read-only
+    FS_ERR_INVAL,        // Bad argument
+    FS_ERR_BUSY,         // In use (open descriptors, running scrub, viewed snapshot)
+    FS_ERR_NOTSUP,       // Not possible on this image
+    FS_ERR_LOOP,         // Too many symlinks in a row
+    FS_ERR_MLINK,        // File has as many links as it can
+    FS_ERR_NXIO,         // No data at or past the offset (FS_SEEK_DATA)
+    FS_ERR_DQUOT,        // A directory above would go past its quota
+    FS_ERR_NODATA,       // No such extended attribute
+    FS_ERR_RANGE         // Buffer too small for the result
+};
+
+// fs_open flags
+#define FS_O_RDONLY 0
+#define FS_O_WRONLY 1
+#define FS_O_RDWR 2
+#define FS_O_ACCMODE 3
+#define FS_O_CREAT 0x10
+#define FS_O_TRUNC 0x20
+#define FS_O_APPEND 0x40
+
+// fs_rmdir flags
+#define FS_RMDIR_RECURSIVE 1
+
+// fs_lseek whence
+#define FS_SEEK_SET 0
+#define FS_SEEK_CUR 1
+#define FS_SEEK_END 2
+#define FS_SEEK_DATA 3  // Next offset holding data, holes are never written and read as zeros
+#define FS_SEEK_HOLE 4  // Next hole, the end of the file counts as one
+
+// fs_setxattr flags
+#define FS_XATTR_CREATE 1   // Fail with FS_ERR_EXIST if the attribute is already there
+#define FS_XATTR_REPLACE 2  // Fail with FS_ERR_NODATA if it is not
+#define FS_XATTR_NAME_MAX 255
+#define FS_XATTR_SIZE_MAX 3072
+
+typedef struct FsHandle FsHandle;
+
+typedef struct {
+    uint32_t ino;
+    bool is_directory;
+    bool is_symlink;     // Only from fs_lstat, fs_stat reports what the link points to
+    uint32_t nlink;      // Directory entries naming it
+    uint32_t size;       // Bytes (the target's length for symlinks), 0 for directories
+    uint32_t blocks;     // Data blocks in use
+    uint32_t entries;    // Directory entries, 0 for files
+    uint16_t permissions;
+    int64_t created;     // Seconds since the epoch
+    int64_t modified;
+    int64_t accessed;    // Relatime: moves on a read only if older than the last write or a day old
+} FsStat;
+
+typedef struct {
+    char name[FS_NAME_MAX];
+    uint32_t ino;
+    bool is_directory;
+    bool is_symlink;
+} FsDirent;
+
+// fs_readdir_stat output: an entry and what fs_lstat says about it
+typedef struct {
+    FsDirent dirent;
+    FsStat st;
+} FsDirentStat;
+
+typedef struct {
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t used_blocks;
+    uint32_t file_blocks;     // Blocks referenced by live files
+    uint32_t reserved_blocks; // Set aside by fs_reserve and not written yet
+    uint32_t available_blocks; // Neither used nor reserved
+    uint32_t total_inodes;
+    uint32_t used_inodes;
+    uint32_t pending_frees;   // Unlinked inodes the background reclaimer has not freed yet
+    uint32_t checksum_errors;
+    uint32_t dirty_blocks;    // Written since the last writeback flush
+    uint64_t writeback_flushes;
+    uint64_t writeback_blocks; // Blocks written back in place
+    uint64_t block_allocs;
+    uint64_t block_frees;
+    uint64_t inode_allocs;
+    uint64_t inode_frees;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t dir_lookups;
+    uint64_t name_cache_hits;   // Path components resolved from the name cache instead of a directory scan
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t map_hits;        // Reads served from an open descriptor's cached block map
+} FsStatfs;
+
+// What fs_du adds up below a path
+typedef struct {
+    uint64_t bytes;           // File sizes
+    uint64_t blocks;          // Data blocks of those files
+    uint64_t files;           // Files and symlinks, a hard-linked file once
+    uint64_t directories;
+} FsUsage;
+
+// A directory's quota and what counts against it
+typedef struct {
+    uint32_t limit;           // Blocks, 0 for no limit
+    uint64_t blocks;          // Data blocks below the directory, as fs_du counts them
+    uint64_t reserved;        // Blocks reserved for files below it
+} FsQuota;
+
+// fs_find conditions, all of them have to hold
+typedef struct {
+    const char *name;         // Shell pattern for the last component (fnmatch), NULL for any
+    char type;                // 'f' file, 'd' directory, 'l' symlink, 0 for any
+    char size_op;             // '+' larger than size, '-' smaller, '=' exactly, 0 for any
+    uint64_t size;            // Bytes, directories count as 0
+    int64_t newer;            // Modified after this (seconds since the epoch), 0 for any
+} FsFindFilter;
+
+// Called for each fs_find match in path order, with the handle locked (no fs_* calls
+// from inside). Returning nonzero stops the search.
+typedef int (*FsFindCallback)(const char *path, const FsStat *st, void *arg);
+
+typedef struct {
+    char name[FS_NAME_MAX];
+    int64_t created;          // Seconds since the epoch
+    uint32_t inode_count;
+} FsSnapshotInfo;
+
+#define FS_SCRUB_MAX_REPORTED 16
+
+typedef struct {
+    bool ran;                 // A scrub was started on this handle
+    bool running;
+    uint32_t checked;
+    uint32_t errors;
+    uint32_t unreadable;
+    double seconds;           // Duration of the last finished run
+    int threads;
+    uint32_t bad_blocks[FS_SCRUB_MAX_REPORTED];
+} FsScrubStatus;
+
+#define FS_DEFRAG_MAX_REPORTED 8
+
+typedef struct {
+    char path[FS_PATH_MAX];
+    uint32_t extents;         // Runs of consecutive blocks
+    uint32_t blocks;
+} FsDefragFile;
+
+typedef struct {
+    bool ran;                 // A defrag was started on this handle
+    bool running;
+    uint32_t files_moved;     // By the current or last run
+    uint32_t blocks_moved;
+    uint32_t slices;
+    double seconds;           // Duration of the last finished run
+    uint32_t files;           // Layout now: files with data blocks
+    uint32_t fragmented_files;
+    uint32_t extents;
+    uint32_t end_block;       // Last used block + 1, where a saved image ends
+    uint32_t holes;           // Free blocks below end_block
+    FsDefragFile worst[FS_DEFRAG_MAX_REPORTED]; // Most fragmented files first
+    uint32_t worst_count;
+} FsDefragStatus;
+
+typedef void (*FsLogCallback)(const char *fmt, va_list args);
+
+
+// Handles
+FS_API int fs_format(FsHandle **out, uint32_t num_blocks);
+FS_API int fs_mount(FsHandle **out, const char *image);
+FS_API int fs_sync(FsHandle *h, const char *image);
+// Keep image up to date from a background thread: changes go out once they are a few
+// seconds old or enough data is dirty (see writeback.h for the knobs). fs_sync on the
+// same image then only writes what is left, and so does fs_unmount.
+FS_API int fs_writeback_start(FsHandle *h, const char *image);
+FS_API void fs_unmount(FsHandle *h);
+FS_API const char *fs_strerror(int err);
+FS_API void fs_set_log_handler(FsLogCallback handler);
+FS_API void fs_log_stdout(const char *fmt, va_list args);
+
+// Files
+FS_API int fs_open(FsHandle *h, const char *path, int flags);
+FS_API int fs_close(FsHandle *h, int fd);
+FS_API ssize_t fs_read(FsHandle *h, int fd, void *buf, size_t size);
+FS_API ssize_t fs_pread(FsHandle *h, int fd, void *buf, size_t size, off_t offset);
+FS_API ssize_t fs_write(FsHandle *h, int fd, const void *buf, size_t size);
+FS_API off_t fs_lseek(FsHandle *h, int fd, off_t offset, int whence);
+FS_API int fs_ftruncate(FsHandle *h, int fd, off_t size);
+// Set aside the blocks fd's file needs to hold size bytes, so writes up to there cannot
+// run out of space or over a quota; fails right away with FS_ERR_NOSPC or FS_ERR_DQUOT
+// otherwise. Only blocks the file keeps to itself count as present, holes and blocks
+// shared with a snapshot are reserved too since writing them takes new ones. Replaces
+// the descriptor's earlier reservation (size 0 drops it), writes use it up and fs_close
+// releases the rest.
+FS_API int fs_reserve(FsHandle *h, int fd, off_t size);
+FS_API int fs_stat(FsHandle *h, const char *path, FsStat *st);
+FS_API int fs_fstat(FsHandle *h, int fd, FsStat *st);
+FS_API int fs_lstat(FsHandle *h, const char *path, FsStat *st);
+FS_API int fs_chmod(FsHandle *h, const char *path, uint16_t permissions);
+FS_API int fs_unlink(FsHandle *h, const char *path);
+
+// Links. Paths are followed through symlinks except in their last component,
+// which fs_open, fs_stat, fs_opendir and fs_chdir follow as well.
+FS_API int fs_link(FsHandle *h, const char *existing, const char *path);
+FS_API int fs_symlink(FsHandle *h, const char *target, const char *path);
+FS_API int fs_readlink(FsHandle *h, const char *path, char *buf, size_t size);
+
+// Extended attributes, on files, directories and symlinks alike (paths are followed).
+// Names are up to FS_XATTR_NAME_MAX bytes, values up to FS_XATTR_SIZE_MAX. With size 0
+// fs_getxattr and fs_listxattr only return the length they need; fs_listxattr gives
+// the names one after another, each ending in '\0'.
+FS_API int fs_setxattr(FsHandle *h, const char *path, const char *name, const void *value, size_t size, int flags);
+FS_API ssize_t fs_getxattr(FsHandle *h, const char *path, const char *name, void *value, size_t size);
+FS_API ssize_t fs_listxattr(FsHandle *h, const char *path, char *list, size_t size);
+FS_API int fs_removexattr(FsHandle *h, const char *path, const char *name);
+
+// Directories
+FS_API int fs_mkdir(FsHandle *h, const char *path);
+FS_API int fs_rmdir(FsHandle *h, const char *path, int flags);
+FS_API int fs_opendir(FsHandle *h, const char *path);
+FS_API int fs_readdir(FsHandle *h, int fd, FsDirent *entry);
+FS_API int fs_readdir_stat(FsHandle *h, int fd, FsDirentStat *out, int max);
+FS_API int fs_chdir(FsHandle *h, const char *path);
+FS_API int fs_getcwd(FsHandle *h, char *buf, size_t size);
+
+// Subtrees. Both walk the tree below path on several threads; fs_du answers from
+// totals kept up to date on every write when it can. Symlinks are not followed below path.
+FS_API int fs_du(FsHandle *h, const char *path, FsUsage *out);
+FS_API int fs_find(FsHandle *h, const char *path, const FsFindFilter *filter, FsFindCallback callback, void *arg);
+
+// Quotas cap the blocks below a directory (reservations included); writes that would
+// grow a file past one fail with FS_ERR_DQUOT. A limit under what is already there only
+// stops further growth. Checks answer from the totals fs_du keeps up to date.
+FS_API int fs_set_quota(FsHandle *h, const char *path, uint32_t blocks);
+FS_API int fs_get_quota(FsHandle *h, const char *path, FsQuota *out);
+
+// Whole file system
+FS_API int fs_statfs(FsHandle *h, FsStatfs *st);
+// Grow or shrink the partition while mounted; open descriptors stay valid. Shrinking
+// moves the blocks past the new end down first and fails with FS_ERR_NOSPC if the
+// used blocks do not fit. Not while a snapshot is viewed.
+FS_API int fs_resize(FsHandle *h, uint32_t num_blocks);
+FS_API int fs_snapshot_create(FsHandle *h, const char *name);
+FS_API int fs_snapshot_delete(FsHandle *h, const char *name);
+FS_API int fs_snapshot_list(FsHandle *h, FsSnapshotInfo *out, int max);
+FS_API int fs_snapshot_view(FsHandle *h, const char *name);
+FS_API const char *fs_snapshot_viewed(FsHandle *h);
+FS_API int fs_snapshot_clone(FsHandle *h, const char *name, const char *path);
+FS_API int fs_scrub_start(FsHandle *h);
+FS_API int fs_scrub_wait(FsHandle *h);
+FS_API int fs_scrub_status(FsHandle *h, FsScrubStatus *st);
+// Move files into contiguous runs at the start of the partition in the background,
+// a slice at a time between other calls. Saved images end at the last used block.
+FS_API int fs_defrag_start(FsHandle *h);
+FS_API int fs_defrag_wait(FsHandle *h);
+FS_API int fs_defrag_status(FsHandle *h, FsDefragStatus *st);
+FS_API int fs_fsck(FsHandle *h, bool repair);
+
+#endif
@@ -1,265 +1,956 @@
-#include "FileSystem.h"
+#include "libfs.h"
+#include "histogram.h"
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/stat.h>   // mkdir 所需
 #include <sys/types.h>  // mkdir 所需
+#include <unistd.h>     // ftruncate
 
 #define MAX_INPUT_LENGTH 512
-#define MAX_PATH_LENGTH 512
-#define CAT_BUFFER_SIZE (BLOCK_SIZE * 4)
+#define MAX_PATH_LENGTH FS_PATH_MAX
+#define COPY_BUFFER_SIZE 4096
+#define MAX_LISTED_SNAPSHOTS 64
+#define LS_BATCH 64              // Entries fetched per fs_readdir_stat call
 
 
 //#define LOAD_IMG
 
 
 typedef struct {
-    FileSystem* fs;
-    int current_dir_inode;
+    FsHandle* h;             // Library handle, keeps the current directory and snapshot view
 } FileSystemContext;
 
-typedef void (*CommandHandler)(FileSystemContext* ctx, char* arg1, char* arg2);
+typedef void (*CommandHandler)(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3);
 
-// Command handlers
-static void handle_ls(FileSystemContext* ctx, char* arg1, char* arg2) {
-    Inode* dir_inode = &ctx->fs->inodes[ctx->current_dir_inode];
-    printf("Contents of directory:\n");
-    
-    for (uint32_t i = 0; i < dir_inode->dir_entry_count; i++) {
-        DirectoryEntry* entry = &dir_inode->entries[i];
-        printf("  %s (inode %d, %s)\n", 
-            entry->name,
-            entry->inode_index,
-            ctx->fs->inodes[entry->inode_index].is_directory ? "directory" : "file");
+// Errors every mutating command reports the same way
+static void print_error(FileSystemContext* ctx, const char* name, int err) {
+    if (err == -FS_ERR_ROFS) {
+        printf("Snapshot '%s' is read-only, use 'snapview' to go back.\n", fs_snapshot_viewed(ctx->h));
+    } else {
+        printf("'%s': %s.\n", name, fs_strerror(err));
     }
 }
 
-static void handle_cd(FileSystemContext* ctx, char* arg1, char* arg2) {
-    if (!arg1) {
-        printf("Missing argument\n");
-        return;
+// Output collected in memory and written with a single fwrite
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} OutBuffer;
+
+static void out_printf(OutBuffer* out, const char* fmt, ...) {
+    va_list args;
+    while (true) {
+        size_t room = out->cap - out->len;
+        va_start(args, fmt);
+        int n = vsnprintf(out->data ? out->data + out->len : NULL, room, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < room) {
+            out->len += n;
+            return;
+        }
+        size_t cap = out->cap ? out->cap * 2 : 4096;
+        while (cap - out->len <= (size_t)n) {
+            cap *= 2;
+        }
+        char* data = (char*)realloc(out->data, cap);
+        if (!data) {
+            return;
+        }
+        out->data = data;
+        out->cap = cap;
     }
+}
+
+static void out_flush(OutBuffer* out) {
+    fwrite(out->data, 1, out->len, stdout);
+    free(out->data);
+    memset(out, 0, sizeof(*out));
+}
 
-    if (strcmp(arg1, "..") == 0) {
-        if (ctx->current_dir_inode != 0) {
-            int parent_inode_index = -1;
-            for (uint32_t parent_inode_idx = 0; parent_inode_idx < ctx->fs->total_inodes; parent_inode_idx++) {
-                if (ctx->fs->inodes[parent_inode_idx].is_directory) {
-                    for (int j = 0; j < ctx->fs->inodes[parent_inode_idx].dir_entry_count; j++) {
-                        if (ctx->fs->inodes[parent_inode_idx].entries[j].inode_index == ctx->current_dir_inode) {
-                            parent_inode_index = parent_inode_idx;
-                            break;
-                        }
-                    }
-                    if (parent_inode_index != -1)
-                        break;
-                }
+// ls sort order, set before qsort
+static char ls_sort;
+
+static int cmp_ls_entry(const void* a, const void* b) {
+    const FsDirentStat* x = (const FsDirentStat*)a;
+    const FsDirentStat* y = (const FsDirentStat*)b;
+    // Largest or newest first, then by name
+    if (ls_sort == 'S' && x->st.size != y->st.size) {
+        return x->st.size < y->st.size ? 1 : -1;
+    }
+    if (ls_sort == 't' && x->st.modified != y->st.modified) {
+        return x->st.modified < y->st.modified ? 1 : -1;
+    }
+    return strcmp(x->dirent.name, y->dirent.name);
+}
+
+static void format_mode(const FsStat* st, char* mode) {
+    mode[0] = st->is_directory ? 'd' : st->is_symlink ? 'l' : '-';
+    for (int i = 0; i < 9; i++) {
+        mode[1 + i] = (st->permissions >> (8 - i)) & 1 ? "rwx"[i % 3] : '-';
+    }
+    mode[10] = '\0';
+}
+
+// "ls [-l] [-S|-t] [path]": directory order by default; -l long format sorted by name,
+// -S by size and -t by modification time, largest and newest first
+static void handle_ls(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    bool longform = false;
+    ls_sort = 0;
+    const char* path = ".";
+    char* args[] = {arg1, arg2, arg3};
+    for (int a = 0; a < 3 && args[a]; a++) {
+        if (args[a][0] != '-') {
+            path = args[a];
+            continue;
+        }
+        for (const char* f = args[a] + 1; *f; f++) {
+            if (*f == 'l') {
+                longform = true;
+                ls_sort = ls_sort ? ls_sort : 'n';
+            } else if (*f == 'S' || *f == 't') {
+                ls_sort = *f;
+            } else {
+                printf("Usage: ls [-l] [-S|-t] [path]\n");
+                return;
             }
-            if (parent_inode_index != -1)
-                ctx->current_dir_inode = parent_inode_index;
         }
-    } else {
-        int found_inode = -1;
-        Inode* dir_inode = &ctx->fs->inodes[ctx->current_dir_inode];
-        if (dir_inode->is_directory) {
-            for (uint32_t i = 0; i < dir_inode->dir_entry_count; i++) {
-                DirectoryEntry* entry = &dir_inode->entries[i];
-                if (strcmp(entry->name, arg1) == 0) {
-                    if (ctx->fs->inodes[entry->inode_index].is_directory) {
-                        found_inode = entry->inode_index;
-                        break;
-                    } else {
-                        printf("'%s' is not a directory.\n", arg1);
-                    }
-                }
+    }
+
+    int fd = fs_opendir(ctx->h, path);
+    if (fd < 0) {
+        print_error(ctx, path, fd);
+        return;
+    }
+    // Everything with its metadata, a batch per call, then sorted in memory
+    FsDirentStat* entries = NULL;
+    int count = 0, cap = 0, got;
+    do {
+        if (count + LS_BATCH > cap) {
+            cap = cap ? cap * 2 : LS_BATCH;
+            FsDirentStat* grown = (FsDirentStat*)realloc(entries, cap * sizeof(FsDirentStat));
+            if (!grown) {
+                break;
             }
+            entries = grown;
+        }
+        got = fs_readdir_stat(ctx->h, fd, entries + count, LS_BATCH);
+        count += got > 0 ? got : 0;
+    } while (got > 0);
+    fs_close(ctx->h, fd);
+    if (ls_sort) {
+        qsort(entries, count, sizeof(FsDirentStat), cmp_ls_entry);
+    }
+
+    OutBuffer out = {0};
+    if (!longform) {
+        out_printf(&out, "Contents of directory:\n");
+    }
+    for (int i = 0; i < count; i++) {
+        const FsDirent* entry = &entries[i].dirent;
+        const FsStat* st = &entries[i].st;
+        char target[MAX_PATH_LENGTH] = "";
+        if (entry->is_symlink) {
+            char link[MAX_PATH_LENGTH];
+            snprintf(link, sizeof(link), "%s/%s", path, entry->name);
+            fs_readlink(ctx->h, link, target, sizeof(target));
         }
 
-        if (found_inode != -1)
-            ctx->current_dir_inode = found_inode;
-        else {
-            printf("Directory '%s' not found on cd\n", arg1);
+        if (!longform) {
+            if (entry->is_symlink) {
+                out_printf(&out, "  %s (inode %u, symlink -> %s)\n", entry->name, entry->ino, target);
+            } else {
+                out_printf(&out, "  %s (inode %u, %s)\n", entry->name, entry->ino,
+                           entry->is_directory ? "directory" : "file");
+            }
+            continue;
         }
+        char mode[11], when[32];
+        format_mode(st, mode);
+        time_t modified = (time_t)st->modified;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&modified));
+        out_printf(&out, "%s %3u %10u %s %s%s%s\n", mode, st->nlink, st->size, when, entry->name,
+                   entry->is_symlink ? " -> " : "", target);
     }
+    out_flush(&out);
+    free(entries);
 }
 
-static void handle_cat(FileSystemContext* ctx, char* arg1, char* arg2) {
+static void handle_cd(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
     if (!arg1) {
-        printf("Missing file name.\n");
+        printf("Missing argument\n");
         return;
     }
 
-    int found_file = -1;
-    Inode* dir_inode = &ctx->fs->inodes[ctx->current_dir_inode];
-    if (dir_inode->is_directory) {
-        for (uint32_t i = 0; i < dir_inode->dir_entry_count; i++) {
-            DirectoryEntry* entry = &dir_inode->entries[i];
-            if (strcmp(entry->name, arg1) == 0) {
-                found_file = entry->inode_index;
-                break;
-            }
-        }
+    int ret = fs_chdir(ctx->h, arg1);
+    if (ret == -FS_ERR_NOTDIR) {
+        printf("'%s' is not a directory.\n", arg1);
+    } else if (ret < 0) {
+        printf("Directory '%s' not found on cd\n", arg1);
+    }
+}
+
+static void handle_cat(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    if (!arg1) {
+        printf("Missing file name.\n");
+        return;
     }
 
-    if (found_file != -1) {
-        uint8_t buffer[CAT_BUFFER_SIZE] = {0};
-        read_from_file(ctx->fs, found_file, buffer, ctx->fs->inodes[found_file].size);
-        printf("%s\n", buffer);
-    } else {
+    int fd = fs_open(ctx->h, arg1, FS_O_RDONLY);
+    if (fd == -FS_ERR_NOENT) {
         printf("File '%s' not found on cat.\n", arg1);
+        return;
+    }
+    if (fd < 0) {
+        print_error(ctx, arg1, fd);
+        return;
     }
+
+    // Stream through a fixed buffer, files of any size fit
+    char buffer[COPY_BUFFER_SIZE];
+    ssize_t got;
+    while ((got = fs_read(ctx->h, fd, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, 1, got, stdout);
+    }
+    printf("\n");
+    fs_close(ctx->h, fd);
 }
 
-static void handle_mkdir(FileSystemContext* ctx, char* arg1, char* arg2) {
+static void handle_mkdir(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
     if (!arg1) {
         printf("Missing directory name\n");
         return;
     }
 
-    int new_dir_inode = create_directory(ctx->fs, arg1);
-    if (new_dir_inode != -1) {
-        add_to_directory(ctx->fs, ctx->current_dir_inode, new_dir_inode, arg1);
+    int ret = fs_mkdir(ctx->h, arg1);
+    if (ret == 0) {
         printf("Directory '%s' created.\n", arg1);
+    } else {
+        print_error(ctx, arg1, ret);
     }
 }
 
-static void handle_rm(FileSystemContext* ctx, char* arg1, char* arg2) {
+static void handle_rm(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
     if (!arg1) {
         printf("Missing file name\n");
         return;
     }
 
-    int found_file = -1;
-    Inode* dir_inode = &ctx->fs->inodes[ctx->current_dir_inode];
-    if (dir_inode->is_directory) {
-        for (uint32_t i = 0; i < dir_inode->dir_entry_count; i++) {
-            DirectoryEntry* entry = &dir_inode->entries[i];
-            if (strcmp(entry->name, arg1) == 0) {
-                found_file = entry->inode_index;
-                if (ctx->fs->inodes[entry->inode_index].is_directory) {
-                    printf("'%s' is a directory, use rmdir instead.\n", arg1);
-                }
-                break;
-            }
-        }
+    int ret = fs_unlink(ctx->h, arg1);
+    if (ret == 0) {
+        printf("File '%s' removed.\n", arg1);
+    } else if (ret == -FS_ERR_ISDIR) {
+        printf("'%s' is a directory, use rmdir instead.\n", arg1);
+    } else if (ret == -FS_ERR_NOENT) {
+        printf("File '%s' not found on rm.\n", arg1);
+    } else {
+        print_error(ctx, arg1, ret);
     }
+}
 
-    if (found_file != -1) {
-        remove_from_directory(ctx->fs, ctx->current_dir_inode, found_file, arg1);
-        free_inode(ctx->fs, found_file);
-        printf("File '%s' removed.\n", arg1);
+// "ln <existing> <new>" adds a hard link, "ln -s <target> <new>" a symlink
+static void handle_ln(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    bool symbolic = arg1 && strcmp(arg1, "-s") == 0;
+    if (symbolic) {
+        arg1 = arg2;
+        arg2 = arg3;
+    }
+    if (!arg1 || !arg2) {
+        printf("Usage: ln [-s] <target> <link>\n");
+        return;
+    }
+
+    int ret = symbolic ? fs_symlink(ctx->h, arg1, arg2) : fs_link(ctx->h, arg1, arg2);
+    if (ret == 0) {
+        printf("'%s' linked to '%s'.\n", arg2, arg1);
+    } else if (ret == -FS_ERR_EXIST) {
+        printf("'%s' already exists.\n", arg2);
+    } else if (ret == -FS_ERR_ISDIR) {
+        printf("'%s' is a directory, only symlinks can point to directories.\n", arg1);
+    } else if (ret == -FS_ERR_NOENT) {
+        printf("'%s' not found on ln.\n", symbolic ? arg2 : arg1);
     } else {
-        printf("File '%s' not found on rm.\n", arg1);
+        print_error(ctx, arg2, ret);
     }
 }
 
-static void handle_rmdir(FileSystemContext* ctx, char* arg1, char* arg2) {
-    if (!arg1) {
-        printf("Missing directory name\n");
+// "chmod <octal mode> <path>"
+static void handle_chmod(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    char* end = NULL;
+    unsigned long mode = arg1 ? strtoul(arg1, &end, 8) : 0;
+    if (!arg1 || !arg2 || *end != '\0' || mode > 07777) {
+        printf("Usage: chmod <octal mode> <path>\n");
         return;
     }
 
-    int found_dir = -1;
-    Inode* dir_inode = &ctx->fs->inodes[ctx->current_dir_inode];
-    if (dir_inode->is_directory) {
-        for (uint32_t i = 0; i < dir_inode->dir_entry_count; i++) {
-            DirectoryEntry* entry = &dir_inode->entries[i];
-            if (strcmp(entry->name, arg1) == 0) {
-                if (ctx->fs->inodes[entry->inode_index].is_directory) {
-                    found_dir = entry->inode_index;
-                    break;
-                } else {
-                    printf("'%s' is not a directory.\n", arg1);
-                }
-            }
-        }
+    int ret = fs_chmod(ctx->h, arg2, (uint16_t)mode);
+    if (ret == -FS_ERR_NOENT) {
+        printf("'%s' not found on chmod.\n", arg2);
+    } else if (ret < 0) {
+        print_error(ctx, arg2, ret);
+    }
+}
+
+static void handle_rmdir(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    // "rmdir -r name" removes the directory with everything in it
+    bool recursive = arg1 && strcmp(arg1, "-r") == 0;
+    if (recursive) {
+        arg1 = arg2;
+    }
+    if (!arg1) {
+        printf("Missing directory name\n");
+        return;
     }
 
-    if (found_dir != -1) {
-        remove_from_directory(ctx->fs, ctx->current_dir_inode, found_dir, arg1);
-        free_inode(ctx->fs, found_dir);
+    int ret = fs_rmdir(ctx->h, arg1, recursive ? FS_RMDIR_RECURSIVE : 0);
+    if (ret == 0) {
         printf("Directory '%s' removed.\n", arg1);
-    } else {
+    } else if (ret == -FS_ERR_NOTEMPTY) {
+        printf("Directory '%s' is not empty, use rmdir -r.\n", arg1);
+    } else if (ret == -FS_ERR_NOTDIR) {
+        printf("'%s' is not a directory.\n", arg1);
+    } else if (ret == -FS_ERR_NOENT) {
         printf("Directory '%s' not found on rmdir\n", arg1);
+    } else {
+        print_error(ctx, arg1, ret);
     }
 }
 
-static void handle_put(FileSystemContext* ctx, char* arg1, char* arg2) {
+static void handle_put(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
     if (!arg1) {
         printf("Missing file name.\n");
         return;
     }
 
     // If arg2 is not provided, use arg1 as the destination name
-    const char* dest_name = arg2 && *arg2 ? arg2 : arg1;
+    const char* dest_name = arg2 ? arg2 : arg1;
+
+    FILE* in = fopen(arg1, "rb");
+    struct stat host;
+    if (!in || fstat(fileno(in), &host) != 0) {
+        printf("Failed to open external file '%s'.\n", arg1);
+        if (in) {
+            fclose(in);
+        }
+        return;
+    }
+    FsStat existing;
+    bool created = fs_stat(ctx->h, dest_name, &existing) != 0;
+    // Not truncated: a put that does not fit must leave an existing file as it was
+    int fd = fs_open(ctx->h, dest_name, FS_O_WRONLY | FS_O_CREAT);
+    if (fd < 0) {
+        print_error(ctx, dest_name, fd);
+        fclose(in);
+        return;
+    }
 
-    int file_inode = read_file_to_fs(ctx->fs, arg1, dest_name);
-    if (file_inode != -1) {
-        add_to_directory(ctx->fs, ctx->current_dir_inode, file_inode, dest_name);
+    // Claim the whole file's blocks up front, so a put that cannot fit fails before
+    // anything is written. The new contents go over the old blocks the file keeps to
+    // itself, fs_reserve counts those as present and the rest as needed.
+    int ret = host.st_size > 0 ? fs_reserve(ctx->h, fd, host.st_size) : 0;
+    if (ret != 0) {
+        printf("'%s' (%lld bytes) does not fit: %s.\n", arg1, (long long)host.st_size, fs_strerror(ret));
+        fclose(in);
+        fs_close(ctx->h, fd);
+        if (created) {
+            fs_unlink(ctx->h, dest_name);
+        }
+        return;
+    }
+
+    char buffer[COPY_BUFFER_SIZE];
+    size_t got;
+    uint32_t total = 0;
+    bool complete = true;
+    while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        ssize_t written = fs_write(ctx->h, fd, buffer, got);
+        if (written > 0) {
+            total += written;
+        }
+        if (written == (ssize_t)got) {
+            continue;
+        }
+        // A short write means the file is full, the next one says why
+        if (written >= 0) {
+            written = fs_write(ctx->h, fd, buffer + written, got - written);
+        }
+        if (written == -FS_ERR_FBIG) {
+            printf("File is larger than the direct blocks allow! File partially written.\n");
+        } else if (written == -FS_ERR_DQUOT) {
+            printf("Directory quota reached! File partially written.\n");
+        } else {
+            printf("No free blocks available! File partially written.\n");
+        }
+        complete = false;
+        break;
+    }
+    if (ferror(in)) {
+        printf("Failed to read external file '%s'. File partially written.\n", arg1);
+        complete = false;
+    }
+    fclose(in);
+    // What is left of the old contents past the new end goes, shrinking needs no space
+    ret = fs_ftruncate(ctx->h, fd, total);
+    fs_close(ctx->h, fd);
+    if (ret < 0) {
+        print_error(ctx, dest_name, ret);
+        return;
+    }
+
+    printf("File '%s' written to internal file system as '%s'. Total bytes: %u\n", arg1, dest_name, total);
+    if (complete) {
         printf("File '%s' put successfully.\n", dest_name);
     }
 }
 
-static void handle_get(FileSystemContext* ctx, char* arg1, char* arg2)
+static void handle_get(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3)
 {
     if (!arg1) {
         printf("Missing file name.\n");
         return;
     }
 
-    // 如果沒有指定 arg2，就用 arg1 做為外部檔名
-    const char* dest_name = arg2 && *arg2 ? arg2 : arg1;
+    // 如果沒有指定 arg2，就用 arg1 的最後一段做為外部檔名
+    const char* slash = strrchr(arg1, '/');
+    const char* dest_name = arg2 ? arg2 : slash ? slash + 1 : arg1;
+
+    //==== (1) 在模擬檔案系統開啟 arg1 ====
+    int fd = fs_open(ctx->h, arg1, FS_O_RDONLY);
+    if (fd == -FS_ERR_NOENT) {
+        printf("File '%s' not found on get.\n", arg1);
+        return;
+    }
+    if (fd < 0) {
+        print_error(ctx, arg1, fd);
+        return;
+    }
 
-    //==== (1) 檢查並建立 "dump" 目錄(資料夾) ====
+    //==== (2) 檢查並建立 "dump" 目錄(資料夾) ====
     // 如果 mkdir("dump", 0777) 回傳 -1，代表失敗；
     // 若 errno == EEXIST，表示資料夾已經存在，可以忽略。
-    // 在真正使用前可再判斷 errno 做錯誤處理。
     mkdir("dump", 0777);
 
-    //==== (2) 構建新的目的檔路徑: "dump/原始檔名" ====
+    //==== (3) 構建新的目的檔路徑: "dump/原始檔名" ====
     char path_in_dump[1024];
     snprintf(path_in_dump, sizeof(path_in_dump), "dump/%s", dest_name);
 
-    //==== (3) 在模擬檔案系統找出 arg1 這個檔名對應的 inode ====
-    int found_file = -1;
-    Inode* dir_inode = &ctx->fs->inodes[ctx->current_dir_inode];
-    if (dir_inode->is_directory) {
-        for (uint32_t i = 0; i < dir_inode->dir_entry_count; i++) {
-            DirectoryEntry* entry = &dir_inode->entries[i];
-            if (strcmp(entry->name, arg1) == 0) {
-                found_file = entry->inode_index;
+    //==== (4) 一段一段讀出來寫到外部檔案 ====
+    FILE* out = fopen(path_in_dump, "wb");
+    if (!out) {
+        printf("Failed to create external file '%s'.\n", path_in_dump);
+        fs_close(ctx->h, fd);
+        return;
+    }
+    // 只讀有資料的部分，洞直接跳過，外部檔案也留成 sparse
+    char buffer[COPY_BUFFER_SIZE];
+    off_t size = fs_lseek(ctx->h, fd, 0, FS_SEEK_END);
+    off_t data = fs_lseek(ctx->h, fd, 0, FS_SEEK_DATA);
+    size_t total = 0;
+    while (data >= 0) {
+        off_t hole = fs_lseek(ctx->h, fd, data, FS_SEEK_HOLE);
+        fseeko(out, data, SEEK_SET);
+        for (off_t pos = data; pos < hole; ) {
+            size_t want = hole - pos < (off_t)sizeof(buffer) ? (size_t)(hole - pos) : sizeof(buffer);
+            ssize_t got = fs_pread(ctx->h, fd, buffer, want, pos);
+            if (got <= 0) {
                 break;
             }
+            total += fwrite(buffer, 1, got, out);
+            pos += got;
         }
+        data = fs_lseek(ctx->h, fd, hole, FS_SEEK_DATA);
+    }
+    // 結尾是洞的話檔案長度要另外補
+    if (fflush(out) == 0 && ftruncate(fileno(out), size) == 0) {
+        total = size;
+    }
+    fclose(out);
+    fs_close(ctx->h, fd);
+
+    printf("File '%s' written to host file '%s'. Total bytes: %zu\n", arg1, path_in_dump, total);
+    printf("File '%s' got successfully.\n", arg1);
+}
+
+// "du [path]": the total below path, and for a directory each entry's share of it
+static void handle_du(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    const char* path = arg1 ? arg1 : ".";
+    FsUsage total;
+    int ret = fs_du(ctx->h, path, &total);
+    if (ret < 0) {
+        print_error(ctx, path, ret);
+        return;
     }
 
-    //==== (4) 如果找到檔案，就呼叫 write_file_to_host ====
-    if (found_file != -1) {
-        // 把「dump/檔名」傳給 write_file_to_host
-        if (write_file_to_host(ctx->fs, found_file, path_in_dump) > 0) {
-            printf("File '%s' got successfully.\n", arg1);
+    int fd = fs_opendir(ctx->h, path);
+    if (fd >= 0) {
+        FsDirent entry;
+        while (fs_readdir(ctx->h, fd, &entry) > 0) {
+            char child[MAX_PATH_LENGTH];
+            FsUsage usage;
+            snprintf(child, sizeof(child), "%s/%s", path, entry.name);
+            if (entry.is_symlink || fs_du(ctx->h, child, &usage) < 0) {
+                continue;
+            }
+            printf("%10llu %6llu  %s%s\n", (unsigned long long)usage.bytes, (unsigned long long)usage.blocks,
+                   entry.name, entry.is_directory ? "/" : "");
         }
+        fs_close(ctx->h, fd);
+    }
+    printf("%10llu %6llu  %s (%llu files, %llu directories)\n", (unsigned long long)total.bytes,
+           (unsigned long long)total.blocks, path, (unsigned long long)total.files,
+           (unsigned long long)total.directories);
+}
+
+static int print_find_match(const char* path, const FsStat* st, void* arg) {
+    printf("%s\n", path);
+    return 0;
+}
+
+// "find [path] [-name pattern] [-type f|d|l] [-size [+|-]n[k|M]] [-newer file]"
+static void handle_find(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    char* args[16];
+    int count = 0;
+    char* save = NULL;
+    if (arg1) args[count++] = arg1;
+    if (arg2) args[count++] = arg2;
+    for (char* tok = arg3 ? strtok_r(arg3, " ", &save) : NULL; tok && count < 16; tok = strtok_r(NULL, " ", &save)) {
+        args[count++] = tok;
+    }
+
+    const char* path = ".";
+    FsFindFilter filter;
+    memset(&filter, 0, sizeof(filter));
+    int i = 0;
+    if (i < count && args[i][0] != '-') {
+        path = args[i++];
+    }
+    for (; i < count; i += 2) {
+        const char* value = i + 1 < count ? args[i + 1] : NULL;
+        if (!value) {
+            printf("Missing value for '%s'.\n", args[i]);
+            return;
+        }
+        if (strcmp(args[i], "-name") == 0) {
+            filter.name = value;
+        } else if (strcmp(args[i], "-type") == 0 && strchr("fdl", value[0]) && value[1] == '\0') {
+            filter.type = value[0];
+        } else if (strcmp(args[i], "-size") == 0) {
+            filter.size_op = value[0] == '+' || value[0] == '-' ? *value++ : '=';
+            char* end;
+            filter.size = strtoull(value, &end, 10);
+            if (*end == 'k') {
+                filter.size <<= 10;
+            } else if (*end == 'M') {
+                filter.size <<= 20;
+            }
+        } else if (strcmp(args[i], "-newer") == 0) {
+            FsStat st;
+            int ret = fs_stat(ctx->h, value, &st);
+            if (ret < 0) {
+                print_error(ctx, value, ret);
+                return;
+            }
+            filter.newer = st.modified;
+        } else {
+            printf("Usage: find [path] [-name pattern] [-type f|d|l] [-size [+|-]n[k|M]] [-newer file]\n");
+            return;
+        }
+    }
+
+    int ret = fs_find(ctx->h, path, &filter, print_find_match, NULL);
+    if (ret == -FS_ERR_NOENT) {
+        printf("'%s' not found on find.\n", path);
+    } else if (ret < 0) {
+        print_error(ctx, path, ret);
+    }
+}
+
+static void print_command_latency(void);
+static void dump_command_latency_json(FILE* out);
+
+static void print_status(const FsStatfs* st) {
+    printf("partition size: %ld\n", (long)st->total_blocks * st->block_size);
+    printf("total inodes: %u\n", st->total_inodes);
+    printf("used inodes: %u\n", st->used_inodes);
+    printf("total blocks: %u\n", st->total_blocks);
+    printf("used blocks: %u\n", st->used_blocks);
+    printf("files' blocks: %u\n", st->file_blocks);
+    printf("block size: %u\n", st->block_size);
+    printf("free space: %ld\n", (long)(st->total_blocks - st->used_blocks) * st->block_size);
+    if (st->reserved_blocks) {
+        printf("reserved blocks: %u (available: %ld)\n", st->reserved_blocks,
+               (long)st->available_blocks * st->block_size);
+    }
+    if (st->pending_frees) {
+        printf("pending frees: %u inodes\n", st->pending_frees);
+    }
+    if (st->checksum_errors) {
+        printf("checksum errors: %u\n", st->checksum_errors);
+    }
+}
+
+static void print_counters(const FsStatfs* st) {
+    printf("block allocs: %llu\n", (unsigned long long)st->block_allocs);
+    printf("block frees: %llu\n", (unsigned long long)st->block_frees);
+    printf("inode allocs: %llu\n", (unsigned long long)st->inode_allocs);
+    printf("inode frees: %llu\n", (unsigned long long)st->inode_frees);
+    printf("bytes read: %llu\n", (unsigned long long)st->bytes_read);
+    printf("bytes written: %llu\n", (unsigned long long)st->bytes_written);
+    printf("dir lookups: %llu\n", (unsigned long long)st->dir_lookups);
+    printf("name cache hits: %llu\n", (unsigned long long)st->name_cache_hits);
+    printf("block cache hits: %llu\n", (unsigned long long)st->cache_hits);
+    printf("block cache misses: %llu\n", (unsigned long long)st->cache_misses);
+    printf("block map hits: %llu\n", (unsigned long long)st->map_hits);
+    printf("dirty blocks: %u\n", st->dirty_blocks);
+    printf("writeback flushes: %llu\n", (unsigned long long)st->writeback_flushes);
+    printf("writeback blocks: %llu\n", (unsigned long long)st->writeback_blocks);
+}
+
+static void dump_stats_json(const FsStatfs* st, FILE* out) {
+    fprintf(out, "{\"block_size\":%u,\"total_blocks\":%u,\"used_blocks\":%u,\"file_blocks\":%u,"
+                 "\"reserved_blocks\":%u,\"available_blocks\":%u,"
+                 "\"total_inodes\":%u,\"used_inodes\":%u,\"pending_frees\":%u,\"checksum_errors\":%u,",
+            st->block_size, st->total_blocks, st->used_blocks, st->file_blocks,
+            st->reserved_blocks, st->available_blocks, st->total_inodes, st->used_inodes, st->pending_frees, st->checksum_errors);
+    fprintf(out, "\"block_allocs\":%llu,\"block_frees\":%llu,\"inode_allocs\":%llu,\"inode_frees\":%llu,"
+                 "\"bytes_read\":%llu,\"bytes_written\":%llu,\"dir_lookups\":%llu,\"name_cache_hits\":%llu,"
+                 "\"cache_hits\":%llu,\"cache_misses\":%llu,\"map_hits\":%llu,"
+                 "\"dirty_blocks\":%u,\"writeback_flushes\":%llu,\"writeback_blocks\":%llu}",
+            (unsigned long long)st->block_allocs, (unsigned long long)st->block_frees,
+            (unsigned long long)st->inode_allocs, (unsigned long long)st->inode_frees,
+            (unsigned long long)st->bytes_read, (unsigned long long)st->bytes_written,
+            (unsigned long long)st->dir_lookups, (unsigned long long)st->name_cache_hits,
+            (unsigned long long)st->cache_hits,
+            (unsigned long long)st->cache_misses, (unsigned long long)st->map_hits,
+            st->dirty_blocks, (unsigned long long)st->writeback_flushes,
+            (unsigned long long)st->writeback_blocks);
+}
+
+static void handle_status(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    FsStatfs st;
+    fs_statfs(ctx->h, &st);
+
+    // "status -j [file]" dumps the counters and latencies as JSON, to stdout without a file
+    if (arg1 && strcmp(arg1, "-j") == 0) {
+        FILE* out = arg2 ? fopen(arg2, "w") : stdout;
+        if (!out) {
+            printf("Failed to open '%s' for writing.\n", arg2);
+            return;
+        }
+        fprintf(out, "{\"fs\":");
+        dump_stats_json(&st, out);
+        fprintf(out, ",\"commands\":");
+        dump_command_latency_json(out);
+        fprintf(out, "}\n");
+        if (out != stdout) {
+            fclose(out);
+            printf("Stats written to '%s'.\n", arg2);
+        }
+        return;
+    }
+
+    print_status(&st);
+    if (arg1 && strcmp(arg1, "-v") == 0) {
+        print_counters(&st);
+        print_command_latency();
+    }
+}
+
+static void handle_snapshot(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    if (!arg1) {
+        FsSnapshotInfo snaps[MAX_LISTED_SNAPSHOTS];
+        int count = fs_snapshot_list(ctx->h, snaps, MAX_LISTED_SNAPSHOTS);
+        if (count == 0) {
+            printf("No snapshots.\n");
+            return;
+        }
+        printf("Snapshots:\n");
+        for (int i = 0; i < count && i < MAX_LISTED_SNAPSHOTS; i++) {
+            time_t created = (time_t)snaps[i].created;
+            char when[32];
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+            printf("  %s (%s, %u inodes)\n", snaps[i].name, when, snaps[i].inode_count);
+        }
+        return;
+    }
+
+    int ret = fs_snapshot_create(ctx->h, arg1);
+    if (ret == 0) {
+        printf("Snapshot '%s' created.\n", arg1);
+    } else if (ret == -FS_ERR_EXIST) {
+        printf("Snapshot '%s' already exists.\n", arg1);
+    } else if (ret == -FS_ERR_NOSPC) {
+        printf("Too many snapshots.\n");
     } else {
-        printf("File '%s' not found on get.\n", arg1);
+        print_error(ctx, arg1, ret);
+    }
+}
+
+static void handle_snapdel(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    if (!arg1) {
+        printf("Missing snapshot name\n");
+        return;
+    }
+
+    int ret = fs_snapshot_delete(ctx->h, arg1);
+    if (ret == 0) {
+        printf("Snapshot '%s' deleted.\n", arg1);
+    } else if (ret == -FS_ERR_BUSY) {
+        printf("Snapshot '%s' is being viewed, leave it first.\n", arg1);
+    } else if (ret == -FS_ERR_NOENT) {
+        printf("Snapshot '%s' not found.\n", arg1);
+    } else {
+        print_error(ctx, arg1, ret);
+    }
+}
+
+static void handle_snapview(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    // "snapview" without a name goes back to the live file system
+    int ret = fs_snapshot_view(ctx->h, arg1);
+    if (ret == -FS_ERR_NOENT) {
+        printf("Snapshot '%s' not found.\n", arg1);
+    } else if (ret < 0) {
+        print_error(ctx, arg1 ? arg1 : "snapview", ret);
     }
 }
 
-static void handle_status(FileSystemContext* ctx, char* arg1, char* arg2) {
-    status(ctx->fs);
+static void handle_clone(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    if (!arg1 || !arg2) {
+        printf("Usage: clone <snapshot> <directory>\n");
+        return;
+    }
+
+    int ret = fs_snapshot_clone(ctx->h, arg1, arg2);
+    if (ret == 0) {
+        printf("Snapshot '%s' cloned to '%s'.\n", arg1, arg2);
+    } else if (ret == -FS_ERR_EXIST) {
+        printf("'%s' already exists.\n", arg2);
+    } else {
+        print_error(ctx, arg1, ret);
+    }
+}
+
+static void handle_scrub(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    int ret = fs_scrub_start(ctx->h);
+    if (ret == -FS_ERR_BUSY) {
+        FsScrubStatus st;
+        fs_scrub_status(ctx->h, &st);
+        printf("Scrub running: %u blocks checked, %u errors so far.\n", st.checked, st.errors);
+        return;
+    }
+    if (ret == -FS_ERR_NOTSUP) {
+        printf("Image has no checksums yet, save it once before scrubbing.\n");
+        return;
+    }
+    if (ret < 0) {
+        print_error(ctx, "scrub", ret);
+        return;
+    }
+
+    // "scrub -w" waits for the result, the scrub prints its own report
+    if (arg1 && strcmp(arg1, "-w") == 0) {
+        fs_scrub_wait(ctx->h);
+    }
 }
 
-static void handle_help(FileSystemContext* ctx, char* arg1, char* arg2) {
+static void handle_defrag(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    // "defrag -n" only reports how fragmented things are
+    if (arg1 && strcmp(arg1, "-n") == 0) {
+        FsDefragStatus st;
+        fs_defrag_status(ctx->h, &st);
+        printf("%u of %u files fragmented, %u extents. Used blocks end at %u with %u free below.\n",
+               st.fragmented_files, st.files, st.extents, st.end_block, st.holes);
+        for (uint32_t i = 0; i < st.worst_count; i++) {
+            printf("  %6u extents %6u blocks  %s\n", st.worst[i].extents, st.worst[i].blocks, st.worst[i].path);
+        }
+        return;
+    }
+
+    int ret = fs_defrag_start(ctx->h);
+    if (ret == -FS_ERR_BUSY) {
+        FsDefragStatus st;
+        fs_defrag_status(ctx->h, &st);
+        printf("Defrag running: %u files moved (%u blocks) so far.\n", st.files_moved, st.blocks_moved);
+    } else if (ret < 0) {
+        print_error(ctx, "defrag", ret);
+        return;
+    }
+
+    // "defrag -w" waits for the result (of the one already running too), the defrag prints its own report
+    if (arg1 && strcmp(arg1, "-w") == 0) {
+        fs_defrag_wait(ctx->h);
+    }
+}
+
+static void handle_fsck(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    bool repair = arg1 && strcmp(arg1, "-r") == 0;
+    if (fs_fsck(ctx->h, repair) == -FS_ERR_BUSY) {
+        printf("Leave the snapshot view before repairing.\n");
+    }
+}
+
+// "quota <dir>" shows a directory's quota, "quota <dir> <blocks>" sets it (0 removes it)
+static void handle_quota(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    char* end = NULL;
+    unsigned long blocks = arg2 ? strtoul(arg2, &end, 10) : 0;
+    if (!arg1 || (arg2 && (*end != '\0' || blocks > UINT32_MAX))) {
+        printf("Usage: quota <dir> [blocks]\n");
+        return;
+    }
+
+    int ret = arg2 ? fs_set_quota(ctx->h, arg1, (uint32_t)blocks) : 0;
+    FsQuota quota;
+    if (ret == 0) {
+        ret = fs_get_quota(ctx->h, arg1, &quota);
+    }
+    if (ret < 0) {
+        print_error(ctx, arg1, ret);
+        return;
+    }
+    if (quota.limit) {
+        printf("%s: %llu of %u blocks used, %llu reserved\n", arg1, (unsigned long long)quota.blocks,
+               quota.limit, (unsigned long long)quota.reserved);
+    } else {
+        printf("%s: %llu blocks used, %llu reserved, no quota\n", arg1, (unsigned long long)quota.blocks,
+               (unsigned long long)quota.reserved);
+    }
+}
+
+// "setxattr <path> <name> [value]", no value stores an empty attribute
+static void handle_setxattr(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    if (!arg1 || !arg2) {
+        printf("Usage: setxattr <path> <name> [value]\n");
+        return;
+    }
+
+    int ret = fs_setxattr(ctx->h, arg1, arg2, arg3 ? arg3 : "", arg3 ? strlen(arg3) : 0, 0);
+    if (ret < 0) {
+        print_error(ctx, arg1, ret);
+    }
+}
+
+static void print_xattr(FileSystemContext* ctx, const char* path, const char* name) {
+    char value[FS_XATTR_SIZE_MAX];
+    ssize_t len = fs_getxattr(ctx->h, path, name, value, sizeof(value));
+    if (len < 0) {
+        print_error(ctx, name, (int)len);
+        return;
+    }
+    printf("%s=\"", name);
+    for (ssize_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)value[i];
+        if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\') {
+            putchar(c);
+        } else {
+            printf("\\%03o", c);
+        }
+    }
+    printf("\"\n");
+}
+
+// "getxattr <path> [name]", without a name every attribute of path is shown
+static void handle_getxattr(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    if (!arg1) {
+        printf("Usage: getxattr <path> [name]\n");
+        return;
+    }
+    if (arg2) {
+        print_xattr(ctx, arg1, arg2);
+        return;
+    }
+
+    ssize_t size = fs_listxattr(ctx->h, arg1, NULL, 0);
+    char* list = size > 0 ? malloc((size_t)size) : NULL;
+    if (size > 0 && list) {
+        size = fs_listxattr(ctx->h, arg1, list, (size_t)size);
+    }
+    if (size < 0) {
+        print_error(ctx, arg1, (int)size);
+    } else if (size > 0 && !list) {
+        printf("Out of memory.\n");
+    } else {
+        for (ssize_t i = 0; i < size; i += (ssize_t)strlen(list + i) + 1) {
+            print_xattr(ctx, arg1, list + i);
+        }
+    }
+    free(list);
+}
+
+// "rmxattr <path> <name>"
+static void handle_rmxattr(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    if (!arg1 || !arg2) {
+        printf("Usage: rmxattr <path> <name>\n");
+        return;
+    }
+
+    int ret = fs_removexattr(ctx->h, arg1, arg2);
+    if (ret < 0) {
+        print_error(ctx, arg1, ret);
+    }
+}
+
+static void handle_resize(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
+    char* end = NULL;
+    unsigned long blocks = arg1 ? strtoul(arg1, &end, 10) : 0;
+    if (!arg1 || *end != '\0' || blocks > UINT32_MAX) {
+        printf("Usage: resize <blocks>\n");
+        return;
+    }
+
+    FsStatfs before;
+    fs_statfs(ctx->h, &before);
+    int ret = fs_resize(ctx->h, (uint32_t)blocks);
+    if (ret == 0) {
+        FsStatfs st;
+        fs_statfs(ctx->h, &st);
+        printf("Partition resized from %u to %u blocks (%u inodes).\n", before.total_blocks, st.total_blocks,
+               st.total_inodes);
+    } else if (ret == -FS_ERR_NOSPC) {
+        printf("%u blocks are in use, cannot shrink to %lu.\n", before.used_blocks, blocks);
+    } else if (ret == -FS_ERR_BUSY) {
+        printf("Leave the snapshot view before resizing.\n");
+    } else if (ret == -FS_ERR_INVAL) {
+        printf("A partition needs at least 4 blocks.\n");
+    } else {
+        print_error(ctx, arg1, ret);
+    }
+}
+
+static void handle_help(FileSystemContext* ctx, char* arg1, char* arg2, char* arg3) {
     printf("List of commands:\n");
-    printf("'ls' list directory\n");
+    printf("'ls' [-l] [-S|-t] [path] list directory, long format, by size or by time\n");
     printf("'cd' change directory\n");
     printf("'rm' remove file\n");
     printf("'mkdir' make directory\n");
-    printf("'rmdir' remove directory\n");
+    printf("'rmdir' [-r] remove directory\n");
+    printf("'ln' [-s] <target> <link> hard link a file, or symlink anything\n");
     printf("'put' put file into the space\n");
     printf("'get' get file from the space\n");
     printf("'cat' show content\n");
-    printf("'status' show status of the space\n");
+    printf("'chmod' <octal mode> <path> set permission bits\n");
+    printf("'setxattr' <path> <name> [value] set an extended attribute\n");
+    printf("'getxattr' <path> [name] show one extended attribute, or all of them\n");
+    printf("'rmxattr' <path> <name> remove an extended attribute\n");
+    printf("'find' [path] [-name pattern] [-type f|d|l] [-size [+|-]n[k|M]] [-newer file] search a subtree\n");
+    printf("'du' [path] space used below a directory\n");
+    printf("'quota' <dir> [blocks] show or set the blocks a directory may hold, 0 for no limit\n");
+    printf("'status' [-v|-j [file]] show status of the space, with counters and latencies\n");
+    printf("'snapshot' [name] create a snapshot, or list them\n");
+    printf("'snapdel' delete a snapshot\n");
+    printf("'snapview' [name] browse a snapshot read-only, or go back\n");
+    printf("'clone' <snapshot> <dir> writable copy of a snapshot\n");
+    printf("'scrub' [-w] verify block checksums in the background\n");
+    printf("'fsck' [-r] check (and repair) bitmaps and directories\n");
+    printf("'resize' <blocks> grow or shrink the partition in place\n");
+    printf("'defrag' [-n|-w] make files contiguous and compact them to the start, -n only reports\n");
     printf("'help' show help\n");
     printf("'exit' exit and store img\n");
 }
@@ -276,35 +967,93 @@ static const CommandEntry COMMAND_TABLE[] = {
     {"mkdir", handle_mkdir},
     {"rm", handle_rm},
     {"rmdir", handle_rmdir},
+    {"ln", handle_ln},
+    {"chmod", handle_chmod},
+    {"setxattr", handle_setxattr},
+    {"getxattr", handle_getxattr},
+    {"rmxattr", handle_rmxattr},
     {"put", handle_put},
     {"get", handle_get},
+    {"find", handle_find},
+    {"du", handle_du},
+    {"quota", handle_quota},
     {"status", handle_status},
+    {"snapshot", handle_snapshot},
+    {"snapdel", handle_snapdel},
+    {"snapview", handle_snapview},
+    {"clone", handle_clone},
+    {"scrub", handle_scrub},
+    {"fsck", handle_fsck},
+    {"resize", handle_resize},
+    {"defrag", handle_defrag},
     {"help", handle_help},
     {NULL, NULL}
 };
 
+#define COMMAND_COUNT (sizeof(COMMAND_TABLE) / sizeof(COMMAND_TABLE[0]) - 1)
+
+// Latency of each command, lock wait included, as seen from the prompt
+static Histogram command_latency[COMMAND_COUNT];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void print_command_latency(void) {
+    printf("%-10s %8s %10s %10s %10s %10s\n", "command", "count", "p50 us", "p90 us", "p99 us", "max us");
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        const Histogram* h = &command_latency[i];
+        if (h->total == 0)
+            continue;
+        printf("%-10s %8llu %10.1f %10.1f %10.1f %10.1f\n", COMMAND_TABLE[i].command,
+               (unsigned long long)h->total, hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+               hist_percentile(h, 99) / 1e3, h->max / 1e3);
+    }
+}
+
+static void dump_command_latency_json(FILE* out) {
+    bool first = true;
+    fprintf(out, "{");
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        if (command_latency[i].total == 0)
+            continue;
+        fprintf(out, "%s\"%s\":", first ? "" : ",", COMMAND_TABLE[i].command);
+        hist_print_json(&command_latency[i], out);
+        first = false;
+    }
+    fprintf(out, "}");
+}
+
 static void process_command(FileSystemContext* ctx, const char* input) {
-    char command[MAX_FILENAME];
-    char arg1[MAX_PATH_LENGTH] = "";
-    char arg2[MAX_PATH_LENGTH] = "";
-    
     char input_copy[MAX_INPUT_LENGTH];
-    strncpy(input_copy, input, MAX_INPUT_LENGTH - 1);
-    
-    char* token = strtok(input_copy, " \n");
-    if (!token) return;
-    
-    strncpy(command, token, MAX_FILENAME - 1);
-    
-    token = strtok(NULL, " \n");
-    if (token) strncpy(arg1, token, MAX_PATH_LENGTH - 1);
-    
-    token = strtok(NULL, " \n");
-    if (token) strncpy(arg2, token, MAX_PATH_LENGTH - 1);
-    
+    snprintf(input_copy, sizeof(input_copy), "%s", input);
+
+    char* command = strtok(input_copy, " \n");
+    if (!command) return;
+
+    // Missing arguments are NULL, arg3 is the rest of the line for commands with options
+    char* arg1 = strtok(NULL, " \n");
+    char* arg2 = arg1 ? strtok(NULL, " \n") : NULL;
+    char* arg3 = arg2 ? strtok(NULL, "\n") : NULL;
+    if (arg3) {
+        arg3 += strspn(arg3, " ");
+        size_t len = strlen(arg3);
+        while (len > 0 && arg3[len - 1] == ' ') {
+            arg3[--len] = '\0';
+        }
+        if (len == 0) {
+            arg3 = NULL;
+        }
+    }
+
     for (const CommandEntry* entry = COMMAND_TABLE; entry->command != NULL; entry++) {
         if (strcmp(command, entry->command) == 0) {
-            entry->handler(ctx, arg1, arg2);
+            // The library locks around each call, scrub keeps reading between them
+            uint64_t start = now_ns();
+            entry->handler(ctx, arg1, arg2, arg3);
+            hist_record(&command_latency[entry - COMMAND_TABLE], now_ns() - start);
             return;
         }
     }
@@ -313,10 +1062,12 @@ static void process_command(FileSystemContext* ctx, const char* input) {
 }
 
 int main() {
-    FileSystem fs;
     FileSystemContext ctx;
     uint32_t num_blocks;
 
+    // The library is quiet unless told where to report
+    fs_set_log_handler(fs_log_stdout);
+
     // 讓使用者選擇要「載入檔案系統」或是「建立新檔案系統」
     printf("選擇要進行的動作:\n");
     printf("1. Loads from file\n");
@@ -334,11 +1085,10 @@ int main() {
     while ((c = getchar()) != '\n' && c != EOF);
 
     if (choice == 1) {
-        // 使用者選擇載入現有檔案系統
-        load_file_system(&fs, "disk_image.bin");
-        // 假設載入的檔案系統根目錄 inode 為 0
-        ctx.fs = &fs;
-        ctx.current_dir_inode = 0;
+        // 使用者選擇載入現有檔案系統，從根目錄開始
+        if (fs_mount(&ctx.h, "disk_image.bin") != 0) {
+            return 1;
+        }
     } 
     else if (choice == 2) {
         // 使用者選擇在記憶體中建立新檔案系統
@@ -352,10 +1102,13 @@ int main() {
         while ((c = getchar()) != '\n' && c != EOF);
 
         // 初始化檔案系統，並建立一個 root 目錄
-        initialize_file_system(&fs, num_blocks);
-        int root_inode = create_directory(&fs, "root");
-        ctx.fs = &fs;
-        ctx.current_dir_inode = root_inode;
+        int ret = fs_format(&ctx.h, num_blocks);
+        if (ret != 0) {
+            printf("Failed to create file system: %s.\n", fs_strerror(ret));
+            return 1;
+        }
+        // 背景持續寫回 disk_image.bin，exit 時只需寫完剩下的部分
+        fs_writeback_start(ctx.h, "disk_image.bin");
     } 
     else {
         printf("無效的選項，請重新執行程式。\n");
@@ -366,7 +1119,11 @@ int main() {
     while (true) {
         // 印出目前所在的路徑
         char current_path[MAX_PATH_LENGTH];
-        get_inode_path(&fs, ctx.current_dir_inode, current_path, sizeof(current_path));
+        fs_getcwd(ctx.h, current_path, sizeof(current_path));
+        const char* view = fs_snapshot_viewed(ctx.h);
+        if (view) {
+            printf("@%s:", view);
+        }
         printf("%s$ ", current_path);
 
         if (fgets(input, sizeof(input), stdin) == NULL) {
@@ -375,10 +1132,12 @@ int main() {
 
         // 如果輸入 "exit" 就離開
         if (strncmp(input, "exit", 4) == 0) {
+            // Snapshot views share blocks with the file system, drop them before saving
+            fs_snapshot_view(ctx.h, NULL);
             // 如果是「記憶體中新建」的檔案系統，離開前可視需求決定是否要儲存
             // 這裡假設都要存成 "disk_image.bin"
             if (choice == 2) {
-                save_file_system(&fs, "disk_image.bin");
+                fs_sync(ctx.h, "disk_image.bin");
             }
             break;
         }
@@ -388,7 +1147,7 @@ int main() {
     }
 
     // 清理系統資源
-    cleanup_file_system(&fs);
+    fs_unmount(ctx.h);
 
     return 0;
-}
\ No newline at end of file
+}
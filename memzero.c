@@ -0,0 +1,106 @@
+#include "memzero.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEMZERO_X86
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define MEMZERO_NEON
+#endif
+
+#define MEMZERO_CHUNK 128 // Bytes OR-ed together between checks
+
+
+static bool (*mem_is_zero_fn)(const uint8_t *p, size_t len);
+static const char *mem_is_zero_name = "words";
+
+
+static bool mem_is_zero_words(const uint8_t *p, size_t len) {
+    while (len >= MEMZERO_CHUNK) {
+        uint64_t acc = 0;
+        for (size_t i = 0; i < MEMZERO_CHUNK; i += 8) {
+            uint64_t w;
+            memcpy(&w, p + i, 8);
+            acc |= w;
+        }
+        if (acc)
+            return false;
+        p += MEMZERO_CHUNK;
+        len -= MEMZERO_CHUNK;
+    }
+    while (len--) {
+        if (*p++)
+            return false;
+    }
+    return true;
+}
+
+#ifdef MEMZERO_X86
+// Four 32-byte loads OR-ed together, one vptest per chunk
+__attribute__((target("avx2")))
+static bool mem_is_zero_avx2(const uint8_t *p, size_t len) {
+    while (len >= MEMZERO_CHUNK) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(p + 96));
+        __m256i acc = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(acc, acc))
+            return false;
+        p += MEMZERO_CHUNK;
+        len -= MEMZERO_CHUNK;
+    }
+    return mem_is_zero_words(p, len);
+}
+#endif
+
+#ifdef MEMZERO_NEON
+static bool mem_is_zero_neon(const uint8_t *p, size_t len) {
+    while (len >= MEMZERO_CHUNK) {
+        uint8x16_t acc = vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16));
+        for (size_t i = 32; i < MEMZERO_CHUNK; i += 32) {
+            acc = vorrq_u8(acc, vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)));
+        }
+        if (vmaxvq_u8(acc) != 0)
+            return false;
+        p += MEMZERO_CHUNK;
+        len -= MEMZERO_CHUNK;
+    }
+    return mem_is_zero_words(p, len);
+}
+#endif
+
+static void mem_is_zero_init(void) {
+    mem_is_zero_fn = mem_is_zero_words;
+    mem_is_zero_name = "words";
+
+#ifdef MEMZERO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        mem_is_zero_fn = mem_is_zero_avx2;
+        mem_is_zero_name = "avx2";
+    }
+#endif
+#ifdef MEMZERO_NEON
+    mem_is_zero_fn = mem_is_zero_neon;
+    mem_is_zero_name = "neon";
+#endif
+}
+
+bool mem_is_zero(const void *data, size_t len) {
+    if (!mem_is_zero_fn) {
+        mem_is_zero_init();
+    }
+    return mem_is_zero_fn((const uint8_t *)data, len);
+}
+
+const char *mem_is_zero_impl(void) {
+    if (!mem_is_zero_fn) {
+        mem_is_zero_init();
+    }
+    return mem_is_zero_name;
+}
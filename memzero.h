@@ -0,0 +1,16 @@
+#ifndef MEMZERO_H
+#define MEMZERO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+// Whether len bytes are all zero, used to find blocks that can stay holes.
+// Picks AVX2 (x86, checked at runtime) or NEON (ARMv8) and falls back to
+// 64-bit words everywhere else. Returns at the first 128 bytes holding data.
+bool mem_is_zero(const void *data, size_t len);
+
+// Name of the implementation mem_is_zero() dispatches to ("avx2", "neon", "words")
+const char *mem_is_zero_impl(void);
+
+#endif
@@ -0,0 +1,61 @@
+#include "namecache.h"
+
+
+// FNV-1a over the name, seeded with the directory
+static uint32_t name_hash(uint32_t dir, const char *name, size_t len) {
+    uint32_t hash = 2166136261u ^ dir;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// find_in_directory through the cache
+int name_cache_lookup(FileSystem *fs, int dir_inode_index, const char *name) {
+    size_t len = strlen(name);
+    Inode *dir = &fs->inodes[dir_inode_index];
+    if (len >= NAME_CACHE_NAME_MAX || !dir->is_directory)
+        return find_in_directory(fs, dir_inode_index, name);
+    if (!fs->names) {
+        fs->names = (NameCache *)calloc(1, sizeof(NameCache));
+        if (!fs->names)
+            return find_in_directory(fs, dir_inode_index, name);
+    }
+
+    NameCacheEntry *slot = &fs->names->slots[name_hash(dir_inode_index, name, len) & (NAME_CACHE_SLOTS - 1)];
+    if (slot->dir == (uint32_t)dir_inode_index + 1) {
+        // A hit is compared with the entry itself, which also tells whether it is still there
+        bool valid;
+        if (slot->inode >= 0) {
+            valid = slot->pos < dir->dir_entry_count &&
+                    dir->entries[slot->pos].inode_index == (uint32_t)slot->inode &&
+                    strcmp(dir->entries[slot->pos].name, name) == 0;
+        } else {
+            valid = slot->generation == fs->name_generation && memcmp(slot->name, name, len + 1) == 0;
+        }
+        if (valid) {
+            fs->stats.name_cache_hits++;
+            return slot->inode;
+        }
+    }
+
+    fs->stats.dir_lookups++;
+    slot->dir = dir_inode_index + 1;
+    slot->inode = -1;
+    slot->generation = fs->name_generation;
+    memcpy(slot->name, name, len + 1);
+    for (uint32_t i = 0; i < dir->dir_entry_count; i++) {
+        if (strcmp(dir->entries[i].name, name) == 0) {
+            slot->inode = (int32_t)dir->entries[i].inode_index;
+            slot->pos = i;
+            break;
+        }
+    }
+    return slot->inode;
+}
+
+void name_cache_free(FileSystem *fs) {
+    free(fs->names);
+    fs->names = NULL;
+}
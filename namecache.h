@@ -0,0 +1,30 @@
+#ifndef NAMECACHE_H
+#define NAMECACHE_H
+
+#include "FileSystem.h"
+
+#define NAME_CACHE_SLOTS 1024     // Direct mapped, a power of two
+#define NAME_CACHE_NAME_MAX 32    // Longer names are looked up without the cache
+
+
+// Lookups resolve_path made recently, hits and misses alike. A hit is checked
+// against the directory entry it came from, so renames and unlinks need no
+// invalidation; a miss is only trusted while fs->name_generation is unchanged,
+// which every new directory entry bumps. Updated by resolve_path, so it is
+// protected by fs->lock held for writing.
+typedef struct {
+    uint32_t dir;                      // Directory inode + 1, 0 for an empty slot
+    int32_t inode;                     // Child inode, -1 for a cached miss
+    uint32_t pos;                      // Entry the child was found at
+    uint32_t generation;               // fs->name_generation the miss was seen at
+    char name[NAME_CACHE_NAME_MAX];
+} NameCacheEntry;
+
+typedef struct NameCache {
+    NameCacheEntry slots[NAME_CACHE_SLOTS];
+} NameCache;
+
+int name_cache_lookup(FileSystem *fs, int dir_inode_index, const char *name);
+void name_cache_free(FileSystem *fs);
+
+#endif
@@ -0,0 +1,133 @@
+#include "openfile.h"
+
+
+int open_file_install(OpenFileTable *table, uint32_t inode_index, bool is_directory, int flags) {
+    int fd = 0;
+    while (fd < table->slots && table->files[fd])
+        fd++;
+    if (fd == table->slots) {
+        int slots = table->slots ? table->slots * 2 : OPEN_FILE_MIN_SLOTS;
+        OpenFile **files = (OpenFile **)realloc(table->files, slots * sizeof(OpenFile *));
+        if (!files)
+            return -1;
+        memset(files + table->slots, 0, (slots - table->slots) * sizeof(OpenFile *));
+        table->files = files;
+        table->slots = slots;
+    }
+    // Tables start out zeroed, the slab is set up on first use
+    if (!table->slab.object_size)
+        slab_init(&table->slab, sizeof(OpenFile), OPEN_FILE_SLAB_CHUNK);
+
+    OpenFile *file = (OpenFile *)slab_alloc(&table->slab);
+    if (!file)
+        return -1;
+    file->is_directory = is_directory;
+    file->flags = flags;
+    file->inode = inode_index;
+    file->reserved = 0;
+    pthread_mutex_init(&file->lock, NULL);
+    table->files[fd] = file;
+    table->open_count++;
+    return fd;
+}
+
+OpenFile *open_file_get(OpenFileTable *table, int fd) {
+    if (fd < 0 || fd >= table->slots)
+        return NULL;
+    return table->files[fd];
+}
+
+void open_file_close(OpenFileTable *table, int fd) {
+    OpenFile *file = open_file_get(table, fd);
+    if (file) {
+        pthread_mutex_destroy(&file->lock);
+        slab_free(&table->slab, file);
+        table->files[fd] = NULL;
+        table->open_count--;
+    }
+}
+
+// Some descriptor has inode_index open
+bool open_file_busy(OpenFileTable *table, uint32_t inode_index) {
+    for (int fd = 0; fd < table->slots; fd++) {
+        if (table->files[fd] && table->files[fd]->inode == inode_index)
+            return true;
+    }
+    return false;
+}
+
+void open_file_table_free(OpenFileTable *table) {
+    for (int fd = 0; fd < table->slots; fd++) {
+        if (table->files[fd])
+            pthread_mutex_destroy(&table->files[fd]->lock);
+    }
+    free(table->files);
+    slab_destroy(&table->slab);
+    memset(table, 0, sizeof(OpenFileTable));
+}
+
+// Resolve logical block n of the file on a map miss
+static const Block *map_block(FileSystem *fs, OpenFile *file, Inode *inode, uint32_t n) {
+    // A reader moving through the file in order gets the next few blocks hinted to the image
+    if (n == file->next_block) {
+        uint32_t count = inode_block_count(inode);
+        uint32_t end = n + 1 + OPEN_FILE_READAHEAD < count ? n + 1 + OPEN_FILE_READAHEAD : count;
+        for (uint32_t b = file->readahead_end > n + 1 ? file->readahead_end : n + 1; b < end; b++) {
+            prefetch_block(fs, inode->blocks[b]);
+        }
+        if (end > file->readahead_end)
+            file->readahead_end = end;
+    }
+    file->map[n] = data_block(fs, inode->blocks[n]);
+    return file->map[n];
+}
+
+// Every block a read of size bytes at offset touches is in memory already. Only then
+// can it run under the shared lock, faulting a block in changes fs.
+bool open_file_resident(FileSystem *fs, OpenFile *file, uint32_t offset, uint32_t size) {
+    Inode *inode = &fs->inodes[file->inode];
+    if (!fs->block_loaded || offset >= inode->size || size == 0)
+        return true;
+    uint32_t end = size > inode->size - offset ? inode->size : offset + size;
+    for (uint32_t n = offset / BLOCK_SIZE; n <= (end - 1) / BLOCK_SIZE; n++) {
+        uint32_t block_index = inode->blocks[n];
+        if (block_index != BLOCK_HOLE && !fs->block_loaded[block_index])
+            return false;
+    }
+    return true;
+}
+
+// read_file_range through the descriptor's block map, the position is the caller's business
+uint32_t open_file_read(FileSystem *fs, OpenFile *file, uint32_t offset, uint8_t *buffer, uint32_t size) {
+    Inode *inode = &fs->inodes[file->inode];
+    if (offset >= inode->size)
+        return 0;
+    if (size > inode->size - offset)
+        size = inode->size - offset;
+
+    // Block pointers may have moved since the map was filled
+    if (file->map_generation != fs->map_generation) {
+        memset(file->map, 0, sizeof(file->map));
+        file->map_generation = fs->map_generation;
+    }
+
+    uint32_t done = 0;
+    uint32_t hits = 0;
+    while (done < size) {
+        uint32_t pos = offset + done;
+        uint32_t in_block = pos % BLOCK_SIZE;
+        uint32_t len = BLOCK_SIZE - in_block < size - done ? BLOCK_SIZE - in_block : size - done;
+        const Block *block = file->map[pos / BLOCK_SIZE];
+        if (block)
+            hits++;
+        else
+            block = map_block(fs, file, inode, pos / BLOCK_SIZE);
+        memcpy(buffer + done, block->data + in_block, len);
+        file->next_block = (pos + len) / BLOCK_SIZE;
+        done += len;
+    }
+    __atomic_fetch_add(&fs->stats.map_hits, hits, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fs->stats.bytes_read, done, __ATOMIC_RELAXED);
+    touch_accessed(fs, inode);
+    return done;
+}
@@ -0,0 +1,49 @@
+#ifndef OPENFILE_H
+#define OPENFILE_H
+
+#include "FileSystem.h"
+
+#define OPEN_FILE_MIN_SLOTS 16  // Descriptor slots allocated on first open
+#define OPEN_FILE_SLAB_CHUNK 64 // OpenFile objects carved per slab chunk
+#define OPEN_FILE_READAHEAD 4   // Blocks hinted ahead of a sequential reader
+
+
+// One open descriptor. Reads go through map, the file's logical blocks
+// resolved to resident blocks the first time they are touched, so a file
+// read over and over skips get_block and the image. The map is dropped
+// whenever fs->map_generation moves (a block was allocated or freed somewhere).
+// Reads run under the shared fs->lock, lock keeps readers of the same descriptor
+// from stepping on offset and the map; holders of the exclusive lock skip it.
+typedef struct {
+    bool is_directory;
+    int flags;                     // Opener's flags (libfs FS_O_*)
+    uint32_t inode;
+    uint32_t offset;               // File position, or next entry for directories
+    uint32_t map_generation;       // fs->map_generation map was filled at
+    const Block *map[DIRECT_POINTERS]; // Logical block -> resident block (a zero block for holes), NULL until first read
+    uint32_t next_block;           // Block a sequential reader asks for next
+    uint32_t readahead_end;        // First block not hinted to the image yet
+    uint32_t reserved;             // Blocks set aside by fs_reserve and not written yet (see quota.h)
+    pthread_mutex_t lock;          // Guards offset, map and the readahead fields between readers
+} OpenFile;
+
+// Descriptor table, grown on demand. The OpenFile objects come from a slab,
+// so they stay put when the table grows and reopening does not hit malloc.
+// Protected by the owner's lock.
+typedef struct {
+    OpenFile **files;              // NULL where the descriptor is free
+    int slots;
+    Slab slab;
+    int open_count;                // Descriptors in use
+} OpenFileTable;
+
+
+int open_file_install(OpenFileTable *table, uint32_t inode_index, bool is_directory, int flags);
+OpenFile *open_file_get(OpenFileTable *table, int fd);
+void open_file_close(OpenFileTable *table, int fd);
+bool open_file_busy(OpenFileTable *table, uint32_t inode_index);
+void open_file_table_free(OpenFileTable *table);
+bool open_file_resident(FileSystem *fs, OpenFile *file, uint32_t offset, uint32_t size);
+uint32_t open_file_read(FileSystem *fs, OpenFile *file, uint32_t offset, uint8_t *buffer, uint32_t size);
+
+#endif
@@ -0,0 +1,48 @@
+#include "quota.h"
+#include "walk.h"
+#include "reclaim.h"
+
+
+bool quota_allows(FileSystem *fs, uint32_t inode_index, uint32_t blocks) {
+    if (fs->read_only)
+        return true;
+    // Bounded in case a damaged image links directories in a circle
+    uint32_t steps = 0;
+    for (uint32_t dir = fs->parents[inode_index]; dir && steps < fs->total_inodes; dir = fs->parents[dir - 1]) {
+        uint32_t quota = fs->inodes[dir - 1].quota_blocks;
+        if (quota) {
+            TreeUsage usage;
+            tree_usage(fs, dir - 1, &usage);
+            if (usage.blocks + usage.reserved + blocks > quota)
+                return false;
+        }
+        steps++;
+    }
+    return true;
+}
+
+int reserve_blocks(FileSystem *fs, uint32_t inode_index, uint32_t blocks) {
+    // Short while unlinked files wait for the reclaim thread: free them now and look again
+    if ((blocks > available_blocks(fs) || !quota_allows(fs, inode_index, blocks)) && reclaim_pending(fs))
+        reclaim_drain(fs);
+    if (blocks > available_blocks(fs))
+        return RESERVE_NO_SPACE;
+    if (!quota_allows(fs, inode_index, blocks))
+        return RESERVE_OVER_QUOTA;
+    charge_reserved(fs, inode_index, blocks);
+    return 0;
+}
+
+void charge_reserved(FileSystem *fs, uint32_t inode_index, int64_t blocks) {
+    if (blocks == 0 || !fs->reserved)
+        return;
+    fs->reserved[inode_index] += blocks;
+    fs->reserved_blocks += blocks;
+    TreeUsage delta = { 0, 0, 0, 0, blocks };
+    charge_usage(fs, inode_index, &delta, 1);
+}
+
+uint32_t available_blocks(FileSystem *fs) {
+    uint32_t taken = fs->used_blocks + fs->reserved_blocks;
+    return taken < fs->total_blocks ? fs->total_blocks - taken : 0;
+}
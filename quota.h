@@ -0,0 +1,38 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+#include "FileSystem.h"
+
+// reserve_blocks results
+#define RESERVE_NO_SPACE -1     // Fewer free blocks than asked for, other reservations counted
+#define RESERVE_OVER_QUOTA -2   // A directory above would go past its quota
+
+
+// Directory quotas and block reservations.
+//
+// A directory's quota_blocks caps everything below it: file blocks as du counts them
+// (holes included) plus the blocks reserved for files there. Both totals come from
+// fs->usage, so a check is a walk up parents[] and never a scan of the tree; only a
+// stale fs->usage is rebuilt first (see walk.h).
+//
+// A reservation takes blocks out of the free pool up front (fs->reserved_blocks, which
+// allocate_block does not touch) and charges them to the directories above the file,
+// so a large write gets all of its space before it starts or fails without writing
+// anything. The writer gives the reservation back around each write and charges what
+// is left again afterwards, with the blocks the write took subtracted.
+// Caller holds fs->lock for writing.
+
+// Whether the file may gain blocks without a directory above going over its quota
+bool quota_allows(FileSystem *fs, uint32_t inode_index, uint32_t blocks);
+
+// Set blocks aside for the file: 0, RESERVE_NO_SPACE or RESERVE_OVER_QUOTA
+int reserve_blocks(FileSystem *fs, uint32_t inode_index, uint32_t blocks);
+
+// Add blocks (negative to give them back) to the file's reservation without checking
+// anything; only for blocks that were reserved a moment ago.
+void charge_reserved(FileSystem *fs, uint32_t inode_index, int64_t blocks);
+
+// Blocks neither in use nor reserved
+uint32_t available_blocks(FileSystem *fs);
+
+#endif
@@ -0,0 +1,179 @@
+#include "reclaim.h"
+
+
+static int reclaim_push(ReclaimQueue *q, uint32_t inode_index) {
+    if (q->count == q->capacity) {
+        uint32_t capacity = q->capacity ? q->capacity * 2 : 64;
+        uint32_t *items = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+        if (!items)
+            return -1;
+        // Unwrap the ring into the new buffer
+        for (uint32_t i = 0; i < q->count; i++) {
+            items[i] = q->items[(q->head + i) % q->capacity];
+        }
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->capacity = capacity;
+    }
+    q->items[(q->head + q->count) % q->capacity] = inode_index;
+    q->count++;
+    return 0;
+}
+
+// Free up to budget blocks from the front of the queue. Caller holds fs->lock for writing.
+static uint32_t reclaim_batch(FileSystem *fs, uint32_t budget) {
+    ReclaimQueue *q = fs->reclaim;
+    uint32_t freed = 0;
+
+    while (q->count > 0 && freed < budget) {
+        uint32_t inode_index = q->items[q->head];
+        Inode *inode = &fs->inodes[inode_index];
+
+        if (inode->is_directory) {
+            // Children go to the back of the queue, the tree is taken apart breadth first.
+            // A file still linked from elsewhere just loses this name.
+            uint32_t i;
+            for (i = 0; i < inode->dir_entry_count; i++) {
+                Inode *child = &fs->inodes[inode->entries[i].inode_index];
+                if (child->nlink > 1) {
+                    child->nlink--;
+                    if (fs->parents[inode->entries[i].inode_index] == inode_index + 1) {
+                        fs->parents[inode->entries[i].inode_index] = 0;
+                        // It left the directory totals with this subtree and is counted nowhere now
+                        fs->usage_valid = false;
+                    }
+                    continue;
+                }
+                if (reclaim_push(q, inode->entries[i].inode_index) != 0)
+                    break;
+                child->nlink = 0;
+            }
+            if (i < inode->dir_entry_count) {
+                // Out of memory, keep what is left for the next round
+                memmove(&inode->entries[0], &inode->entries[i],
+                        (inode->dir_entry_count - i) * sizeof(DirectoryEntry));
+                inode->dir_entry_count -= i;
+                return freed;
+            }
+            inode->dir_entry_count = 0;
+        } else {
+            // Free from the tail so a file can be released across several batches
+            uint32_t count = inode_block_count(inode);
+            while (count > 0 && freed < budget) {
+                count--;
+                free_block(fs, inode->blocks[count]);
+                set_file_size(fs, inode, count * BLOCK_SIZE);
+                freed++;
+            }
+            if (count > 0)
+                break;
+            set_file_size(fs, inode, 0);
+        }
+
+        free_inode(fs, inode_index);
+        q->freed_inodes++;
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+    }
+    q->freed_blocks += freed;
+    return freed;
+}
+
+static void *reclaim_main(void *arg) {
+    FileSystem *fs = (FileSystem *)arg;
+    ReclaimQueue *q = fs->reclaim;
+
+    while (true) {
+        pthread_mutex_lock(&q->mutex);
+        while (!q->work && !q->stop) {
+            pthread_cond_wait(&q->wake, &q->mutex);
+        }
+        bool stop = q->stop;
+        q->work = false;
+        pthread_mutex_unlock(&q->mutex);
+        if (stop)
+            break;
+
+        // One batch per lock hold, shell commands run in between
+        bool more = true;
+        while (more) {
+            pthread_rwlock_wrlock(fs->lock);
+            reclaim_batch(fs, RECLAIM_BATCH_BLOCKS);
+            more = q->count > 0;
+            pthread_rwlock_unlock(fs->lock);
+        }
+    }
+    return NULL;
+}
+
+// Queue an inode that is no longer linked anywhere. Caller holds fs->lock for writing.
+int reclaim_inode(FileSystem *fs, uint32_t inode_index) {
+    if (!fs->reclaim) {
+        ReclaimQueue *q = (ReclaimQueue *)calloc(1, sizeof(ReclaimQueue));
+        if (!q) {
+            fs_log("Memory allocation for reclaim queue failed!\n");
+            return -1;
+        }
+        pthread_mutex_init(&q->mutex, NULL);
+        pthread_cond_init(&q->wake, NULL);
+        fs->reclaim = q;
+    }
+
+    ReclaimQueue *q = fs->reclaim;
+    if (reclaim_push(q, inode_index) != 0) {
+        fs_log("Memory allocation for reclaim queue failed!\n");
+        return -1;
+    }
+
+    if (!q->started) {
+        if (pthread_create(&q->thread, NULL, reclaim_main, fs) != 0) {
+            // No thread, free it right here instead
+            reclaim_drain(fs);
+            return 0;
+        }
+        q->started = true;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    q->work = true;
+    pthread_cond_signal(&q->wake);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
+// Finish all queued frees now. Caller holds fs->lock for writing.
+void reclaim_drain(FileSystem *fs) {
+    if (!fs->reclaim)
+        return;
+    while (fs->reclaim->count > 0) {
+        uint32_t before = fs->reclaim->count;
+        if (reclaim_batch(fs, UINT32_MAX) == 0 && fs->reclaim->count == before)
+            break; // Out of memory, leave the rest queued
+    }
+}
+
+// Stop the background thread, anything still queued is dropped with the file system
+void reclaim_stop(FileSystem *fs) {
+    ReclaimQueue *q = fs->reclaim;
+    if (!q)
+        return;
+
+    if (q->started) {
+        pthread_mutex_lock(&q->mutex);
+        q->stop = true;
+        pthread_cond_signal(&q->wake);
+        pthread_mutex_unlock(&q->mutex);
+        pthread_join(q->thread, NULL);
+        q->started = false;
+    }
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->wake);
+    free(q->items);
+    free(q);
+    fs->reclaim = NULL;
+}
+
+uint32_t reclaim_pending(FileSystem *fs) {
+    return fs->reclaim ? fs->reclaim->count : 0;
+}
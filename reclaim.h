@@ -0,0 +1,33 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include "FileSystem.h"
+
+#define RECLAIM_BATCH_BLOCKS 4096 // Blocks freed per write-lock hold by the background thread
+
+
+// Deferred frees: unlinked inodes wait here until the background thread
+// releases their blocks (and, for directories, their whole subtree).
+// The queue itself is protected by fs->lock like the rest of the metadata.
+typedef struct ReclaimQueue {
+    pthread_t thread;          // Background reclaimer
+    bool started;              // thread has to be joined
+    pthread_mutex_t mutex;     // Guards work and stop
+    pthread_cond_t wake;       // Signalled when work is queued or on stop
+    bool work;                 // Something was queued since the thread last looked
+    bool stop;                 // Thread should exit
+    uint32_t *items;           // Ring buffer of inode indexes waiting to be freed
+    uint32_t head;             // First queued item
+    uint32_t count;            // Number of queued items
+    uint32_t capacity;         // Size of items
+    uint64_t freed_blocks;     // Blocks released so far
+    uint64_t freed_inodes;     // Inodes released so far
+} ReclaimQueue;
+
+
+int reclaim_inode(FileSystem *fs, uint32_t inode_index);
+void reclaim_drain(FileSystem *fs);
+void reclaim_stop(FileSystem *fs);
+uint32_t reclaim_pending(FileSystem *fs);
+
+#endif
@@ -0,0 +1,147 @@
+#include "resize.h"
+#include "snapshot.h"
+#include "reclaim.h"
+#include "namecache.h"
+#include "trace.h"
+
+
+// Point the blocks of an inode that lie past new_end at their copies
+static void repoint_blocks(Inode *inode, const uint32_t *moved, uint32_t new_end, uint32_t old_end) {
+    uint32_t count = inode_block_count(inode);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t block = inode->blocks[i];
+        if (block >= new_end && block < old_end && moved[block - new_end])
+            inode->blocks[i] = moved[block - new_end] - 1;
+    }
+    uint32_t block = inode->xattr_block - 1;
+    if (inode->xattr_block && block >= new_end && block < old_end && moved[block - new_end])
+        inode->xattr_block = moved[block - new_end];
+}
+
+// Copy every used block from new_end on into the lowest free block below it, then
+// repoint the live and snapshot inodes in a single pass. A shared block moves once,
+// refcount and all, so every inode sharing it ends up at the same copy.
+static int evacuate_tail(FileSystem *fs, uint32_t new_end) {
+    TRACE_SPAN("resize_evacuate");
+    uint32_t old_end = fs->total_blocks;
+    // Where each block past new_end went, index + 1, 0 if it was free
+    uint32_t *moved = (uint32_t *)calloc(old_end - new_end, sizeof(uint32_t));
+    if (!moved) {
+        fs_log("Memory allocation for block relocation failed!\n");
+        return RESIZE_NO_MEMORY;
+    }
+
+    // No free block below the hint
+    uint32_t dest = fs->block_hint;
+    uint32_t b;
+    for (b = new_end; b < old_end; b++) {
+        if (fs->block_dirty && fs->block_dirty[b]) {
+            fs->block_dirty[b] = false;
+            fs->dirty_blocks--;
+        }
+        if (!fs->block_bitmap[b])
+            continue;
+        while (dest < new_end && fs->block_bitmap[dest]) {
+            dest++;
+        }
+        if (dest == new_end)
+            break;
+        memcpy(fs->blocks[dest].data, get_block(fs, b)->data, BLOCK_SIZE);
+        if (fs->block_loaded)
+            fs->block_loaded[dest] = true;
+        fs->block_bitmap[dest] = true;
+        fs->block_refcount[dest] = fs->block_refcount[b];
+        fs->block_crc[dest] = fs->block_crc[b];
+        mark_block_dirty(fs, dest);
+        fs->block_bitmap[b] = false;
+        fs->block_refcount[b] = 0;
+        moved[b - new_end] = dest + 1;
+    }
+
+    for (uint32_t i = 0; i < fs->total_inodes; i++) {
+        if (fs->inode_bitmap[i])
+            repoint_blocks(&fs->inodes[i], moved, new_end, old_end);
+    }
+    for (uint32_t s = 0; s < fs->snapshot_count; s++) {
+        Snapshot *snap = &fs->snapshots[s];
+        for (uint32_t i = 0; i < snap->inode_count; i++) {
+            repoint_blocks(&snap->inodes[i], moved, new_end, old_end);
+        }
+    }
+    free(moved);
+    fs->map_generation++;
+
+    if (b < old_end) {
+        // used_blocks said they would fit; what moved is consistent, the rest stays put
+        fs_log("Not enough free blocks below %u to move the used ones into.\n", new_end);
+        return RESIZE_NO_SPACE;
+    }
+    return 0;
+}
+
+int resize_file_system(FileSystem *fs, uint32_t new_blocks) {
+    TRACE_SPAN("resize_file_system");
+    uint32_t old_blocks = fs->total_blocks;
+    if (new_blocks == old_blocks)
+        return 0;
+
+    // Pending frees may be what makes a shrink fit; reserved blocks have to stay free
+    reclaim_drain(fs);
+    if ((uint64_t)new_blocks < (uint64_t)fs->used_blocks + fs->reserved_blocks)
+        return RESIZE_NO_SPACE;
+
+    // Inodes stay where they are, only the unused end of the table comes or goes.
+    // Past the watermark nothing was ever handed out.
+    uint32_t live_end = fs->inode_watermark < fs->total_inodes ? fs->inode_watermark : fs->total_inodes;
+    while (live_end > 0 && !fs->inode_bitmap[live_end - 1]) {
+        live_end--;
+    }
+    uint32_t kept = live_end;
+    for (uint32_t s = 0; s < fs->snapshot_count; s++) {
+        Snapshot *snap = &fs->snapshots[s];
+        // Indexes are ascending
+        if (snap->inode_count > 0 && snap->inode_indexes[snap->inode_count - 1] + 1 > kept)
+            kept = snap->inode_indexes[snap->inode_count - 1] + 1;
+    }
+    uint32_t new_inodes = new_blocks / INODE_BLOCK_RATIO;
+    if (new_inodes < kept)
+        new_inodes = kept;
+
+    // Growing maps the new blocks first, shrinking empties the tail first
+    if (new_blocks > old_blocks) {
+        if (block_memory_resize(&fs->block_memory, (size_t)new_blocks * sizeof(Block)) != 0) {
+            fs_log("Memory allocation for %u blocks failed!\n", new_blocks);
+            return RESIZE_NO_MEMORY;
+        }
+        fs->blocks = (Block *)fs->block_memory.base;
+        fs->map_generation++;
+    } else {
+        int ret = evacuate_tail(fs, new_blocks);
+        if (ret != 0)
+            return ret;
+    }
+
+    if (resize_metadata(fs, new_blocks, new_inodes, live_end) != 0) {
+        // A bigger block array or blocks moved down are both fine at the old size
+        fs_log("Memory allocation for file system metadata failed!\n");
+        return RESIZE_NO_MEMORY;
+    }
+    if (new_blocks < old_blocks &&
+        block_memory_resize(&fs->block_memory, (size_t)new_blocks * sizeof(Block)) == 0) {
+        // Otherwise the array just stays bigger than it needs to be
+        fs->blocks = (Block *)fs->block_memory.base;
+        fs->map_generation++;
+    }
+
+    if (fs->block_hint > new_blocks)
+        fs->block_hint = new_blocks;
+    if (fs->inode_hint > new_inodes)
+        fs->inode_hint = new_inodes;
+    // Free inodes past the last one in use were not copied and are zero now
+    if (fs->inode_watermark > live_end)
+        fs->inode_watermark = live_end;
+    // Cached lookups may name directories past the end of a smaller table
+    name_cache_free(fs);
+    mark_dirty(fs);
+    return 0;
+}
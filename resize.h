@@ -0,0 +1,23 @@
+#ifndef RESIZE_H
+#define RESIZE_H
+
+#include "FileSystem.h"
+
+// resize_file_system results
+#define RESIZE_NO_SPACE -1   // The used and reserved blocks do not fit in the new size
+#define RESIZE_NO_MEMORY -2  // Nothing was resized
+
+
+// Grow or shrink a mounted partition to new_blocks. The block array is remapped
+// (mremap, so growing costs next to nothing whatever the size), the bitmaps and
+// inode table move to arrays of the new size, and on a shrink every used block past
+// the new end is copied into a free one below it first, live and snapshot inodes
+// repointed in one pass. The inode table follows the block count
+// (INODE_BLOCK_RATIO) but never drops an inode in use or kept by a snapshot.
+// The image catches up on the next save or writeback flush, which rewrites it
+// whole since its layout changed.
+// Caller holds fs->lock for writing, with no scrub running and no snapshot view
+// open (views share the block array, which may move).
+int resize_file_system(FileSystem *fs, uint32_t new_blocks);
+
+#endif
@@ -0,0 +1,151 @@
+#include "scrub.h"
+#include "crc32c.h"
+
+
+// Verify chunks of blocks until the partition is exhausted
+static void *scrub_worker(void *arg) {
+    FileSystem *fs = (FileSystem *)arg;
+    ScrubState *st = fs->scrub;
+    Block buffer;
+
+    while (true) {
+        uint32_t start = __atomic_fetch_add(&st->next_block, SCRUB_CHUNK_BLOCKS, __ATOMIC_RELAXED);
+
+        // Hold the lock per chunk only, so shell commands get in between chunks
+        pthread_rwlock_rdlock(fs->lock);
+        if (start >= fs->total_blocks) {
+            pthread_rwlock_unlock(fs->lock);
+            break;
+        }
+        uint32_t end = start + SCRUB_CHUNK_BLOCKS;
+        if (end > fs->total_blocks)
+            end = fs->total_blocks;
+
+        for (uint32_t i = start; i < end; i++) {
+            if (!fs->block_bitmap[i])
+                continue;
+
+            // Blocks not faulted in yet are checked straight from the image, without loading them
+            const Block *block = &fs->blocks[i];
+            if (fs->block_loaded && !fs->block_loaded[i]) {
+                if (fs->fetch_block(fs, i, &buffer) != 0) {
+                    __atomic_fetch_add(&st->unreadable, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                block = &buffer;
+            }
+
+            if (!verify_block_checksum(fs, i, block)) {
+                uint32_t n = __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+                if (n < SCRUB_MAX_REPORTED)
+                    st->bad_blocks[n] = i;
+            }
+            __atomic_fetch_add(&st->checked, 1, __ATOMIC_RELAXED);
+        }
+        pthread_rwlock_unlock(fs->lock);
+    }
+    return NULL;
+}
+
+static void *scrub_main(void *arg) {
+    FileSystem *fs = (FileSystem *)arg;
+    ScrubState *st = fs->scrub;
+    pthread_t workers[MAX_SCRUB_THREADS];
+    struct timespec begin, finish;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int started = 0;
+    for (int t = 0; t < st->thread_count; t++) {
+        if (pthread_create(&workers[t], NULL, scrub_worker, fs) == 0)
+            started++;
+    }
+    if (started == 0) {
+        // No threads available, do the work here
+        scrub_worker(fs);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+
+    st->seconds = (finish.tv_sec - begin.tv_sec) + (finish.tv_nsec - begin.tv_nsec) / 1e9;
+    // Release: whoever sees running drop also sees seconds and bad_blocks
+    __atomic_store_n(&st->running, false, __ATOMIC_RELEASE);
+
+    fs_log("\n");
+    scrub_report(fs);
+    fflush(stdout);
+    return NULL;
+}
+
+// Start verifying every used block against its checksum in the background
+int scrub_start(FileSystem *fs) {
+    if (fs->scrub && __atomic_load_n(&fs->scrub->running, __ATOMIC_ACQUIRE)) {
+        scrub_report(fs);
+        return 0;
+    }
+    if (!fs->checksums_valid) {
+        fs_log("Image has no checksums yet, save it once before scrubbing.\n");
+        return -1;
+    }
+
+    if (!fs->scrub) {
+        fs->scrub = (ScrubState *)calloc(1, sizeof(ScrubState));
+        if (!fs->scrub) {
+            fs_log("Memory allocation for scrub failed!\n");
+            return -1;
+        }
+    }
+    scrub_wait(fs);
+
+    ScrubState *st = fs->scrub;
+    st->thread_count = worker_thread_count(MAX_SCRUB_THREADS);
+    st->next_block = 0;
+    __atomic_store_n(&st->checked, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->errors, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->unreadable, 0, __ATOMIC_RELAXED);
+    st->seconds = 0;
+    __atomic_store_n(&st->running, true, __ATOMIC_RELEASE);
+
+    // Pick the crc32c implementation before the threads race to do it
+    crc32c_impl();
+
+    if (pthread_create(&st->thread, NULL, scrub_main, fs) != 0) {
+        fs_log("Failed to start scrub thread.\n");
+        __atomic_store_n(&st->running, false, __ATOMIC_RELEASE);
+        return -1;
+    }
+    st->started = true;
+    fs_log("Scrub started with %d threads (crc32c: %s).\n", st->thread_count, crc32c_impl());
+    return 0;
+}
+
+// Block until a running scrub is done
+void scrub_wait(FileSystem *fs) {
+    if (fs->scrub && fs->scrub->started) {
+        pthread_join(fs->scrub->thread, NULL);
+        fs->scrub->started = false;
+    }
+}
+
+void scrub_report(FileSystem *fs) {
+    ScrubState *st = fs->scrub;
+    if (!st) {
+        fs_log("No scrub has run.\n");
+        return;
+    }
+
+    uint32_t checked = __atomic_load_n(&st->checked, __ATOMIC_RELAXED);
+    uint32_t errors = __atomic_load_n(&st->errors, __ATOMIC_RELAXED);
+    uint32_t unreadable = __atomic_load_n(&st->unreadable, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&st->running, __ATOMIC_ACQUIRE)) {
+        fs_log("Scrub running: %u blocks checked, %u errors so far.\n", checked, errors);
+        return;
+    }
+
+    fs_log("Scrub finished: %u blocks checked, %u checksum errors, %u unreadable, %.3f s.\n",
+           checked, errors, unreadable, st->seconds);
+    for (uint32_t i = 0; i < errors && i < SCRUB_MAX_REPORTED; i++) {
+        fs_log("  bad block %u\n", st->bad_blocks[i]);
+    }
+}
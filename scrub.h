@@ -0,0 +1,30 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#include "FileSystem.h"
+
+#define MAX_SCRUB_THREADS 16   // Upper bound on verifier threads
+#define SCRUB_CHUNK_BLOCKS 256 // Blocks a thread verifies per read-lock hold
+#define SCRUB_MAX_REPORTED 16  // Bad block numbers remembered for the report
+
+
+// State of the background scrub, one per live file system
+typedef struct ScrubState {
+    pthread_t thread;          // Coordinator, spawns and joins the verifiers
+    bool started;              // thread has to be joined
+    bool running;              // Verifiers still working (atomic, the results are final once it drops)
+    uint32_t next_block;       // Next chunk to hand out (atomic)
+    uint32_t checked;          // Used blocks verified so far (atomic)
+    uint32_t errors;           // Checksum mismatches (atomic)
+    uint32_t unreadable;       // Blocks the image could not return (atomic)
+    uint32_t bad_blocks[SCRUB_MAX_REPORTED]; // First few mismatching blocks
+    int thread_count;          // Verifier threads used
+    double seconds;            // Wall time of the last finished run
+} ScrubState;
+
+
+int scrub_start(FileSystem *fs);
+void scrub_wait(FileSystem *fs);
+void scrub_report(FileSystem *fs);
+
+#endif
@@ -0,0 +1,374 @@
+#include "snapshot.h"
+#include "reclaim.h"
+#include "namecache.h"
+
+
+static void snapshot_unref_blocks(FileSystem *fs, Snapshot *snap) {
+    for (uint32_t i = 0; i < snap->inode_count; i++) {
+        Inode *inode = &snap->inodes[i];
+        uint32_t count = inode_block_count(inode);
+        for (uint32_t b = 0; b < count; b++) {
+            free_block(fs, inode->blocks[b]);
+        }
+        if (inode->xattr_block)
+            free_block(fs, inode->xattr_block - 1);
+    }
+}
+
+static Inode *snapshot_inode(Snapshot *snap, uint32_t inode_index) {
+    // inode_indexes is sorted, binary search it
+    uint32_t lo = 0, hi = snap->inode_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (snap->inode_indexes[mid] == inode_index)
+            return &snap->inodes[mid];
+        if (snap->inode_indexes[mid] < inode_index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+Snapshot *find_snapshot(FileSystem *fs, const char *name) {
+    for (uint32_t i = 0; i < fs->snapshot_count; i++) {
+        if (strcmp(fs->snapshots[i].name, name) == 0)
+            return &fs->snapshots[i];
+    }
+    return NULL;
+}
+
+int create_snapshot(FileSystem *fs, const char *name) {
+    if (find_snapshot(fs, name)) {
+        fs_log("Snapshot '%s' already exists.\n", name);
+        return -1;
+    }
+    if (fs->snapshot_count >= MAX_SNAPSHOTS) {
+        fs_log("Too many snapshots (max %d).\n", MAX_SNAPSHOTS);
+        return -1;
+    }
+
+    // Unlinked inodes still waiting to be freed must not end up in the snapshot
+    reclaim_drain(fs);
+
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < fs->total_inodes; i++) {
+        if (fs->inode_bitmap[i])
+            used++;
+    }
+
+    Snapshot snap;
+    memset(&snap, 0, sizeof(Snapshot));
+    strncpy(snap.name, name, MAX_FILENAME - 1);
+    snap.creation_time = (uint32_t)time(NULL);
+    snap.inode_count = used;
+    snap.inode_indexes = (uint32_t *)malloc((used ? used : 1) * sizeof(uint32_t));
+    snap.inodes = (Inode *)malloc((used ? used : 1) * sizeof(Inode));
+    if (!snap.inode_indexes || !snap.inodes) {
+        fs_log("Memory allocation for snapshot failed!\n");
+        free(snap.inode_indexes);
+        free(snap.inodes);
+        return -1;
+    }
+
+    // Only metadata is copied, data blocks just gain a reference
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < fs->total_inodes; i++) {
+        if (!fs->inode_bitmap[i])
+            continue;
+        Inode *inode = &fs->inodes[i];
+        uint32_t count = inode_block_count(inode);
+        // The attribute block is shared like the data, taken last so the rollback
+        // below only has data blocks to drop
+        uint32_t refs = count + (inode->xattr_block ? 1 : 0);
+        for (uint32_t b = 0; b < refs; b++) {
+            uint32_t block = b < count ? inode->blocks[b] : inode->xattr_block - 1;
+            if (ref_block(fs, block) != 0) {
+                fs_log("Block %u cannot be shared, snapshot aborted.\n", block);
+                // Roll back the references taken so far
+                for (uint32_t k = 0; k < b; k++)
+                    free_block(fs, inode->blocks[k]);
+                snap.inode_count = n;
+                snapshot_unref_blocks(fs, &snap);
+                free(snap.inode_indexes);
+                free(snap.inodes);
+                return -1;
+            }
+        }
+        snap.inode_indexes[n] = i;
+        snap.inodes[n] = *inode;
+        n++;
+    }
+
+    Snapshot *grown = (Snapshot *)realloc(fs->snapshots, (fs->snapshot_count + 1) * sizeof(Snapshot));
+    if (!grown) {
+        fs_log("Memory allocation for snapshot failed!\n");
+        snapshot_unref_blocks(fs, &snap);
+        free(snap.inode_indexes);
+        free(snap.inodes);
+        return -1;
+    }
+    fs->snapshots = grown;
+    fs->snapshots[fs->snapshot_count++] = snap;
+    fs->snapshot_generation++;
+    mark_dirty(fs);
+    return 0;
+}
+
+int delete_snapshot(FileSystem *fs, const char *name) {
+    Snapshot *snap = find_snapshot(fs, name);
+    if (!snap) {
+        fs_log("Snapshot '%s' not found.\n", name);
+        return -1;
+    }
+
+    snapshot_unref_blocks(fs, snap);
+    free(snap->inode_indexes);
+    free(snap->inodes);
+
+    uint32_t pos = (uint32_t)(snap - fs->snapshots);
+    memmove(&fs->snapshots[pos], &fs->snapshots[pos + 1],
+            (fs->snapshot_count - pos - 1) * sizeof(Snapshot));
+    fs->snapshot_count--;
+    fs->snapshot_generation++;
+    mark_dirty(fs);
+    return 0;
+}
+
+// Build a read-only FileSystem that shares blocks with fs but sees the snapshot's inodes.
+// The view must be closed before fs is saved or cleaned up.
+FileSystem *open_snapshot_view(FileSystem *fs, const char *name) {
+    Snapshot *snap = find_snapshot(fs, name);
+    if (!snap) {
+        fs_log("Snapshot '%s' not found.\n", name);
+        return NULL;
+    }
+
+    FileSystem *view = (FileSystem *)malloc(sizeof(FileSystem));
+    if (!view) {
+        fs_log("Memory allocation for snapshot view failed!\n");
+        return NULL;
+    }
+    *view = *fs;
+    view->inode_bitmap = (bool *)calloc(fs->total_inodes, sizeof(bool));
+    view->inodes = (Inode *)calloc(fs->total_inodes, sizeof(Inode));
+    view->parents = (uint32_t *)calloc(fs->total_inodes, sizeof(uint32_t));
+    view->names = NULL;
+    view->xattrs = NULL;
+    // du walks the snapshot's tree every time instead of keeping totals
+    view->usage = NULL;
+    view->usage_valid = false;
+    // Nothing is written through a view, the live file system's flusher stays its own
+    view->block_dirty = NULL;
+    view->writeback = NULL;
+    view->defrag = NULL;
+    view->reserved = NULL;
+    view->dirty_limit = 0;
+    if (!view->inode_bitmap || !view->inodes || !view->parents) {
+        fs_log("Memory allocation for snapshot view failed!\n");
+        free(view->inode_bitmap);
+        free(view->inodes);
+        free(view->parents);
+        free(view);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < snap->inode_count; i++) {
+        view->inode_bitmap[snap->inode_indexes[i]] = true;
+        view->inodes[snap->inode_indexes[i]] = snap->inodes[i];
+    }
+    rebuild_parents(view);
+    view->snapshots = NULL;
+    view->snapshot_count = 0;
+    view->read_only = true;
+    view->used_inodes = snap->inode_count;
+    view->file_blocks = 0;
+    for (uint32_t i = 0; i < snap->inode_count; i++) {
+        view->file_blocks += inode_block_count(&snap->inodes[i]);
+    }
+    memset(&view->stats, 0, sizeof(view->stats));
+    return view;
+}
+
+void close_snapshot_view(FileSystem *view) {
+    if (!view)
+        return;
+    free(view->inode_bitmap);
+    free(view->inodes);
+    free(view->parents);
+    name_cache_free(view);
+    free(view);
+}
+
+// Share a block with a clone. A block whose refcount is already at the limit is
+// copied instead, the clone gets the copy.
+static int clone_block(FileSystem *fs, uint32_t *block_index) {
+    if (ref_block(fs, *block_index) == 0)
+        return 0;
+    if (*block_index >= fs->total_blocks || fs->block_refcount[*block_index] != UINT16_MAX)
+        return -1;
+    int copy = allocate_block(fs);
+    if (copy == -1)
+        return -1;
+    memcpy(get_block(fs, copy)->data, get_block(fs, *block_index)->data, BLOCK_SIZE);
+    fs->block_crc[copy] = fs->block_crc[*block_index];
+    mark_block_dirty(fs, copy);
+    *block_index = copy;
+    return 0;
+}
+
+// Copy one snapshot inode (and its subtree) into a fresh live inode.
+// cloned maps snapshot inodes to their copies + 1, so hard links stay links.
+static int clone_inode(FileSystem *fs, Snapshot *snap, uint32_t snap_index, int *cloned) {
+    Inode *src = snapshot_inode(snap, snap_index);
+    if (!src)
+        return -1;
+    int *copy = &cloned[src - snap->inodes];
+    if (*copy)
+        return *copy - 1;
+
+    int inode_index = allocate_inode(fs);
+    if (inode_index == -1)
+        return -1;
+    *copy = inode_index + 1;
+
+    Inode *inode = &fs->inodes[inode_index];
+    *inode = *src;
+    inode->nlink = 0;
+    if (inode->xattr_block) {
+        uint32_t block = inode->xattr_block - 1;
+        inode->xattr_block = 0;
+        if (clone_block(fs, &block) != 0) {
+            fs_log("Attributes of '%s' cannot be shared or copied, left out of the clone.\n", src->filename);
+            free_inode(fs, inode_index);
+            *copy = 0;
+            return -1;
+        }
+        inode->xattr_block = block + 1;
+    }
+
+    if (inode->is_directory) {
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < src->dir_entry_count; i++) {
+            int child = clone_inode(fs, snap, src->entries[i].inode_index, cloned);
+            if (child == -1)
+                continue;
+            inode->entries[kept] = src->entries[i];
+            inode->entries[kept].inode_index = child;
+            fs->inodes[child].nlink++;
+            if (!fs->parents[child])
+                fs->parents[child] = inode_index + 1;
+            kept++;
+        }
+        inode->dir_entry_count = kept;
+    } else {
+        uint32_t count = inode_block_count(inode);
+        for (uint32_t b = 0; b < count; b++) {
+            if (clone_block(fs, &inode->blocks[b]) != 0) {
+                fs_log("Block %u cannot be shared or copied, '%s' left out of the clone.\n",
+                       src->blocks[b], src->filename);
+                for (uint32_t k = 0; k < b; k++)
+                    free_block(fs, inode->blocks[k]);
+                // Drops the attribute block as well
+                free_inode(fs, inode_index);
+                *copy = 0;
+                return -1;
+            }
+        }
+        fs->file_blocks += count;
+    }
+    return inode_index;
+}
+
+// Writable clone: the snapshot's root becomes a new directory under dir_inode_index
+int clone_snapshot(FileSystem *fs, const char *name, int dir_inode_index, const char *clone_name) {
+    Snapshot *snap = find_snapshot(fs, name);
+    if (!snap) {
+        fs_log("Snapshot '%s' not found.\n", name);
+        return -1;
+    }
+
+    if (fs->total_inodes - fs->used_inodes < snap->inode_count) {
+        fs_log("Not enough free inodes to clone '%s'.\n", name);
+        return -1;
+    }
+
+    int *cloned = (int *)calloc(snap->inode_count ? snap->inode_count : 1, sizeof(int));
+    if (!cloned) {
+        fs_log("Memory allocation for clone failed!\n");
+        return -1;
+    }
+    int root = clone_inode(fs, snap, 0, cloned);
+    free(cloned);
+    if (root == -1) {
+        fs_log("Snapshot '%s' has no root directory.\n", name);
+        return -1;
+    }
+    strncpy(fs->inodes[root].filename, clone_name, MAX_FILENAME - 1);
+    fs->inodes[root].filename[MAX_FILENAME - 1] = '\0';
+    // The copies were linked without going through add_to_directory
+    fs->usage_valid = false;
+
+    if (add_to_directory(fs, dir_inode_index, root, clone_name) != 0) {
+        return -1;
+    }
+    return root;
+}
+
+void save_snapshots(FileSystem *fs, FILE *file) {
+    for (uint32_t i = 0; i < fs->snapshot_count; i++) {
+        Snapshot *snap = &fs->snapshots[i];
+        SnapshotRecord record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.name, snap->name, MAX_FILENAME);
+        record.creation_time = snap->creation_time;
+        record.inode_count = snap->inode_count;
+
+        fwrite(&record, sizeof(SnapshotRecord), 1, file);
+        fwrite(snap->inode_indexes, sizeof(uint32_t), snap->inode_count, file);
+        fwrite(snap->inodes, sizeof(Inode), snap->inode_count, file);
+    }
+}
+
+int load_snapshots(FileSystem *fs, FILE *file, uint32_t count, uint32_t version) {
+    fs->snapshots = NULL;
+    fs->snapshot_count = 0;
+    if (count == 0)
+        return 0;
+
+    fs->snapshots = (Snapshot *)calloc(count, sizeof(Snapshot));
+    if (!fs->snapshots)
+        return -1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        SnapshotRecord record;
+        if (fread(&record, sizeof(SnapshotRecord), 1, file) != 1)
+            return -1;
+
+        Snapshot *snap = &fs->snapshots[i];
+        memcpy(snap->name, record.name, MAX_FILENAME);
+        snap->name[MAX_FILENAME - 1] = '\0';
+        snap->creation_time = record.creation_time;
+        snap->inode_count = record.inode_count;
+        snap->inode_indexes = (uint32_t *)malloc((record.inode_count ? record.inode_count : 1) * sizeof(uint32_t));
+        snap->inodes = (Inode *)malloc((record.inode_count ? record.inode_count : 1) * sizeof(Inode));
+        fs->snapshot_count++;
+        if (!snap->inode_indexes || !snap->inodes)
+            return -1;
+
+        if (fread(snap->inode_indexes, sizeof(uint32_t), record.inode_count, file) != record.inode_count ||
+            !read_inode_records(file, snap->inodes, record.inode_count, version))
+            return -1;
+    }
+    return 0;
+}
+
+void free_snapshots(FileSystem *fs) {
+    for (uint32_t i = 0; i < fs->snapshot_count; i++) {
+        free(fs->snapshots[i].inode_indexes);
+        free(fs->snapshots[i].inodes);
+    }
+    free(fs->snapshots);
+    fs->snapshots = NULL;
+    fs->snapshot_count = 0;
+}
@@ -0,0 +1,40 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "FileSystem.h"
+
+#define MAX_SNAPSHOTS 64 // Maximum number of snapshots kept in one image
+
+
+// A named point-in-time copy of the used part of the inode table.
+// Data blocks are shared with the live file system through block_refcount
+// and only copied when one side writes to them (cow_block).
+typedef struct Snapshot {
+    char name[MAX_FILENAME];   // Snapshot name
+    uint32_t creation_time;    // When the snapshot was taken
+    uint32_t inode_count;      // Number of inodes captured
+    uint32_t *inode_indexes;   // Inode slots that were in use, ascending
+    Inode *inodes;             // Inode contents at snapshot time
+} Snapshot;
+
+// Snapshot record as stored in the image, followed by the indexes and inodes
+typedef struct {
+    char name[MAX_FILENAME];
+    uint32_t creation_time;
+    uint32_t inode_count;
+} SnapshotRecord;
+
+
+int create_snapshot(FileSystem *fs, const char *name);
+int delete_snapshot(FileSystem *fs, const char *name);
+Snapshot *find_snapshot(FileSystem *fs, const char *name);
+
+FileSystem *open_snapshot_view(FileSystem *fs, const char *name);
+void close_snapshot_view(FileSystem *view);
+int clone_snapshot(FileSystem *fs, const char *name, int dir_inode_index, const char *clone_name);
+
+void save_snapshots(FileSystem *fs, FILE *file);
+int load_snapshots(FileSystem *fs, FILE *file, uint32_t count, uint32_t version);
+void free_snapshots(FileSystem *fs);
+
+#endif
@@ -0,0 +1,101 @@
+#include "trace.h"
+
+#ifdef FS_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#ifdef FS_TRACE_USDT
+#include <sys/sdt.h>
+#endif
+
+
+typedef struct {
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+    uint32_t tid;
+} TraceEvent;
+
+static TraceEvent *events;      // NULL unless FS_TRACE_FILE is set
+static uint32_t event_count;    // Slots handed out (atomic), may run past TRACE_MAX_EVENTS
+static uint64_t trace_base;     // Timestamps in the file are relative to this
+static const char *trace_path;
+static __thread uint32_t thread_id;
+
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+TraceSpan trace_span_begin(const char *name) {
+    TraceSpan span = { name, trace_now() };
+#ifdef FS_TRACE_USDT
+    DTRACE_PROBE1(fs, span_begin, name);
+#endif
+    return span;
+}
+
+void trace_span_end(TraceSpan *span) {
+    uint64_t duration = trace_now() - span->start;
+#ifdef FS_TRACE_USDT
+    DTRACE_PROBE2(fs, span_end, span->name, duration);
+#endif
+    if (!events)
+        return;
+
+    uint32_t slot = __atomic_fetch_add(&event_count, 1, __ATOMIC_RELAXED);
+    if (slot >= TRACE_MAX_EVENTS)
+        return;
+    if (!thread_id)
+        thread_id = (uint32_t)syscall(SYS_gettid);
+    events[slot].name = span->name;
+    events[slot].start = span->start;
+    events[slot].duration = duration;
+    events[slot].tid = thread_id;
+}
+
+// Write the recorded spans as complete ("X") events, times in microseconds
+static void trace_flush(void) {
+    FILE *out = fopen(trace_path, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to write trace file '%s'.\n", trace_path);
+        return;
+    }
+
+    uint32_t count = event_count < TRACE_MAX_EVENTS ? event_count : TRACE_MAX_EVENTS;
+    int pid = (int)getpid();
+    fprintf(out, "{\"traceEvents\":[");
+    for (uint32_t i = 0; i < count; i++) {
+        TraceEvent *e = &events[i];
+        fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"fs\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+                i ? "," : "", e->name, (e->start - trace_base) / 1e3, e->duration / 1e3, pid, e->tid);
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped_events\":%u}}\n",
+            event_count - count);
+    fclose(out);
+    fprintf(stderr, "Trace with %u spans written to '%s'.\n", count, trace_path);
+
+    free(events);
+    events = NULL;
+}
+
+__attribute__((constructor)) static void trace_init(void) {
+    trace_path = getenv("FS_TRACE_FILE");
+    if (!trace_path || !*trace_path)
+        return;
+
+    events = (TraceEvent *)malloc(TRACE_MAX_EVENTS * sizeof(TraceEvent));
+    if (!events) {
+        fprintf(stderr, "Memory allocation for trace buffer failed!\n");
+        return;
+    }
+    trace_base = trace_now();
+    atexit(trace_flush);
+}
+
+#endif
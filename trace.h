@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Trace spans around the core operations.
+//
+// Built with -DFS_TRACE (make TRACE=1), every span is timed and, when the
+// FS_TRACE_FILE environment variable names a file, kept in memory and written
+// there as Chrome trace-event JSON at exit (chrome://tracing or ui.perfetto.dev).
+// With -DFS_TRACE_USDT (make USDT=1) each span also fires the fs:span_begin and
+// fs:span_end USDT probes, so perf and bpftrace can attach at run time.
+// Without FS_TRACE the macro expands to nothing.
+
+#ifdef FS_TRACE
+
+#define TRACE_MAX_EVENTS (1 << 20) // Spans kept for the trace file, later ones are dropped
+
+typedef struct {
+    const char *name;  // Must outlive the program (string literal)
+    uint64_t start;    // CLOCK_MONOTONIC nanoseconds
+} TraceSpan;
+
+TraceSpan trace_span_begin(const char *name);
+void trace_span_end(TraceSpan *span);
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Span from here to the end of the enclosing block, early returns included
+#define TRACE_SPAN(name) \
+    TraceSpan TRACE_CONCAT(trace_span_, __LINE__) __attribute__((cleanup(trace_span_end))) = trace_span_begin(name)
+
+#else
+
+#define TRACE_SPAN(name) do { } while (0)
+
+#endif
+
+#endif
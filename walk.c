@@ -0,0 +1,303 @@
+#include "walk.h"
+#include <sched.h>
+
+
+// Directories waiting to be scanned. The owner pushes and pops at the tail, so it
+// goes depth first through what it just found; thieves take from the head, the
+// oldest entries and usually the biggest subtrees.
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t *items;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t capacity;
+} WalkDeque;
+
+typedef struct {
+    FileSystem *fs;
+    WalkVisitor visit;
+    void *arg;
+    int threads;
+    uint32_t pending;                      // Directories queued or being scanned (atomic)
+    WalkDeque deques[MAX_WALK_THREADS];
+} WalkContext;
+
+typedef struct {
+    WalkContext *ctx;
+    int id;
+} WalkWorker;
+
+// Per-thread totals for walks that do not go through fs->usage, a cache line each
+typedef struct {
+    TreeUsage sum;
+    uint8_t pad[64 - sizeof(TreeUsage) % 64];
+} UsageSlot;
+
+
+static int deque_push(WalkDeque *dq, uint32_t dir) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->capacity) {
+        if (dq->head > 0) {
+            // Room left by thieves at the front
+            memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(uint32_t));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            uint32_t capacity = dq->capacity ? dq->capacity * 2 : WALK_DEQUE_MIN;
+            uint32_t *items = (uint32_t *)realloc(dq->items, capacity * sizeof(uint32_t));
+            if (!items) {
+                pthread_mutex_unlock(&dq->lock);
+                return -1;
+            }
+            dq->items = items;
+            dq->capacity = capacity;
+        }
+    }
+    dq->items[dq->tail++] = dir;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+static bool deque_pop(WalkDeque *dq, uint32_t *dir) {
+    pthread_mutex_lock(&dq->lock);
+    bool got = dq->tail > dq->head;
+    if (got)
+        *dir = dq->items[--dq->tail];
+    pthread_mutex_unlock(&dq->lock);
+    return got;
+}
+
+static bool deque_steal(WalkDeque *dq, uint32_t *dir) {
+    pthread_mutex_lock(&dq->lock);
+    bool got = dq->tail > dq->head;
+    if (got)
+        *dir = dq->items[dq->head++];
+    pthread_mutex_unlock(&dq->lock);
+    return got;
+}
+
+static void scan_directory(WalkContext *ctx, int id, uint32_t dir_index) {
+    FileSystem *fs = ctx->fs;
+    Inode *dir = &fs->inodes[dir_index];
+    uint32_t count = dir->dir_entry_count < MAX_DIR_ENTRIES ? dir->dir_entry_count : MAX_DIR_ENTRIES;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const DirectoryEntry *entry = &dir->entries[i];
+        uint32_t child = entry->inode_index;
+        if (child >= fs->total_inodes)
+            continue;
+        ctx->visit(fs, dir_index, entry, id, ctx->arg);
+
+        if (!fs->inodes[child].is_directory || fs->parents[child] != dir_index + 1)
+            continue;
+        __atomic_fetch_add(&ctx->pending, 1, __ATOMIC_RELAXED);
+        if (deque_push(&ctx->deques[id], child) != 0) {
+            // No room to queue it, scan it right here
+            scan_directory(ctx, id, child);
+            __atomic_fetch_sub(&ctx->pending, 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static void *walk_worker(void *arg) {
+    WalkWorker *worker = (WalkWorker *)arg;
+    WalkContext *ctx = worker->ctx;
+    int id = worker->id;
+
+    while (true) {
+        uint32_t dir;
+        bool got = deque_pop(&ctx->deques[id], &dir);
+        for (int v = 1; !got && v < ctx->threads; v++) {
+            got = deque_steal(&ctx->deques[(id + v) % ctx->threads], &dir);
+        }
+        if (got) {
+            scan_directory(ctx, id, dir);
+            __atomic_fetch_sub(&ctx->pending, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        // Nothing to take; done once no directory is left queued or being scanned
+        if (__atomic_load_n(&ctx->pending, __ATOMIC_ACQUIRE) == 0)
+            break;
+        sched_yield();
+    }
+    return NULL;
+}
+
+void walk_tree(FileSystem *fs, uint32_t root, WalkVisitor visit, void *arg) {
+    if (root >= fs->total_inodes || !fs->inodes[root].is_directory)
+        return;
+
+    WalkContext *ctx = (WalkContext *)calloc(1, sizeof(WalkContext));
+    if (!ctx) {
+        fs_log("Memory allocation for tree walk failed!\n");
+        return;
+    }
+    ctx->fs = fs;
+    ctx->visit = visit;
+    ctx->arg = arg;
+    // Small trees are done before the threads would have started
+    ctx->threads = fs->used_inodes >= WALK_PARALLEL_MIN ? worker_thread_count(MAX_WALK_THREADS) : 1;
+    for (int t = 0; t < ctx->threads; t++) {
+        pthread_mutex_init(&ctx->deques[t].lock, NULL);
+    }
+
+    ctx->pending = 1;
+    if (deque_push(&ctx->deques[0], root) != 0) {
+        scan_directory(ctx, 0, root);
+        ctx->pending = 0;
+    }
+
+    // This thread is worker 0, a helper that fails to start just leaves its deque empty
+    pthread_t tids[MAX_WALK_THREADS];
+    WalkWorker workers[MAX_WALK_THREADS];
+    bool started[MAX_WALK_THREADS] = {false};
+    for (int t = 0; t < ctx->threads; t++) {
+        workers[t].ctx = ctx;
+        workers[t].id = t;
+        if (t > 0)
+            started[t] = pthread_create(&tids[t], NULL, walk_worker, &workers[t]) == 0;
+    }
+    walk_worker(&workers[0]);
+    for (int t = 1; t < ctx->threads; t++) {
+        if (started[t])
+            pthread_join(tids[t], NULL);
+    }
+
+    for (int t = 0; t < ctx->threads; t++) {
+        pthread_mutex_destroy(&ctx->deques[t].lock);
+        free(ctx->deques[t].items);
+    }
+    free(ctx);
+}
+
+
+// The inode on its own, without anything below it
+static void own_usage(FileSystem *fs, uint32_t inode_index, TreeUsage *out) {
+    const Inode *inode = &fs->inodes[inode_index];
+    memset(out, 0, sizeof(TreeUsage));
+    if (inode->is_directory) {
+        out->directories = 1;
+        return;
+    }
+    out->bytes = inode->size;
+    out->blocks = inode_block_count(inode);
+    out->files = 1;
+    out->reserved = fs->reserved ? fs->reserved[inode_index] : 0;
+}
+
+static void add_usage(TreeUsage *to, const TreeUsage *from, int sign) {
+    to->bytes += sign * from->bytes;
+    to->blocks += sign * from->blocks;
+    to->files += sign * from->files;
+    to->directories += sign * from->directories;
+    to->reserved += sign * from->reserved;
+}
+
+void inode_usage(FileSystem *fs, uint32_t inode_index, TreeUsage *out) {
+    own_usage(fs, inode_index, out);
+    if (fs->inodes[inode_index].is_directory && fs->usage)
+        add_usage(out, &fs->usage[inode_index], 1);
+}
+
+void charge_usage(FileSystem *fs, uint32_t inode_index, const TreeUsage *delta, int sign) {
+    if (!fs->usage_valid)
+        return;
+    // Bounded in case a damaged image links directories in a circle
+    uint32_t steps = 0;
+    for (uint32_t dir = fs->parents[inode_index]; dir && steps < fs->total_inodes; dir = fs->parents[dir - 1]) {
+        add_usage(&fs->usage[dir - 1], delta, sign);
+        steps++;
+    }
+}
+
+// Each inode is counted once, under the directory parents[] records, so hard links
+// are not counted twice and the totals match what charge_usage keeps up. A file whose
+// recorded directory was unlinked (or is unknown) is claimed by the first directory
+// the walk finds it in.
+static bool counted_here(FileSystem *fs, uint32_t dir_inode_index, uint32_t child) {
+    uint32_t parent = __atomic_load_n(&fs->parents[child], __ATOMIC_RELAXED);
+    if (parent == dir_inode_index + 1)
+        return true;
+    if (fs->inodes[child].is_directory || (parent && (parent == 1 || fs->inodes[parent - 1].nlink > 0)))
+        return false;
+    return __atomic_compare_exchange_n(&fs->parents[child], &parent, dir_inode_index + 1, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void count_direct(FileSystem *fs, uint32_t dir_inode_index, const DirectoryEntry *entry, int worker, void *arg) {
+    if (!counted_here(fs, dir_inode_index, entry->inode_index))
+        return;
+    TreeUsage own;
+    own_usage(fs, entry->inode_index, &own);
+    // Only the worker scanning dir_inode_index gets here for it
+    add_usage(&fs->usage[dir_inode_index], &own, 1);
+}
+
+static void count_subtree(FileSystem *fs, uint32_t dir_inode_index, const DirectoryEntry *entry, int worker, void *arg) {
+    if (!counted_here(fs, dir_inode_index, entry->inode_index))
+        return;
+    TreeUsage own;
+    own_usage(fs, entry->inode_index, &own);
+    add_usage(&((UsageSlot *)arg)[worker].sum, &own, 1);
+}
+
+// Recompute every directory's totals: a parallel walk sums what each directory holds
+// directly, then those sums are added to the directories above.
+static void rebuild_usage(FileSystem *fs) {
+    uint32_t dirs = 0;
+    for (uint32_t i = 0; i < fs->total_inodes; i++) {
+        if (fs->inode_bitmap[i] && fs->inodes[i].is_directory) {
+            memset(&fs->usage[i], 0, sizeof(TreeUsage));
+            dirs++;
+        }
+    }
+    walk_tree(fs, 0, count_direct, NULL);
+
+    uint32_t *index = (uint32_t *)malloc(dirs * sizeof(uint32_t) + 1);
+    TreeUsage *direct = (TreeUsage *)malloc(dirs * sizeof(TreeUsage) + 1);
+    if (!index || !direct) {
+        fs_log("Memory allocation for usage totals failed!\n");
+        free(index);
+        free(direct);
+        return;
+    }
+    uint32_t n = 0;
+    for (uint32_t i = 1; i < fs->total_inodes && n < dirs; i++) {
+        if (fs->inode_bitmap[i] && fs->inodes[i].is_directory) {
+            index[n] = i;
+            direct[n++] = fs->usage[i];
+        }
+    }
+    fs->usage_valid = true;
+    for (uint32_t i = 0; i < n; i++) {
+        charge_usage(fs, index[i], &direct[i], 1);
+    }
+    free(index);
+    free(direct);
+}
+
+void tree_usage(FileSystem *fs, uint32_t dir_inode_index, TreeUsage *out) {
+    memset(out, 0, sizeof(TreeUsage));
+    if (!fs->inodes[dir_inode_index].is_directory)
+        return;
+
+    if (fs->usage) {
+        if (!fs->usage_valid)
+            rebuild_usage(fs);
+        if (fs->usage_valid) {
+            *out = fs->usage[dir_inode_index];
+            return;
+        }
+    }
+
+    UsageSlot *slots = (UsageSlot *)calloc(MAX_WALK_THREADS, sizeof(UsageSlot));
+    if (!slots) {
+        fs_log("Memory allocation for usage totals failed!\n");
+        return;
+    }
+    walk_tree(fs, dir_inode_index, count_subtree, slots);
+    for (int t = 0; t < MAX_WALK_THREADS; t++) {
+        add_usage(out, &slots[t].sum, 1);
+    }
+    free(slots);
+}
@@ -0,0 +1,34 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include "FileSystem.h"
+
+#define MAX_WALK_THREADS 16      // Upper bound on tree walker threads
+#define WALK_PARALLEL_MIN 4096   // Used inodes below which a walk stays on the calling thread
+#define WALK_DEQUE_MIN 64        // Directories a worker's deque holds before it first grows
+
+
+// Called for every entry of every directory below the walk's root, from any of
+// the walker threads at once; worker (0 .. MAX_WALK_THREADS - 1) tells them apart
+// so visitors can keep per-thread results without locking.
+typedef void (*WalkVisitor)(FileSystem *fs, uint32_t dir_inode_index, const DirectoryEntry *entry,
+                            int worker, void *arg);
+
+// Visit the tree below root. Each worker scans directories from its own deque and
+// steals from the others when it runs dry. A subdirectory is only descended into
+// from the directory parents[] records for it, symlinks are not followed.
+// The caller holds fs->lock and keeps it until the walk returns.
+void walk_tree(FileSystem *fs, uint32_t root, WalkVisitor visit, void *arg);
+
+// Usage of one inode as its parent directory counts it: a file's size and blocks,
+// a directory and everything below it.
+void inode_usage(FileSystem *fs, uint32_t inode_index, TreeUsage *out);
+
+// Add sign * delta to every directory above inode_index while fs->usage is valid
+void charge_usage(FileSystem *fs, uint32_t inode_index, const TreeUsage *delta, int sign);
+
+// What the directory holds, itself excluded. Served from fs->usage on the live file
+// system (rebuilt by a walk when it is stale), walked every time on snapshot views.
+void tree_usage(FileSystem *fs, uint32_t dir_inode_index, TreeUsage *out);
+
+#endif
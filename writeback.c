@@ -0,0 +1,500 @@
+#include "writeback.h"
+#include "reclaim.h"
+#include "crc32c.h"
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define META_SECTIONS 5
+
+
+// The metadata arrays in image order, each starts where the previous one ends
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t live;      // Bytes that may be nonzero, the rest is known to be zero
+} MetaSection;
+
+static const uint8_t zero_page[WRITEBACK_PAGE];
+
+static void meta_sections(FileSystem *fs, MetaSection *out) {
+    size_t inodes = (size_t)fs->total_inodes * sizeof(Inode);
+    out[0] = (MetaSection){ (const uint8_t *)fs->block_bitmap, fs->total_blocks * sizeof(bool), SIZE_MAX };
+    out[1] = (MetaSection){ (const uint8_t *)fs->inode_bitmap, fs->total_inodes * sizeof(bool), SIZE_MAX };
+    out[2] = (MetaSection){ (const uint8_t *)fs->block_refcount, fs->total_blocks * sizeof(uint16_t), SIZE_MAX };
+    out[3] = (MetaSection){ (const uint8_t *)fs->block_crc, fs->total_blocks * sizeof(uint32_t), SIZE_MAX };
+    // Inodes past the watermark were never handed out, a big table is mostly that
+    out[4] = (MetaSection){ (const uint8_t *)fs->inodes, inodes, (size_t)fs->inode_watermark * sizeof(Inode) };
+}
+
+// Checksum of one page, without touching it when it lies in the zero part
+static uint32_t page_checksum(const MetaSection *section, size_t off, size_t len, uint32_t zero_crc) {
+    if (off >= section->live)
+        return len == WRITEBACK_PAGE ? zero_crc : crc32c(0, zero_page, len);
+    return crc32c(0, section->data + off, len);
+}
+
+// Checksum every metadata page as the image now has it. Caller holds fs->lock.
+static int record_pages(FileSystem *fs, Writeback *wb) {
+    MetaSection sections[META_SECTIONS];
+    meta_sections(fs, sections);
+    uint32_t count = 0;
+    for (int s = 0; s < META_SECTIONS; s++) {
+        count += (sections[s].size + WRITEBACK_PAGE - 1) / WRITEBACK_PAGE;
+    }
+    if (count != wb->page_count) {
+        uint32_t *page_crc = (uint32_t *)realloc(wb->page_crc, (count ? count : 1) * sizeof(uint32_t));
+        if (!page_crc)
+            return -1;
+        wb->page_crc = page_crc;
+        wb->page_count = count;
+    }
+
+    uint32_t p = 0;
+    for (int s = 0; s < META_SECTIONS; s++) {
+        for (size_t off = 0; off < sections[s].size; off += WRITEBACK_PAGE) {
+            size_t len = sections[s].size - off < WRITEBACK_PAGE ? sections[s].size - off : WRITEBACK_PAGE;
+            wb->page_crc[p++] = page_checksum(&sections[s], off, len, wb->zero_crc);
+        }
+    }
+    return 0;
+}
+
+static bool write_all(int fd, const void *data, size_t size, off_t offset) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+// The metadata pages whose checksum moved, runs of them in one write. Caller holds fs->lock.
+static bool write_metadata(FileSystem *fs, Writeback *wb) {
+    MetaSection sections[META_SECTIONS];
+    meta_sections(fs, sections);
+    off_t offset = sizeof(SuperBlock);
+    uint32_t p = 0;
+    uint64_t pages = 0;
+
+    for (int s = 0; s < META_SECTIONS; s++) {
+        const uint8_t *data = sections[s].data;
+        size_t run_start = 0;
+        size_t run_len = 0;
+        for (size_t off = 0; off < sections[s].size; off += WRITEBACK_PAGE, p++) {
+            size_t len = sections[s].size - off < WRITEBACK_PAGE ? sections[s].size - off : WRITEBACK_PAGE;
+            uint32_t crc = page_checksum(&sections[s], off, len, wb->zero_crc);
+            if (crc != wb->page_crc[p]) {
+                wb->page_crc[p] = crc;
+                if (run_len == 0)
+                    run_start = off;
+                run_len += len;
+                pages++;
+                continue;
+            }
+            if (run_len > 0 && !write_all(wb->fd, data + run_start, run_len, offset + run_start))
+                return false;
+            run_len = 0;
+        }
+        if (run_len > 0 && !write_all(wb->fd, data + run_start, run_len, offset + run_start))
+            return false;
+        offset += sections[s].size;
+    }
+    __atomic_fetch_add(&wb->pages_written, pages, __ATOMIC_RELAXED);
+    return true;
+}
+
+// In-place writes need the image to have the layout fs has now
+static bool layout_changed(FileSystem *fs, Writeback *wb) {
+    return wb->fd < 0 || wb->total_blocks != fs->total_blocks || wb->total_inodes != fs->total_inodes ||
+           wb->snapshot_generation != fs->snapshot_generation;
+}
+
+// A block's contents as the file system has them, read from the backing image when
+// it was never faulted in. Faulting would change fs, the caller only holds the read lock.
+static bool copy_block(FileSystem *fs, uint32_t block_index, uint8_t *out) {
+    if (fs->block_loaded && !fs->block_loaded[block_index])
+        return fs->fetch_block(fs, block_index, (Block *)out) == 0;
+    memcpy(out, fs->blocks[block_index].data, BLOCK_SIZE);
+    return true;
+}
+
+// Write everything to the temporary file and rename it over the image. Like
+// incremental_write the blocks go out a batch per read-lock hold, so readers and
+// writers keep going while a large image is rewritten. The metadata is written once
+// to find where the blocks start and again after the last batch, with what fs has
+// then; blocks changed behind the cursor stay dirty for the next flush. A layout
+// change on the way starts over. The old file stays open as the backing image for
+// blocks not faulted in yet, so nothing has to be loaded up front and snapshot
+// views keep reading from it.
+static int full_write(FileSystem *fs, Writeback *wb) {
+    TRACE_SPAN("writeback_full");
+    // Pending frees would otherwise be written as leaked blocks
+    pthread_rwlock_wrlock(fs->lock);
+    reclaim_drain(fs);
+    pthread_rwlock_unlock(fs->lock);
+
+    FILE *file;
+restart:
+    file = fopen(wb->temp, "wb");
+    if (!file)
+        goto fail;
+
+    pthread_rwlock_rdlock(fs->lock);
+    uint32_t total_blocks = fs->total_blocks;
+    uint32_t total_inodes = fs->total_inodes;
+    uint32_t generation = fs->snapshot_generation;
+    write_image_metadata(fs, file);
+    off_t data_offset = ftello(file);
+    pthread_rwlock_unlock(fs->lock);
+    if (fflush(file) != 0 || data_offset < 0)
+        goto fail_file;
+
+    uint32_t cursor = 0;
+    uint32_t end = 0;
+    while (true) {
+        pthread_rwlock_rdlock(fs->lock);
+        if (fs->total_blocks != total_blocks || fs->total_inodes != total_inodes ||
+            fs->snapshot_generation != generation) {
+            // Resized or a snapshot came or went, data_offset no longer holds
+            pthread_rwlock_unlock(fs->lock);
+            fclose(file);
+            unlink(wb->temp);
+            goto restart;
+        }
+
+        // Only the flusher clears these, writers are kept out by the lock
+        uint32_t n = 0;
+        bool ok = true;
+        for (; cursor < fs->total_blocks && n < WRITEBACK_BATCH_BLOCKS && ok; cursor++) {
+            if (fs->block_dirty[cursor]) {
+                fs->block_dirty[cursor] = false;
+                fs->dirty_blocks--;
+            }
+            if (!fs->block_bitmap[cursor])
+                continue;
+            ok = copy_block(fs, cursor, wb->staging + (size_t)n * BLOCK_SIZE);
+            wb->staged[n++] = cursor;
+        }
+        bool last = cursor >= fs->total_blocks;
+        if (last && ok) {
+            // Same layout, so the same size: this overwrites the first copy exactly
+            rewind(file);
+            write_image_metadata(fs, file);
+            ok = fflush(file) == 0 && ferror(file) == 0 && record_pages(fs, wb) == 0;
+            end = used_block_end(fs);
+            if (ok)
+                fs->dirty_since = fs->dirty_blocks ? fs_time() : 0;
+        }
+        pthread_rwlock_unlock(fs->lock);
+
+        for (uint32_t i = 0; ok && i < n; ) {
+            uint32_t j = i + 1;
+            while (j < n && wb->staged[j] == wb->staged[j - 1] + 1) {
+                j++;
+            }
+            ok = write_all(fileno(file), wb->staging + (size_t)i * BLOCK_SIZE, (size_t)(j - i) * BLOCK_SIZE,
+                           data_offset + (off_t)wb->staged[i] * BLOCK_SIZE);
+            i = j;
+        }
+        if (!ok)
+            goto fail_file;
+        __atomic_fetch_add(&wb->blocks_written, n, __ATOMIC_RELAXED);
+        if (last)
+            break;
+    }
+
+    // The image ends with the last used block, reads past it come back as free zero blocks
+    if (ftruncate(fileno(file), data_offset + (off_t)end * BLOCK_SIZE) != 0 || fsync(fileno(file)) != 0)
+        goto fail_file;
+    if (fclose(file) != 0 || rename(wb->temp, wb->image) != 0) {
+        file = NULL;
+        goto fail_file;
+    }
+    if (wb->fd >= 0)
+        close(wb->fd);
+    wb->fd = open(wb->image, O_WRONLY);
+    if (wb->fd < 0)
+        goto fail;
+    wb->data_offset = data_offset;
+    wb->total_blocks = total_blocks;
+    wb->total_inodes = total_inodes;
+    wb->snapshot_generation = generation;
+    __atomic_fetch_add(&wb->full_writes, 1, __ATOMIC_RELAXED);
+    return 0;
+
+fail_file:
+    if (file)
+        fclose(file);
+    unlink(wb->temp);
+fail:
+    // Cleared dirty flags went into a file that was thrown away, the next flush writes all of it
+    fs_log("Writeback of '%s' failed.\n", wb->image);
+    if (wb->fd >= 0) {
+        close(wb->fd);
+        wb->fd = -1;
+    }
+    return -1;
+}
+
+// Copy the dirty blocks out a batch per read-lock hold and write them in place,
+// then the metadata pages that changed. Writers get in between the batches.
+static int incremental_write(FileSystem *fs, Writeback *wb) {
+    TRACE_SPAN("writeback_incremental");
+    uint32_t cursor = 0;
+    uint32_t end = 0;
+    while (true) {
+        pthread_rwlock_rdlock(fs->lock);
+        if (layout_changed(fs, wb)) {
+            // A snapshot came or went since the last batch
+            pthread_rwlock_unlock(fs->lock);
+            return full_write(fs, wb);
+        }
+
+        // Only the flusher clears these, writers are kept out by the lock
+        uint32_t n = 0;
+        for (; cursor < fs->total_blocks && n < WRITEBACK_BATCH_BLOCKS; cursor++) {
+            if (!fs->block_dirty[cursor])
+                continue;
+            fs->block_dirty[cursor] = false;
+            fs->dirty_blocks--;
+            memcpy(wb->staging + (size_t)n * BLOCK_SIZE, fs->blocks[cursor].data, BLOCK_SIZE);
+            wb->staged[n++] = cursor;
+        }
+        bool last = cursor >= fs->total_blocks;
+        bool ok = true;
+        if (last) {
+            ok = write_metadata(fs, wb);
+            end = used_block_end(fs);
+            // Blocks written behind the cursor wait for the next flush
+            if (ok)
+                fs->dirty_since = fs->dirty_blocks ? fs_time() : 0;
+        }
+        pthread_rwlock_unlock(fs->lock);
+
+        // Runs of neighbouring blocks go out in one write
+        for (uint32_t i = 0; ok && i < n; ) {
+            uint32_t j = i + 1;
+            while (j < n && wb->staged[j] == wb->staged[j - 1] + 1) {
+                j++;
+            }
+            ok = write_all(wb->fd, wb->staging + (size_t)i * BLOCK_SIZE, (size_t)(j - i) * BLOCK_SIZE,
+                           wb->data_offset + (off_t)wb->staged[i] * BLOCK_SIZE);
+            i = j;
+        }
+        if (!ok)
+            goto fail;
+        __atomic_fetch_add(&wb->blocks_written, n, __ATOMIC_RELAXED);
+        if (last)
+            break;
+    }
+    // Blocks past the last used one were free by then, a compacted partition gives the space back
+    struct stat st;
+    off_t image_end = wb->data_offset + (off_t)end * BLOCK_SIZE;
+    if (fstat(wb->fd, &st) != 0 || (st.st_size > image_end && ftruncate(wb->fd, image_end) != 0))
+        goto fail;
+    if (fdatasync(wb->fd) != 0)
+        goto fail;
+    return 0;
+
+fail:
+    // What reached the image is unknown, the next flush writes all of it
+    fs_log("Writeback to '%s' failed: %s\n", wb->image, strerror(errno));
+    close(wb->fd);
+    wb->fd = -1;
+    return -1;
+}
+
+// Bring the image up to date. Called without fs->lock, from the flusher or whoever
+// needs the image current now (sync, unmount).
+int writeback_flush(FileSystem *fs) {
+    Writeback *wb = fs->writeback;
+    if (!wb)
+        return -1;
+    TRACE_SPAN("writeback_flush");
+    pthread_mutex_lock(&wb->flush_lock);
+
+    pthread_rwlock_rdlock(fs->lock);
+    bool full = layout_changed(fs, wb);
+    pthread_rwlock_unlock(fs->lock);
+    int ret = full ? full_write(fs, wb) : incremental_write(fs, wb);
+    __atomic_fetch_add(&wb->flushes, 1, __ATOMIC_RELAXED);
+
+    // The flusher sleeps until the next change, or retries a failed flush once it ages again
+    pthread_rwlock_rdlock(fs->lock);
+    if (ret != 0 && fs->dirty_since == 0)
+        fs->dirty_since = fs_time();
+    uint32_t since = fs->dirty_since;
+    pthread_mutex_lock(&wb->mutex);
+    wb->dirty_since = since;
+    pthread_mutex_unlock(&wb->mutex);
+    pthread_rwlock_unlock(fs->lock);
+
+    pthread_mutex_unlock(&wb->flush_lock);
+    return ret;
+}
+
+static void *writeback_main(void *arg) {
+    FileSystem *fs = (FileSystem *)arg;
+    Writeback *wb = fs->writeback;
+
+    pthread_mutex_lock(&wb->mutex);
+    while (!wb->stop) {
+        if (!wb->urgent) {
+            if (wb->dirty_since == 0) {
+                pthread_cond_wait(&wb->wake, &wb->mutex);
+                continue;
+            }
+            struct timespec now;
+            struct timespec deadline = { (time_t)wb->dirty_since + wb->expire, 0 };
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (now.tv_sec < deadline.tv_sec) {
+                pthread_cond_timedwait(&wb->wake, &wb->mutex, &deadline);
+                continue;
+            }
+        }
+        wb->urgent = false;
+        pthread_mutex_unlock(&wb->mutex);
+        writeback_flush(fs);
+        pthread_mutex_lock(&wb->mutex);
+    }
+    pthread_mutex_unlock(&wb->mutex);
+    return NULL;
+}
+
+static uint64_t env_number(const char *name, uint64_t fallback) {
+    const char *value = getenv(name);
+    if (!value || !*value)
+        return fallback;
+    char *end;
+    unsigned long long n = strtoull(value, &end, 10);
+    return *end == '\0' && n > 0 ? n : fallback;
+}
+
+// path is the file fs was loaded from
+static bool loaded_from(FileSystem *fs, const char *path) {
+    struct stat st;
+    return fs->image_current && stat(path, &st) == 0 && st.st_dev == fs->image_dev && st.st_ino == fs->image_ino;
+}
+
+// Keep image up to date from a background thread. Caller holds fs->lock for writing.
+int writeback_start(FileSystem *fs, const char *image) {
+    if (fs->writeback) {
+        fs_log("Writeback to '%s' is already running.\n", fs->writeback->image);
+        return -1;
+    }
+
+    size_t len = strlen(image);
+    Writeback *wb = (Writeback *)calloc(1, sizeof(Writeback));
+    if (wb) {
+        wb->image = strdup(image);
+        wb->temp = (char *)malloc(len + sizeof(".tmp"));
+        wb->staging = (uint8_t *)malloc((size_t)WRITEBACK_BATCH_BLOCKS * BLOCK_SIZE);
+        wb->staged = (uint32_t *)malloc(WRITEBACK_BATCH_BLOCKS * sizeof(uint32_t));
+    }
+    if (!wb || !wb->image || !wb->temp || !wb->staging || !wb->staged) {
+        fs_log("Memory allocation for writeback failed!\n");
+        if (wb) {
+            free(wb->image);
+            free(wb->temp);
+            free(wb->staging);
+            free(wb->staged);
+            free(wb);
+        }
+        return -1;
+    }
+    snprintf(wb->temp, len + sizeof(".tmp"), "%s.tmp", image);
+    pthread_mutex_init(&wb->mutex, NULL);
+    pthread_cond_init(&wb->wake, NULL);
+    pthread_mutex_init(&wb->flush_lock, NULL);
+    wb->fd = -1;
+    wb->zero_crc = crc32c(0, zero_page, WRITEBACK_PAGE);
+    wb->expire = (uint32_t)env_number("FS_DIRTY_EXPIRE", WRITEBACK_EXPIRE);
+    uint64_t limit = env_number("FS_DIRTY_BYTES", WRITEBACK_DIRTY_BYTES) / BLOCK_SIZE;
+
+    // Loaded from this very file and unchanged since: the image is where the flusher starts from
+    if (fs->dirty_since == 0 && loaded_from(fs, image)) {
+        wb->fd = open(image, O_WRONLY);
+        if (wb->fd >= 0 && record_pages(fs, wb) != 0) {
+            close(wb->fd);
+            wb->fd = -1;
+        }
+        wb->data_offset = fs->data_offset;
+        wb->total_blocks = fs->total_blocks;
+        wb->total_inodes = fs->total_inodes;
+        wb->snapshot_generation = fs->snapshot_generation;
+    }
+    // Anything else starts with a full write
+    if (wb->fd < 0 && fs->dirty_since == 0)
+        fs->dirty_since = fs_time();
+    wb->dirty_since = fs->dirty_since;
+    fs->dirty_limit = limit == 0 ? 1 : limit > UINT32_MAX ? UINT32_MAX : (uint32_t)limit;
+    fs->writeback = wb;
+
+    // Without the thread the image is only written on writeback_flush
+    wb->started = pthread_create(&wb->thread, NULL, writeback_main, fs) == 0;
+    if (!wb->started)
+        fs_log("Writeback thread could not be started, changes are written on sync only.\n");
+    return 0;
+}
+
+// Something to flush: the first change (the thread starts its clock), or the dirty
+// limit reached (urgent). Caller holds fs->lock for writing.
+void writeback_kick(FileSystem *fs, bool urgent) {
+    Writeback *wb = fs->writeback;
+    if (!wb)
+        return;
+    pthread_mutex_lock(&wb->mutex);
+    wb->dirty_since = fs->dirty_since;
+    wb->urgent |= urgent;
+    pthread_cond_signal(&wb->wake);
+    pthread_mutex_unlock(&wb->mutex);
+}
+
+bool writeback_targets(FileSystem *fs, const char *image) {
+    return fs->writeback && strcmp(fs->writeback->image, image) == 0;
+}
+
+// Stop the thread and write what is left. Called without fs->lock.
+void writeback_stop(FileSystem *fs) {
+    Writeback *wb = fs->writeback;
+    if (!wb)
+        return;
+
+    if (wb->started) {
+        pthread_mutex_lock(&wb->mutex);
+        wb->stop = true;
+        pthread_cond_signal(&wb->wake);
+        pthread_mutex_unlock(&wb->mutex);
+        pthread_join(wb->thread, NULL);
+        wb->started = false;
+    }
+    // Queued frees would be written as leaked blocks
+    pthread_rwlock_wrlock(fs->lock);
+    reclaim_drain(fs);
+    pthread_rwlock_unlock(fs->lock);
+    writeback_flush(fs);
+
+    fs->writeback = NULL;
+    fs->dirty_limit = 0;
+    if (wb->fd >= 0)
+        close(wb->fd);
+    pthread_mutex_destroy(&wb->mutex);
+    pthread_cond_destroy(&wb->wake);
+    pthread_mutex_destroy(&wb->flush_lock);
+    free(wb->page_crc);
+    free(wb->image);
+    free(wb->temp);
+    free(wb->staging);
+    free(wb->staged);
+    free(wb);
+}
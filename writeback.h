@@ -0,0 +1,62 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include "FileSystem.h"
+
+#define WRITEBACK_DIRTY_BYTES (16u << 20) // Dirty data that wakes the flusher before it ages out
+#define WRITEBACK_EXPIRE 5                // Seconds a change may wait before it is written
+#define WRITEBACK_BATCH_BLOCKS 256        // Dirty blocks copied out per read-lock hold
+#define WRITEBACK_PAGE 4096               // Metadata is compared and written in pieces this big
+
+
+// Background writeback: keeps an image file in step with the file system so that
+// saving at the end only has to write what changed since the last flush.
+//
+// Blocks are marked dirty as they are written (mark_block_dirty), other changes just
+// start the clock (mark_dirty). The flusher runs once the oldest change is
+// WRITEBACK_EXPIRE seconds old or the dirty blocks reach WRITEBACK_DIRTY_BYTES, copies
+// the dirty blocks out a batch at a time under the read lock and writes them in place.
+// Metadata is compared page by page against checksums of what was last written and
+// only the pages that differ go out, which also picks up access times (never marked).
+// When the layout moves (first flush, snapshot taken or deleted, different size) the
+// whole image is written to a temporary file and renamed over the old one.
+//
+// The environment can change the thresholds:
+//   FS_DIRTY_BYTES = <bytes>     dirty data that starts a flush early
+//   FS_DIRTY_EXPIRE = <seconds>  age at which changes are flushed
+typedef struct Writeback {
+    pthread_t thread;          // Background flusher
+    bool started;              // thread has to be joined
+    pthread_mutex_t mutex;     // Guards urgent, stop and dirty_since
+    pthread_cond_t wake;       // Signalled on the first change, when the limit is hit, on stop
+    bool urgent;               // Dirty limit reached, flush without waiting for the age
+    bool stop;                 // Thread should exit
+    uint32_t dirty_since;      // Copy of fs->dirty_since for the thread to sleep on
+    uint32_t expire;           // Seconds, WRITEBACK_EXPIRE unless overridden
+    pthread_mutex_t flush_lock; // One flush at a time, taken before fs->lock
+    char *image;               // Image kept up to date
+    char *temp;                // image + ".tmp", where full writes go before the rename
+    int fd;                    // Open on image for in-place writes, -1 until a full write
+    off_t data_offset;         // Where the blocks start in image
+    uint32_t total_blocks;     // Layout image was written with
+    uint32_t total_inodes;
+    uint32_t snapshot_generation;
+    uint32_t *page_crc;        // Checksum of every metadata page as written
+    uint32_t page_count;
+    uint32_t zero_crc;         // Checksum of an all-zero page
+    uint8_t *staging;          // WRITEBACK_BATCH_BLOCKS blocks copied out for writing
+    uint32_t *staged;          // Their block indexes
+    uint64_t flushes;          // Counters, read without the lock
+    uint64_t full_writes;
+    uint64_t blocks_written;
+    uint64_t pages_written;
+} Writeback;
+
+
+int writeback_start(FileSystem *fs, const char *image);
+int writeback_flush(FileSystem *fs);
+void writeback_stop(FileSystem *fs);
+void writeback_kick(FileSystem *fs, bool urgent);
+bool writeback_targets(FileSystem *fs, const char *image);
+
+#endif
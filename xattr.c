@@ -0,0 +1,335 @@
+#include "xattr.h"
+#include "crc32c.h"
+#include "trace.h"
+
+#define XATTR_BLOCK_AREA (BLOCK_SIZE - sizeof(XattrBlockHeader)) // Entry bytes in an attribute block
+
+
+static uint32_t xattr_hash(const char *name, size_t len) {
+    return crc32c(0, name, len);
+}
+
+static size_t entry_size(size_t name_len, size_t value_len) {
+    return (sizeof(XattrEntry) + name_len + value_len + 3) & ~(size_t)3;
+}
+
+static char *entry_name(XattrEntry *entry) {
+    return (char *)(entry + 1);
+}
+
+static uint8_t *entry_value(XattrEntry *entry) {
+    return (uint8_t *)(entry + 1) + entry->name_len;
+}
+
+// The entry at *pos, moving *pos past it; NULL at the end of the list. Bounded by
+// size in case the area is damaged.
+static XattrEntry *next_entry(uint8_t *area, size_t size, size_t *pos) {
+    if (*pos + sizeof(XattrEntry) > size)
+        return NULL;
+    XattrEntry *entry = (XattrEntry *)(area + *pos);
+    size_t len = entry_size(entry->name_len, entry->value_len);
+    if (entry->name_len == 0 || *pos + len > size)
+        return NULL;
+    *pos += len;
+    return entry;
+}
+
+// Bytes the list takes
+static size_t area_used(uint8_t *area, size_t size) {
+    size_t pos = 0;
+    while (next_entry(area, size, &pos)) {
+    }
+    return pos;
+}
+
+// Entries are sorted by hash, then name
+static int entry_cmp(XattrEntry *entry, uint32_t hash, const char *name, size_t len) {
+    if (entry->hash != hash)
+        return entry->hash < hash ? -1 : 1;
+    int c = memcmp(entry_name(entry), name, len < entry->name_len ? len : entry->name_len);
+    return c ? c : (int)entry->name_len - (int)len;
+}
+
+// The entry called name, or NULL; *at gets where it is or would go
+static XattrEntry *area_find(uint8_t *area, size_t size, uint32_t hash, const char *name, size_t len, size_t *at) {
+    size_t pos = 0;
+    while (true) {
+        size_t start = pos;
+        XattrEntry *entry = next_entry(area, size, &pos);
+        int c = entry ? entry_cmp(entry, hash, name, len) : 1;
+        if (c >= 0) {
+            *at = start;
+            return c == 0 ? entry : NULL;
+        }
+    }
+}
+
+static void area_remove(uint8_t *area, size_t size, size_t at) {
+    XattrEntry *entry = (XattrEntry *)(area + at);
+    size_t len = entry_size(entry->name_len, entry->value_len);
+    size_t used = area_used(area, size);
+    memmove(area + at, area + at + len, used - at - len);
+    memset(area + used - len, 0, len);
+}
+
+static bool area_insert(uint8_t *area, size_t size, uint32_t hash, const char *name, size_t len,
+                        const void *value, size_t value_len) {
+    size_t at;
+    area_find(area, size, hash, name, len, &at);
+    size_t need = entry_size(len, value_len);
+    size_t used = area_used(area, size);
+    if (used + need > size)
+        return false;
+    memmove(area + at + need, area + at, used - at);
+    memset(area + at, 0, need);
+    XattrEntry *entry = (XattrEntry *)(area + at);
+    entry->hash = hash;
+    entry->name_len = (uint8_t)len;
+    entry->value_len = (uint16_t)value_len;
+    memcpy(entry_name(entry), name, len);
+    memcpy(entry_value(entry), value, value_len);
+    return true;
+}
+
+// The inode's attribute block, NULL if it has none or it is not one
+static Block *attr_block(FileSystem *fs, Inode *inode) {
+    if (!inode->xattr_block)
+        return NULL;
+    uint32_t block_index = inode->xattr_block - 1;
+    if (block_index >= fs->total_blocks)
+        return NULL;
+    Block *block = get_block(fs, block_index);
+    if (((XattrBlockHeader *)block->data)->magic != XATTR_MAGIC) {
+        fs_log("Block %u is not an attribute block.\n", block_index);
+        return NULL;
+    }
+    return block;
+}
+
+// Where name is, in the inode or its block
+static XattrEntry *find_attr(FileSystem *fs, Inode *inode, const char *name, size_t len) {
+    uint32_t hash = xattr_hash(name, len);
+    size_t at;
+    XattrEntry *entry = NULL;
+    if (!inode->is_directory)
+        entry = area_find(inode->xattrs, sizeof(inode->xattrs), hash, name, len, &at);
+    Block *block = entry ? NULL : attr_block(fs, inode);
+    if (block)
+        entry = area_find(block->data + sizeof(XattrBlockHeader), XATTR_BLOCK_AREA, hash, name, len, &at);
+    return entry;
+}
+
+static bool valid_name(const char *name, size_t *len) {
+    *len = name ? strlen(name) : 0;
+    return *len > 0 && *len <= XATTR_NAME_MAX;
+}
+
+
+// Seeded with the attribute blocks already there, so files tagged before the load
+// share with the ones tagged after
+static XattrCache *xattr_cache(FileSystem *fs) {
+    if (fs->xattrs)
+        return fs->xattrs;
+    fs->xattrs = (XattrCache *)calloc(1, sizeof(XattrCache));
+    if (!fs->xattrs)
+        return NULL;
+    for (uint32_t i = 0; i < fs->total_inodes; i++) {
+        uint32_t block = fs->inodes[i].xattr_block;
+        if (fs->inode_bitmap[i] && block && block - 1 < fs->total_blocks)
+            fs->xattrs->slots[fs->block_crc[block - 1] & (XATTR_CACHE_SLOTS - 1)] = block;
+    }
+    return fs->xattrs;
+}
+
+// A block holding exactly data, or -1
+static int cache_find(FileSystem *fs, uint32_t crc, const uint8_t *data) {
+    XattrCache *cache = xattr_cache(fs);
+    if (!cache)
+        return -1;
+    uint32_t block = cache->slots[crc & (XATTR_CACHE_SLOTS - 1)];
+    if (!block || block - 1 >= fs->total_blocks || !fs->block_bitmap[block - 1] ||
+        fs->block_crc[block - 1] != crc || memcmp(get_block(fs, block - 1)->data, data, BLOCK_SIZE) != 0)
+        return -1;
+    return block - 1;
+}
+
+// Point the inode at a block holding data: one that already does, the inode's own
+// rewritten in place if nobody shares it, or a new one
+static int store_block(FileSystem *fs, Inode *inode, const uint8_t *data) {
+    TRACE_SPAN("xattr_store_block");
+    uint32_t old = inode->xattr_block;
+    if (((const XattrBlockHeader *)data)->count == 0) {
+        if (old)
+            free_block(fs, old - 1);
+        inode->xattr_block = 0;
+        return 0;
+    }
+
+    uint32_t crc = crc32c(0, data, BLOCK_SIZE);
+    int shared = cache_find(fs, crc, data);
+    if (shared >= 0 && (uint32_t)shared + 1 == old)
+        return 0;
+    if (shared >= 0 && ref_block(fs, shared) == 0) {
+        if (old)
+            free_block(fs, old - 1);
+        inode->xattr_block = shared + 1;
+        return 0;
+    }
+
+    int block;
+    if (old && old - 1 < fs->total_blocks && fs->block_refcount[old - 1] == 1) {
+        block = old - 1;
+    } else {
+        block = allocate_block(fs);
+        if (block == -1)
+            return XATTR_NO_SPACE;
+        if (old)
+            free_block(fs, old - 1);
+    }
+    memcpy(get_block(fs, block)->data, data, BLOCK_SIZE);
+    update_block_checksum(fs, block);
+    if (fs->xattrs)
+        fs->xattrs->slots[crc & (XATTR_CACHE_SLOTS - 1)] = block + 1;
+    inode->xattr_block = block + 1;
+    return 0;
+}
+
+// The inode's block as a fresh copy to edit, an empty one if it has none
+static void copy_block(FileSystem *fs, Inode *inode, uint8_t *data) {
+    Block *block = attr_block(fs, inode);
+    if (block) {
+        memcpy(data, block->data, BLOCK_SIZE);
+        return;
+    }
+    memset(data, 0, BLOCK_SIZE);
+    ((XattrBlockHeader *)data)->magic = XATTR_MAGIC;
+}
+
+
+int xattr_get(FileSystem *fs, uint32_t inode_index, const char *name, void *value, size_t size) {
+    size_t len;
+    if (!valid_name(name, &len))
+        return XATTR_INVALID;
+    XattrEntry *entry = find_attr(fs, &fs->inodes[inode_index], name, len);
+    if (!entry)
+        return XATTR_NOT_FOUND;
+    if (size == 0)
+        return entry->value_len;
+    if (size < entry->value_len)
+        return XATTR_RANGE;
+    memcpy(value, entry_value(entry), entry->value_len);
+    return entry->value_len;
+}
+
+int xattr_list(FileSystem *fs, uint32_t inode_index, char *list, size_t size) {
+    Inode *inode = &fs->inodes[inode_index];
+    Block *block = attr_block(fs, inode);
+    struct {
+        uint8_t *area;
+        size_t size;
+    } areas[2] = {
+        { inode->is_directory ? NULL : inode->xattrs, inode->is_directory ? 0 : sizeof(inode->xattrs) },
+        { block ? block->data + sizeof(XattrBlockHeader) : NULL, block ? XATTR_BLOCK_AREA : 0 },
+    };
+
+    size_t total = 0;
+    for (int a = 0; a < 2; a++) {
+        size_t pos = 0;
+        XattrEntry *entry;
+        while ((entry = next_entry(areas[a].area, areas[a].size, &pos))) {
+            if (size && total + entry->name_len + 1 > size)
+                return XATTR_RANGE;
+            if (size) {
+                memcpy(list + total, entry_name(entry), entry->name_len);
+                list[total + entry->name_len] = '\0';
+            }
+            total += entry->name_len + 1;
+        }
+    }
+    return (int)total;
+}
+
+// Both copies are edited first and only stored once everything fitted
+int xattr_set(FileSystem *fs, uint32_t inode_index, const char *name, const void *value, size_t size, int flags) {
+    TRACE_SPAN("xattr_set");
+    size_t len;
+    if (!valid_name(name, &len) || size > XATTR_VALUE_MAX)
+        return XATTR_INVALID;
+    uint32_t hash = xattr_hash(name, len);
+    Inode *inode = &fs->inodes[inode_index];
+    bool has_inline = !inode->is_directory;
+    uint8_t inline_area[sizeof(inode->xattrs)];
+    uint8_t data[BLOCK_SIZE];
+    XattrBlockHeader *header = (XattrBlockHeader *)data;
+    uint8_t *block_area = data + sizeof(XattrBlockHeader);
+    if (has_inline)
+        memcpy(inline_area, inode->xattrs, sizeof(inline_area));
+    copy_block(fs, inode, data);
+
+    size_t at;
+    bool in_inode = has_inline && area_find(inline_area, sizeof(inline_area), hash, name, len, &at);
+    if (in_inode)
+        area_remove(inline_area, sizeof(inline_area), at);
+    bool in_block = !in_inode && area_find(block_area, XATTR_BLOCK_AREA, hash, name, len, &at);
+    if (in_block) {
+        area_remove(block_area, XATTR_BLOCK_AREA, at);
+        header->count--;
+    }
+    if ((in_inode || in_block) && (flags & XATTR_ONLY_CREATE))
+        return XATTR_EXISTS;
+    if (!in_inode && !in_block && (flags & XATTR_ONLY_REPLACE))
+        return XATTR_NOT_FOUND;
+
+    // Short values stay in the inode while it has room, long ones go there only
+    // when the block is full
+    bool placed = has_inline && size <= XATTR_INLINE_VALUE_MAX &&
+                  area_insert(inline_area, sizeof(inline_area), hash, name, len, value, size);
+    bool to_block = !placed && area_insert(block_area, XATTR_BLOCK_AREA, hash, name, len, value, size);
+    if (to_block)
+        header->count++;
+    placed = placed || to_block ||
+             (has_inline && area_insert(inline_area, sizeof(inline_area), hash, name, len, value, size));
+    if (!placed)
+        return XATTR_NO_SPACE;
+
+    if (in_block || to_block) {
+        int ret = store_block(fs, inode, data);
+        if (ret != 0)
+            return ret;
+    }
+    if (has_inline)
+        memcpy(inode->xattrs, inline_area, sizeof(inline_area));
+    mark_dirty(fs);
+    return 0;
+}
+
+int xattr_remove(FileSystem *fs, uint32_t inode_index, const char *name) {
+    size_t len;
+    if (!valid_name(name, &len))
+        return XATTR_INVALID;
+    uint32_t hash = xattr_hash(name, len);
+    Inode *inode = &fs->inodes[inode_index];
+    size_t at;
+    if (!inode->is_directory && area_find(inode->xattrs, sizeof(inode->xattrs), hash, name, len, &at)) {
+        area_remove(inode->xattrs, sizeof(inode->xattrs), at);
+        mark_dirty(fs);
+        return 0;
+    }
+
+    uint8_t data[BLOCK_SIZE];
+    copy_block(fs, inode, data);
+    if (!area_find(data + sizeof(XattrBlockHeader), XATTR_BLOCK_AREA, hash, name, len, &at))
+        return XATTR_NOT_FOUND;
+    area_remove(data + sizeof(XattrBlockHeader), XATTR_BLOCK_AREA, at);
+    ((XattrBlockHeader *)data)->count--;
+    // Dropping the last one frees the block, nothing to allocate
+    int ret = store_block(fs, inode, data);
+    if (ret == 0)
+        mark_dirty(fs);
+    return ret;
+}
+
+void xattr_cache_free(FileSystem *fs) {
+    free(fs->xattrs);
+    fs->xattrs = NULL;
+}
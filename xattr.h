@@ -0,0 +1,64 @@
+#ifndef XATTR_H
+#define XATTR_H
+
+#include "FileSystem.h"
+
+#define XATTR_NAME_MAX 255          // Longest attribute name
+#define XATTR_VALUE_MAX 3072        // Longest value, one attribute always fits in a block
+#define XATTR_INLINE_VALUE_MAX 128  // Longer values go to the shared block first
+#define XATTR_MAGIC 0x58415454      // "TTAX", first word of an attribute block
+#define XATTR_CACHE_SLOTS 1024      // Attribute blocks remembered for sharing, a power of two
+
+// xattr_set flags
+#define XATTR_ONLY_CREATE 1         // Fail with XATTR_EXISTS if the attribute is there
+#define XATTR_ONLY_REPLACE 2        // Fail with XATTR_NOT_FOUND if it is not
+
+// Results
+#define XATTR_NOT_FOUND -1
+#define XATTR_EXISTS -2
+#define XATTR_NO_SPACE -3           // Neither the inode nor the block has room, or no block is free
+#define XATTR_RANGE -4              // The caller's buffer is too small
+#define XATTR_INVALID -5            // Empty or too long name, too long value
+
+
+// Extended attributes: named values on a file, directory or symlink.
+//
+// Files and symlinks keep short values in the inode, in the space directories use
+// for their entries (Inode.xattrs). The rest, and everything of a directory, goes in
+// one attribute block per inode (Inode.xattr_block). Attribute blocks are shared:
+// one with exactly the same contents as the new one is referenced instead of writing
+// another (block refcounts, the same way snapshots share data), and a shared block is
+// copied before it changes. Entries are kept sorted by name hash and then name, so
+// the same set of attributes always makes the same bytes and lookups stop early.
+//
+// Each entry is an XattrEntry followed by the name and the value, padded to 4 bytes;
+// a zero name_len ends the list.
+typedef struct {
+    uint32_t hash;         // xattr_hash of the name, compared before the name
+    uint16_t value_len;
+    uint8_t name_len;      // 0 ends the list
+    uint8_t reserved;
+} XattrEntry;
+
+typedef struct {
+    uint32_t magic;        // XATTR_MAGIC
+    uint32_t count;        // Entries that follow
+    uint32_t reserved[2];
+} XattrBlockHeader;
+
+// Attribute blocks written recently, by checksum, for xattr_set to share. A hit is
+// compared with the block itself, so frees and moves need no invalidation. Protected
+// by fs->lock held for writing.
+typedef struct XattrCache {
+    uint32_t slots[XATTR_CACHE_SLOTS]; // Block + 1, 0 for an empty slot
+} XattrCache;
+
+// Copy the value out, returns its length. size 0 only asks for the length.
+int xattr_get(FileSystem *fs, uint32_t inode_index, const char *name, void *value, size_t size);
+int xattr_set(FileSystem *fs, uint32_t inode_index, const char *name, const void *value, size_t size, int flags);
+int xattr_remove(FileSystem *fs, uint32_t inode_index, const char *name);
+// Names one after another, each ending in '\0'; returns the bytes that takes. size 0 only asks.
+int xattr_list(FileSystem *fs, uint32_t inode_index, char *list, size_t size);
+void xattr_cache_free(FileSystem *fs);
+
+#endif